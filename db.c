@@ -31,21 +31,50 @@
 #include <talloc.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include  "defs.h"
 #include "types.h"
 #include "notify.h"
+#include "util.h"
 #include "db.h"
+#include "parser.h"
 #include "xplevent.h"
 
 #define SQLITE_BHAND_MAX_RETRIES 10
 #define DB_MAGIC 0x026DA723
+#define NV_INITIAL_SIZE 64 /* Initial size of the nvstate cache table. Must be a power of 2 */
+
+/* Per script execution limits and overrun counts. Kept apart from the scripts, so replacing a script keeps them */
+#define DB_SCRIPTLIMITS_TABLE "CREATE TABLE IF NOT EXISTS scriptlimits (\"scriptlimitsid\" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL," \
+	"\"scriptname\" TEXT NOT NULL UNIQUE,\"maxinstrs\" INTEGER,\"maxms\" INTEGER,\"overruns\" INTEGER NOT NULL DEFAULT 0);"
+
+#define NV_LOCK pthread_mutex_lock(&db->nvLock);
+#define NV_UNLOCK pthread_mutex_unlock(&db->nvLock);
 
 typedef enum {TXTY_DEFERRED = 0, TXTY_IMMEDIATE, TXTY_EXCLUSIVE} txType_t;
 
+/* nvstate cache entry */
+
+typedef struct nvEntry_s {
+	unsigned hash;
+	Bool dirty; /* Changed since the last flush */
+	time_t timestamp;
+	String key;
+	String value;
+	struct nvEntry_s *next; /* Hash chain */
+	struct nvEntry_s *nextDirty;
+} nvEntry_t, *nvEntryPtr_t;
+
 typedef struct dbObj_s {
 	unsigned magic;
 	unsigned backoffMS;
 	unsigned busyCount;
+	Bool nvSync; /* Write nvstate values through to the database */
+	unsigned nvTableSize;
+	unsigned nvCount;
+	nvEntryPtr_t *nvTable; /* nvstate cache. NULL if it could not be loaded */
+	nvEntryPtr_t nvDirtyHead; /* Entries to write on the next flush */
+	pthread_mutex_t nvLock;
 	sqlite3 *db;
 } dbObj_t, *dbObjPtr_t;
 	
@@ -341,6 +370,109 @@ String keyColName, String key, String valueColName)
 	
 }
 
+/*
+ * Read a script and its compiled bytecode from the scripts table.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the database object
+ * 2. Talloc context to hang the result off of.
+ * 3. ID String for debugging purposes
+ * 4. Name of the script
+ *
+ * Return Value:
+ *
+ * Pointer to the script, or NULL if the script was not found, or an error occurred.
+ * Result must be talloc_free'd when no longer required
+ */
+
+static DBScriptPtr_t dbReadScript(dbObjPtr_t db, TALLOC_CTX *ctx, const char *id, const String name)
+{
+	int r, index, len;
+	const void *blob;
+	String code;
+	DBScriptPtr_t script = NULL;
+	sqlite3_stmt *stmt = NULL;
+	static const String sql = "SELECT s.scriptcode,s.bytecode,s.srchash,l.maxinstrs,l.maxms FROM scripts s "
+	"LEFT JOIN scriptlimits l ON l.scriptname=s.scriptname WHERE s.scriptname=:key LIMIT 1";
+	
+	debug(DEBUG_INCOMPLETE, "%s: Sql = %s", id, sql);
+	
+	/* Parse Sql */
+	if(SQLITE_OK != (r = sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL))){
+		logErr(db, __LINE__, id, "Error on sqlite3_prepare()");
+		return NULL;
+	}
+	
+	/* Bind the key */
+	index = sqlite3_bind_parameter_index(stmt, ":key");
+	if(SQLITE_OK != (r = sqlite3_bind_text(stmt, index, name, -1, SQLITE_TRANSIENT))){
+		logErr(db, __LINE__, id, "Error on sqlite_bind_text()");
+	}
+	else if(SQLITE_ROW == (r = sqlite3_step(stmt))){
+		if(!(code = (String) sqlite3_column_text(stmt, 0))){
+			logErr(db, __LINE__, id, "sqlite3_column_text() returned NULL");
+		}
+		else{
+			MALLOC_FAIL(script = talloc_zero(ctx, DBScript_t))
+			MALLOC_FAIL(script->name = talloc_strdup(script, name))
+			MALLOC_FAIL(script->code = talloc_strdup(script, code))
+			/* Bytecode is NULL in rows written before it was stored */
+			blob = sqlite3_column_blob(stmt, 1);
+			len = sqlite3_column_bytes(stmt, 1);
+			if(blob && len){
+				MALLOC_FAIL(script->bytecode = talloc_memdup(script, blob, len))
+				script->bytecodeLen = len;
+				script->srcHash = (unsigned) sqlite3_column_int64(stmt, 2);
+			}
+			/* NULL limits, or no row in the scriptlimits table, mean use the default */
+			script->maxInstrs = (SQLITE_NULL == sqlite3_column_type(stmt, 3)) ? -1 : sqlite3_column_int64(stmt, 3);
+			script->maxMS = (SQLITE_NULL == sqlite3_column_type(stmt, 4)) ? -1 : sqlite3_column_int64(stmt, 4);
+		}
+	}
+	else if(SQLITE_DONE == r){
+		debug(DEBUG_INCOMPLETE, "%s: Record not found", id);
+	}
+	else{
+		logErr(db, __LINE__, id, "Error on sqlite3_step()");
+	}
+	
+	sqlite3_finalize(stmt);
+	return script;
+}
+
+/*
+ * Add the bytecode columns to a scripts table created before they existed.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the database object
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void dbUpgradeScripts(dbObjPtr_t db)
+{
+	String errorMessage = NULL;
+	sqlite3_stmt *stmt = NULL;
+	
+	/* Preparing fails if the columns are not there */
+	if(SQLITE_OK == sqlite3_prepare_v2(db->db, "SELECT bytecode,srchash FROM scripts LIMIT 0", -1, &stmt, NULL)){
+		sqlite3_finalize(stmt);
+		return;
+	}
+	
+	note("Adding bytecode columns to the scripts table");
+	sqlite3_exec(db->db, "ALTER TABLE scripts ADD COLUMN \"bytecode\" BLOB;"
+	"ALTER TABLE scripts ADD COLUMN \"srchash\" INTEGER;", NULL, NULL, &errorMessage);
+	if(errorMessage){
+		debug(DEBUG_UNEXPECTED, "Could not add bytecode columns to the scripts table: %s", errorMessage);
+		sqlite3_free(errorMessage);
+	}
+}
+
 /*
  * Delete a row from a table
  *
@@ -400,6 +532,226 @@ static Bool dbDeleteRow(dbObjPtr_t db, TALLOC_CTX *ctx, const char *id, String t
 	return res;
 }
 
+/*
+* Find an entry in the nvstate cache
+*
+* Arguments:
+*
+* 1. Pointer to the database object
+* 2. The key to look for
+* 3. The hash of the key
+*
+* Return value:
+*
+* The entry, or NULL if the key is not in the cache
+*/
+
+static nvEntryPtr_t nvFind(dbObjPtr_t db, const String key, unsigned kh)
+{
+	nvEntryPtr_t ne;
+	
+	for(ne = db->nvTable[kh & (db->nvTableSize - 1)]; ne; ne = ne->next){
+		if((ne->hash == kh) && (!strcmp(ne->key, key))){
+			break;
+		}
+	}
+	return ne;
+}
+
+/*
+* Add an entry to the nvstate cache, growing the table if it gets too full
+*
+* Arguments:
+*
+* 1. Pointer to the database object
+* 2. The key
+* 3. The hash of the key
+*
+* Return value:
+*
+* The new entry. It has no value yet.
+*/
+
+static nvEntryPtr_t nvAdd(dbObjPtr_t db, const String key, unsigned kh)
+{
+	nvEntryPtr_t ne, next, *old;
+	unsigned i, oldSize;
+	
+	/* Keep the chains short */
+	if(db->nvCount >= db->nvTableSize){
+		old = db->nvTable;
+		oldSize = db->nvTableSize;
+		db->nvTableSize = oldSize * 2;
+		MALLOC_FAIL(db->nvTable = talloc_zero_array(db, nvEntryPtr_t, db->nvTableSize))
+		for(i = 0; i < oldSize; i++){
+			for(ne = old[i]; ne; ne = next){
+				next = ne->next;
+				ne->next = db->nvTable[ne->hash & (db->nvTableSize - 1)];
+				db->nvTable[ne->hash & (db->nvTableSize - 1)] = ne;
+			}
+		}
+		talloc_free(old);
+	}
+	
+	MALLOC_FAIL(ne = talloc_zero(db, nvEntry_t))
+	MALLOC_FAIL(ne->key = talloc_strdup(ne, key))
+	ne->hash = kh;
+	ne->next = db->nvTable[kh & (db->nvTableSize - 1)];
+	db->nvTable[kh & (db->nvTableSize - 1)] = ne;
+	db->nvCount++;
+	return ne;
+}
+
+/*
+* Write nvstate rows to the database. Any existing row for each key is replaced.
+* Must be called inside a transaction.
+*
+* Arguments:
+*
+* 1. Pointer to the database object
+* 2. ID String for debugging purposes
+* 3. List of entries to write, linked through nextDirty
+*
+* Return value:
+*
+* Boolean. PASS = success, FAIL = failure.
+*/
+
+static Bool dbPutNVStateRows(dbObjPtr_t db, const char *id, nvEntryPtr_t list)
+{
+	Bool res = PASS;
+	nvEntryPtr_t ne;
+	sqlite3_stmt *delStmt = NULL;
+	sqlite3_stmt *insStmt = NULL;
+	static const String delSql = "DELETE FROM nvstate WHERE key=:key";
+	static const String insSql = "INSERT INTO nvstate (key,value,timestamp) VALUES (:key,:value,:timestamp)";
+	
+	/* Prepare once, and reuse for each entry */
+	if((SQLITE_OK != sqlite3_prepare_v2(db->db, delSql, -1, &delStmt, NULL)) ||
+	(SQLITE_OK != sqlite3_prepare_v2(db->db, insSql, -1, &insStmt, NULL))){
+		res = logErr(db, __LINE__, id, "Error on sqlite3_prepare_v2()");
+	}
+	
+	for(ne = list; ne && (PASS == res); ne = ne->nextDirty){
+		debug(DEBUG_INCOMPLETE, "%s: Writing nvstate key %s", id, ne->key);
+		if((SQLITE_OK != sqlite3_bind_text(delStmt, 1, ne->key, -1, SQLITE_TRANSIENT)) ||
+		(SQLITE_DONE != sqlite3_step(delStmt))){
+			res = logErr(db, __LINE__, id, "Error deleting old row");
+			break;
+		}
+		sqlite3_reset(delStmt);
+		if((SQLITE_OK != sqlite3_bind_text(insStmt, 1, ne->key, -1, SQLITE_TRANSIENT)) ||
+		(SQLITE_OK != sqlite3_bind_text(insStmt, 2, ne->value, -1, SQLITE_TRANSIENT)) ||
+		(SQLITE_OK != sqlite3_bind_int64(insStmt, 3, (sqlite3_int64) ne->timestamp)) ||
+		(SQLITE_DONE != sqlite3_step(insStmt))){
+			res = logErr(db, __LINE__, id, "Error inserting row");
+			break;
+		}
+		sqlite3_reset(insStmt);
+	}
+	
+	sqlite3_finalize(delStmt);
+	sqlite3_finalize(insStmt);
+	return res;
+}
+
+/*
+* Load the nvstate table into the cache. 
+* If this fails, nvstate reads and writes go straight to the database.
+*
+* Arguments:
+*
+* 1. Pointer to the database object
+*
+* Return value:
+*
+* None
+*/
+
+static void dbLoadNVState(dbObjPtr_t db)
+{
+	int r;
+	String key, value;
+	nvEntryPtr_t ne;
+	sqlite3_stmt *stmt = NULL;
+	static const String sql = "SELECT key,value,timestamp FROM nvstate ORDER BY nvstateid";
+	
+	MALLOC_FAIL(db->nvTable = talloc_zero_array(db, nvEntryPtr_t, NV_INITIAL_SIZE))
+	db->nvTableSize = NV_INITIAL_SIZE;
+	
+	if(SQLITE_OK != sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL)){
+		logErr(db, __LINE__, __func__, "Error on sqlite3_prepare_v2(), nvstate will not be cached");
+		talloc_free(db->nvTable);
+		db->nvTable = NULL;
+		return;
+	}
+	while(SQLITE_ROW == (r = sqlite3_step(stmt))){
+		if(!(key = (String) sqlite3_column_text(stmt, 0)) || !(value = (String) sqlite3_column_text(stmt, 1))){
+			continue;
+		}
+		/* Later rows win if a key is there more than once */
+		if(!(ne = nvFind(db, key, UtilHash(key)))){
+			ne = nvAdd(db, key, UtilHash(key));
+		}
+		else{
+			talloc_free(ne->value);
+		}
+		MALLOC_FAIL(ne->value = talloc_strdup(ne, value))
+		ne->timestamp = (time_t) sqlite3_column_int64(stmt, 2);
+	}
+	if(SQLITE_DONE != r){
+		logErr(db, __LINE__, __func__, "Error on sqlite3_step()");
+	}
+	sqlite3_finalize(stmt);
+	debug(DEBUG_ACTION, "Loaded %u nvstate entries", db->nvCount);
+}
+
+/*
+* Add the scriptlimits table to a database created before it existed.
+*
+* Arguments:
+*
+* 1. Pointer to the database object
+*
+* Return value:
+*
+* None
+*/
+
+static void dbUpgradeScriptLimits(dbObjPtr_t db)
+{
+	String errorMessage = NULL;
+	
+	sqlite3_exec(db->db, DB_SCRIPTLIMITS_TABLE, NULL, NULL, &errorMessage);
+	if(errorMessage){
+		debug(DEBUG_UNEXPECTED, "Could not add the scriptlimits table: %s", errorMessage);
+		sqlite3_free(errorMessage);
+	}
+}
+
+/*
+* Add the key index to an nvstate table created before it existed.
+*
+* Arguments:
+*
+* 1. Pointer to the database object
+*
+* Return value:
+*
+* None
+*/
+
+static void dbUpgradeNVState(dbObjPtr_t db)
+{
+	String errorMessage = NULL;
+	
+	sqlite3_exec(db->db, "CREATE INDEX IF NOT EXISTS nvstatekey ON nvstate (key);", NULL, NULL, &errorMessage);
+	if(errorMessage){
+		debug(DEBUG_UNEXPECTED, "Could not add the nvstate key index: %s", errorMessage);
+		sqlite3_free(errorMessage);
+	}
+}
+
 /*
 * Open the database
 *
@@ -437,6 +789,16 @@ void *DBOpen(TALLOC_CTX *ctx, String file)
 	}
 	/* busyHandler(db, 0); Test call our handler */
 	sqlite3_busy_handler(db->db, busyHandler, db);
+	
+	/* Bring older databases up to date */
+	dbUpgradeScripts(db);
+	dbUpgradeScriptLimits(db);
+	dbUpgradeNVState(db);
+	
+	/* Serve nvstate from memory */
+	pthread_mutex_init(&db->nvLock, NULL);
+	dbLoadNVState(db);
+	
 	return (void *) db;
 }
 
@@ -458,7 +820,9 @@ void DBClose(void *dbObjPtr)
 	dbObjPtr_t db = dbObjPtr;
 	if(db){
 		ASSERT_FAIL(DB_MAGIC == db->magic)
+		DBFlushNVState(db);
 		sqlite3_close(db->db);
+		pthread_mutex_destroy(&db->nvLock);
 		db->magic = 0;
 		talloc_free(db);
 	}
@@ -468,6 +832,9 @@ void DBClose(void *dbObjPtr)
 /*
 * Read a value from the nvstate table
 *
+* Values are served from the nvstate cache. The database is only read if the cache
+* could not be loaded.
+*
 * Arguments
 *
 * 1. A talloc context to hang the result off of.
@@ -486,12 +853,22 @@ const String DBReadNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key)
 
 	String p = NULL;
 	dbObjPtr_t db = dbObjPtr;
+	nvEntryPtr_t ne;
 
 	
 	ASSERT_FAIL(ctx)
 	ASSERT_FAIL(db)
 	ASSERT_FAIL(DB_MAGIC == db->magic)
 	ASSERT_FAIL(key)
+	
+	if(db->nvTable){
+		NV_LOCK
+		if((ne = nvFind(db, key, UtilHash(key)))){
+			MALLOC_FAIL(p = talloc_strdup(ctx, ne->value))
+		}
+		NV_UNLOCK
+		return p;
+	}
 		
 	/* Transaction start */
 	if(dbTxBegin(db, __func__, TXTY_DEFERRED) != PASS){
@@ -510,7 +887,10 @@ const String DBReadNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key)
 /*
 * Write a value to the nvstate table
 *
-* If the value already exists, it will be overwritten.
+* If the value already exists, it will be overwritten. The value is written to the 
+* nvstate cache, and marked dirty to be written to the database by DBFlushNVState().
+* In sync mode, or if the cache could not be loaded, it is written to the database 
+* before returning.
 *
 * Arguments
 *
@@ -526,14 +906,11 @@ const String DBReadNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key)
 
 Bool DBWriteNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key, const String value)
 {
-	Bool res = PASS;
-	int r, index;
+	Bool res;
 	dbObjPtr_t db = dbObjPtr;
-	sqlite3_stmt *stmt = NULL;
-	
-	String sql = NULL;
-	String p;
-	time_t now;
+	nvEntry_t row;
+	nvEntryPtr_t ne;
+	unsigned kh;
 	
 	ASSERT_FAIL(ctx)
 	ASSERT_FAIL(db)
@@ -541,67 +918,113 @@ Bool DBWriteNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key, const Str
 	ASSERT_FAIL(key)
 	ASSERT_FAIL(value)
 	
-	time(&now);
-		
-	/* Transaction begin */
+	if(db->nvTable){
+		NV_LOCK
+		kh = UtilHash(key);
+		if(!(ne = nvFind(db, key, kh))){
+			ne = nvAdd(db, key, kh);
+		}
+		else{
+			talloc_free(ne->value);
+		}
+		MALLOC_FAIL(ne->value = talloc_strdup(ne, value))
+		time(&ne->timestamp);
+		if(!ne->dirty){
+			ne->dirty = TRUE;
+			ne->nextDirty = db->nvDirtyHead;
+			db->nvDirtyHead = ne;
+		}
+		NV_UNLOCK
+		return (db->nvSync) ? DBFlushNVState(db) : PASS;
+	}
+	
+	/* Not cached, write the row now */
+	row = (nvEntry_t) {.key = key, .value = value};
+	time(&row.timestamp);
 	
 	if(dbTxBegin(db, __func__, TXTY_EXCLUSIVE) != PASS){
 		return FAIL;
 	}
+	res = dbPutNVStateRows(db, __func__, &row);
+	dbTxEnd(db, __func__, res);
+
+	return res;
 	
+}
 
+/*
+* Write the nvstate values changed since the last flush to the database in one transaction.
+*
+* Arguments
+*
+* 1. A generic pointer to the database
+*
+* Return value:
+*
+* Boolean. PASS = success, FAIL = failure. The values stay dirty on failure, 
+* and are tried again on the next flush.
+*/
 
-	p = dbReadField(db, ctx, __func__, "nvstate", "key", key, "value");
-	if(p){
-		talloc_free(p);
-		res = dbDeleteRow(db, ctx, __func__, "nvstate", "key",  key);
-	}
+Bool DBFlushNVState(void *dbObjPtr)
+{
+	Bool res = PASS;
+	dbObjPtr_t db = dbObjPtr;
+	nvEntryPtr_t ne, next;
+	unsigned count = 0;
 	
-	if(PASS == res){
-		sql = talloc_asprintf(ctx, "INSERT INTO %s (key,value,timestamp) VALUES (:key,:value,'%lld')",
-		"nvstate",(long long) now);
+	ASSERT_FAIL(db)
+	ASSERT_FAIL(DB_MAGIC == db->magic)
 	
-		MALLOC_FAIL(sql)
-		
-		debug(DEBUG_INCOMPLETE, "%s: Sql = %s", __func__, sql);
-		
-		/* Parse Sql */
-		if(SQLITE_OK != (r = sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL))){
-			res = logErr(db, __LINE__, __func__, "Error on sqlite3_prepare_v2()");
+	NV_LOCK
+	if(db->nvDirtyHead){
+		if(PASS == (res = dbTxBegin(db, __func__, TXTY_IMMEDIATE))){
+			res = dbPutNVStateRows(db, __func__, db->nvDirtyHead);
+			if(PASS == res){
+				res = dbTxEnd(db, __func__, PASS);
+			}
+			else{
+				dbTxEnd(db, __func__, FAIL);
+			}
 		}
-		/* Release the SQL string */
-		talloc_free(sql);
-		
 		if(PASS == res){
-			/* Bind the key */
-			index = sqlite3_bind_parameter_index(stmt, ":key");
-			r = sqlite3_bind_text(stmt, index, key, -1, SQLITE_TRANSIENT);
-		
-			/* Bind the value */
-			if(SQLITE_OK == r){
-				index = sqlite3_bind_parameter_index(stmt, ":value");
-				r = sqlite3_bind_text(stmt, index, value, -1, SQLITE_TRANSIENT);
-			}
-			if(SQLITE_OK == r){
-				/* Execute the parsed statement */
-				r = sqlite3_step(stmt);
-				if(SQLITE_DONE != r){
-					res = logErr(db, __LINE__, __func__, "Error on sqlite3_step()");
-				}
+			for(ne = db->nvDirtyHead; ne; ne = next, count++){
+				next = ne->nextDirty;
+				ne->nextDirty = NULL;
+				ne->dirty = FALSE;
 			}
-			else{
-				res = logErr(db, __LINE__, __func__, "Error on sqlite3_bind_text()");
-			}	
-	
-			sqlite3_finalize(stmt);
+			db->nvDirtyHead = NULL;
+			debug(DEBUG_ACTION, "Flushed %u nvstate values", count);
 		}
 	}
-	/* Transaction end */
-	
-	dbTxEnd(db, __func__, res);
-
+	NV_UNLOCK
 	return res;
+}
+
+/*
+* Set whether nvstate writes are written to the database before DBWriteNVState() returns.
+* Costs a transaction per write, but nothing written is lost if the process dies.
+*
+* Arguments
+*
+* 1. A generic pointer to the database
+* 2. TRUE to write synchronously
+*
+* Return value:
+*
+* None
+*/
+
+void DBSetNVStateSync(void *dbObjPtr, Bool sync)
+{
+	dbObjPtr_t db = dbObjPtr;
 	
+	ASSERT_FAIL(db)
+	ASSERT_FAIL(DB_MAGIC == db->magic)
+	
+	db->nvSync = sync;
+	if(sync){
+		DBFlushNVState(db);
+	}
 }
 
 /*
@@ -688,6 +1111,213 @@ const String DBFetchScriptByTag(TALLOC_CTX *ctx, void *dbObjPtr, const String ta
 	return script;
 }
 
+/*
+* Fetch a script and its compiled bytecode from the script table
+*
+*
+* Arguments
+*
+* 1. A talloc context to hang the result off of.
+* 2. A generic pointer to the database
+* 3. A String containing the script name
+*
+* Return value:
+*
+* A pointer to the script, or NULL if not found.
+* Result must be talloc_free'd when no longer required
+*
+*/
+
+DBScriptPtr_t DBFetchCompiledScript(TALLOC_CTX *ctx, void *dbObjPtr, const String scriptName)
+{
+	DBScriptPtr_t script = NULL;
+	dbObjPtr_t db = dbObjPtr;
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(db)
+	ASSERT_FAIL(DB_MAGIC == db->magic)
+	ASSERT_FAIL(scriptName)
+
+	if(dbTxBegin(db, __func__, TXTY_DEFERRED) == FAIL){
+		return NULL;
+	}
+	
+	script = dbReadScript(db, ctx, __func__, scriptName);
+	
+	dbTxEnd(db, __func__, PASS);
+	
+	return script;
+}
+
+/*
+* Fetch a script and its compiled bytecode given trigger tag/subaddress
+*
+* Arguments
+*
+* 1. A talloc context to hang the result off of.
+* 2. A generic pointer to the database
+* 3. A String containing the tag/subaddress.
+*
+* Return value:
+*
+* A pointer to the script, or NULL if not found.
+* Result must be talloc_free'd when no longer required
+*
+*/
+
+DBScriptPtr_t DBFetchCompiledScriptByTag(TALLOC_CTX *ctx, void *dbObjPtr, const String tagSubAddr)
+{
+	String scriptName = NULL;
+	DBScriptPtr_t script = NULL;
+	dbObjPtr_t db = dbObjPtr;
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(db)
+	ASSERT_FAIL(DB_MAGIC == db->magic)
+	ASSERT_FAIL(tagSubAddr)
+
+	if(dbTxBegin(db, __func__, TXTY_DEFERRED) == FAIL){
+		return NULL;
+	}
+	
+	scriptName = dbReadField(db, ctx, __func__, "trigaction", "source", tagSubAddr, "action");
+	
+	if(scriptName){
+		script = dbReadScript(db, ctx, __func__, scriptName);
+		talloc_free(scriptName);
+	}
+	
+	dbTxEnd(db, __func__, PASS);
+	
+	return script;
+}
+
+/*
+* Replace the stored bytecode for a script. 
+* 
+* Used to refresh the bytecode after it had to be recompiled on load. 
+* Nothing is changed if the script code is no longer the code the bytecode was compiled from.
+*
+* Arguments
+*
+* 1. A talloc context for transitory data
+* 2. A generic pointer to the database
+* 3. A String containing the name of the script.
+* 4. A String containing the script code the bytecode was compiled from.
+* 5. Pointer to the bytecode image.
+* 6. Length of the bytecode image in bytes.
+* 7. Hash of the script code.
+*
+* Return value:
+*
+* Boolean. PASS = success, FAIL = failure.
+*
+*/
+
+Bool DBUpdateBytecode(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String code, const void *bytecode, int len, unsigned srcHash)
+{
+	dbObjPtr_t db = dbObjPtr;
+	Bool res = PASS;
+	int r;
+	sqlite3_stmt *stmt = NULL;
+	static const String sql = "UPDATE scripts SET bytecode=:bytecode,srchash=:srchash WHERE scriptname=:scriptname AND scriptcode=:scriptcode";
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(db)
+	ASSERT_FAIL(DB_MAGIC == db->magic)
+	ASSERT_FAIL(name)
+	ASSERT_FAIL(code)
+	ASSERT_FAIL(bytecode)
+	
+	if(dbTxBegin(db, __func__, TXTY_IMMEDIATE) != PASS){
+		return FAIL;
+	}
+	
+	debug(DEBUG_INCOMPLETE, "%s: Sql = %s", __func__, sql);
+	
+	if(SQLITE_OK != (r = sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL))){
+		res = logErr(db, __LINE__, __func__, "Error on sqlite3_prepare_v2()");
+	}
+	else{
+		r = sqlite3_bind_blob(stmt, sqlite3_bind_parameter_index(stmt, ":bytecode"), bytecode, len, SQLITE_TRANSIENT);
+		if(SQLITE_OK == r){
+			r = sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":srchash"), srcHash);
+		}
+		if(SQLITE_OK == r){
+			r = sqlite3_bind_text(stmt, sqlite3_bind_parameter_index(stmt, ":scriptname"), name, -1, SQLITE_TRANSIENT);
+		}
+		if(SQLITE_OK == r){
+			r = sqlite3_bind_text(stmt, sqlite3_bind_parameter_index(stmt, ":scriptcode"), code, -1, SQLITE_TRANSIENT);
+		}
+		if(SQLITE_OK == r){
+			if(SQLITE_DONE != sqlite3_step(stmt)){
+				res = logErr(db, __LINE__, __func__, "Error on sqlite3_step()");
+			}
+		}
+		else{
+			res = logErr(db, __LINE__, __func__, "Error on sqlite3_bind()");
+		}
+		sqlite3_finalize(stmt);
+	}
+	
+	dbTxEnd(db, __func__, res);
+	
+	return res;
+}
+
+
+/*
+* Count an execution of a script stopped for going over its limits
+*
+* Arguments
+*
+* 1. A generic pointer to the database
+* 2. A String containing the name of the script.
+*
+* Return value:
+*
+* Boolean. PASS = success, FAIL = failure.
+*
+*/
+
+Bool DBCountOverrun(void *dbObjPtr, const String name)
+{
+	dbObjPtr_t db = dbObjPtr;
+	Bool res = PASS;
+	int i;
+	sqlite3_stmt *stmt = NULL;
+	/* Add a row with the default limits if the script doesn't have one */
+	static const String sql[2] = {"INSERT OR IGNORE INTO scriptlimits (scriptname) VALUES (:scriptname)",
+	"UPDATE scriptlimits SET overruns=overruns+1 WHERE scriptname=:scriptname"};
+	
+	ASSERT_FAIL(db)
+	ASSERT_FAIL(DB_MAGIC == db->magic)
+	ASSERT_FAIL(name)
+	
+	if(dbTxBegin(db, __func__, TXTY_IMMEDIATE) != PASS){
+		return FAIL;
+	}
+	
+	for(i = 0; (PASS == res) && (i < 2); i++){
+		debug(DEBUG_INCOMPLETE, "%s: Sql = %s", __func__, sql[i]);
+		if(SQLITE_OK != sqlite3_prepare_v2(db->db, sql[i], -1, &stmt, NULL)){
+			res = logErr(db, __LINE__, __func__, "Error on sqlite3_prepare_v2()");
+			break;
+		}
+		if(SQLITE_OK != sqlite3_bind_text(stmt, sqlite3_bind_parameter_index(stmt, ":scriptname"), name, -1, SQLITE_TRANSIENT)){
+			res = logErr(db, __LINE__, __func__, "Error on sqlite3_bind_text()");
+		}
+		else if(SQLITE_DONE != sqlite3_step(stmt)){
+			res = logErr(db, __LINE__, __func__, "Error on sqlite3_step()");
+		}
+		sqlite3_finalize(stmt);
+	}
+	
+	dbTxEnd(db, __func__, res);
+	
+	return res;
+}
+
 
 /*
 * Update the trigger log
@@ -895,6 +1525,8 @@ Bool DBUpdateHeartbeatLog(TALLOC_CTX *ctx, void *dbObjPtr, const String source)
 * Insert or replace script by script name
 *
 * If the source already exists, it will be overwritten.
+* The script is compiled first, and is rejected if it does not compile. 
+* The bytecode is stored with the script, along with a hash of the script source.
 *
 * Arguments
 *
@@ -920,6 +1552,8 @@ Bool DBIRScript(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String
 	String scriptBuf;
 	String sql = NULL;
 	String p;
+	void *bytecode = NULL;
+	int bytecodeLen = 0;
 
 	
 	ASSERT_FAIL(ctx)
@@ -953,10 +1587,18 @@ Bool DBIRScript(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String
 	/* Terminate the end of the new string */
 	scriptBuf[scriptByteCount] = 0;
 	
+	/* Compile what will be stored. Invalid scripts are rejected here rather than when first run */
+	if((p = ParserCompileScript(ctx, scriptBuf, &bytecode, &bytecodeLen))){
+		debug(DEBUG_UNEXPECTED, "%s: Script %s rejected: %s", __func__, name, p);
+		talloc_free(p);
+		talloc_free(scriptBuf);
+		return FAIL;
+	}
 		
 	/* Transaction begin */
 	
 	if(dbTxBegin(db, __func__, TXTY_EXCLUSIVE) != PASS){
+		talloc_free(bytecode);
 		talloc_free(scriptBuf);
 		return FAIL;
 	}
@@ -968,7 +1610,7 @@ Bool DBIRScript(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String
 	}
 	
 	if(PASS == res){
-		sql = talloc_asprintf(ctx, "INSERT INTO %s (scriptname,scriptcode) VALUES (:scriptname,:scriptcode)",
+		sql = talloc_asprintf(ctx, "INSERT INTO %s (scriptname,scriptcode,bytecode,srchash) VALUES (:scriptname,:scriptcode,:bytecode,:srchash)",
 		"scripts");
 	
 		MALLOC_FAIL(sql)
@@ -992,6 +1634,16 @@ Bool DBIRScript(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String
 				index = sqlite3_bind_parameter_index(stmt, ":scriptcode");
 				r = sqlite3_bind_text(stmt, index, scriptBuf, -1, SQLITE_TRANSIENT);
 			}
+			
+			/* Bind the bytecode and the hash of the source it was compiled from */
+			if(SQLITE_OK == r){
+				index = sqlite3_bind_parameter_index(stmt, ":bytecode");
+				r = sqlite3_bind_blob(stmt, index, bytecode, bytecodeLen, SQLITE_TRANSIENT);
+			}
+			if(SQLITE_OK == r){
+				index = sqlite3_bind_parameter_index(stmt, ":srchash");
+				r = sqlite3_bind_int64(stmt, index, UtilHash(scriptBuf));
+			}
 
 			if(SQLITE_OK == r){
 				/* Execute the parsed statement */
@@ -1008,7 +1660,8 @@ Bool DBIRScript(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String
 		}
 	}
 	
-	/* Free our local copy of the script */
+	/* Free our local copy of the script and its bytecode */
+	talloc_free(bytecode);
 	talloc_free(scriptBuf);
 
 	/* Transaction end */
@@ -1166,7 +1819,8 @@ void DBGenFile(TALLOC_CTX *ctx, String theFile, Bool forceFlag)
 	}	
 	
 	/* Create nvstate table */
-	sql = "CREATE TABLE nvstate (\"nvstateid\" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\"key\" TEXT NOT NULL,\"value\" TEXT,\"timestamp\" INTEGER NOT NULL);";
+	sql = "CREATE TABLE nvstate (\"nvstateid\" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\"key\" TEXT NOT NULL,\"value\" TEXT,\"timestamp\" INTEGER NOT NULL);"
+	"CREATE INDEX nvstatekey ON nvstate (key);";
 	sqlite3_exec(db, sql, NULL, NULL, &errorMessage);
 	if(errorMessage){
 		fatal("Sqlite create table error on nvstate: %s", errorMessage);
@@ -1174,11 +1828,17 @@ void DBGenFile(TALLOC_CTX *ctx, String theFile, Bool forceFlag)
 	
 	
 	/* Create scripts table */
-	sql = "CREATE TABLE \"scripts\" (\"scriptsid\" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\"scriptname\" TEXT NOT NULL,\"scriptcode\" TEXT NOT NULL);";
+	sql = "CREATE TABLE \"scripts\" (\"scriptsid\" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\"scriptname\" TEXT NOT NULL,\"scriptcode\" TEXT NOT NULL,\"bytecode\" BLOB,\"srchash\" INTEGER);";
 	sqlite3_exec(db, sql, NULL, NULL, &errorMessage);
 	if(errorMessage){
 		fatal("Sqlite create table error on scripts: %s", errorMessage);
 	}	
+	
+	/* Create script limits table */
+	sqlite3_exec(db, DB_SCRIPTLIMITS_TABLE, NULL, NULL, &errorMessage);
+	if(errorMessage){
+		fatal("Sqlite create table error on scriptlimits: %s", errorMessage);
+	}	
 
 	/* Create trigaction table */
 	sql = "CREATE TABLE trigaction (\"trigactionid\" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,\"source\" TEXT NOT NULL,\"action\" TEXT NOT NULL);";
@@ -3,13 +3,37 @@
 
 typedef int (* DBRecordCallBack_t)(void *data, int argc, String *argv, String *colnames);
 
+/* Script read from the scripts table, with its compiled bytecode */
+
+typedef struct DBScript_s {
+	String name;
+	String code;
+	void *bytecode; /* NULL if none is stored */
+	int bytecodeLen;
+	unsigned srcHash; /* Hash of the source the bytecode was compiled from */
+	long long maxInstrs; /* Limits from the scriptlimits table. -1 to use the default, 0 for none */
+	long long maxMS;
+} DBScript_t;
+
+typedef DBScript_t * DBScriptPtr_t;
+
+/* When changed nvstate values are written to the database */
+
+enum {NVF_SCRIPT = 0, NVF_TIMER, NVF_SYNC};
+
 
 void *DBOpen(TALLOC_CTX *ctx, String file);
 void DBClose(void *dbObjPtr);
 const String DBReadNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key);
 Bool DBWriteNVState(TALLOC_CTX *ctx, void *dbObjPtr, const String key, const String value);
+Bool DBFlushNVState(void *dbObjPtr);
+void DBSetNVStateSync(void *dbObjPtr, Bool sync);
 const String DBFetchScript(TALLOC_CTX *ctx, void *dbObjPtr, const String scriptName);
 const String DBFetchScriptByTag(TALLOC_CTX *ctx, void *dbObjPtr, const String tagSubAddr);
+DBScriptPtr_t DBFetchCompiledScript(TALLOC_CTX *ctx, void *dbObjPtr, const String scriptName);
+DBScriptPtr_t DBFetchCompiledScriptByTag(TALLOC_CTX *ctx, void *dbObjPtr, const String tagSubAddr);
+Bool DBUpdateBytecode(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String code, const void *bytecode, int len, unsigned srcHash);
+Bool DBCountOverrun(void *dbObjPtr, const String name);
 Bool DBUpdateTrigLog(TALLOC_CTX *ctx, void *dbObjPtr, const String source, const String schema, const String nvpairs);
 Bool DBUpdateHeartbeatLog(TALLOC_CTX *ctx, void *dbObjPtr, const String source);
 Bool DBIRScript(TALLOC_CTX *ctx, void *dbObjPtr, const String name, const String script);
@@ -0,0 +1,353 @@
+/*
+* delayq.c
+*
+* Copyright (C) 2013 Stephen Rodgers
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 3
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*
+*
+* Stephen "Steve" Rodgers <hwstar@rodgers.sdcoxmail.com>
+*
+* Delayed actions. A script schedules another script to run a number of
+* seconds later with after(), and can call it off with cancel().
+*
+* Pending actions are kept on a timer wheel with a one second tick, and in a
+* table indexed by id, so adding and cancelling one is constant time however
+* many are pending. Actions refer to scripts by name, so a script changed
+* while an action is pending runs as it is when the time comes. Times are
+* seconds from the monotonic clock, so setting the time doesn't move them.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include "defs.h"
+#include "types.h"
+#include "notify.h"
+#include "util.h"
+#include "timerwheel.h"
+#include "delayq.h"
+
+#define DQ_MAGIC 0x6D3A0C59
+#define DQ_BUCKETS 64 /* Initial id buckets. Must be a power of 2 */
+#define DQ_WHEEL_SLOTS 4096
+
+typedef struct delayEntry_s {
+	unsigned id;
+	String scriptName;
+	TimerWheelTimer_t timer;
+	struct delayEntry_s *next; /* Next in the id bucket */
+	struct delayEntry_s *nextFired;
+} delayEntry_t, *delayEntryPtr_t;
+
+typedef struct delayQ_s {
+	unsigned magic;
+	pthread_mutex_t lock;
+	void *wheel;
+	unsigned nextId;
+	unsigned numBuckets;
+	unsigned count; /* Pending actions */
+	unsigned long added;
+	unsigned long fired;
+	unsigned long cancelled;
+	TALLOC_CTX *ctx; /* Entries. Only touched with the lock held */
+	delayEntryPtr_t *buckets;
+} delayQ_t, *delayQPtr_t;
+
+/*
+ * Destroy the lock and entries when the object is freed
+ */
+
+static int delayQDestructor(delayQPtr_t dq)
+{
+	pthread_mutex_destroy(&dq->lock);
+	talloc_free(dq->ctx);
+	dq->magic = 0;
+	return 0;
+}
+
+/*
+ * Find an action by id. The lock must be held.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the delay queue
+ * 2. Id to find
+ * 3. Pointer to a variable to receive the link pointing to the entry. Pass NULL if not needed.
+ *
+ * Return value:
+ *
+ * The entry, or NULL if it is not pending.
+ */
+
+static delayEntryPtr_t dqFind(delayQPtr_t dq, unsigned id, delayEntryPtr_t **pLink)
+{
+	delayEntryPtr_t *link, de;
+
+	for(link = dq->buckets + (id & (dq->numBuckets - 1)); (de = *link); link = &de->next){
+		if(de->id == id){
+			break;
+		}
+	}
+	if(pLink){
+		*pLink = link;
+	}
+	return de;
+}
+
+/*
+ * Double the number of id buckets. The lock must be held.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the delay queue
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void dqGrow(delayQPtr_t dq)
+{
+	delayEntryPtr_t *old, de, next;
+	unsigned i, oldSize = dq->numBuckets;
+
+	old = dq->buckets;
+	dq->numBuckets = oldSize * 2;
+	MALLOC_FAIL(dq->buckets = talloc_zero_array(dq->ctx, delayEntryPtr_t, dq->numBuckets))
+	for(i = 0; i < oldSize; i++){
+		for(de = old[i]; de; de = next){
+			next = de->next;
+			de->next = dq->buckets[de->id & (dq->numBuckets - 1)];
+			dq->buckets[de->id & (dq->numBuckets - 1)] = de;
+		}
+	}
+	talloc_free(old);
+}
+
+/*
+ * Timer wheel callback. Take an action whose time has come out of the id table,
+ * and add it to the list to execute once the lock is released.
+ */
+
+static void dqFireCallback(TimerWheelTimerPtr_t timer, void *userObj, void *cbObj)
+{
+	delayQPtr_t dq = ((void **) cbObj)[0];
+	delayEntryPtr_t *firedHead = ((void **) cbObj)[1];
+	delayEntryPtr_t de = userObj;
+	delayEntryPtr_t *link;
+
+	ASSERT_FAIL(de == dqFind(dq, de->id, &link))
+	*link = de->next;
+	dq->count--;
+	de->nextFired = *firedHead;
+	*firedHead = de;
+}
+
+/*
+ * Create the delay queue
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the object off of.
+ *
+ * Return value:
+ *
+ * Generic pointer to the delay queue
+ */
+
+void *DelayQNew(TALLOC_CTX *ctx)
+{
+	delayQPtr_t dq;
+
+	MALLOC_FAIL(dq = talloc_zero(ctx, delayQ_t))
+	pthread_mutex_init(&dq->lock, NULL);
+	/* Not a child of the object, as it is allocated from by script executions */
+	MALLOC_FAIL(dq->ctx = talloc_new(NULL))
+	MALLOC_FAIL(dq->buckets = talloc_zero_array(dq->ctx, delayEntryPtr_t, DQ_BUCKETS))
+	dq->numBuckets = DQ_BUCKETS;
+	dq->nextId = 1;
+	dq->wheel = TimerWheelNew(dq, DQ_WHEEL_SLOTS, UtilMonoSeconds());
+	dq->magic = DQ_MAGIC;
+	talloc_set_destructor(dq, delayQDestructor);
+
+	return dq;
+}
+
+/*
+ * Schedule a script to run later
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the delay queue.
+ * 2. Number of seconds from now. 0 runs it on the next tick.
+ * 3. Name of the script.
+ *
+ * Return value:
+ *
+ * Id to cancel the action with, or 0 if there are too many pending.
+ */
+
+unsigned DelayQAdd(void *delayQPtr, unsigned seconds, const String scriptName)
+{
+	delayQPtr_t dq = delayQPtr;
+	delayEntryPtr_t de, *link;
+	unsigned id;
+
+	ASSERT_FAIL(dq && scriptName)
+	ASSERT_FAIL(DQ_MAGIC == dq->magic)
+
+	pthread_mutex_lock(&dq->lock);
+	if(dq->count >= DELAYQ_MAX_PENDING){
+		pthread_mutex_unlock(&dq->lock);
+		return 0;
+	}
+	if(dq->count >= dq->numBuckets){
+		dqGrow(dq);
+	}
+	/* Ids wrap round eventually. Skip 0, and any still pending */
+	do{
+		id = dq->nextId++;
+	} while((!id) || dqFind(dq, id, &link));
+
+	MALLOC_FAIL(de = talloc_zero(dq->ctx, delayEntry_t))
+	MALLOC_FAIL(de->scriptName = talloc_strdup(de, scriptName))
+	de->id = id;
+	*link = de;
+	dq->count++;
+	dq->added++;
+	TimerWheelAdd(dq->wheel, &de->timer, UtilMonoSeconds() + seconds, de);
+	pthread_mutex_unlock(&dq->lock);
+
+	debug(DEBUG_ACTION, "Delayed action %u: script %s in %u seconds", id, scriptName, seconds);
+	return id;
+}
+
+/*
+ * Cancel a pending action
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the delay queue.
+ * 2. Id returned when the action was added.
+ *
+ * Return value:
+ *
+ * Boolean. PASS if the action was cancelled, FAIL if it is not pending.
+ */
+
+Bool DelayQCancel(void *delayQPtr, unsigned id)
+{
+	delayQPtr_t dq = delayQPtr;
+	delayEntryPtr_t de, *link;
+
+	ASSERT_FAIL(dq)
+	ASSERT_FAIL(DQ_MAGIC == dq->magic)
+
+	pthread_mutex_lock(&dq->lock);
+	if(!(de = dqFind(dq, id, &link))){
+		pthread_mutex_unlock(&dq->lock);
+		return FAIL;
+	}
+	TimerWheelRemove(dq->wheel, &de->timer);
+	*link = de->next;
+	dq->count--;
+	dq->cancelled++;
+	talloc_free(de);
+	pthread_mutex_unlock(&dq->lock);
+
+	debug(DEBUG_ACTION, "Delayed action %u cancelled", id);
+	return PASS;
+}
+
+/*
+ * Execute the actions whose time has come. Call about once a second.
+ *
+ * The actions are executed with the lock released, so the scripts they run
+ * can add and cancel actions.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the delay queue.
+ * 2. Function to execute an action with.
+ *
+ * Return value:
+ *
+ * Number of actions executed.
+ */
+
+unsigned DelayQTick(void *delayQPtr, DelayQExec_t exec)
+{
+	delayQPtr_t dq = delayQPtr;
+	delayEntryPtr_t firedHead = NULL, de, next;
+	void *cbObj[2];
+	unsigned n = 0;
+
+	ASSERT_FAIL(dq && exec)
+	ASSERT_FAIL(DQ_MAGIC == dq->magic)
+
+	cbObj[0] = dq;
+	cbObj[1] = &firedHead;
+	pthread_mutex_lock(&dq->lock);
+	TimerWheelAdvance(dq->wheel, UtilMonoSeconds(), dqFireCallback, cbObj);
+	pthread_mutex_unlock(&dq->lock);
+
+	for(de = firedHead; de; de = de->nextFired){
+		(*exec)(de->scriptName, de->id);
+		n++;
+	}
+
+	pthread_mutex_lock(&dq->lock);
+	dq->fired += n;
+	for(de = firedHead; de; de = next){
+		next = de->nextFired;
+		talloc_free(de);
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return n;
+}
+
+/*
+ * Return the delay queue statistics
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the delay queue.
+ *
+ * Return value:
+ *
+ * Statistics as a string.
+ */
+
+String DelayQGetStats(TALLOC_CTX *ctx, void *delayQPtr)
+{
+	delayQPtr_t dq = delayQPtr;
+	String res;
+
+	ASSERT_FAIL(ctx && dq)
+	ASSERT_FAIL(DQ_MAGIC == dq->magic)
+
+	pthread_mutex_lock(&dq->lock);
+	MALLOC_FAIL(res = talloc_asprintf(ctx, "delay-pending=%u delay-added=%lu delay-fired=%lu delay-cancelled=%lu",
+	dq->count, dq->added, dq->fired, dq->cancelled))
+	pthread_mutex_unlock(&dq->lock);
+
+	return res;
+}
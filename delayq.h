@@ -0,0 +1,15 @@
+#ifndef DELAYQ_H
+#define DELAYQ_H
+
+#define DELAYQ_MAX_PENDING 100000
+
+/* Called for each delayed action whose time has come */
+typedef void (*DelayQExec_t)(const String scriptName, unsigned id);
+
+void *DelayQNew(TALLOC_CTX *ctx);
+unsigned DelayQAdd(void *delayQPtr, unsigned seconds, const String scriptName);
+Bool DelayQCancel(void *delayQPtr, unsigned id);
+unsigned DelayQTick(void *delayQPtr, DelayQExec_t exec);
+String DelayQGetStats(TALLOC_CTX *ctx, void *delayQPtr);
+
+#endif
@@ -52,6 +52,9 @@
 
 %nonassoc EQEQ NEQ .
 %nonassoc EQUALS .
+%left PLUS MINUS .
+%left STAR SLASH .
+%right UMINUS .
 %nonassoc OPAREN CPAREN .
 
 /*
@@ -153,6 +156,15 @@ ifkw ::= IF .
 
 expression ::= function .
 
+/*
+* Value function called for what it does. The result is discarded.
+*/
+
+expression ::= valuefunction .
+{
+	ParserPcodeEmit(parseCtrl, OP_NOP, 0, "discard", NULL);
+}
+
 
 /*
 * Function
@@ -182,26 +194,39 @@ builtinFunction(A) ::= SPAWN(B) .
 }
 
 /*
-* Argument to argument list (sucessive)
+* Builtin set the time to live of a mem hash key
 */
 
-argumentlist ::= argumentlist COMMA argument .
+builtinFunction(A) ::= EXPIRE(B) .
 {
+	A = B;
+}
+
+/*
+* Argument to argument list (sucessive). The operand counts the arguments.
+*/
+
+argumentlist(A) ::= argumentlist(B) COMMA argument .
+{
+	A = B;
+	A->operand++;
 }
 
 /*
 * Argument to argument list (initial)
 */
 
-argumentlist ::= argument .
+argumentlist(A) ::= argument .
 {
+	MALLOC_FAIL(A = talloc_zero(parseCtrl, token_t)) 
+	A->operand = 1;
 }
 
 /*
-* rvalue to argument
+* value to argument
 */
 
-argument ::= rvalue .
+argument ::= value .
 {
 }
 
@@ -221,40 +246,17 @@ argument ::= BACKSLASH HASH(A) .
 * assignment
 */
 
-assignment ::= hash EQUALS rvalue .
+assignment ::= hash EQUALS value .
 {
 
-	ParserPcodeEmit(parseCtrl, OP_ASSIGN, 0, "hash eq rvalue", NULL);
-}
-
-
-assignment ::= hash EQUALS hash .
-{	
-
-	ParserPcodeEmit(parseCtrl, OP_ASSIGN, 0, "hash eq rhash", NULL);
-		
+	ParserPcodeEmit(parseCtrl, OP_ASSIGN, 0, "hash eq value", NULL);
 }
 
 /*
 * Numeric Equality test
 */
 
-test ::= hash testop(A) rvalue .
-{
-	ParserPcodeEmit(parseCtrl, OP_TEST2, A->operand, "test", A->anno);
-}
-
-test ::= rvalue testop(A) hash .
-{
-	ParserPcodeEmit(parseCtrl, OP_TEST2, A->operand, "test", A->anno);
-}
-
-test ::= hash testop(A) hash .
-{
-	ParserPcodeEmit(parseCtrl, OP_TEST2, A->operand, "test", A->anno);
-}
-
-test ::= rvalue testop(A) rvalue .
+test ::= value testop(A) value .
 {
 	ParserPcodeEmit(parseCtrl, OP_TEST2, A->operand, "test", A->anno);
 }
@@ -324,6 +326,154 @@ testop(A) ::= SEQ . /* String Equality */
 }
 
 
+/*
+* Arithmetic. Operands are converted to numbers when the operator runs
+*/
+
+value ::= value PLUS value .
+{
+	ParserEmitValueOp(parseCtrl, OP_ADD, 2, "+");
+}
+
+value ::= value MINUS value .
+{
+	ParserEmitValueOp(parseCtrl, OP_SUB, 2, "-");
+}
+
+value ::= value STAR value .
+{
+	ParserEmitValueOp(parseCtrl, OP_MUL, 2, "*");
+}
+
+value ::= value SLASH value .
+{
+	ParserEmitValueOp(parseCtrl, OP_DIV, 2, "/");
+}
+
+value ::= MINUS value . [UMINUS]
+{
+	ParserEmitValueOp(parseCtrl, OP_NEG, 1, "-");
+}
+
+value ::= OPAREN value CPAREN .
+
+/*
+* hash key, literal or value function to value
+*/
+
+value ::= hash .
+value ::= rvalue .
+value ::= valuefunction .
+
+/*
+* Value function. Returns a value, so it can be used wherever one can
+*/
+
+valuefunction ::= builtinValueFunction(A) OPAREN argumentlist(B) CPAREN .
+{
+	ParserEmitValueOp(parseCtrl, A->operand, B->operand, A->stringVal);
+}
+
+/*
+* Builtin concatenate strings
+*/
+
+builtinValueFunction(A) ::= CONCAT(B) .
+{
+	A = B;
+	A->operand = OP_CONCAT;
+}
+
+/*
+* Builtin printf style format
+*/
+
+builtinValueFunction(A) ::= FORMAT(B) .
+{
+	A = B;
+	A->operand = OP_FORMAT;
+}
+
+/*
+* Builtin substring
+*/
+
+builtinValueFunction(A) ::= SUBSTR(B) .
+{
+	A = B;
+	A->operand = OP_SUBSTR;
+}
+
+/*
+* Builtin absolute value
+*/
+
+builtinValueFunction(A) ::= ABS(B) .
+{
+	A = B;
+	A->operand = OP_ABS;
+}
+
+/*
+* Builtin smallest of the arguments
+*/
+
+builtinValueFunction(A) ::= MIN(B) .
+{
+	A = B;
+	A->operand = OP_MIN;
+}
+
+/*
+* Builtin largest of the arguments
+*/
+
+builtinValueFunction(A) ::= MAX(B) .
+{
+	A = B;
+	A->operand = OP_MAX;
+}
+
+/*
+* Builtin round to a number of decimal places
+*/
+
+builtinValueFunction(A) ::= ROUND(B) .
+{
+	A = B;
+	A->operand = OP_ROUND;
+}
+
+/*
+* Builtin run a script a number of seconds later
+*/
+
+builtinValueFunction(A) ::= AFTER(B) .
+{
+	A = B;
+	A->operand = OP_AFTER;
+}
+
+/*
+* Builtin cancel a script run with after
+*/
+
+builtinValueFunction(A) ::= CANCEL(B) .
+{
+	A = B;
+	A->operand = OP_CANCEL;
+}
+
+/*
+* Builtin wait for a message from a source with a schema, for up to a number of seconds
+*/
+
+builtinValueFunction(A) ::= WAITFOR(B) .
+{
+	A = B;
+	A->operand = OP_WAITFOR;
+}
+
 /*
 *  hash
 */
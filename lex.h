@@ -1,11 +1,11 @@
 #ifndef LEX_H
 #define LEX_H
-void yyInit(void * context);
-void yyScanString(const char *s);
-void yyDeleteBuffer(void);
-int yyLex(void);
-void yySetInputFile(FILE *f);
-void yyLexDestroy(void);
-const tokenPtr_t yyTokenVal(void *context);
+void yyInit(ParseCtrlPtr_t pc);
+void yyScanString(ParseCtrlPtr_t pc, const char *s);
+void yyDeleteBuffer(ParseCtrlPtr_t pc);
+int yyLex(ParseCtrlPtr_t pc);
+void yySetInputFile(ParseCtrlPtr_t pc, FILE *f);
+void yyLexDestroy(ParseCtrlPtr_t pc);
+const tokenPtr_t yyTokenVal(ParseCtrlPtr_t pc);
 #endif
 
@@ -0,0 +1,430 @@
+/*
+* memstate.c
+*
+* Copyright (C) 2013 Stephen Rodgers
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 3
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*
+*
+* Stephen "Steve" Rodgers <hwstar@rodgers.sdcoxmail.com>
+*
+* Backing store for the %mem hash. Values are shared by every script
+* execution in the process, and are lost when it exits.
+*
+* Keys are spread over a number of stripes, each with its own buckets. A stripe
+* grows on its own, so growing rehashes only its share of the keys, and a script
+* putting a key never holds up the poller thread for long. Scripts all run on the
+* poller thread, so the stripe locks are never contended. They keep the object safe
+* to call from any thread, as the delay queue is.
+* Keys can be given a time to live. Expiry is driven by a timer wheel with a
+* one second tick, which is advanced by MemStateTick(). Times are seconds from
+* the monotonic clock, so setting the time doesn't change when keys expire.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include "defs.h"
+#include "types.h"
+#include "notify.h"
+#include "util.h"
+#include "timerwheel.h"
+#include "memstate.h"
+
+#define MS_MAGIC 0x3E0B71A4
+#define MS_STRIPES 16 /* Must be a power of 2 */
+#define MS_STRIPE_BUCKETS 16 /* Initial buckets per stripe. Must be a power of 2 */
+#define MS_WHEEL_SLOTS 512
+
+typedef struct memEntry_s {
+	unsigned hash;
+	unsigned long expires; /* Monotonic seconds, or 0 if the key does not expire */
+	String key;
+	String value;
+	TimerWheelTimer_t timer;
+	struct memEntry_s *next;
+} memEntry_t, *memEntryPtr_t;
+
+typedef struct memStripe_s {
+	pthread_mutex_t lock;
+	unsigned numBuckets;
+	unsigned count;
+	TALLOC_CTX *ctx; /* Entries in this stripe. Only touched with the lock held */
+	memEntryPtr_t *buckets;
+} memStripe_t, *memStripePtr_t;
+
+typedef struct memState_s {
+	unsigned magic;
+	pthread_mutex_t wheelLock; /* Taken after a stripe lock, never before */
+	void *wheel;
+	memStripe_t stripes[MS_STRIPES];
+} memState_t, *memStatePtr_t;
+
+/* Keys of expired entries, collected while the wheel is advanced */
+
+typedef struct memExpired_s {
+	TALLOC_CTX *ctx;
+	unsigned count;
+	String *keys;
+} memExpired_t, *memExpiredPtr_t;
+
+
+/*
+ * Destroy the stripe locks and entries when the object is freed
+ */
+
+static int memStateDestructor(memStatePtr_t ms)
+{
+	int i;
+
+	for(i = 0; i < MS_STRIPES; i++){
+		pthread_mutex_destroy(&ms->stripes[i].lock);
+		talloc_free(ms->stripes[i].ctx);
+	}
+	pthread_mutex_destroy(&ms->wheelLock);
+	ms->magic = 0;
+	return 0;
+}
+
+/*
+ * Find a key in a stripe. The stripe must be locked.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the stripe
+ * 2. Key to find
+ * 3. Hash of the key
+ * 4. Pointer to a variable to receive the link pointing to the entry. Pass NULL if not needed.
+ *
+ * Return value:
+ *
+ * The entry, or NULL if it is not there.
+ */
+
+static memEntryPtr_t memFind(memStripePtr_t st, const String key, unsigned kh, memEntryPtr_t **pLink)
+{
+	memEntryPtr_t *link, me;
+
+	for(link = st->buckets + ((kh / MS_STRIPES) & (st->numBuckets - 1)); (me = *link); link = &me->next){
+		if((me->hash == kh) && (!strcmp(me->key, key))){
+			break;
+		}
+	}
+	if(pLink){
+		*pLink = link;
+	}
+	return me;
+}
+
+/*
+ * Double the number of buckets in a stripe. The stripe must be locked.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the stripe
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void memGrow(memStripePtr_t st)
+{
+	memEntryPtr_t *old, me, next;
+	unsigned i, oldSize = st->numBuckets;
+
+	old = st->buckets;
+	st->numBuckets = oldSize * 2;
+	MALLOC_FAIL(st->buckets = talloc_zero_array(st->ctx, memEntryPtr_t, st->numBuckets))
+	for(i = 0; i < oldSize; i++){
+		for(me = old[i]; me; me = next){
+			next = me->next;
+			me->next = st->buckets[(me->hash / MS_STRIPES) & (st->numBuckets - 1)];
+			st->buckets[(me->hash / MS_STRIPES) & (st->numBuckets - 1)] = me;
+		}
+	}
+	talloc_free(old);
+}
+
+/*
+ * Unlink and free an entry. The stripe must be locked.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the memstate object
+ * 2. Pointer to the stripe
+ * 3. Link pointing to the entry
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void memRemove(memStatePtr_t ms, memStripePtr_t st, memEntryPtr_t *link)
+{
+	memEntryPtr_t me = *link;
+
+	if(me->expires){
+		pthread_mutex_lock(&ms->wheelLock);
+		TimerWheelRemove(ms->wheel, &me->timer);
+		pthread_mutex_unlock(&ms->wheelLock);
+	}
+	*link = me->next;
+	st->count--;
+	talloc_free(me);
+}
+
+/*
+ * Timer wheel callback. Note the key of an entry whose time to live has run out.
+ * The entry is removed after the wheel is unlocked.
+ */
+
+static void memExpireCallback(TimerWheelTimerPtr_t timer, void *userObj, void *cbObj)
+{
+	memEntryPtr_t me = userObj;
+	memExpiredPtr_t ex = cbObj;
+
+	if(!ex->ctx){
+		MALLOC_FAIL(ex->ctx = talloc_new(NULL))
+	}
+	MALLOC_FAIL(ex->keys = talloc_realloc(ex->ctx, ex->keys, String, ex->count + 1))
+	MALLOC_FAIL(ex->keys[ex->count++] = talloc_strdup(ex->ctx, me->key))
+}
+
+/*
+ * Create the memstate object
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the object off of.
+ *
+ * Return value:
+ *
+ * Generic pointer to the memstate object
+ */
+
+void *MemStateNew(TALLOC_CTX *ctx)
+{
+	memStatePtr_t ms;
+	memStripePtr_t st;
+	int i;
+
+	MALLOC_FAIL(ms = talloc_zero(ctx, memState_t))
+
+	for(i = 0; i < MS_STRIPES; i++){
+		st = ms->stripes + i;
+		pthread_mutex_init(&st->lock, NULL);
+		/* Not a child of the object, so a stripe's allocations only touch memory its lock guards */
+		MALLOC_FAIL(st->ctx = talloc_new(NULL))
+		MALLOC_FAIL(st->buckets = talloc_zero_array(st->ctx, memEntryPtr_t, MS_STRIPE_BUCKETS))
+		st->numBuckets = MS_STRIPE_BUCKETS;
+	}
+	pthread_mutex_init(&ms->wheelLock, NULL);
+	ms->wheel = TimerWheelNew(ms, MS_WHEEL_SLOTS, UtilMonoSeconds());
+	ms->magic = MS_MAGIC;
+	talloc_set_destructor(ms, memStateDestructor);
+
+	return ms;
+}
+
+/*
+ * Get a value
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the memstate object.
+ * 3. Key to look up.
+ *
+ * Return value:
+ *
+ * A copy of the value, or NULL if the key is not there or has expired.
+ * Result must be talloc_free'd when no longer required.
+ */
+
+const String MemStateGet(TALLOC_CTX *ctx, void *memStatePtr, const String key)
+{
+	memStatePtr_t ms = memStatePtr;
+	memStripePtr_t st;
+	memEntryPtr_t me;
+	String res = NULL;
+	unsigned kh;
+
+	ASSERT_FAIL(ctx && ms && key)
+	ASSERT_FAIL(MS_MAGIC == ms->magic)
+
+	kh = UtilHash(key);
+	st = ms->stripes + (kh & (MS_STRIPES - 1));
+
+	pthread_mutex_lock(&st->lock);
+	/* Keys past their time are gone, even if the wheel has not caught up yet */
+	if((me = memFind(st, key, kh, NULL)) && ((!me->expires) || (me->expires > UtilMonoSeconds()))){
+		MALLOC_FAIL(res = talloc_strdup(ctx, me->value))
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	return res;
+}
+
+/*
+ * Set a value, adding the key if it is not there.
+ * Any time to live the key had is cleared.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the memstate object.
+ * 2. Key
+ * 3. Value
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void MemStatePut(void *memStatePtr, const String key, const String value)
+{
+	memStatePtr_t ms = memStatePtr;
+	memStripePtr_t st;
+	memEntryPtr_t me, *link;
+	unsigned kh;
+
+	ASSERT_FAIL(ms && key && value)
+	ASSERT_FAIL(MS_MAGIC == ms->magic)
+
+	kh = UtilHash(key);
+	st = ms->stripes + (kh & (MS_STRIPES - 1));
+
+	pthread_mutex_lock(&st->lock);
+	if((me = memFind(st, key, kh, &link))){
+		talloc_free(me->value);
+		if(me->expires){
+			pthread_mutex_lock(&ms->wheelLock);
+			TimerWheelRemove(ms->wheel, &me->timer);
+			pthread_mutex_unlock(&ms->wheelLock);
+		}
+		me->expires = 0;
+	}
+	else{
+		if(st->count >= st->numBuckets){
+			memGrow(st);
+			memFind(st, key, kh, &link);
+		}
+		MALLOC_FAIL(me = talloc_zero(st->ctx, memEntry_t))
+		MALLOC_FAIL(me->key = talloc_strdup(me, key))
+		me->hash = kh;
+		*link = me;
+		st->count++;
+	}
+	MALLOC_FAIL(me->value = talloc_strdup(me, value))
+	pthread_mutex_unlock(&st->lock);
+}
+
+/*
+ * Set the time to live of a key
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the memstate object.
+ * 2. Key
+ * 3. Number of seconds until the key is removed. 0 keeps the key until it is removed.
+ *
+ * Return value:
+ *
+ * Boolean. PASS if successful, FAIL if the key is not there.
+ */
+
+Bool MemStateExpire(void *memStatePtr, const String key, unsigned seconds)
+{
+	memStatePtr_t ms = memStatePtr;
+	memStripePtr_t st;
+	memEntryPtr_t me;
+	unsigned kh;
+
+	ASSERT_FAIL(ms && key)
+	ASSERT_FAIL(MS_MAGIC == ms->magic)
+
+	kh = UtilHash(key);
+	st = ms->stripes + (kh & (MS_STRIPES - 1));
+
+	pthread_mutex_lock(&st->lock);
+	if(!(me = memFind(st, key, kh, NULL))){
+		pthread_mutex_unlock(&st->lock);
+		return FAIL;
+	}
+	pthread_mutex_lock(&ms->wheelLock);
+	if(seconds){
+		me->expires = UtilMonoSeconds() + seconds;
+		TimerWheelAdd(ms->wheel, &me->timer, me->expires, me);
+	}
+	else{
+		me->expires = 0;
+		TimerWheelRemove(ms->wheel, &me->timer);
+	}
+	pthread_mutex_unlock(&ms->wheelLock);
+	pthread_mutex_unlock(&st->lock);
+
+	return PASS;
+}
+
+/*
+ * Remove keys whose time to live has run out. Call about once a second.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the memstate object.
+ *
+ * Return value:
+ *
+ * Number of keys removed.
+ */
+
+unsigned MemStateTick(void *memStatePtr)
+{
+	memStatePtr_t ms = memStatePtr;
+	memExpired_t ex = {NULL, 0, NULL};
+	memStripePtr_t st;
+	memEntryPtr_t me, *link;
+	unsigned long now = UtilMonoSeconds();
+	unsigned i, kh, removed = 0;
+
+	ASSERT_FAIL(ms)
+	ASSERT_FAIL(MS_MAGIC == ms->magic)
+
+	pthread_mutex_lock(&ms->wheelLock);
+	TimerWheelAdvance(ms->wheel, now, memExpireCallback, &ex);
+	pthread_mutex_unlock(&ms->wheelLock);
+
+	/*
+	 * The stripe lock has to be taken before the wheel lock, so the entries are
+	 * removed by key. One which was set again in the meantime is left alone.
+	 */
+	for(i = 0; i < ex.count; i++){
+		kh = UtilHash(ex.keys[i]);
+		st = ms->stripes + (kh & (MS_STRIPES - 1));
+		pthread_mutex_lock(&st->lock);
+		if((me = memFind(st, ex.keys[i], kh, &link)) && (me->expires) && (me->expires <= now)){
+			debug(DEBUG_ACTION, "mem key expired: %s", me->key);
+			memRemove(ms, st, link);
+			removed++;
+		}
+		pthread_mutex_unlock(&st->lock);
+	}
+	talloc_free(ex.ctx);
+
+	return removed;
+}
@@ -0,0 +1,10 @@
+#ifndef MEMSTATE_H
+#define MEMSTATE_H
+
+void *MemStateNew(TALLOC_CTX *ctx);
+const String MemStateGet(TALLOC_CTX *ctx, void *memStatePtr, const String key);
+void MemStatePut(void *memStatePtr, const String key, const String value);
+Bool MemStateExpire(void *memStatePtr, const String key, unsigned seconds);
+unsigned MemStateTick(void *memStatePtr);
+
+#endif
@@ -40,6 +40,7 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/fcntl.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <talloc.h>
 #include  "defs.h"
@@ -51,6 +52,10 @@
 #include "poll.h"
 #include "util.h"
 #include "scheduler.h"
+#include "memstate.h"
+#include "spawnhelper.h"
+#include "delayq.h"
+#include "timerwheel.h"
 #include "xplcore.h"
 #include "monitor.h"
 #include "xplevent.h"
@@ -65,19 +70,85 @@ typedef struct connectionData_s {
 
 typedef connectionData_t * connectionDataPtr_t;
 
+/* Compiled program cache entry */
+
+typedef struct progCacheEntry_s {
+	String name;
+	unsigned srcHash;
+	BCProgramPtr_t prog;
+	struct progCacheEntry_s *next;
+} progCacheEntry_t;
+
+typedef progCacheEntry_t * progCacheEntryPtr_t;
+
+#define PC_LOCK pthread_mutex_lock(&progCacheLock);
+#define PC_UNLOCK pthread_mutex_unlock(&progCacheLock);
+
+/* Script waiting in waitfor() for a message. A child of the script's pcode header */
+
+typedef struct waiter_s {
+	PcodeHeaderPtr_t ph;
+	void *filter; /* Message filter in xplcore */
+	TimerWheelTimer_t timer; /* Timeout */
+	struct waiter_s *prev;
+	struct waiter_s *next;
+	struct waiter_s *nextExpired;
+} waiter_t;
+
+typedef waiter_t * waiterPtr_t;
+
+/* Script being profiled */
+
+typedef struct profileEntry_s {
+	String name;
+	void *profile;
+	struct profileEntry_s *next;
+} profileEntry_t;
+
+typedef profileEntry_t * profileEntryPtr_t;
+
+#define MAX_WAITERS 1024 /* Most scripts which can wait at once */
+#define WAIT_WHEEL_SLOTS 256
+
 
 /* Client command codes */
 
-enum {CC_EXEC = 0, CC_SCHRELOAD};
+enum {CC_EXEC = 0, CC_SCHRELOAD, CC_STATS, CC_PROFILE};
 
 /*  Client command table */
 
 static String clientCommands[]  = {
 	"exec",
 	"schreload",
+	"stats",
+	"profile",
 	NULL
 };
 
+/* Compiled programs, by script name. Shared by every run of a script */
+
+static progCacheEntryPtr_t progCache = NULL;
+static pthread_mutex_t progCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 
+ * Scripts waiting in waitfor(). Only touched from the poller thread, which 
+ * receives the messages and runs the tick handlers.
+ */
+
+static waiterPtr_t waitHead = NULL;
+static unsigned waitCount = 0;
+static unsigned long waitMatched = 0;
+static unsigned long waitTimeouts = 0;
+static void *waitWheel = NULL; /* Ticks are seconds from the monotonic clock */
+
+/* Script executions stopped for going over budget */
+
+static unsigned long overruns = 0;
+
+/* Scripts being profiled, by name. Only touched from the poller thread */
+
+static profileEntryPtr_t profileHead = NULL;
+
 
 
 
@@ -144,12 +215,115 @@ static void kvDump(const String key, const String value)
 }
 
 /*
- * Parse HCL and generate pcode
+ * Attach the cached program for a script to a pcode header
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the pcode header block
+ * 2. Name of the script
+ * 3. Hash of the script source
+ *
+ * Return value:
+ *
+ * Boolean. PASS if the program was in the cache, otherwise FAIL.
+ *
+ */
+
+static Bool progCacheAttach(PcodeHeaderPtr_t ph, const String name, unsigned srcHash)
+{
+	progCacheEntryPtr_t pce;
+	Bool res = FAIL;
+	
+	PC_LOCK
+	for(pce = progCache; pce; pce = pce->next){
+		if(!strcmp(pce->name, name)){
+			if(pce->srcHash == srcHash){
+				ParserAttachProgram(ph, pce->prog);
+				res = PASS;
+			}
+			break;
+		}
+	}
+	PC_UNLOCK
+	return res;
+}
+
+/*
+ * Add a script's program to the cache, replacing any older one for the script
+ *
+ * Arguments:
+ *
+ * 1. Name of the script
+ * 2. Hash of the script source
+ * 3. The program
+ *
+ * Return value:
+ *
+ * None
+ *
+ */
+
+static void progCachePut(const String name, unsigned srcHash, BCProgramPtr_t prog)
+{
+	progCacheEntryPtr_t pce;
+	
+	PC_LOCK
+	for(pce = progCache; pce; pce = pce->next){
+		if(!strcmp(pce->name, name)){
+			break;
+		}
+	}
+	if(!pce){
+		MALLOC_FAIL(pce = talloc_zero(NULL, progCacheEntry_t))
+		MALLOC_FAIL(pce->name = talloc_strdup(pce, name))
+		pce->next = progCache;
+		progCache = pce;
+	}
+	else{
+		/* Runs still using the old program keep their reference to it */
+		ParserProgramRelease(pce->prog);
+	}
+	pce->srcHash = srcHash;
+	pce->prog = ParserProgramRetain(prog);
+	PC_UNLOCK
+}
+
+/*
+ * Release all of the cached programs
+ *
+ * Arguments:
+ *
+ * None
+ *
+ * Return value:
+ *
+ * None
+ *
+ */
+
+static void progCacheFlush(void)
+{
+	progCacheEntryPtr_t pce, next;
+	
+	PC_LOCK
+	for(pce = progCache; pce; pce = next){
+		next = pce->next;
+		ParserProgramRelease(pce->prog);
+		talloc_free(pce);
+	}
+	progCache = NULL;
+	PC_UNLOCK
+}
+
+/*
+ * Use the cached program for a script, or load the stored bytecode, or parse HCL 
+ * and generate pcode if the stored bytecode is missing or stale. Recompiled bytecode 
+ * is written back to the database. Loaded and compiled programs are cached.
  *
  * Arguments:
  *
  * 1. Pointer to parse control block
- * 2. Script to parse as a string
+ * 2. Script to load or parse
  *
  * Return value:
  *
@@ -157,13 +331,36 @@ static void kvDump(const String key, const String value)
  *
  */
  
-static Bool parseHCL(ParseCtrlPtr_t parseCtrl, String hcl)
+static Bool parseHCL(ParseCtrlPtr_t parseCtrl, DBScriptPtr_t script)
 {
-	int res;
+	int res, len;
+	unsigned srcHash;
+	void *bytecode;
+	PcodeHeaderPtr_t ph;
 	
 	ASSERT_FAIL(parseCtrl)
+	ASSERT_FAIL(script)
+	ASSERT_FAIL(ph = parseCtrl->pcodeHeader)
 	
-	res = ParserParseHCL(parseCtrl, FALSE, hcl);
+	srcHash = UtilHash(script->code);
+	
+	/* Use the program already in memory if the script has not changed */
+	if(PASS == progCacheAttach(ph, script->name, srcHash)){
+		debug(DEBUG_ACTION, "Using cached program for script %s", script->name);
+		return PASS;
+	}
+	
+	if(script->bytecode && (srcHash == script->srcHash)){
+		if(PASS == ParserLoadProgram(ph, script->bytecode, script->bytecodeLen, srcHash)){
+			debug(DEBUG_ACTION, "Loaded bytecode for script %s", script->name);
+			progCachePut(script->name, srcHash, ph->prog);
+			return PASS;
+		}
+	}
+	
+	debug(DEBUG_EXPECTED, "Compiling script %s", script->name);
+	
+	res = ParserParseHCL(parseCtrl, FALSE, script->code);
 	
 	if(res == FAIL){
 		debug(DEBUG_UNEXPECTED,"Parse failed: %s", parseCtrl->failReason);
@@ -171,30 +368,45 @@ static Bool parseHCL(ParseCtrlPtr_t parseCtrl, String hcl)
 			exit(-1);
 		}
 	}
+	else{
+		/* Store the bytecode so the next load does not have to compile */
+		bytecode = ParserSerializeProgram(parseCtrl, ph->prog, srcHash, &len);
+		DBUpdateBytecode(parseCtrl, Globals->db, script->name, script->code, bytecode, len, srcHash);
+		talloc_free(bytecode);
+		progCachePut(script->name, srcHash, ph->prog);
+	}
 	return res;
 }
 
 
 /*
-* Execute pcode
+* Finish up after pcode has run, or has run until it waits
 *
 * Arguments:
 *
 * 1. Pcode header pointer
+* 2. Result of running the pcode
 *
 * Return value:
 *
-* Boolean. PASS indicates success, FAIL indicates failure.
+* Boolean. The result passed in.
 *
 */
  
 
-static Bool execPcode(PcodeHeaderPtr_t ph)
+static Bool execDone(PcodeHeaderPtr_t ph, Bool res)
 {
-	int res;
-	
-	ASSERT_FAIL(ph);
-	res = ParserExecPcode(ph);
+	/* Write out any nvstate changes the script made */
+	if(NVF_SCRIPT == Globals->nvFlushMode){
+		DBFlushNVState(Globals->db);
+	}
+	/* Count executions stopped for going over budget against the script */
+	if(ph->overrun){
+		overruns++;
+		if(ph->scriptName){
+			DBCountOverrun(Globals->db, ph->scriptName);
+		}
+	}
 	if(res == FAIL){
 		debug(DEBUG_UNEXPECTED,"Code execution failed: %s", ph->failReason);
 		if(Globals->exitOnErr){
@@ -204,7 +416,346 @@ static Bool execPcode(PcodeHeaderPtr_t ph)
 	return res;
 }
 
+/*
+* Execute pcode
+*
+* Arguments:
+*
+* 1. Pcode header pointer
+*
+* Return value:
+*
+* Boolean. PASS indicates success, FAIL indicates failure.
+*
+*/
+ 
+
+static Bool execPcode(PcodeHeaderPtr_t ph)
+{
+	ASSERT_FAIL(ph);
+	return execDone(ph, ParserExecPcode(ph));
+}
+
+/*
+* Take a script off the wait list. Called when the waiter is freed.
+*/
+
+static int waiterDestructor(waiterPtr_t w)
+{
+	if(w->filter){
+		XplRemoveMessageFilter(w->filter);
+	}
+	TimerWheelRemove(waitWheel, &w->timer);
+	if(w->prev){
+		w->prev->next = w->next;
+	}
+	else{
+		waitHead = w->next;
+	}
+	if(w->next){
+		w->next->prev = w->prev;
+	}
+	waitCount--;
+	w->ph->waitObj = NULL;
+	return 0;
+}
+
+/*
+* Resume a script waiting in waitfor(), and free its pcode header if it runs to the end
+*
+* Arguments:
+*
+* 1. Waiter pointer
+* 2. Message which matched, or NULL if the wait timed out.
+*
+* Return value:
+*
+* None
+*
+*/
+
+static void resumeWaiter(waiterPtr_t w, void *theMessage)
+{
+	PcodeHeaderPtr_t ph = w->ph;
+	
+	talloc_free(w);
+	
+	/* Make %xplreply a view of the reply. It is copied if the script waits again */
+	if(theMessage){
+		ParserHashAttachView(ph, "xplreply", theMessage, XplPeekMessageValueByName, XplMessageIterateNameValues);
+	}
+	execDone(ph, ParserResumePcode(ph, (theMessage != NULL)));
+	
+	if(!ph->suspended){
+		debug(DEBUG_ACTION, "***Execute complete***");
+		talloc_free(ph);
+	}
+}
+
+/*
+* Message filter callback for a waiting script. Called by xplcore when a message matches.
+*
+* Arguments:
+*
+* 1. Message pointer
+* 2. Waiter pointer
+*
+* Return value:
+*
+* None
+*
+*/
+
+static void waitMatch(void *theMessage, void *userObj)
+{
+	waiterPtr_t w = userObj;
+	
+	waitMatched++;
+	resumeWaiter(w, theMessage);
+}
+
+/*
+* Timer wheel callback for a waiting script whose time is up. Add it to the list to resume
+* once the wheel has been advanced.
+*/
+
+static void waitExpireCallback(TimerWheelTimerPtr_t timer, void *userObj, void *cbObj)
+{
+	waiterPtr_t w = userObj;
+	waiterPtr_t *expiredHead = cbObj;
+	
+	w->nextExpired = *expiredHead;
+	*expiredHead = w;
+}
+
+/*
+* Resume the waiting scripts whose time is up
+*
+* Arguments:
+*
+* None
+*
+* Return value:
+*
+* None
+*
+*/
 
+static void waitTick(void)
+{
+	waiterPtr_t expiredHead = NULL, w, next;
+	
+	TimerWheelAdvance(waitWheel, UtilMonoSeconds(), waitExpireCallback, &expiredHead);
+	
+	for(w = expiredHead; w; w = next){
+		next = w->nextExpired;
+		waitTimeouts++;
+		resumeWaiter(w, NULL);
+	}
+}
+
+/*
+* Wait handler for waitfor(). Adds a message filter and a timeout for the script.
+*
+* Arguments:
+*
+* 1. Pcode header pointer of the script
+* 2. Source to wait for, as vendor-device.instance, or *
+* 3. Schema to wait for, as class.type, or *
+* 4. Timeout in seconds
+*
+* Return value:
+*
+* Boolean. PASS if the script can wait, FAIL if too many are.
+*
+*/
+
+static Bool monitorWait(PcodeHeaderPtr_t ph, const String source, const String schema, unsigned timeout)
+{
+	waiterPtr_t w;
+	
+	ASSERT_FAIL(ph && source && schema)
+	ASSERT_FAIL(!ph->waitObj)
+	
+	if(waitCount >= MAX_WAITERS){
+		debug(DEBUG_UNEXPECTED, "Too many scripts waiting");
+		return FAIL;
+	}
+	
+	MALLOC_FAIL(w = talloc_zero(ph, waiter_t))
+	w->ph = ph;
+	w->filter = XplAddMessageFilter(Globals->xplEventService, source, schema, w, waitMatch);
+	TimerWheelAdd(waitWheel, &w->timer, UtilMonoSeconds() + timeout, w);
+	
+	/* Insert at head of list */
+	if(waitHead){
+		waitHead->prev = w;
+	}
+	w->next = waitHead;
+	waitHead = w;
+	waitCount++;
+	
+	ph->waitObj = w;
+	talloc_set_destructor(w, waiterDestructor);
+	debug(DEBUG_ACTION, "Script waiting for %s from %s for %u seconds", schema, source, timeout);
+	
+	return PASS;
+}
+
+
+
+/*
+* Find the profile entry for a script
+*
+* Arguments:
+*
+* 1. Name of the script
+* 2. Pointer to a variable to receive the link pointing to the entry. Pass NULL if not needed.
+*
+* Return value:
+*
+* The entry, or NULL if the script is not being profiled.
+*
+*/
+
+static profileEntryPtr_t profileFind(const String name, profileEntryPtr_t **pLink)
+{
+	profileEntryPtr_t *link, pe;
+	
+	for(link = &profileHead; (pe = *link); link = &pe->next){
+		if(!strcmp(pe->name, name)){
+			break;
+		}
+	}
+	if(pLink){
+		*pLink = link;
+	}
+	return pe;
+}
+
+/*
+* Set up a pcode header for an execution of a script. Sets the instruction and time budgets,
+* with limits set for the script in the database overriding the defaults, and attaches the
+* script's profile if it is being profiled.
+*
+* Arguments:
+*
+* 1. Pcode header pointer
+* 2. Script to be executed
+*
+* Return value:
+*
+* None
+*
+*/
+
+static void setScriptInfo(PcodeHeaderPtr_t ph, DBScriptPtr_t script)
+{
+	profileEntryPtr_t pe;
+	
+	ph->maxInstrs = (script->maxInstrs >= 0) ? (unsigned long) script->maxInstrs : Globals->scriptMaxInstrs;
+	ph->maxMS = ((script->maxMS >= 0) && (script->maxMS <= UINT_MAX)) ? (unsigned) script->maxMS : Globals->scriptMaxMS;
+	MALLOC_FAIL(ph->scriptName = talloc_strdup(ph, script->name))
+	if((pe = profileFind(script->name, NULL))){
+		ph->profile = pe->profile;
+	}
+}
+
+/*
+* Write the annotated listing of a script's profile to the log
+*
+* Arguments:
+*
+* 1. Profile entry pointer
+*
+* Return value:
+*
+* None
+*
+*/
+
+static void profileLog(profileEntryPtr_t pe)
+{
+	TALLOC_CTX *ctx;
+	String source;
+	
+	MALLOC_FAIL(ctx = talloc_new(Globals))
+	source = DBFetchScript(ctx, Globals->db, pe->name);
+	note("Profile of script %s:\n%s", pe->name, ParserProfileListing(ctx, pe->profile, source));
+	talloc_free(ctx);
+}
+
+/*
+* Stop profiling a script, and free its profile. Waiting executions stop adding to it.
+*
+* Arguments:
+*
+* 1. Link pointing to the profile entry, as returned by profileFind()
+*
+* Return value:
+*
+* None
+*
+*/
+
+static void profileRemove(profileEntryPtr_t *link)
+{
+	profileEntryPtr_t pe = *link;
+	waiterPtr_t w;
+	
+	*link = pe->next;
+	for(w = waitHead; w; w = w->next){
+		if(w->ph->profile == pe->profile){
+			w->ph->profile = NULL;
+		}
+	}
+	talloc_free(pe);
+}
+
+/*
+* Control command to profile a script
+*
+* Arguments:
+*
+* 1. Name of the script
+* 2. start to start profiling, or start again. stop to log the listing and stop.
+*    NULL to log the listing.
+*
+* Return value:
+*
+* Boolean. PASS indicates success, FAIL indicates the command isn't valid.
+*
+*/
+
+static Bool profileCommand(const String name, const String action)
+{
+	profileEntryPtr_t pe, *link;
+	
+	pe = profileFind(name, &link);
+	
+	if((action) && (!strcmp(action, "start"))){
+		if(pe){ /* Start again */
+			profileRemove(link);
+		}
+		MALLOC_FAIL(pe = talloc_zero(Globals, profileEntry_t))
+		MALLOC_FAIL(pe->name = talloc_strdup(pe, name))
+		pe->profile = ParserProfileNew(pe);
+		pe->next = profileHead;
+		profileHead = pe;
+		debug(DEBUG_EXPECTED, "Profiling script %s", name);
+		return PASS;
+	}
+	
+	if((!pe) || ((action) && (strcmp(action, "stop")))){
+		return FAIL;
+	}
+	
+	profileLog(pe);
+	if(action){ /* Stop */
+		profileRemove(link);
+	}
+	return PASS;
+}
 
 /*
 * Parse and execute script
@@ -221,14 +772,14 @@ static Bool execPcode(PcodeHeaderPtr_t ph)
 */
  
  
-static int parseAndExecScript(TALLOC_CTX *ctx, String hcl)
+static int parseAndExecScript(TALLOC_CTX *ctx, DBScriptPtr_t script)
 {
 	ParseCtrlPtr_t parseCtrl;
 	PcodeHeaderPtr_t ph;
 
 	Bool res = PASS;
 	
-	debug(DEBUG_ACTION, "***Parsing***\n %s", hcl);
+	debug(DEBUG_ACTION, "***Parsing***\n %s", script->code);
 
 	parseCtrl = talloc_zero(ctx, ParseCtrl_t);
 	MALLOC_FAIL(parseCtrl);
@@ -239,6 +790,10 @@ static int parseAndExecScript(TALLOC_CTX *ctx, String hcl)
 	/* Add XPL service pointer and database handle */
 	ph->xplServicePtr = Globals->xplEventService;
 	ph->DB = Globals->db;
+	ph->memState = Globals->memState;
+	ph->delayQ = Globals->delayQ;
+	ph->waitHandler = monitorWait;
+	setScriptInfo(ph, script);
 	
 	
 	/* Save pointer to pcode header in parse control block */
@@ -247,7 +802,7 @@ static int parseAndExecScript(TALLOC_CTX *ctx, String hcl)
 	 
 	/* Parse the script */
 	
-	res = parseHCL(parseCtrl, hcl);
+	res = parseHCL(parseCtrl, script);
 
 	/* Free the parser data structures */
 	
@@ -263,37 +818,17 @@ static int parseAndExecScript(TALLOC_CTX *ctx, String hcl)
 		debug(DEBUG_ACTION, "***Execute complete***");
 	}
 	
-	talloc_free(ph);
+	if(ph->suspended){
+		/* Waiting for a message. Freed when the script finishes */
+		talloc_steal(Globals, ph);
+	}
+	else{
+		talloc_free(ph);
+	}
 	
 	return res;
 }
 
-/*
- * Callback function for getting all of the name value pairs for
- * parseAndExecTrig()
- *
- * Arguments:
- *
- * 1. Pointer to pcode header as (void *)
- * 2. Name as a string
- * 3. Value as a string
- *
- * Return value:
- *
- * None
- */
- 
-
-
-static void parseAndExecTrigCallback(void *userObj, const String name, const String value)
-{
-	PcodeHeaderPtr_t ph = userObj;
-	
-	ASSERT_FAIL(ph);
-	ParserHashAddKeyValue(ph, ph, "xplnvin", name, value);
-}
-
-
 /*
 * Parse and execute based on contents of trigger message.
 *
@@ -311,7 +846,7 @@ static void parseAndExecTrigCallback(void *userObj, const String name, const Str
  
 
  
-static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, String hcl)
+static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, DBScriptPtr_t script)
 {
 	ParseCtrlPtr_t parseCtrl;
 	String classType,sourceAddress; 
@@ -320,7 +855,7 @@ static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, String hc
 
 	
 	
-	debug(DEBUG_ACTION, "***Parsing***\n %s", hcl);
+	debug(DEBUG_ACTION, "***Parsing***\n %s", script->code);
 
 	parseCtrl = talloc_zero(Globals, ParseCtrl_t);
 	MALLOC_FAIL(parseCtrl);
@@ -330,9 +865,9 @@ static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, String hc
 	parseCtrl->pcodeHeader = ph;
 	 
 	
-	/* Initialize and fill %xplnvin */
+	/* Make %xplnvin a view of the trigger message's name/value pairs. Nothing is copied unless the script writes to it */
 		
-	XplMessageIterateNameValues(triggerMessage, ph, parseAndExecTrigCallback);
+	ParserHashAttachView(ph, "xplnvin", triggerMessage, XplPeekMessageValueByName, XplMessageIterateNameValues);
 
 
 	debug(DEBUG_ACTION, "xplnvin:");
@@ -355,7 +890,7 @@ static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, String hc
 	
 	/* Parse the script */
 	
-	res = parseHCL(parseCtrl, hcl);
+	res = parseHCL(parseCtrl, script);
 	
 	/* Free the parser data structures */
 	
@@ -380,6 +915,7 @@ static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, String hc
 * 1. Trigger message pointer.
 * 2. Script to execute
 * 3. Reference to pcode header pointer
+* 4. TRUE if the script may wait for messages with waitfor()
 *
 * Return value:
 *
@@ -388,7 +924,7 @@ static int parseAndExecTrig(PcodeHeaderPtr_t ph, void *triggerMessage, String hc
 */
  
 
-static Bool trigExec(void *triggerMessage, const String script, PcodeHeaderPtrPtr_t ph)
+static Bool trigExec(void *triggerMessage, DBScriptPtr_t script, PcodeHeaderPtrPtr_t ph, Bool canWait)
 {
 	Bool res;
 
@@ -407,6 +943,10 @@ static Bool trigExec(void *triggerMessage, const String script, PcodeHeaderPtrPt
 	
 	/* Set the pointer to the database */
 	(*ph)->DB = Globals->db;
+	(*ph)->memState = Globals->memState;
+	(*ph)->delayQ = Globals->delayQ;
+	(*ph)->waitHandler = canWait ? monitorWait : NULL;
+	setScriptInfo(*ph, script);
 
 	res = parseAndExecTrig(*ph, triggerMessage, script);
 		
@@ -433,7 +973,7 @@ static Bool trigExec(void *triggerMessage, const String script, PcodeHeaderPtrPt
  
 
 
-static Bool actOnXPLTrig(void *triggerMessage, const String trigaction)
+static Bool actOnXPLTrig(void *triggerMessage, DBScriptPtr_t trigaction)
 {
 	Bool res;
 	PcodeHeaderPtr_t ph = NULL;
@@ -444,9 +984,12 @@ static Bool actOnXPLTrig(void *triggerMessage, const String trigaction)
 	ASSERT_FAIL(trigaction)
 	
 	
-	res = trigExec(triggerMessage, trigaction, &ph);
+	res = trigExec(triggerMessage, trigaction, &ph, TRUE);
 	
-	talloc_free(ph);
+	/* A script waiting for a message is freed when it finishes */
+	if(!ph->suspended){
+		talloc_free(ph);
+	}
 	
 	return res;
 	
@@ -482,9 +1025,9 @@ static void checkTriggerMessage(void *theMessage, String *sourceDevice)
 	String instance_id;
 	String schema_class;
 	String schema_type; 
-	String pScript;
+	DBScriptPtr_t pScript;
 	String subAddress;
-	String script = NULL;
+	DBScriptPtr_t script = NULL;
 	TALLOC_CTX *tempCTX;
 	TALLOC_CTX *ctx;
 	char source[96];
@@ -513,7 +1056,7 @@ static void checkTriggerMessage(void *theMessage, String *sourceDevice)
 	debug(DEBUG_ACTION, "Schema: %s", schema);
 	
 	/* Get any preprocessing script */
-	pScript = DBFetchScript(ctx, Globals->db, "preprocess");
+	pScript = DBFetchCompiledScript(ctx, Globals->db, "preprocess");
 	
 	if(!pScript){
 		debug(DEBUG_EXPECTED,"Preprocess script not found, using canned subaddress handling");
@@ -536,7 +1079,8 @@ static void checkTriggerMessage(void *theMessage, String *sourceDevice)
 	}
 	else{
 		debug(DEBUG_EXPECTED,"Preprocess script found");
-		errs = trigExec(theMessage, pScript, &ph);
+		/* The preprocess script can't wait, as its result is needed now */
+		errs = trigExec(theMessage, pScript, &ph, FALSE);
 		if(!errs){
 			
 		}
@@ -568,7 +1112,7 @@ static void checkTriggerMessage(void *theMessage, String *sourceDevice)
  
 	/* Fetch the script by source tag and sub-address */
 	
-	script = DBFetchScriptByTag(ctx, Globals->db, source);
+	script = DBFetchCompiledScriptByTag(ctx, Globals->db, source);
 
 		
 	/* Execute the script if it exists */ 
@@ -701,14 +1245,27 @@ static void xPLListener(void *theMessage, void *theService, void *userValue, XPL
 static void monitorShutdown(void)
 {
 		debug(DEBUG_STATUS, "Monitor shutdown");
+		
+		/* Free waiting scripts while their message filters still exist */
+		while(waitHead){
+			talloc_free(waitHead->ph);
+		}
+		
 		XplDestroy(Globals->xplObj);
 		
 		if(Globals->timerFD > 0){
 			close(Globals->timerFD);
 		}
 		
+		if(Globals->secTimerFD > 0){
+			close(Globals->secTimerFD);
+		}
+		
+		SpawnHelperStop();
+		
 		PollDestroy(Globals->poller);
 		
+		progCacheFlush();
 }
 /*
  * Scheduler handler for executing scripts
@@ -726,10 +1283,10 @@ static void monitorShutdown(void)
 
 void schedulerExec(TALLOC_CTX *ctx, const String entryName, const String scriptName)
 {
-	String script;
+	DBScriptPtr_t script;
 	
 	debug(DEBUG_EXPECTED, "Scheduler exec called: entryName = %s, scriptName = %s", entryName, scriptName);
-	script = DBFetchScript(Globals, Globals->db, scriptName);
+	script = DBFetchCompiledScript(Globals, Globals->db, scriptName);
 	if(!script){
 		debug(DEBUG_UNEXPECTED, "Script not in database");
 	}
@@ -744,6 +1301,36 @@ void schedulerExec(TALLOC_CTX *ctx, const String entryName, const String scriptN
 
 
 
+/*
+ * Delay queue handler for executing scripts scheduled with after()
+ *
+ * Arguments:
+ *
+ * 1. Name of the script to execute as a string.
+ * 2. Id after() returned for it.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void delayedExec(const String scriptName, unsigned id)
+{
+	DBScriptPtr_t script;
+	
+	debug(DEBUG_EXPECTED, "Delayed exec called: id = %u, scriptName = %s", id, scriptName);
+	script = DBFetchCompiledScript(Globals, Globals->db, scriptName);
+	if(!script){
+		debug(DEBUG_UNEXPECTED, "Script not in database");
+	}
+	else{
+		if(parseAndExecScript(Globals, script) == FAIL){
+			debug(DEBUG_UNEXPECTED, "Delayed script failed");
+		}
+		talloc_free(script);
+	}
+}
+
 /*
  * Callback from sqlite3 exec to add a scheduler entry to the scheduler
  *
@@ -798,8 +1385,43 @@ static Bool schedulerLoad(void)
 }
 
 /*
-* Our tick handler. Called by xPL Library once per second.
-* We do exit checking, and logging memory usage here.
+* One second tick handler. Drives the timers scripts can set, which need 
+* a finer resolution than the scheduler tick.
+*
+* Arguments:
+*
+* 1. Timer FD
+* 2. Poll flags (not used)
+* 3. Object pointer (not used)
+*
+* Return value:
+*
+* None
+*
+*/
+
+static void secondTickHandler(int fd, int flags, void *obj)
+{
+	char tickBuff[8];
+	char eBuff[64];
+	
+	if(8 != read(fd, tickBuff, 8)){
+		debug(DEBUG_UNEXPECTED, "%s: Could not read timerfd: %s", __func__, strerror_r(errno, eBuff, sizeof(eBuff)));
+	}
+	
+	/* Remove mem keys whose time is up */
+	MemStateTick(Globals->memState);
+	
+	/* Run scripts scheduled with after() */
+	DelayQTick(Globals->delayQ, delayedExec);
+	
+	/* Resume scripts whose wait has timed out */
+	waitTick();
+}
+
+/*
+* Our tick handler. Called every 6 seconds.
+* We flush the nvstate and run the scheduler here.
 *
 * Arguments:
 *
@@ -822,6 +1444,10 @@ static void tickHandler(int fd, int flags, void *obj)
 		debug(DEBUG_UNEXPECTED, "%s: Could not read timerfd: %s", __func__, strerror_r(errno, eBuff, sizeof(eBuff)));
 	}
 	debug(DEBUG_INCOMPLETE, "Monitor Tick\n");
+	
+	if(NVF_TIMER == Globals->nvFlushMode){
+		DBFlushNVState(Globals->db);
+	}
 
 	if((Globals->xplEventService) && ( XPL_HUB_CONFIRMED == XplGetHubDiscoveryState(Globals->xplEventService))){
 		/* Hub must be confirmed to send data */
@@ -860,7 +1486,8 @@ static Bool interpretClientCommand(connectionDataPtr_t cdp, int userSock, String
 	String *argv = UtilSplitString(cdp, cl, ' ');
 	int i;
 	Bool res = PASS;
-	String script;
+	DBScriptPtr_t script;
+	String reply = "";
 	
 	ASSERT_FAIL(cdp)
 	ASSERT_FAIL(cl)
@@ -875,7 +1502,7 @@ static Bool interpretClientCommand(connectionDataPtr_t cdp, int userSock, String
 			case CC_EXEC: /* Execute specified script */
 				if(argv[1]){
 					debug(DEBUG_EXPECTED, "Exec: %s", argv[1]);
-					if(!(script = DBFetchScript(cdp, Globals->db, argv[1]))){
+					if(!(script = DBFetchCompiledScript(cdp, Globals->db, argv[1]))){
 							res = FAIL;
 					}
 					else{
@@ -895,6 +1522,19 @@ static Bool interpretClientCommand(connectionDataPtr_t cdp, int userSock, String
 					SchedulerStart(Globals->sch);
 				}
 				break;
+				
+			case CC_STATS: /* Return the statistics */
+				MALLOC_FAIL(reply = talloc_asprintf(argv, "%s %s", XplGetStats(argv, Globals->xplObj), 
+				SpawnHelperGetStats(argv)))
+				MALLOC_FAIL(reply = talloc_asprintf_append(reply, " %s", DelayQGetStats(argv, Globals->delayQ)))
+				MALLOC_FAIL(reply = talloc_asprintf_append(reply, " waiting=%u wait-matched=%lu wait-timeouts=%lu overruns=%lu",
+				waitCount, waitMatched, waitTimeouts, overruns))
+				break;
+				
+			case CC_PROFILE: /* Profile a script. The listing is written to the log */
+				res = (argv[1]) ? profileCommand(argv[1], argv[2]) : FAIL;
+				break;
+				
 			default:
 				ASSERT_FAIL(0);
 		}
@@ -905,7 +1545,12 @@ static Bool interpretClientCommand(connectionDataPtr_t cdp, int userSock, String
 		res = FAIL;
 	}
 
-	SocketPrintf(argv, userSock,"%s\n", (res == PASS) ? "ok:" : "er:Command not recognized");
+	if(res == PASS){
+		SocketPrintf(argv, userSock,"ok:%s\n", reply);
+	}
+	else{
+		SocketPrintf(argv, userSock,"er:Command not recognized\n");
+	}
 
 	talloc_free(argv);
 	return res;
@@ -1184,13 +1829,28 @@ void MonitorSetup(void)
 {
 	struct itimerspec its;
 
-	if(!(Globals->xplObj = XplInit(Globals, Globals->poller, Globals->ipAddr, Globals->xplService))){
+	/* Fork the spawn helper while there is only one thread */
+	if(FAIL == SpawnHelperStart(Globals->poller, Globals->spawnMax)){
+		debug(DEBUG_UNEXPECTED, "Could not start the spawn helper, commands will be spawned directly");
+	}
+
+	if(!(Globals->xplObj = XplInit(Globals, Globals->poller, Globals->ipAddr, Globals->xplService, Globals->rxThreads,
+	Globals->rcvBufSize))){
 		fatal("Could not create XPL  object, is the interface up?");
 	}
 		
 	/* Create a service and set our application version */
 	Globals->xplEventService = XplNewService(Globals->xplObj, "hwstar", "xplevent", Globals->instanceID, VERSION);
 	
+	/* Create the store for the mem hash shared by all scripts */
+	Globals->memState = MemStateNew(Globals);
+	
+	/* Create the queue for scripts scheduled with after() */
+	Globals->delayQ = DelayQNew(Globals);
+	
+	/* Create the timer wheel for scripts waiting in waitfor() */
+	waitWheel = TimerWheelNew(Globals, WAIT_WHEEL_SLOTS, UtilMonoSeconds());
+	
 
 	/* Add 6 second tick service */
 	/* Create a timerfd to poll the scheduler periodically */
@@ -1209,6 +1869,19 @@ void MonitorSetup(void)
 	if(FAIL == PollRegEvent(Globals->poller, Globals->timerFD, POLL_WT_IN, tickHandler, NULL)){
 		fatal("%s: Could not register poll event for timerFD", __func__);
 	}
+	
+	/* Add 1 second tick service for after(), waitfor() and expire() */
+	if((Globals->secTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0){
+		fatal("%s: Could not create an timer FD", __func__);
+	}
+	its.it_value.tv_sec = its.it_interval.tv_sec = 1;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = 0;
+	if(timerfd_settime(Globals->secTimerFD, 0, &its, NULL) < 0){
+		fatal("%s: Could not set timer FD interval", __func__);
+	}
+	if(FAIL == PollRegEvent(Globals->poller, Globals->secTimerFD, POLL_WT_IN, secondTickHandler, NULL)){
+		fatal("%s: Could not register poll event for secTimerFD", __func__);
+	}
 
   	/* And a listener for all xPL messages */
   	XplAddMessageListener(Globals->xplEventService, XPL_REPORT_MODE_NORMAL, FALSE, NULL, xPLListener);
@@ -31,6 +31,9 @@
 #include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
 
 
 #include "defs.h"
@@ -42,6 +45,9 @@
 #include "parse.h"
 #include "lex.h"
 #include "db.h"
+#include "memstate.h"
+#include "spawnhelper.h"
+#include "delayq.h"
 #include "xplcore.h"
 #include "xplevent.h"
 
@@ -52,18 +58,81 @@
 #define AL_MAGIC	0x689C9A2F
 #define PC_MAGIC	0x9A905437
 #define SE_MAGIC	0x59F593AC
+#define BP_MAGIC	0x2C4E8B17
+#define PF_MAGIC	0x71D3E05B
+
+#define HT_INITIAL_SIZE 8 /* Initial size of a hash table index. Must be a power of 2 */
+#define PH_ARENA_SIZE 16384 /* Size of the per execution talloc pool */
+#define BUDGET_CLOCK_INSTRS 256 /* Instructions between clock reads when there is a time limit */
+
+/* 
+ * Serialized bytecode image. A header, the instructions, the symbol slots and 
+ * the key slots as 32 bit words in host byte order, then the constant pool as 
+ * NUL terminated strings. An image from a host with the other byte order fails 
+ * the magic number check, and is treated like a stale one.
+ */
+
+#define BI_MAGIC	0x58454243
+#define BI_VERSION	7 /* Bump when the image layout or the instruction set changes */
+#define BI_INSTR_WORDS	9
 
+enum {BIH_MAGIC = 0, BIH_VERSION, BIH_SRCHASH, BIH_CODELEN, BIH_NUMCONSTS, BIH_MAXSTACK, BIH_NUMSYMS, BIH_NUMKEYSLOTS, BI_HDR_WORDS};
+
+/* 
+ * Execution profile. Counts and times are kept by instruction address, and added 
+ * up by line for the listing. Kept across executions, until the program changes.
+ */
 
+typedef struct profile_s {
+	unsigned magic;
+	BCProgramPtr_t prog; /* Program the counts are for. Retained */
+	unsigned long runs; /* Executions started */
+	unsigned long *counts; /* Times each instruction was dispatched */
+	unsigned long long *ns; /* Nanoseconds from each instruction's dispatch to the next */
+	unsigned long *taken; /* Conditional branches into the block */
+	unsigned long *skipped; /* Conditional branches around the block */
+	int last; /* Address of the instruction running, or -1 */
+	unsigned long long lastNS; /* When it was dispatched */
+} profile_t;
+
+typedef profile_t * profilePtr_t;
+
+/* TRUE if an opcode is a test or exists which skips its block when false */
+#define IS_COND_BRANCH(op) (((op) == OP_TEST2) || ((op) == OP_EXISTS) || \
+((op) == OP_TEST_HASHKEY_LITERAL) || ((op) == OP_EXISTS_HASHKEY))
+
+/* Constant pool string for an instruction argument, or NULL if none */
+#define BC_CONST(prog, idx) (((idx) >= 0) ? (prog)->consts[(idx)].str : NULL)
+
+/* Opcode names for dumps and traces, indexed by opcode */
+static const String opNames[OP_NUMOPS] = {"Nop", "Push", "Assign", "Func", "Block", "If", "Test 2", "Exists", 
+"Add", "Subtract", "Multiply", "Divide", "Negate", "Concat", "Format", "Substr", "Abs", "Min", "Max", "Round", 
+"After", "Cancel", "Wait for", "End",
+"Test hash key literal", "Assign literal", "Assign hash to hash", "Exists hash key"};
+
+/* 
+ * Argument counts accepted by the value instructions, and a bit for each argument used as a string,
+ * indexed by opcode. Zero for other instructions. The other arguments are converted to numbers.
+ */
+static const struct {int min; int max; unsigned strArgs;} valueOpArgs[OP_NUMOPS] = {
+	[OP_ADD] = {2, 2, 0}, [OP_SUB] = {2, 2, 0}, [OP_MUL] = {2, 2, 0}, [OP_DIV] = {2, 2, 0}, [OP_NEG] = {1, 1, 0},
+	[OP_CONCAT] = {1, PARSER_MAX_ARGS, ~0U}, [OP_FORMAT] = {1, PARSER_MAX_ARGS, ~0U}, [OP_SUBSTR] = {2, 3, 1}, 
+	[OP_ABS] = {1, 1, 0}, [OP_MIN] = {1, PARSER_MAX_ARGS, 0}, [OP_MAX] = {1, PARSER_MAX_ARGS, 0}, [OP_ROUND] = {1, 2, 0},
+	[OP_AFTER] = {2, 2, 2}, [OP_CANCEL] = {1, 1, 0}, [OP_WAITFOR] = {3, 3, 3}
+};
 
+/* TRUE if an opcode is a value instruction */
+#define IS_VALUE_OP(op) (((op) >= 0) && ((op) < OP_NUMOPS) && valueOpArgs[(op)].max)
 
 
 
-static ParseCtrlPtr_t parseCtrl; /* Not re-entrant because of this */
 
 
 
 /*
  * Malloc for parser. This is called by Lemon when a block of memory is required.
+ * Lemon passes no context here, so the block is allocated at the top level,
+ * and freed by ParserParseHCL when the parse is complete.
  *
  * Arguments: 
  *
@@ -78,7 +147,7 @@ static ParseCtrlPtr_t parseCtrl; /* Not re-entrant because of this */
 static void *parserMalloc(size_t size)
 {	
 	void *p;
-	p = talloc_size(parseCtrl, size);
+	p = talloc_size(NULL, size);
 	MALLOC_FAIL(p)
 	return p;
 }
@@ -105,68 +174,56 @@ static void parserFree(void *ctx)
 }
 
 /*
- * Print P-code info
+ * Format bytecode instruction info
  *
  * Arguments: 
  *
- * 1. Pointer to pcode block.
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the bytecode program.
+ * 3. Address (index) of the instruction to format.
  *
  * Return value:
  *
- * None
+ * The instruction info as a string.
  */
 
-static void printOpcode(PcodePtr_t p)
+static String formatInstr(TALLOC_CTX *ctx, BCProgramPtr_t prog, int addr)
 {
-	String op ,data1, data2;
+	BCInstrPtr_t p;
+	String op, data1, data2, s;
 	
-	ASSERT_FAIL(p)
+	ASSERT_FAIL(prog)
+	ASSERT_FAIL((addr >= 0) && (addr < prog->codeLen))
 	
-	switch(p->opcode){
-		case OP_NOP:
-			op = "Nop";
-			break;
-		
-		case OP_PUSH:
-			op = "Push";
-			break;
-		
-		case OP_ASSIGN:
-			op = "Assign";
-			break;
-			
-		case OP_FUNC:
-			op = "Func";
-			break;
-				
-		case OP_BLOCK:
-			op = "Block";
-			break;
+	p = prog->code + addr;
+	op = ((p->opcode >= 0) && (p->opcode < OP_NUMOPS)) ? opNames[p->opcode] : "UNK";
+	data1 = (p->arg1 >= 0) ? prog->consts[p->arg1].str : "(nil)";
+	data2 = (p->arg2 >= 0) ? prog->consts[p->arg2].str : "(nil)";
 				
-		case OP_IF:
-			op = "If";
-			break;	
-		
-				
-		case OP_TEST2:
-			op = "Test 2";
-			break;
-			
-			
-		case OP_EXISTS:
-			op = "Exists";
-			break;
-			
+	MALLOC_FAIL(s = talloc_asprintf(ctx, "Addr: %d Line: %d, Opcode: %s, Operand: %d, Data1: %s, Data2: %s, Jump: %d, Sym: %d, Key: %d, Flags: %d", 
+	addr, p->lineNo, op, p->operand, data1, data2, p->jump, p->sym, p->keySlot, p->flags))
+	return s;
+}
 
-		default:
-			op = "UNK";
-			break;
-	}	
-	data1 = (p->data1) ? p->data1 : "(nil)";
-	data2 = (p->data2) ? p->data2 : "(nil)";
-				
-	debug(DEBUG_EXPECTED,"Seq: %d CBRC: %d, Opcode: %s, Operand: %d, Data1: %s, Data2: %s, Skip: %p", 
-	p->seq, p->ctrlStructRefCount, op, p->operand, data1, data2, p->skip);	
+/*
+ * Print bytecode instruction info
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ * 2. Address (index) of the instruction to print.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void printInstr(BCProgramPtr_t prog, int addr)
+{
+	String s = formatInstr(NULL, prog, addr);
+	
+	debug(DEBUG_EXPECTED, "%s", s);
+	talloc_free(s);
 }
 
 
@@ -202,6 +259,88 @@ static void undefVar(PcodeHeaderPtr_t ph, String var, int lineNo)
 	}
 }
 
+/*
+ * Report an undefined operand. A value instruction's result is only undefined when
+ * one of its own arguments was, and that has been reported already, so it is not
+ * reported again under the operator's name.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to pcode header
+ * 2. The push or value instruction which left the operand on the stack
+ * 3. Line number where the operand was used.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void undefOperand(PcodeHeaderPtr_t ph, BCInstrPtr_t instr, int lineNo)
+{
+	if(OP_PUSH == instr->opcode){
+		undefVar(ph, BC_CONST(ph->prog, instr->arg1), lineNo);
+	}
+}
+
+/*
+ * Insert an entry in an open addressing table. The entry must not already be there,
+ * and the table must have a free slot.
+ *
+ * Arguments: 
+ *
+ * 1. The table
+ * 2. Table size. Must be a power of 2.
+ * 3. Hash of the entry
+ * 4. The entry
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void tableInsert(void **table, unsigned size, unsigned hash, void *entry)
+{
+	unsigned i;
+	
+	for(i = hash & (size - 1); table[i]; i = (i + 1) & (size - 1));
+	table[i] = entry;
+}
+
+/*
+ * Make room in a hash's key table for one more entry, growing it if needed.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer the hash
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void keyTableReserve(ParseHashSTEPtr_t h)
+{
+	ParseHashKVPtr_t *old = h->table;
+	unsigned i, oldSize = h->tableSize;
+	
+	/* Keep the load factor at or below 3/4 */
+	if(h->table && (((h->count + 1) * 4) <= (h->tableSize * 3))){
+		return;
+	}
+	
+	h->tableSize = (oldSize) ? oldSize * 2 : HT_INITIAL_SIZE;
+	MALLOC_FAIL(h->table = talloc_zero_array(h, ParseHashKVPtr_t, h->tableSize))
+	
+	for(i = 0; i < oldSize; i++){
+		if(old[i]){
+			tableInsert((void **) h->table, h->tableSize, old[i]->hash, old[i]);
+		}
+	}
+	if(old){
+		talloc_free(old);
+	}
+}
+
 /*
 * Remove ALL the keys from a hash
 * Arguments: 
@@ -217,8 +356,20 @@ static void deleteHashContents(ParseHashSTEPtr_t se)
 {
 	ASSERT_FAIL(se)
 	debug(DEBUG_ACTION,"Deleting contents of hash: %s", se->name);
+	
+	if(se->table){
+		memset(se->table, 0, se->tableSize * sizeof(ParseHashKVPtr_t));
+	}
+	se->count = 0;
+	
+	/* The entries all live in the context */
 	talloc_free(se->context);
-	se->context = se->head = NULL;
+	MALLOC_FAIL(se->context = talloc_new(se))
+	se->liveHead = se->liveTail = NULL;
+	se->viewObj = NULL;
+	
+	/* Inline caches holding the freed entries are now stale */
+	se->generation++;
 }
 
 
@@ -229,8 +380,6 @@ static void deleteHashContents(ParseHashSTEPtr_t se)
  *
  * 1. Pointer the pcode header block
  * 2. String contining the name of the hash
- * 3. A pointer to a pointer variable where the end of the list can be stored if the search fails.
- *    this value is optional, and a NULL can be passed in if it is not required.
  *
  *
  * Return value:
@@ -238,849 +387,3347 @@ static void deleteHashContents(ParseHashSTEPtr_t se)
  * Return the symbol table entry, or NULL if not found
  */
 
-static ParseHashSTEPtr_t findHash(PcodeHeaderPtr_t ph, const String hashName, ParseHashSTEPtrPtr_t tail)
+static ParseHashSTEPtr_t findHash(PcodeHeaderPtr_t ph, const String hashName)
 {
-	unsigned hashVal;
-	ParseHashSTEPtr_t se,p = NULL;
+	unsigned hashVal, i, mask;
+	ParseHashSTEPtr_t se;
 	
 	ASSERT_FAIL(ph)
 	ASSERT_FAIL(hashName)
 	
-	if(!ph->steHead){
+	if(!ph->steTable){
 		return NULL; /* Empty symbol table */
 	}
 	hashVal = UtilHash(hashName);
+	mask = ph->steTableSize - 1;
 	
-	for(se = ph->steHead; (se); se = se->next){
-		p = se;
+	for(i = hashVal & mask; (se = ph->steTable[i]); i = (i + 1) & mask){
 		ASSERT_FAIL(se->magic == SE_MAGIC)
 		if((se->hash == hashVal) && (!strcmp(hashName, se->name))){
 			break;
 		}
 	}
 	
-	if(tail){
-		*tail = p; /* Return pointer to end of list or current entry if set */
-	}
-	
 	return se;
 }
 
 
 /*
-* Add a hash to the end of the symbol table
+ * Return the arena of a pcode header, creating it on first use.
+ *
+ * Everything belonging to one run of a script, the hashes, their keys and values,
+ * and the execution scratch memory, is allocated from a talloc pool. The pool is 
+ * released in one go with the pcode header. Compiled programs are not put in it. 
+ *
+ * Arguments: 
+ *
+ * 1. Pointer the pcode header block
+ *
+ * Return value:
+ * 
+ * The arena talloc context
+ */
+
+static TALLOC_CTX *getArena(PcodeHeaderPtr_t ph)
+{
+	if(!ph->arena){
+		MALLOC_FAIL(ph->arena = talloc_pool(ph, PH_ARENA_SIZE))
+	}
+	return ph->arena;
+}
+
+/*
+* Add a hash to the symbol table
 *
 * Arguments: 
 *
-* 1. Talloc context to hang the new symbol table off of.
-* 2. Pointer to the symbol table tail pointer.
-* 3. The key to add to the new hash entry.
+* 1. Pointer the pcode header block
+* 2. The name of the new hash.
 *
 * Return value:
 *
-* None
+* The new symbol table entry
 *
 * 
 */
 
-static void hashAppend(TALLOC_CTX *ctx, ParseHashSTEPtrPtr_t ptail, String name)
+static ParseHashSTEPtr_t hashAppend(PcodeHeaderPtr_t ph, String name)
 {
 	ParseHashSTEPtr_t hNew;
+	ParseHashSTEPtr_t *old;
+	unsigned i, oldSize;
 
-	ASSERT_FAIL(ctx)
-	ASSERT_FAIL(ptail)
+	ASSERT_FAIL(ph)
 	ASSERT_FAIL(name)
 		
 	/* Initialize a new list entry */
 	 
-	hNew = talloc_zero(ctx, ParseHashSTE_t);
+	hNew = talloc_zero(getArena(ph), ParseHashSTE_t);
 	MALLOC_FAIL(hNew)
 	hNew->magic = SE_MAGIC;
 	hNew->name = talloc_strdup(hNew, name);
 	MALLOC_FAIL(hNew->name)
 	hNew->hash = UtilHash(name);
 	hNew->writable = TRUE;
+	hNew->context = talloc_new(hNew);
+	MALLOC_FAIL(hNew->context)
+	
+	/* Grow the symbol table index if needed */
+	if(!ph->steTable || (((ph->steCount + 1) * 4) > (ph->steTableSize * 3))){
+		old = ph->steTable;
+		oldSize = ph->steTableSize;
+		ph->steTableSize = (oldSize) ? oldSize * 2 : HT_INITIAL_SIZE;
+		MALLOC_FAIL(ph->steTable = talloc_zero_array(ph->arena, ParseHashSTEPtr_t, ph->steTableSize))
+		for(i = 0; i < oldSize; i++){
+			if(old[i]){
+				tableInsert((void **) ph->steTable, ph->steTableSize, old[i]->hash, old[i]);
+			}
+		}
+		if(old){
+			talloc_free(old);
+		}
+	}
+	
+	/* Add it to the index and the list */
+	tableInsert((void **) ph->steTable, ph->steTableSize, hNew->hash, hNew);
+	ph->steCount++;
+	hNew->next = ph->steHead;
+	ph->steHead = hNew;
 
-	*ptail = hNew;
+	return hNew;
 }
 
 /*
- * Spawn another program
+ * Find a hash in the symbol table, and optionally create it if it isn't there.
  *
  * Arguments: 
  *
- * 1. Pointer to the pcode header
- * 2. Pointer to the pcode instruction containing the spawn token.
+ * 1. Pointer the pcode header block
+ * 2. String contining the name of the hash
+ * 3. TRUE to create the hash if it does not exist
  *
  * Return value:
- *
- * None
- *
+ * 
+ * Return the symbol table entry, or NULL if not found and not created
  */
- 
-static void spawn(PcodeHeaderPtr_t ph, PcodePtr_t pi)
+
+static ParseHashSTEPtr_t getHash(PcodeHeaderPtr_t ph, const String hashName, Bool create)
 {
-	PcodePtr_t pa;
-	String command = NULL;
-	TALLOC_CTX *ctx;
-	
-	ASSERT_FAIL(ph)
-	ASSERT_FAIL(pi)
-	
-	/* Make dedicated context */
-	ctx = talloc_new(ph);
-	MALLOC_FAIL(ctx)
-	
-	/* Check for correct argument count */
-	if(ph->pushCount != 1){
-		ph->failReason = talloc_asprintf(ph, "Incorrect number of arguments passed to spawn, requires 1, got %d",
-		ph->pushCount);
-		goto end;
-	}
+	ParseHashSTEPtr_t h;
 	
-	/* Retrieve parameter */
-	pa = pi->prev;
-	ASSERT_FAIL(ParserPcodeGetValue(ctx, ph, pa, &command) == PASS)
-	if(/* ph->xplServicePtr */ 1){ /* Make sure this isn't a dry run */
-		debug(DEBUG_ACTION, "Spawning command: %s", command);
-		if(UtilSpawn(command, NULL) == FAIL){
-			ph->failReason = talloc_asprintf(ph, "Spawn %s failed", command);
-		}
+	if((h = findHash(ph, hashName)) || !create){
+		return h;
 	}
 	
-end:
-	talloc_free(ctx);
-
+	debug(DEBUG_ACTION, "Creating hash: %s in symbol table", hashName);
+	return hashAppend(ph, hashName);
 }
 
-
 /*
- * Send xPL command if everything looks good
+ * Find a key in a hash
+ *
  * Arguments: 
  *
- * 1. Pointer to the pcode header
- * 2. Pointer to the pcode instruction containing the spawn token.
+ * 1. Pointer the hash
+ * 2. The key to look for
+ * 3. The hash of the key
  *
  * Return value:
- *
- * None
+ * 
+ * The key entry, or NULL if not found. The entry's value is NULL if the key is undefined.
  */
 
-static void sendXPLCommand(PcodeHeaderPtr_t ph, PcodePtr_t pi)
+static ParseHashKVPtr_t findKey(ParseHashSTEPtr_t h, const String key, unsigned kh)
 {
-	String tag = NULL;
-	String class = NULL;
-	String type = NULL;
-	String hash = NULL;
-	TALLOC_CTX *ctx;
-	String vendor, device, instance;
-	ParseHashSTEPtr_t se = NULL;
-	ParseHashKVPtr_t kvp;
-	void *msg = NULL;
-	PcodePtr_t pa;
-
-
-	ASSERT_FAIL(ph)
-	ASSERT_FAIL(pi)
-	
-	ctx = talloc_new(ph);
-	MALLOC_FAIL(ctx)
-			
-	if(ph->pushCount != 4){
-		ph->failReason = talloc_asprintf(ph, "Incorrect number of arguments passed to xplcmd, requires 4, got %d",
-		ph->pushCount);
-		goto end;
-	}
-
-
-	pa = pi->prev;
-	ASSERT_FAIL(ParserPcodeGetValue(ctx, ph, pa, &hash) == PASS)
-	pa = pa->prev;
-	ASSERT_FAIL(ParserPcodeGetValue(ctx, ph, pa, &type) == PASS)
-	pa = pa->prev;
-	ASSERT_FAIL(ParserPcodeGetValue(ctx, ph, pa, &class) == PASS)
-	pa = pa->prev;
-	ASSERT_FAIL(ParserPcodeGetValue(ctx, ph, pa, &tag) == PASS)
-
-	
+	ParseHashKVPtr_t ke = NULL;
+	unsigned i, mask;
 	
-	if(ParserSplitXPLTag(ctx, tag, &vendor, &device, &instance)){
-		ph->failReason = talloc_asprintf(ph, "Bad xPL Tag: %s", tag);
-		goto end;
+	if(!h->table){
+		return NULL;
 	}
-
-
-	if(ph->xplServicePtr){ /* if this is NULL, it is to be a dry run */
-			
-		/* Create xpl command message */
-		msg = XplInitTargettedMessage(ph->xplServicePtr, XPL_MESSAGE_COMMAND, vendor, device, instance);
-		ASSERT_FAIL(msg)
-		
-		/* Set message schema */
-		XplSetMessageClassType(msg, class, type);
+	mask = h->tableSize - 1;
 	
-		
-		/* Clear name/value pairs */
-		XplClearNameValues(msg);
-	}
-	else{
-		/* For dry run, just print the vendor, device and instance */
-		debug(DEBUG_EXPECTED, "Vendor: %s", vendor);
-		debug(DEBUG_EXPECTED, "Device: %s", device);
-		debug(DEBUG_EXPECTED, "Instance: %s", instance);
-	}		
-
-	se = findHash(ph, hash, NULL);
-	ASSERT_FAIL(se)
-	/* Build xPL name value pairs from hash entries */
-	for(kvp = se->head; kvp; kvp = kvp->next){
-		ASSERT_FAIL(se->magic == SE_MAGIC)
-		if(!ph->xplServicePtr){
-			debug(DEBUG_EXPECTED,"Adding Key: %s, Value: %s", kvp->key, kvp->value);
+	for(i = kh & mask; (ke = h->table[i]); i = (i + 1) & mask){ /* Probe the table */
+		ASSERT_FAIL(KE_MAGIC == ke->magic)
+		/* Compare hashes, and if they match, compare strings */
+		if((kh == ke->hash) && (!strcmp(ke->key, key))){
+			break;
 		}
-		else{
-			XplAddNameValue(msg, kvp->key, kvp->value);
-		}		
-	}
-	
-	debug(DEBUG_ACTION, "***Sending xPL command***");
-	
-	if(ph->xplServicePtr){
-		XplSendMessage(msg);
-		XplDestroyMessage(msg);
-	}
-
-end:
-	/* Clear out the xplout hash */
-	
-	if(se){
-		deleteHashContents(se);
 	}
-	
-	/* Free the context used here */
-	
-	talloc_free(ctx);
-	
+	return ke;
 }
 
-
 /*
- * Split an xPL tag into its constituent parts.
- * 
- * Check parts for length
- * 
- * To do just a validation without returning the strings, set vendor, device, and instance to NULL
- * 
- * Strings must be freed unless set to NULL
+ * Add a new undefined key to a hash
  *
  * Arguments: 
  *
- * 1. Talloc context to hang the strings off of.
- * 2. String containing xPL tag. 
- * 3. Pointer to string to store vendor name (or NULL)
- * 4. Pointer to string to store device name (or NULL)
- * 5. Pointer to string to store instance (or NULL)
+ * 1. Pointer the hash
+ * 2. The key to add
+ * 3. The hash of the key
  *
  * Return value:
- *
- * Boolean. PASS indicates success, FAIL indicates failure.
  * 
+ * The new key entry.
  */
 
-Bool ParserSplitXPLTag(TALLOC_CTX *ctx, const String tag, String *vendor, String *device, String *instance)
+static ParseHashKVPtr_t newKey(ParseHashSTEPtr_t h, const String key, unsigned kh)
 {
-	int res = PASS;
-	int done = FALSE;
-	int i,j,state, begin;
-	
-	ASSERT_FAIL(ctx)
-	ASSERT_FAIL(tag)
-	
-	for(i = 0, j = 0, state = 0, begin = 0; !done; i++,j++){
+	ParseHashKVPtr_t keNew;
+	
+	MALLOC_FAIL(keNew = talloc_zero(h->context, ParseHashKV_t))
+	keNew->magic = KE_MAGIC;
+	MALLOC_FAIL(keNew->key = talloc_strdup(keNew, key))
+	keNew->hash = kh;
+	
+	/* Index it */
+	keyTableReserve(h);
+	tableInsert((void **) h->table, h->tableSize, kh, keNew);
+	h->count++;
+	return keNew;
+}
 
-		switch(state){
-			case 0: /* Search for hyphen */
-				if(!tag[i]){
-					done = TRUE;
-					res = FAIL;
-					break;
-				}
-				if('-' == tag[i]){
-					if((!j) || (j > 9)){
-						done = TRUE;
-						res = FAIL;
-						break;
-					}
-					else{
-						if(vendor){
-							*vendor = talloc_strndup(ctx, tag, j);
-							MALLOC_FAIL(*vendor)
-						}
-						begin = i + 1;
-						j = 0;
-						state++;
-					}
-				}
-				break;
-				
-			case 1: /* Search for dot */
-				if(!tag[i]){
-					done = TRUE;
-					res = FAIL;
-					break;
-				}
-				if('.' == tag[i]){
-					if((!j) || (j > 9)){
-						done = TRUE;
-						res = FAIL;
-						break;
-					}
-					else{
-						if(device){
-								*device = talloc_strndup(ctx, tag + begin, j - 1);
-								ASSERT_FAIL(*device);
-						}
-						begin = i + 1;
-						j = 0;
-						state++;
-					}
-				}
-				
-			case 2: /* Search for end of string and measure length */
-				if(!tag[i]){
-					if((!j) || (j > 9)){
-						res = FAIL;
-						
-					}
-					if(res != FAIL && device){
-							*instance = talloc_strndup(ctx, tag + begin, j - 1);
-							MALLOC_FAIL(*instance);
-					}
-					done = TRUE;
-				}
-				break;
+/*
+ * Set the value of a key entry. 
+ * If the key was undefined, it is added to the end of the hash's insertion order. 
+ *
+ * Arguments: 
+ *
+ * 1. Pointer the hash
+ * 2. Pointer to the key entry
+ * 3. The value to set. A copy is made.
+ *
+ * Return value:
+ * 
+ * None
+ */
 
-			default:
-				ASSERT_FAIL(FALSE);	
-		}
-		
-		
+static void setKeyValue(ParseHashSTEPtr_t h, ParseHashKVPtr_t ke, const String value)
+{
+	String old = ke->val.str;
+	
+	/* Copy the new value before freeing the old one, as they may be the same string */
+	MALLOC_FAIL(ke->val.str = talloc_strdup(ke, value))
+	ke->val.numState = PVN_UNKNOWN;
+	if(old){
+		talloc_free(old);
+		return;
 	}
-	return res;	
+	
+	/* Newly defined, append to the insertion order */
+	ke->nextLive = NULL;
+	ke->prevLive = h->liveTail;
+	if(h->liveTail){
+		h->liveTail->nextLive = ke;
+	}
+	else{
+		h->liveHead = ke;
+	}
+	h->liveTail = ke;
 }
 
+/*
+ * View callback which copies a name/value pair into a hash
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the hash as (void *)
+ * 2. The key
+ * 3. The value
+ *
+ * Return value:
+ * 
+ * None
+ */
 
+static void viewCopyCallback(void *userObj, const String key, const String value)
+{
+	ParseHashSTEPtr_t h = userObj;
+	ParseHashKVPtr_t ke;
+	unsigned kh = UtilHash(key);
+	
+	if(!(ke = findKey(h, key, kh))){
+		ke = newKey(h, key, kh);
+	}
+	setKeyValue(h, ke, value);
+}
 
 /*
- * Get a value from the hash. If the has name is "nvstate" and the database pointer is
- * in the pcode header, retreive the value from the database instead of memory.
+ * Copy the contents of a view into the hash it backs, and detach the view.
+ * Done before the first write to the hash. Does nothing if the hash is not a view.
  *
  * Arguments: 
  *
- * 1. Talloc context to hang the result off of.
- * 2. Pointer to pcode header block.
- * 3. String with the name of the hash.
- * 4. String with the key to look up.
+ * 1. Pointer to the hash
  *
  * Return value:
+ * 
+ * None
+ */
+
+static void hashDetachView(ParseHashSTEPtr_t h)
+{
+	void *viewObj = h->viewObj;
+	
+	if(!viewObj){
+		return;
+	}
+	debug(DEBUG_ACTION, "Copying view into hash %s", h->name);
+	h->viewObj = NULL;
+	(*h->viewIterate)(viewObj, h, viewCopyCallback);
+}
+
+/*
+ * Bind the program's symbol slots to hashes, and set up the inline caches.
  *
- * Value as a string. String must be freed when it is no longer required.
+ * Done once before a program is first executed. Hashes are created as needed. 
+ * The nvstate hash is left unbound when it is backed by the database, and so
+ * is the mem hash when it is shared between executions. They are accessed by name.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer the pcode header block
  *
+ * Return value:
  * 
+ * None
  */
 
-const String ParserHashGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, const String hashName, const String key)
+static void bindSlots(PcodeHeaderPtr_t ph)
 {
-	unsigned kh;
-	String s;
+	BCProgramPtr_t prog = ph->prog;
+	String name;
+	int i;
+	
+	MALLOC_FAIL(ph->symtab = talloc_zero_array(getArena(ph), ParseHashSTEPtr_t, prog->numSyms + 1))
+	MALLOC_FAIL(ph->icache = talloc_zero_array(ph->arena, ParseInlineCache_t, prog->codeLen))
+	MALLOC_FAIL(ph->lookupCache = talloc_zero_array(ph->arena, String, prog->numKeySlots + 1))
+	MALLOC_FAIL(ph->temps = talloc_zero_array(ph->arena, ParseValue_t, prog->codeLen))
+	
+	for(i = 0; i < prog->numSyms; i++){
+		name = prog->consts[prog->syms[i]].str;
+		if((ph->DB) && (!strcmp(name, "nvstate"))){
+			continue;
+		}
+		if((ph->memState) && (!strcmp(name, "mem"))){
+			continue;
+		}
+		ph->symtab[i] = getHash(ph, name, TRUE);
+	}
+}
+
+/*
+ * Return the key entry for a hash access instruction through its inline cache.
+ *
+ * The cache holds the entry found the last time the instruction ran. It is 
+ * used as long as the hash's generation has not changed since. On a miss 
+ * the key is looked up with the hash stored in its key slot, and the cache 
+ * is refilled.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer the pcode header block
+ * 2. Pointer to the instruction.
+ * 3. TRUE to add the key if it isn't in the hash
+ *
+ * Return value:
+ * 
+ * The key entry, or NULL if the key is not in the hash, or the hash is not bound.
+ */
+
+static ParseHashKVPtr_t icLookup(PcodeHeaderPtr_t ph, BCInstrPtr_t instr, Bool create)
+{
+	BCProgramPtr_t prog = ph->prog;
+	ParseInlineCachePtr_t ic;
 	ParseHashSTEPtr_t h;
+	BCKeySlotPtr_t ks;
 	ParseHashKVPtr_t ke;
-
-	ASSERT_FAIL(ctx && ph && hashName && key)
 	
-	if((ph->DB) && (!strcmp(hashName, "nvstate"))){
-		/* nvstate database hash */
-		return DBReadNVState(ctx, ph->DB, key);
+	if((instr->keySlot < 0) || !(h = ph->symtab[instr->sym])){
+		return NULL;
 	}
-	else{ /* In memory hash */
-		h = findHash(ph, hashName, NULL);
-		if(!h)
-			return NULL;
-		
-		/* Hash the section string passed in */
-		kh = UtilHash(key);
-		for(ke = h->head; (ke); ke = ke->next){ /* Traverse key list */
-			ASSERT_FAIL(KE_MAGIC == ke->magic)
-			/* Compare hashes, and if they match, compare strings */
-			if((kh == ke->hash) && (!strcmp(ke->key, key))){
-				s = talloc_strdup(ctx, ke->value);
-				MALLOC_FAIL(s)
-				return s;
-			}
-		}
-		return NULL; /* No match found */
+	if(create){
+		hashDetachView(h); /* Copy on write */
+	}
+	ic = ph->icache + (instr - prog->code);
+	if(ic->ke && (ic->ste == h) && (ic->generation == h->generation)){
+		ph->icHits++;
+		return ic->ke;
+	}
+	ph->icMisses++;
+	
+	ks = prog->keySlots + instr->keySlot;
+	if(!(ke = findKey(h, prog->consts[ks->key].str, ks->hash)) && create){
+		ke = newKey(h, prog->consts[ks->key].str, ks->hash);
 	}
+	ic->ste = h;
+	ic->ke = ke;
+	ic->generation = h->generation;
+	return ke;
 }
 
 /*
- * Add a value to the hash
- * Replace any entry with a matching key which is already there
- * Add hash to the symbol table if it does not already exist.
- * If the hash name is "nvstate" and the database pointer is in the
- * pcode header block, store the key and value in the database instead
- * of in memory.
- * 
+ * Return the value of an argument passed to a function
  *
  * Arguments: 
  *
- * 1. Talloc context to hang the result off of.
- * 2. Pointer to the pcode header block.
- * 3. String containing the name of the hash.
- * 4. String containing the key to add to the hash
+ * 1. Talloc context to hang the value off of.
+ * 2. Pointer to the pcode header
+ * 3. Pointer to the pcode instruction containing the function token.
+ * 4. Argument number, starting at 0.
+ * 5. Pointer to a string to store the value.
+ *
+ * Return value:
+ *
+ * Boolean. PASS if the argument is defined, otherwise FAIL. Undefined arguments are reported.
+ */
+
+static Bool getFuncArg(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t pi, int argNum, String *pValue)
+{
+	BCInstrPtr_t instr = ph->stack[argNum];
+	
+	if(FAIL == ParserPcodeGetValue(ctx, ph, instr, pValue)){
+		undefOperand(ph, instr, pi->lineNo);
+		return FAIL;
+	}
+	return PASS;
+}
+
+/*
+ * Spawn another program
+ *
+ * Arguments: 
  *
+ * 1. Pointer to the pcode header
+ * 2. Pointer to the pcode instruction containing the spawn token.
  *
  * Return value:
  *
- * Boolean. PASS, unless DB write fails, then FAIL.
+ * None
+ *
  */
  
-Bool ParserHashAddKeyValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, const String hashName, const String key, const String value)
+static void spawn(PcodeHeaderPtr_t ph, BCInstrPtr_t pi)
 {
-	ParseHashSTEPtr_t h = NULL;
-	ParseHashKVPtr_t ke, keNew, kePrev;
+	String command = NULL;
+	TALLOC_CTX *ctx;
 	
-
-	ASSERT_FAIL(ph && hashName && key && value)
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(pi)
 	
-	if((ph->DB) && (!strcmp(hashName, "nvstate"))){
-		/* nvstate database hash */
-		return DBWriteNVState(ctx, ph->DB, key, value);
+	/* Temporary strings go in the execution's scratch context, and are freed with it */
+	ASSERT_FAIL(ctx = ph->execCtx)
+	
+	/* Check for correct argument count */
+	if(ph->sp != 1){
+		ph->failReason = talloc_asprintf(ph, "Incorrect number of arguments passed to spawn, requires 1, got %d",
+		ph->sp);
+		goto end;
 	}
-	else{	/* In memory hash */	
-		/* Attempt to find the hash in the symbol table */
-		
-		if(ph->steHead){ /* If symbol table isn't empty */
-			if(!findHash(ph, hashName, &h)){
-				debug(DEBUG_ACTION, "Creating hash: %s in symbol table", hashName);
-				hashAppend(ph, &h->next, hashName); /* Was not found, add it to the symbol table */
-				h = h->next;
-				ASSERT_FAIL(h)
-				h->context = talloc_new(h);
-				MALLOC_FAIL(h->context);
-			}
 	
-		
-		}
-		else{ /* Empty symbol table */
-			debug(DEBUG_ACTION, "Creating first hash: %s in empty symbol table", hashName);
-			hashAppend(ph, &ph->steHead, hashName);
-			h = ph->steHead;
-			h->context = talloc_new(h);
-			MALLOC_FAIL(h->context);
+	/* Retrieve parameter */
+	if(FAIL == getFuncArg(ctx, ph, pi, 0, &command)){
+		goto end;
+	}
+	if(/* ph->xplServicePtr */ 1){ /* Make sure this isn't a dry run */
+		debug(DEBUG_ACTION, "Spawning command: %s", command);
+		if(SpawnHelperCommand(command) == FAIL){
+			ph->failReason = talloc_asprintf(ph, "Spawn %s failed", command);
 		}
-		
+	}
 	
-			
-		/* Initialize a new key list entry */
-		 
-		keNew = talloc_zero(h->context, ParseHashKV_t);
-		MALLOC_FAIL(keNew)
-		keNew->magic = KE_MAGIC;
-		keNew->key = talloc_strdup(keNew, key);
-		MALLOC_FAIL(keNew->key)
-		keNew->value = talloc_strdup(keNew, value);
-		MALLOC_FAIL(keNew->value);
-		keNew->hash = UtilHash(key);
-	
-		/* add the key/value to the hash, replacing any existing identical key */
-		
-		if(!h->head){
-			/* First entry */
-			debug(DEBUG_ACTION, "First entry in hash %s is: %s", h->name, key);
-			h->head = keNew;
-		}
-		else{
-			for(ke = h->head, kePrev = NULL; (ke); ke = ke->next){ /* Traverse key list */
-				ASSERT_FAIL(KE_MAGIC == ke->magic);
-				/* Compare hashes, and if they match, compare strings */
-				if((keNew->hash == ke->hash) && (!strcmp(ke->key, key))){
-					/* Key already exists, need to replace it */
-					keNew->next = ke->next;
-					if(!kePrev){
-						debug(DEBUG_ACTION, "Replacing first entry in hash %s: %s", h->name, key);
-						h->head = keNew; /* Change first entry */
-					}
-					else{
-						debug(DEBUG_ACTION, "Replacing other than the first entry in hash %s: %s", h->name, key);
-						kePrev->next = keNew; /* Change subsequent entry */
-					}	
-					talloc_free(ke); /* Free the old entry and its strings */
-					break;
-				}
-				else if(!ke->next){
-					debug(DEBUG_ACTION, "Appending entry to end of hash %s: %s", h->name, key);
-					/* At end of list, need to append it */
-					ke->next = keNew;
-					break;	
-				}
-				kePrev = ke;	
+end:
+	return;
+}
+
+/*
+ * Set the time to live of a key in the mem hash
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header
+ * 2. Pointer to the pcode instruction containing the expire token.
+ *
+ * Return value:
+ *
+ * None
+ *
+ */
+ 
+static void expire(PcodeHeaderPtr_t ph, BCInstrPtr_t pi)
+{
+	String key = NULL;
+	String seconds = NULL;
+	unsigned secs;
+	TALLOC_CTX *ctx;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(pi)
+	
+	ASSERT_FAIL(ctx = ph->execCtx)
+	
+	if(ph->sp != 2){
+		ph->failReason = talloc_asprintf(ph, "Incorrect number of arguments passed to expire, requires 2, got %d",
+		ph->sp);
+		return;
+	}
+	
+	if((FAIL == getFuncArg(ctx, ph, pi, 0, &key)) || (FAIL == getFuncArg(ctx, ph, pi, 1, &seconds))){
+		return;
+	}
+	
+	if(FAIL == UtilStou(seconds, &secs)){
+		ph->failReason = talloc_asprintf(ph, "Number of seconds passed to expire is not valid: %s", seconds);
+		return;
+	}
+	
+	if(!ph->memState){ /* mem is local to this execution, so there is nothing to expire */
+		debug(DEBUG_EXPECTED, "Expire mem key %s in %u seconds", key, secs);
+		return;
+	}
+	
+	if(FAIL == MemStateExpire(ph->memState, key, secs)){
+		debug(DEBUG_ACTION, "Expire: mem key %s does not exist", key);
+	}
+}
+
+
+/*
+ * Send xPL command if everything looks good
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header
+ * 2. Pointer to the pcode instruction containing the spawn token.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void sendXPLCommand(PcodeHeaderPtr_t ph, BCInstrPtr_t pi)
+{
+	String tag = NULL;
+	String class = NULL;
+	String type = NULL;
+	String hash = NULL;
+	TALLOC_CTX *ctx;
+	String vendor, device, instance;
+	ParseHashSTEPtr_t se = NULL;
+	ParseHashKVPtr_t kvp;
+	void *msg = NULL;
+
+
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(pi)
+	
+	/* Temporary strings go in the execution's scratch context, and are freed with it */
+	ASSERT_FAIL(ctx = ph->execCtx)
+			
+	if(ph->sp != 4){
+		ph->failReason = talloc_asprintf(ph, "Incorrect number of arguments passed to xplcmd, requires 4, got %d",
+		ph->sp);
+		goto end;
+	}
+
+	/* Arguments are on the stack in the order they were pushed */
+	if((FAIL == getFuncArg(ctx, ph, pi, 0, &tag)) || (FAIL == getFuncArg(ctx, ph, pi, 1, &class)) ||
+	(FAIL == getFuncArg(ctx, ph, pi, 2, &type)) || (FAIL == getFuncArg(ctx, ph, pi, 3, &hash))){
+		goto end;
+	}
+
+	
+	
+	if(ParserSplitXPLTag(ctx, tag, &vendor, &device, &instance)){
+		ph->failReason = talloc_asprintf(ph, "Bad xPL Tag: %s", tag);
+		goto end;
+	}
+
+
+	if(ph->xplServicePtr){ /* if this is NULL, it is to be a dry run */
+			
+		/* Create xpl command message */
+		msg = XplInitTargettedMessage(ph->xplServicePtr, XPL_MESSAGE_COMMAND, vendor, device, instance);
+		ASSERT_FAIL(msg)
+		
+		/* Set message schema */
+		XplSetMessageClassType(msg, class, type);
+	
+		
+		/* Clear name/value pairs */
+		XplClearNameValues(msg);
+	}
+	else{
+		/* For dry run, just print the vendor, device and instance */
+		debug(DEBUG_EXPECTED, "Vendor: %s", vendor);
+		debug(DEBUG_EXPECTED, "Device: %s", device);
+		debug(DEBUG_EXPECTED, "Instance: %s", instance);
+	}		
+
+	/* Use the symbol slot if the hash was referenced by name */
+	if(ph->stack[3]->sym >= 0){
+		se = ph->symtab[ph->stack[3]->sym];
+	}
+	if(!se){
+		se = findHash(ph, hash);
+	}
+	if(!se){ /* A value passed as the last argument might not name a hash */
+		ph->failReason = talloc_asprintf(ph, "Hash %s passed to xplcmd does not exist", hash);
+		if(msg){
+			XplDestroyMessage(msg);
+		}
+		goto end;
+	}
+	hashDetachView(se); /* It gets emptied afterwards */
+	/* Build xPL name value pairs from hash entries */
+	for(kvp = se->liveHead; kvp; kvp = kvp->nextLive){
+		ASSERT_FAIL(kvp->magic == KE_MAGIC)
+		if(!ph->xplServicePtr){
+			debug(DEBUG_EXPECTED,"Adding Key: %s, Value: %s", kvp->key, kvp->val.str);
+		}
+		else{
+			XplAddNameValue(msg, kvp->key, kvp->val.str);
+		}		
+	}
+	
+	debug(DEBUG_ACTION, "***Sending xPL command***");
+	
+	if(ph->xplServicePtr){
+		XplSendMessage(msg);
+		XplDestroyMessage(msg);
+	}
+
+end:
+	/* Clear out the xplout hash */
+	
+	if(se){
+		deleteHashContents(se);
+	}
+}
+
+
+/*
+ * Split an xPL tag into its constituent parts.
+ * 
+ * Check parts for length
+ * 
+ * To do just a validation without returning the strings, set vendor, device, and instance to NULL
+ * 
+ * Strings must be freed unless set to NULL
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the strings off of.
+ * 2. String containing xPL tag. 
+ * 3. Pointer to string to store vendor name (or NULL)
+ * 4. Pointer to string to store device name (or NULL)
+ * 5. Pointer to string to store instance (or NULL)
+ *
+ * Return value:
+ *
+ * Boolean. PASS indicates success, FAIL indicates failure.
+ * 
+ */
+
+Bool ParserSplitXPLTag(TALLOC_CTX *ctx, const String tag, String *vendor, String *device, String *instance)
+{
+	int res = PASS;
+	int done = FALSE;
+	int i,j,state, begin;
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(tag)
+	
+	for(i = 0, j = 0, state = 0, begin = 0; !done; i++,j++){
+
+		switch(state){
+			case 0: /* Search for hyphen */
+				if(!tag[i]){
+					done = TRUE;
+					res = FAIL;
+					break;
+				}
+				if('-' == tag[i]){
+					if((!j) || (j > 9)){
+						done = TRUE;
+						res = FAIL;
+						break;
+					}
+					else{
+						if(vendor){
+							*vendor = talloc_strndup(ctx, tag, j);
+							MALLOC_FAIL(*vendor)
+						}
+						begin = i + 1;
+						j = 0;
+						state++;
+					}
+				}
+				break;
+				
+			case 1: /* Search for dot */
+				if(!tag[i]){
+					done = TRUE;
+					res = FAIL;
+					break;
+				}
+				if('.' == tag[i]){
+					if((!j) || (j > 9)){
+						done = TRUE;
+						res = FAIL;
+						break;
+					}
+					else{
+						if(device){
+								*device = talloc_strndup(ctx, tag + begin, j - 1);
+								ASSERT_FAIL(*device);
+						}
+						begin = i + 1;
+						j = 0;
+						state++;
+					}
+				}
+				
+			case 2: /* Search for end of string and measure length */
+				if(!tag[i]){
+					if((!j) || (j > 9)){
+						res = FAIL;
+						
+					}
+					if(res != FAIL && device){
+							*instance = talloc_strndup(ctx, tag + begin, j - 1);
+							MALLOC_FAIL(*instance);
+					}
+					done = TRUE;
+				}
+				break;
+
+			default:
+				ASSERT_FAIL(FALSE);	
+		}
+		
+		
+	}
+	return res;	
+}
+
+
+
+/*
+ * Get a value from the hash. If the has name is "nvstate" and the database pointer is
+ * in the pcode header, retreive the value from the database instead of memory.
+ * If the hash name is "mem" and the memstate pointer is in the pcode header, 
+ * retrieve the value from the shared memstate object.
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to pcode header block.
+ * 3. String with the name of the hash.
+ * 4. String with the key to look up.
+ *
+ * Return value:
+ *
+ * Value as a string. String must be freed when it is no longer required.
+ *
+ * 
+ */
+
+const String ParserHashGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, const String hashName, const String key)
+{
+	String s;
+	ParseHashSTEPtr_t h;
+	ParseHashKVPtr_t ke;
+
+	ASSERT_FAIL(ctx && ph && hashName && key)
+	
+	if((ph->DB) && (!strcmp(hashName, "nvstate"))){
+		/* nvstate database hash */
+		return DBReadNVState(ctx, ph->DB, key);
+	}
+	else if((ph->memState) && (!strcmp(hashName, "mem"))){
+		/* Hash shared between executions */
+		return MemStateGet(ctx, ph->memState, key);
+	}
+	else{ /* In memory hash */
+		h = findHash(ph, hashName);
+		if(!h)
+			return NULL;
+		
+		/* Read views in place */
+		if(h->viewObj){
+			if(!(s = (*h->viewGet)(h->viewObj, key))){
+				return NULL;
+			}
+			MALLOC_FAIL(s = talloc_strdup(ctx, s))
+			return s;
+		}
+		
+		/* Look for a defined key */
+		ke = findKey(h, key, UtilHash(key));
+		if(!ke || !ke->val.str){
+			return NULL; /* No match found */
+		}
+		s = talloc_strdup(ctx, ke->val.str);
+		MALLOC_FAIL(s)
+		return s;
+	}
+}
+
+/*
+ * Add a value to the hash
+ * Replace the value of any entry with a matching key which is already there
+ * Add hash to the symbol table if it does not already exist.
+ * If the hash name is "nvstate" and the database pointer is in the
+ * pcode header block, store the key and value in the database instead
+ * of in memory. If the hash name is "mem" and the memstate pointer is in
+ * the pcode header block, store them in the shared memstate object.
+ * 
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the pcode header block.
+ * 3. String containing the name of the hash.
+ * 4. String containing the key to add to the hash
+ *
+ *
+ * Return value:
+ *
+ * Boolean. PASS, unless DB write fails, then FAIL.
+ */
+ 
+Bool ParserHashAddKeyValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, const String hashName, const String key, const String value)
+{
+	ParseHashSTEPtr_t h;
+	ParseHashKVPtr_t ke;
+	unsigned kh;
+	
+
+	ASSERT_FAIL(ph && hashName && key && value)
+	
+	if((ph->DB) && (!strcmp(hashName, "nvstate"))){
+		/* nvstate database hash */
+		return DBWriteNVState(ctx, ph->DB, key, value);
+	}
+	else if((ph->memState) && (!strcmp(hashName, "mem"))){
+		/* Hash shared between executions */
+		MemStatePut(ph->memState, key, value);
+		return PASS;
+	}
+	else{	/* In memory hash */	
+		/* Find the hash in the symbol table, creating it if necessary */
+		h = getHash(ph, hashName, TRUE);
+		hashDetachView(h); /* Copy on write */
+		
+		/* Find the key, or add it if it isn't there */
+		kh = UtilHash(key);
+		if(!(ke = findKey(h, key, kh))){
+			debug(DEBUG_ACTION, "Adding entry to hash %s: %s", h->name, key);
+			ke = newKey(h, key, kh);
+		}
+		
+		/* Set the value in place. Inline caches holding the entry stay valid */
+		setKeyValue(h, ke, value);
+		return PASS;
+	}	
+}
+
+/*
+ * View callback for ParserHashWalk. Passes the pair on to the walk callback.
+ */
+
+static void viewWalkCallback(void *userObj, const String key, const String value)
+{
+	void (**walkCallback)(const String key, const String value) = userObj;
+	
+	(**walkCallback)(key, value);
+}
+
+/*
+ * Walk the list calling a callback function with each key/value
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header block.
+ * 2. String containing the hash name
+ * 3. Callback function (see below)
+ * 
+ *
+ *
+ * Return value:
+ *
+ * None
+ *
+ ************** Callback Function ***************
+ *
+ * Arguments:
+ *
+ * 1. Key found as a String
+ * 2. Value found as a String
+ *
+ * Return value:
+ *
+ * None
+ */
+ 
+void ParserHashWalk(PcodeHeaderPtr_t ph, const String name, void (*parseHashWalkCallback)(const String key, const String value))
+{
+	ParseHashKVPtr_t ke;
+	ParseHashSTEPtr_t h;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(name)
+	/* NULL function pointer is fatal */
+	ASSERT_FAIL(parseHashWalkCallback)
+
+	h = findHash(ph, name);
+	
+	if(!h){
+		return;
+	}
+	
+	/* Views are walked in the order of the object they are a view of */
+	if(h->viewObj){
+		(*h->viewIterate)(h->viewObj, &parseHashWalkCallback, viewWalkCallback);
+		return;
+	}
+	
+	/* Traverse the defined keys in insertion order */	
+	for(ke = h->liveHead; (ke); ke = ke->nextLive){
+		ASSERT_FAIL(KE_MAGIC == ke->magic)
+		(*parseHashWalkCallback)(ke->key, ke->val.str);
+	}
+	
+}
+
+
+/*
+ * Make a hash a read only view of name/value pairs stored elsewhere.
+ * 
+ * Nothing is copied. Lookups are passed to the get function, and walks to the iterate 
+ * function. The first write to the hash copies the pairs into it, and the view is 
+ * detached. Anything already in the hash is deleted. The object must stay valid for as 
+ * long as the hash is used, or until the view is detached.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header block.
+ * 2. String containing the hash name
+ * 3. Pointer to the object to view
+ * 4. Function to look up the value for a key in the object. Returns NULL if not found.
+ * 5. Function to iterate through the name/value pairs in the object.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserHashAttachView(PcodeHeaderPtr_t ph, const String hashName, void *viewObj, ParserViewGet_t viewGet, 
+ParserViewIterate_t viewIterate)
+{
+	ParseHashSTEPtr_t h;
+	
+	ASSERT_FAIL(ph && hashName && viewObj && viewGet && viewIterate)
+	
+	h = getHash(ph, hashName, TRUE);
+	deleteHashContents(h);
+	h->viewObj = viewObj;
+	h->viewGet = viewGet;
+	h->viewIterate = viewIterate;
+}
+
+/*
+ * Return a reference to the value for the push instruction passed in
+ *
+ * Literals and hash keys bound at compile time are returned in place, so their 
+ * cached numeric form is kept between executions. Anything else is looked up 
+ * by name and returned in the scratch value.
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang a looked up string off of.
+ * 2. Pointer to the pcode header block.
+ * 3. Pointer to the push or value instruction to extract the value from.
+ * 4. Pointer to a scratch value to use for values looked up by name.
+ *
+ *
+ * Return value:
+ *
+ * Pointer to the value, or NULL if the variable is undefined.
+ */
+
+static ParseValuePtr_t getValueRef(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t instr, ParseValuePtr_t scratch)
+{
+	ParseValuePtr_t v = NULL;
+	ParseHashSTEPtr_t h = NULL;
+	ParseHashKVPtr_t ke;
+	BCProgramPtr_t prog = ph->prog;
+	
+	/* Value instructions leave their result in the temps */
+	if(OP_PUSH != instr->opcode){
+		ASSERT_FAIL(IS_VALUE_OP(instr->opcode))
+		v = ph->temps + (instr - prog->code);
+		return (v->str) ? v : NULL;
+	}
+	
+	/* Do something based on the operand */
+	switch(instr->operand){
+		
+		case OPRD_STRINGLIT: /* Literals */
+		case OPRD_INTLIT:
+		case OPRD_FLOATLIT:
+		case OPRD_HASHREF: /* Hash reference */
+			if(instr->arg1 >= 0){
+				v = prog->consts + instr->arg1;
+			}
+			break;
+			
+		case OPRD_HASHKV:  /* Assoc array key/value */
+			if((instr->sym >= 0) && (h = ph->symtab[instr->sym]) && h->viewObj){
+				/* Views are read in place */
+				scratch->str = (*h->viewGet)(h->viewObj, BC_CONST(prog, instr->arg2));
+				scratch->numState = PVN_UNKNOWN;
+				v = scratch;
+			}
+			else if(h){
+				/* Bound at compile time, found through the inline cache */
+				v = ((ke = icLookup(ph, instr, FALSE))) ? &ke->val : NULL;
+			}
+			else if((instr->flags & (BIF_LOOKUP_FILL | BIF_LOOKUP_REUSE)) && ph->execCtx){
+				/* Lookups merged by the optimizer share one result */
+				if((instr->flags & BIF_LOOKUP_FILL) || !ph->lookupCache[instr->keySlot]){
+					ph->lookupCache[instr->keySlot] = ParserHashGetValue(ph->execCtx, ph, 
+					BC_CONST(prog, instr->arg1), BC_CONST(prog, instr->arg2));
+				}
+				scratch->str = ph->lookupCache[instr->keySlot];
+				scratch->numState = PVN_UNKNOWN;
+				v = scratch;
+			}
+			else{
+				scratch->str = ParserHashGetValue(ctx, ph, BC_CONST(prog, instr->arg1), BC_CONST(prog, instr->arg2));
+				scratch->numState = PVN_UNKNOWN;
+				v = scratch;
+			}
+			break;
+			
+		default:
+			ASSERT_FAIL(0)
+	}
+	
+	return (v && v->str) ? v : NULL;
+}
+
+/*
+ * Return the numeric form of a value, converting and caching it on first use.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the value.
+ * 2. Pointer to a double to store the result.
+ *
+ *
+ * Return value:
+ *
+ * Boolean. PASS if the value is numeric, else FAIL
+ */
+
+static Bool getValueNum(ParseValuePtr_t v, double *num)
+{
+	if(PVN_UNKNOWN == v->numState){
+		v->numState = (PASS == UtilStod(v->str, &v->num)) ? PVN_VALID : PVN_INVALID;
+	}
+	*num = v->num;
+	return (PVN_VALID == v->numState) ? PASS : FAIL;
+}
+
+/*
+ * Evaluate a two operand test
+ *
+ * Arguments: 
+ *
+ * 1. Test operand (OPRT_)
+ * 2. Left string
+ * 3. Right string
+ * 4. Left numeric value. Not used for string tests.
+ * 5. Right numeric value. Not used for string tests.
+ *
+ *
+ * Return value:
+ *
+ * Boolean. TRUE if the test is true, else FALSE
+ */
+
+static Bool evalTest(int operand, const String left, const String right, double leftNum, double rightNum)
+{
+	switch(operand){
+		case OPRT_NUMEQUALITY:
+			return (leftNum == rightNum);
+			
+		case OPRT_NUMINEQUALITY:
+			return (leftNum != rightNum);
+			
+		case OPRT_NUMGTRTHAN:
+			return (leftNum > rightNum);
+		
+		case OPRT_NUMLESSTHAN:
+			return (leftNum < rightNum);
+		
+		case OPRT_NUMGTREQTHAN:
+			return (leftNum >= rightNum);
+		
+		case OPRT_NUMLESSEQTHAN:
+			return (leftNum <= rightNum);
+		
+		case OPRT_STREQUALITY:
+			return (0 == strcmp(right, left));
+		
+		default:
+			ASSERT_FAIL(0);
+	}
+	return FALSE;
+}
+
+/*
+ * Return the value for the push instruction passed in
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the pcode header block.
+ * 3. Pointer to the push instruction to extract the value from.
+ * 4. Pointer to string to store value.
+ *
+ *
+ * Return value:
+ *
+ * Boolean. PASS if variable could be retrieved, else FAIL
+ */
+ 
+
+Bool ParserPcodeGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t instr, String *pValue)
+{
+	ParseValue_t scratch;
+	ParseValuePtr_t v;
+	
+	ASSERT_FAIL(ph);
+	ASSERT_FAIL(instr)
+	ASSERT_FAIL(pValue)
+	ASSERT_FAIL(ph->prog)
+	
+	if(!(v = getValueRef(ctx, ph, instr, &scratch))){
+		return FAIL;
+	}
+	*pValue = v->str;
+	return PASS;
+}
+
+/*
+ * Put a value in a variable
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the pcode header block.
+ * 3. Pointer to the push instruction contining the lvalue.
+ * 4. String containing the value to add to the hash
+ *
+ *
+ * Return value:
+ *
+ * Boolean. PASS if success, otherwise FAIL
+ */
+
+Bool ParserPcodePutValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t instr, String value)
+{
+	ParseHashKVPtr_t ke;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(ph->prog)
+	ASSERT_FAIL(instr)
+	ASSERT_FAIL(value)
+	
+	if((OP_PUSH != instr->opcode) || (instr->operand != OPRD_HASHKV)){
+		return FAIL;
+	}
+	
+	/* Bound at compile time */
+	if((ke = icLookup(ph, instr, TRUE))){
+		setKeyValue(ph->symtab[instr->sym], ke, value);
+		return PASS;
+	}
+
+	return ParserHashAddKeyValue(ctx, ph, BC_CONST(ph->prog, instr->arg1), BC_CONST(ph->prog, instr->arg2), value);
+}
+
+/*
+ * This is called by the parser when a pcode structure has to be added to the list. It adds
+ * the new instruction to the end of the instruction list.
+ *
+ *  Arguments: 
+ *
+ * 1. Pointer to parse control block
+ * 2. Opcode type
+ * 3. Operand
+ * 4. Optional string 1 (Pass NULL if not used)
+ * 5. Optional string 2 (Pass NULL if not used)
+ *
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserPcodeEmit(ParseCtrlPtr_t pc, opType_t op, int operand, String data1, String data2)
+{
+	PcodeHeaderPtr_t ph;
+	PcodePtr_t new;
+	
+	ASSERT_FAIL(pc)
+	
+	ph = pc->pcodeHeader;
+	
+	if(ph){
+		
+		new = talloc_zero(ph, Pcode_t);
+		ASSERT_FAIL(new);
+		
+		/* Initialize new list entry */
+		new->magic = PC_MAGIC;
+		new->opcode = op;
+		new->operand = operand;
+		new->lineNo = pc->lineNo;
+		new->seq = ph->seq++;
+		new->ctrlStructRefCount = ph->ctrlStructRefCount;
+		
+		if(data1){
+			/* Make a copy of the string */
+			new->data1 = talloc_strdup(new, data1);
+			MALLOC_FAIL(new->data1);
+		}
+		if(data2){
+			/* Make a copy of the string */
+			new->data2 = talloc_strdup(new, data2);
+			MALLOC_FAIL(new->data2);
+		}
+		
+		if(!ph->head){
+			/* First entry */
+			ph->head = ph->tail = new;
+			return;
+		}
+		else{
+			/* Subsequent entry */
+			ph->tail->next = new;
+			new->prev = ph->tail;
+			ph->tail = new; 
+		}
+	}
+}
+
+/*
+ * This is called by the parser when a value instruction has to be added. The argument
+ * count is checked against the ones the instruction accepts.
+ *
+ *  Arguments: 
+ *
+ * 1. Pointer to parse control block
+ * 2. Opcode type. Must be a value instruction.
+ * 3. Number of arguments on the stack
+ * 4. Name of the operator or function for error messages
+ *
+ *
+ * Return value:
+ *
+ * None. pc->failReason is set on error.
+ */
+
+void ParserEmitValueOp(ParseCtrlPtr_t pc, opType_t op, int argc, String name)
+{
+	ASSERT_FAIL(pc)
+	ASSERT_FAIL(IS_VALUE_OP(op))
+	ASSERT_FAIL(name)
+	
+	if((argc < valueOpArgs[op].min) || (argc > valueOpArgs[op].max)){
+		if(!pc->failReason){
+			MALLOC_FAIL(pc->failReason = talloc_asprintf(pc, "Wrong number of arguments to %s on line %d", 
+			name, pc->lineNo))
+		}
+		return;
+	}
+	ParserPcodeEmit(pc, op, argc, name, NULL);
+}
+
+/*
+ * Debug function.
+ * 
+ * Dump the lowered bytecode
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header block.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserPcodeDumpList(PcodeHeaderPtr_t ph)
+{
+	int addr;
+	
+	if(!ph || !ph->prog)
+		return;
+	debug(DEBUG_EXPECTED, "*** begin p-code dump ***");
+	for(addr = 0; addr < ph->prog->codeLen; addr++){
+		printInstr(ph->prog, addr);
+	}
+	debug(DEBUG_EXPECTED, "*** end p-code dump ***");
+	
+}
+
+/*
+ * Convert a constant pool entry to its numeric form.
+ * Done once when the constant is added, instead of on every test.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the constant pool entry.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void convertConst(ParseValuePtr_t v)
+{
+	v->numState = (PASS == UtilStod(v->str, &v->num)) ? PVN_VALID : PVN_INVALID;
+}
+
+/*
+ * Add a string to the constant pool, or find the copy already there.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ * 2. Size of the constant pool array.
+ * 3. String to add, or NULL.
+ *
+ * Return value:
+ *
+ * Index of the string in the constant pool, or -1 if a NULL was passed in.
+ */
+
+static int addConst(BCProgramPtr_t prog, int poolSize, const String str)
+{
+	int i;
+	
+	if(!str){
+		return -1;
+	}
+	
+	for(i = 0; i < prog->numConsts; i++){
+		if(!strcmp(prog->consts[i].str, str)){
+			return i;
+		}
+	}
+	
+	ASSERT_FAIL(prog->numConsts < poolSize)
+	MALLOC_FAIL(prog->consts[i].str = talloc_strdup(prog->consts, str))
+	convertConst(prog->consts + i);
+	prog->numConsts++;
+	return i;
+}
+
+/*
+ * Return the symbol slot for a hash name, adding one if necessary.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ * 2. Constant pool index of the hash name.
+ *
+ * Return value:
+ *
+ * Symbol slot index
+ */
+
+static int addSym(BCProgramPtr_t prog, int name)
+{
+	int i;
+	
+	/* Constants are de-duplicated, so the index identifies the name */
+	for(i = 0; i < prog->numSyms; i++){
+		if(prog->syms[i] == name){
+			return i;
+		}
+	}
+	MALLOC_FAIL(prog->syms = talloc_realloc(prog, prog->syms, int, prog->numSyms + 1))
+	prog->syms[i] = name;
+	prog->numSyms++;
+	return i;
+}
+
+/*
+ * Return the key slot for a hash key, adding one if necessary.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ * 2. Symbol slot of the hash.
+ * 3. Constant pool index of the key.
+ *
+ * Return value:
+ *
+ * Key slot index
+ */
+
+static int addKeySlot(BCProgramPtr_t prog, int sym, int key)
+{
+	int i;
+	
+	for(i = 0; i < prog->numKeySlots; i++){
+		if((prog->keySlots[i].sym == sym) && (prog->keySlots[i].key == key)){
+			return i;
+		}
+	}
+	MALLOC_FAIL(prog->keySlots = talloc_realloc(prog, prog->keySlots, BCKeySlot_t, prog->numKeySlots + 1))
+	prog->keySlots[i].sym = sym;
+	prog->keySlots[i].key = key;
+	prog->keySlots[i].hash = UtilHash(prog->consts[key].str);
+	prog->numKeySlots++;
+	return i;
+}
+
+/*
+ * Return the number of operand records following a superinstruction, or 0 for other instructions
+ */
+
+static int fusedOperands(opType_t opcode)
+{
+	switch(opcode){
+		case OP_TEST_HASHKEY_LITERAL:
+		case OP_ASSIGN_LITERAL:
+		case OP_ASSIGN_HASH_TO_HASH:
+			return 2;
+			
+		case OP_EXISTS_HASHKEY:
+			return 1;
+			
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Work out the stack depth a bytecode program needs, checking that each instruction finds
+ * the stack as it expects. A jump is taken with the stack empty, so it must land where the
+ * stack is empty anyway, and not on an operand record. Used when a program is made, and 
+ * again when one is loaded, so a damaged image can't trip over the checks at run time.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program. The jumps must be in range.
+ *
+ * Return value:
+ *
+ * The deepest the stack gets, or -1 if an instruction would find the stack in a state it doesn't expect.
+ */
+
+static int stackDepth(BCProgramPtr_t prog)
+{
+	BCInstrPtr_t bi;
+	Bool *target;
+	int i, j, depth, maxDepth, res = -1;
+	
+	MALLOC_FAIL(target = talloc_zero_array(prog, Bool, prog->codeLen))
+	for(i = 0; i < prog->codeLen; i++){
+		if(prog->code[i].jump >= 0){
+			target[prog->code[i].jump] = TRUE;
+		}
+	}
+	
+	for(i = 0, depth = 0, maxDepth = 0; i < prog->codeLen; i += 1 + fusedOperands(bi->opcode)){
+		bi = prog->code + i;
+		if(target[i] && depth){
+			goto out;
+		}
+		switch(bi->opcode){
+			case OP_PUSH:
+				depth++;
+				break;
+				
+			case OP_ASSIGN:
+			case OP_TEST2:
+				if(2 != depth){
+					goto out;
+				}
+				depth = 0;
+				break;
+				
+			case OP_EXISTS:
+				if(1 != depth){
+					goto out;
+				}
+				depth = 0;
+				break;
+				
+			case OP_NOP:
+			case OP_BLOCK:
+			case OP_FUNC:
+			case OP_END:
+				depth = 0;
+				break;
+				
+			case OP_TEST_HASHKEY_LITERAL:
+			case OP_ASSIGN_LITERAL:
+			case OP_ASSIGN_HASH_TO_HASH:
+			case OP_EXISTS_HASHKEY:
+				/* Superinstructions leave the stack alone, and can jump */
+				if(depth || (i + fusedOperands(bi->opcode) >= prog->codeLen)){
+					goto out;
+				}
+				for(j = 1; j <= fusedOperands(bi->opcode); j++){
+					if(target[i + j]){
+						goto out;
+					}
+				}
+				break;
+				
+			default:
+				/* Value instructions replace their arguments with their result */
+				if(!IS_VALUE_OP(bi->opcode) || (bi->operand < 1) || (bi->operand > depth)){
+					goto out;
+				}
+				depth -= bi->operand - 1;
+				break;
+		}
+		if(depth > maxDepth){
+			maxDepth = depth;
+		}
+	}
+	res = maxDepth;
+	
+out:
+	talloc_free(target);
+	return res;
+}
+
+/*
+ * Lower the pcode list into a bytecode program.
+ * 
+ * Called once when parsing is complete. The instructions are copied to a contiguous array
+ * with their strings in a de-duplicated constant pool, and skip pointers are resolved to
+ * instruction indexes. Hash names and keys are assigned symbol and key slots. 
+ * An end instruction is appended. The pcode list is freed afterwards.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header block.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserLowerPcode(PcodeHeaderPtr_t ph)
+{
+	BCProgramPtr_t prog;
+	BCInstrPtr_t bi;
+	PcodePtr_t p, next;
+	int count, addr;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(!ph->prog)
+	
+	/* Number the instructions */
+	for(count = 0, p = ph->head; p; p = p->next, count++){
+		ASSERT_FAIL(PC_MAGIC == p->magic)
+		p->seq = count;
+	}
+	
+	/* Programs are not owned by a pcode header, they can be shared */
+	MALLOC_FAIL(prog = talloc_zero(NULL, BCProgram_t))
+	prog->magic = BP_MAGIC;
+	prog->codeLen = count + 1;
+	MALLOC_FAIL(prog->code = talloc_zero_array(prog, BCInstr_t, prog->codeLen))
+	/* At most two strings per instruction */
+	MALLOC_FAIL(prog->consts = talloc_zero_array(prog, ParseValue_t, (count * 2) + 1))
+	
+	for(addr = 0, p = ph->head; p; p = p->next, addr++){
+		bi = prog->code + addr;
+		bi->opcode = p->opcode;
+		bi->operand = p->operand;
+		bi->lineNo = p->lineNo;
+		/* Execution continues at the instruction after the skip target */
+		bi->jump = (p->skip) ? p->skip->seq + 1 : -1;
+		bi->arg1 = addConst(prog, (count * 2) + 1, p->data1);
+		bi->arg2 = addConst(prog, (count * 2) + 1, p->data2);
+		bi->sym = bi->keySlot = -1;
+		
+		/* Resolve hash names and keys to slots */
+		if((OP_PUSH == p->opcode) && ((OPRD_HASHKV == p->operand) || (OPRD_HASHREF == p->operand))){
+			ASSERT_FAIL(bi->arg1 >= 0)
+			bi->sym = addSym(prog, bi->arg1);
+			if(OPRD_HASHKV == p->operand){
+				ASSERT_FAIL(bi->arg2 >= 0)
+				bi->keySlot = addKeySlot(prog, bi->sym, bi->arg2);
+			}
+		}
+
+	}
+	
+	/* Terminate the program */
+	bi = prog->code + addr;
+	bi->opcode = OP_END;
+	bi->jump = bi->arg1 = bi->arg2 = bi->sym = bi->keySlot = -1;
+	bi->lineNo = (ph->tail) ? ph->tail->lineNo : 0;
+	
+	/* Size the stack */
+	ASSERT_FAIL((prog->maxStack = stackDepth(prog)) >= 0)
+	
+	/* The pcode list is no longer required */
+	for(p = ph->head; p; p = next){
+		next = p->next;
+		p->magic = 0;
+		talloc_free(p);
+	}
+	ph->head = ph->tail = NULL;
+	
+	ParserAttachProgram(ph, prog);
+}
+
+/*
+ * Return TRUE if an instruction pushes a literal
+ */
+
+static Bool isLiteralPush(BCInstrPtr_t bi)
+{
+	return (OP_PUSH == bi->opcode) && (bi->arg1 >= 0) && 
+	((OPRD_STRINGLIT == bi->operand) || (OPRD_INTLIT == bi->operand) || (OPRD_FLOATLIT == bi->operand));
+}
+
+/*
+ * Return TRUE if an instruction pushes a hash key
+ */
+
+static Bool isHashKeyPush(BCInstrPtr_t bi)
+{
+	return (OP_PUSH == bi->opcode) && (OPRD_HASHKV == bi->operand) && (bi->arg1 >= 0) && (bi->arg2 >= 0);
+}
+
+/*
+ * Mark a range of instructions as dropped
+ *
+ * Arguments: 
+ *
+ * 1. Array of dropped flags, indexed by instruction address.
+ * 2. First address in the range.
+ * 3. Address after the last one in the range.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void dropRange(Bool *dropped, int first, int end)
+{
+	for(; first < end; first++){
+		dropped[first] = TRUE;
+	}
+}
+
+/*
+ * Fold tests between two literals, and drop the code which can never execute as a result.
+ * 
+ * A test which is always true is dropped with its operands, along with any else block.
+ * A test which is always false is dropped with its operands and the if block. Tests on 
+ * numeric operators with non-numeric literals are left alone, so they still fail at run time.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ * 2. Array of dropped flags, indexed by instruction address.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void foldTests(BCProgramPtr_t prog, Bool *dropped)
+{
+	BCInstrPtr_t bi, left, right, ifEnd;
+	ParseValuePtr_t lv, rv;
+	Bool testRes;
+	int t;
+	
+	for(t = 2; t < prog->codeLen; t++){
+		bi = prog->code + t;
+		left = bi - 2;
+		right = bi - 1;
+		if(dropped[t] || (OP_TEST2 != bi->opcode) || (bi->jump < 0) || !isLiteralPush(left) || !isLiteralPush(right)){
+			continue;
+		}
+		lv = prog->consts + left->arg1;
+		rv = prog->consts + right->arg1;
+		if((OPRT_STREQUALITY != bi->operand) && ((PVN_VALID != lv->numState) || (PVN_VALID != rv->numState))){
+			continue;
+		}
+		testRes = evalTest(bi->operand, lv->str, rv->str, lv->num, rv->num);
+		debug(DEBUG_ACTION, "Folded test on line %d, result: %d", bi->lineNo, testRes);
+		prog->optStats.testsFolded++;
+		
+		if(testRes){
+			dropRange(dropped, t - 2, t + 1);
+			/* 
+			 * With an else, the test jumps past the start of the else block, 
+			 * and the end of the if block jumps past the end of the else block.
+			 */
+			ifEnd = prog->code + bi->jump - 2;
+			if((OP_BLOCK == prog->code[bi->jump - 1].opcode) && (OPRB_BEGIN == prog->code[bi->jump - 1].operand) &&
+			(OP_BLOCK == ifEnd->opcode) && (ifEnd->jump >= bi->jump)){
+				dropRange(dropped, bi->jump - 2, ifEnd->jump);
+			}
+		}
+		else{
+			dropRange(dropped, t - 2, bi->jump);
+		}
+	}
+}
+
+/*
+ * Flag hash key lookups which repeat one earlier in the same basic block, so they share its result.
+ * 
+ * This matters for hashes which are not bound to key slots at run time, such as nvstate when 
+ * it is backed by the database. At run time, the result is invalidated when the key is assigned to
+ * or a function is called.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void mergeLookups(BCProgramPtr_t prog)
+{
+	BCInstrPtr_t bi;
+	Bool *leader, *assignDest;
+	int *first;
+	int i, j, stmtStart;
+	
+	MALLOC_FAIL(leader = talloc_zero_array(prog, Bool, prog->codeLen + 1))
+	MALLOC_FAIL(assignDest = talloc_zero_array(prog, Bool, prog->codeLen + 1))
+	MALLOC_FAIL(first = talloc_array(prog, int, prog->numKeySlots + 1))
+	
+	/* Basic blocks start at jump targets, and after instructions which can jump */
+	for(i = 0, stmtStart = 0; i < prog->codeLen; i++){
+		bi = prog->code + i;
+		if(bi->jump >= 0){
+			leader[bi->jump] = TRUE;
+			leader[i + 1] = TRUE;
+		}
+		if(OP_ASSIGN == bi->opcode){
+			assignDest[stmtStart] = TRUE; /* Written, not looked up */
+		}
+		/* The destination is the first push of the statement */
+		if((OP_PUSH != bi->opcode) && !IS_VALUE_OP(bi->opcode)){
+			stmtStart = i + 1;
+		}
+	}
+	
+	for(i = 0; i < prog->codeLen; i++){
+		bi = prog->code + i;
+		if((0 == i) || leader[i]){
+			for(j = 0; j < prog->numKeySlots; j++){
+				first[j] = -1;
+			}
+		}
+		if((OP_PUSH != bi->opcode) || (OPRD_HASHKV != bi->operand) || (bi->keySlot < 0) || assignDest[i]){
+			continue;
+		}
+		if(first[bi->keySlot] < 0){
+			first[bi->keySlot] = i;
+		}
+		else{
+			prog->code[first[bi->keySlot]].flags |= BIF_LOOKUP_FILL;
+			bi->flags |= BIF_LOOKUP_REUSE;
+			prog->optStats.lookupsMerged++;
+		}
+	}
+	
+	talloc_free(first);
+	talloc_free(assignDest);
+	talloc_free(leader);
+}
+
+/*
+ * Replace common push, push, operation sequences with superinstructions.
+ * 
+ * The superinstruction takes the place of the first push, and the pushes follow it
+ * as operand records. No instruction moves, so jump targets are unchanged. 
+ * Only whole statements are fused. Jumps never land inside a statement.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void fuseInstructions(BCProgramPtr_t prog)
+{
+	BCInstr_t fused;
+	BCInstrPtr_t a, b, c;
+	opType_t op;
+	int i;
+	Bool stmtStart;
+	
+	for(i = 0, stmtStart = TRUE; i + 1 < prog->codeLen; i++){
+		a = prog->code + i;
+		b = a + 1;
+		c = (i + 2 < prog->codeLen) ? a + 2 : NULL;
+		/* 
+		 * Must be at the start of a statement. The instruction before may be the last 
+		 * operand record of a statement just fused, so that is not looked at.
+		 */
+		if(!stmtStart || !isHashKeyPush(a)){
+			stmtStart = (OP_PUSH != a->opcode) && !IS_VALUE_OP(a->opcode);
+			continue;
+		}
+		stmtStart = FALSE;
+		
+		if(OP_EXISTS == b->opcode){
+			fused = *b;
+			fused.opcode = OP_EXISTS_HASHKEY;
+			*b = *a;
+			*a = fused;
+			prog->optStats.instrsFused++;
+			stmtStart = TRUE;
+			i += 1;
+			continue;
+		}
+		if(!c || (OP_PUSH != b->opcode)){
+			continue;
+		}
+		if((OP_TEST2 == c->opcode) && isLiteralPush(b)){
+			op = OP_TEST_HASHKEY_LITERAL;
+		}
+		else if((OP_ASSIGN == c->opcode) && isLiteralPush(b)){
+			op = OP_ASSIGN_LITERAL;
+		}
+		else if((OP_ASSIGN == c->opcode) && isHashKeyPush(b)){
+			op = OP_ASSIGN_HASH_TO_HASH;
+		}
+		else{
+			continue;
+		}
+		fused = *c;
+		fused.opcode = op;
+		*c = *b;
+		*b = *a;
+		*a = fused;
+		prog->optStats.instrsFused++;
+		stmtStart = TRUE;
+		i += 2;
+	}
+}
+
+/*
+ * Optimize a bytecode program. 
+ * 
+ * Tests between literals are folded, unreachable blocks are dropped, repeated 
+ * lookups of the same hash key within a basic block are merged, and common
+ * instruction sequences are fused into superinstructions. The results are 
+ * recorded in the program's optimizer statistics.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ * 2. OPT_ passes not to run, or 0 to run all of them.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserOptimize(BCProgramPtr_t prog, unsigned skipPasses)
+{
+	Bool *dropped;
+	int *newAddr;
+	int i, j;
+	BCInstrPtr_t bi;
+	
+	ASSERT_FAIL(prog)
+	ASSERT_FAIL(BP_MAGIC == prog->magic)
+	
+	prog->optStats.instrsIn = prog->codeLen;
+	
+	MALLOC_FAIL(dropped = talloc_zero_array(prog, Bool, prog->codeLen))
+	MALLOC_FAIL(newAddr = talloc_array(prog, int, prog->codeLen))
+	
+	if(!(skipPasses & OPT_FOLD)){
+		foldTests(prog, dropped);
+	}
+	
+	/* A dropped instruction's address becomes that of the next instruction kept */
+	for(i = 0, j = 0; i < prog->codeLen; i++){
+		newAddr[i] = j;
+		if(!dropped[i]){
+			j++;
+		}
+	}
+	/* The end instruction is never dropped, so every jump still has a target */
+	ASSERT_FAIL(!dropped[prog->codeLen - 1])
+	
+	for(i = 0, j = 0; i < prog->codeLen; i++){
+		if(dropped[i]){
+			continue;
+		}
+		bi = prog->code + i;
+		if(bi->jump >= 0){
+			bi->jump = newAddr[bi->jump];
+		}
+		prog->code[j++] = *bi;
+	}
+	prog->codeLen = j;
+	
+	talloc_free(newAddr);
+	talloc_free(dropped);
+	
+	if(!(skipPasses & OPT_MERGE)){
+		mergeLookups(prog);
+	}
+	if(!(skipPasses & OPT_FUSE)){
+		fuseInstructions(prog);
+	}
+	
+	/* Fewer pushes may be needed now */
+	ASSERT_FAIL((prog->maxStack = stackDepth(prog)) >= 0)
+	
+	/* Operand records of superinstructions are not counted, they are never executed */
+	prog->optStats.instrsOut = 0;
+	for(i = 0; i < prog->codeLen; i += 1 + fusedOperands(prog->code[i].opcode)){
+		prog->optStats.instrsOut++;
+	}
+	debug(DEBUG_ACTION, "Optimizer: %d instructions in, %d out, %d tests folded, %d lookups merged, %d superinstructions", 
+	prog->optStats.instrsIn, prog->optStats.instrsOut, prog->optStats.testsFolded, prog->optStats.lookupsMerged,
+	prog->optStats.instrsFused);
+}
+
+/*
+ * Serialize a bytecode program into an image which can be stored and loaded later
+ * with ParserLoadProgram.
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the image off of.
+ * 2. Pointer to the bytecode program.
+ * 3. Hash of the script source the program was compiled from.
+ * 4. Pointer to an integer to store the length of the image in bytes.
+ *
+ * Return value:
+ *
+ * Pointer to the image.
+ */
+
+void *ParserSerializeProgram(TALLOC_CTX *ctx, BCProgramPtr_t prog, unsigned srcHash, int *pLen)
+{
+	int32_t *w;
+	char *image, *s;
+	int i, words, len, strBytes;
+	BCInstrPtr_t bi;
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(prog)
+	ASSERT_FAIL(BP_MAGIC == prog->magic)
+	ASSERT_FAIL(pLen)
+	
+	for(i = 0, strBytes = 0; i < prog->numConsts; i++){
+		strBytes += strlen(prog->consts[i].str) + 1;
+	}
+	words = BI_HDR_WORDS + (prog->codeLen * BI_INSTR_WORDS) + prog->numSyms + (prog->numKeySlots * 2);
+	len = (words * sizeof(int32_t)) + strBytes;
+	MALLOC_FAIL(image = talloc_size(ctx, len))
+	
+	/* Header */
+	w = (int32_t *) image;
+	w[BIH_MAGIC] = BI_MAGIC;
+	w[BIH_VERSION] = BI_VERSION;
+	w[BIH_SRCHASH] = (int32_t) srcHash;
+	w[BIH_CODELEN] = prog->codeLen;
+	w[BIH_NUMCONSTS] = prog->numConsts;
+	w[BIH_MAXSTACK] = prog->maxStack;
+	w[BIH_NUMSYMS] = prog->numSyms;
+	w[BIH_NUMKEYSLOTS] = prog->numKeySlots;
+	w += BI_HDR_WORDS;
+	
+	/* Instructions */
+	for(i = 0; i < prog->codeLen; i++){
+		bi = prog->code + i;
+		*w++ = bi->opcode;
+		*w++ = bi->operand;
+		*w++ = bi->lineNo;
+		*w++ = bi->jump;
+		*w++ = bi->arg1;
+		*w++ = bi->arg2;
+		*w++ = bi->sym;
+		*w++ = bi->keySlot;
+		*w++ = bi->flags;
+	}
+	
+	/* Symbol and key slots */
+	for(i = 0; i < prog->numSyms; i++){
+		*w++ = prog->syms[i];
+	}
+	for(i = 0; i < prog->numKeySlots; i++){
+		*w++ = prog->keySlots[i].sym;
+		*w++ = prog->keySlots[i].key;
+	}
+	
+	/* Constant pool */
+	for(s = (char *) w, i = 0; i < prog->numConsts; i++){
+		strcpy(s, prog->consts[i].str);
+		s += strlen(s) + 1;
+	}
+	ASSERT_FAIL(s == image + len)
+	
+	*pLen = len;
+	return image;
+}
+
+/*
+ * Load a program from a serialized bytecode image into a pcode header block, 
+ * so it can be executed without parsing the script again. 
+ * 
+ * The image is checked against the format version and the hash of the script source,
+ * and every index in it is range checked, so a stale or damaged image is rejected 
+ * rather than executed. The caller should recompile the script when this fails.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header block.
+ * 2. Pointer to the image.
+ * 3. Length of the image in bytes.
+ * 4. Hash of the current script source.
+ *
+ * Return value:
+ *
+ * Boolean. PASS if the program was loaded, otherwise FAIL
+ */
+
+Bool ParserLoadProgram(PcodeHeaderPtr_t ph, const void *image, int len, unsigned srcHash)
+{
+	const int32_t *w = image;
+	const char *s, *end;
+	BCProgramPtr_t prog;
+	BCInstrPtr_t bi;
+	long long words;
+	size_t n;
+	int i;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(!ph->prog)
+	
+	if(!image || (len < (int) (BI_HDR_WORDS * sizeof(int32_t)))){
+		return FAIL;
+	}
+	if((BI_MAGIC != w[BIH_MAGIC]) || (BI_VERSION != w[BIH_VERSION]) || (srcHash != (unsigned) w[BIH_SRCHASH])){
+		debug(DEBUG_EXPECTED, "Bytecode image is from another version, or the script has changed");
+		return FAIL;
+	}
+	if((w[BIH_CODELEN] < 1) || (w[BIH_NUMCONSTS] < 0) || (w[BIH_MAXSTACK] < 0) || 
+	(w[BIH_MAXSTACK] > w[BIH_CODELEN]) || (w[BIH_NUMSYMS] < 0) || (w[BIH_NUMKEYSLOTS] < 0)){
+		goto bad;
+	}
+	words = BI_HDR_WORDS + ((long long) w[BIH_CODELEN] * BI_INSTR_WORDS) + w[BIH_NUMSYMS] + ((long long) w[BIH_NUMKEYSLOTS] * 2);
+	if(words * (long long) sizeof(int32_t) > len){
+		goto bad;
+	}
+	
+	MALLOC_FAIL(prog = talloc_zero(NULL, BCProgram_t))
+	prog->magic = BP_MAGIC;
+	prog->codeLen = w[BIH_CODELEN];
+	prog->numConsts = w[BIH_NUMCONSTS];
+	prog->maxStack = w[BIH_MAXSTACK];
+	prog->numSyms = w[BIH_NUMSYMS];
+	prog->numKeySlots = w[BIH_NUMKEYSLOTS];
+	MALLOC_FAIL(prog->code = talloc_zero_array(prog, BCInstr_t, prog->codeLen))
+	MALLOC_FAIL(prog->consts = talloc_zero_array(prog, ParseValue_t, prog->numConsts + 1))
+	MALLOC_FAIL(prog->syms = talloc_zero_array(prog, int, prog->numSyms + 1))
+	MALLOC_FAIL(prog->keySlots = talloc_zero_array(prog, BCKeySlot_t, prog->numKeySlots + 1))
+	w += BI_HDR_WORDS;
+	
+	for(i = 0; i < prog->codeLen; i++){
+		bi = prog->code + i;
+		bi->opcode = *w++;
+		bi->operand = *w++;
+		bi->lineNo = *w++;
+		bi->jump = *w++;
+		bi->arg1 = *w++;
+		bi->arg2 = *w++;
+		bi->sym = *w++;
+		bi->keySlot = *w++;
+		bi->flags = *w++;
+	}
+	for(i = 0; i < prog->numSyms; i++){
+		prog->syms[i] = *w++;
+		if((prog->syms[i] < 0) || (prog->syms[i] >= prog->numConsts)){
+			goto badProg;
+		}
+	}
+	for(i = 0; i < prog->numKeySlots; i++){
+		prog->keySlots[i].sym = *w++;
+		prog->keySlots[i].key = *w++;
+		if((prog->keySlots[i].sym < 0) || (prog->keySlots[i].sym >= prog->numSyms) ||
+		(prog->keySlots[i].key < 0) || (prog->keySlots[i].key >= prog->numConsts)){
+			goto badProg;
+		}
+	}
+	
+	/* Constant pool */
+	end = ((const char *) image) + len;
+	for(s = (const char *) w, i = 0; i < prog->numConsts; i++){
+		n = strnlen(s, end - s);
+		if(s + n == end){
+			goto badProg; /* Unterminated */
+		}
+		MALLOC_FAIL(prog->consts[i].str = talloc_strndup(prog->consts, s, n))
+		convertConst(prog->consts + i);
+		s += n + 1;
+	}
+	if(s != end){
+		goto badProg;
+	}
+	for(i = 0; i < prog->numKeySlots; i++){
+		prog->keySlots[i].hash = UtilHash(prog->consts[prog->keySlots[i].key].str);
+	}
+	
+	/* Range check the instructions */
+	for(i = 0; i < prog->codeLen; i++){
+		bi = prog->code + i;
+		if((bi->opcode < 0) || (bi->opcode >= OP_NUMOPS) ||
+		(bi->jump < -1) || (bi->jump >= prog->codeLen) ||
+		(bi->arg1 < -1) || (bi->arg1 >= prog->numConsts) ||
+		(bi->arg2 < -1) || (bi->arg2 >= prog->numConsts) ||
+		(bi->sym < -1) || (bi->sym >= prog->numSyms) ||
+		(bi->keySlot < -1) || (bi->keySlot >= prog->numKeySlots)){
+			goto badProg;
+		}
+		if((bi->keySlot >= 0) && (prog->keySlots[bi->keySlot].sym != bi->sym)){
+			goto badProg;
+		}
+		if(bi->flags && (bi->keySlot < 0)){
+			goto badProg;
+		}
+		if(IS_COND_BRANCH(bi->opcode) && (bi->jump < 0)){
+			goto badProg;
+		}
+		if(IS_VALUE_OP(bi->opcode) && ((bi->operand < valueOpArgs[bi->opcode].min) || 
+		(bi->operand > valueOpArgs[bi->opcode].max) || (bi->operand > prog->maxStack) || (bi->arg1 < 0))){
+			goto badProg;
+		}
+	}
+	/* Superinstructions must be followed by the operand records they use */
+	for(i = 0; i < prog->codeLen; i += 1 + fusedOperands(bi->opcode)){
+		bi = prog->code + i;
+		if(fusedOperands(bi->opcode) && (i + fusedOperands(bi->opcode) >= prog->codeLen - 1)){
+			goto badProg;
+		}
+		switch(bi->opcode){
+			case OP_TEST_HASHKEY_LITERAL:
+			case OP_ASSIGN_LITERAL:
+				if(!isHashKeyPush(bi + 1) || !isLiteralPush(bi + 2)){
+					goto badProg;
+				}
+				break;
+				
+			case OP_ASSIGN_HASH_TO_HASH:
+				if(!isHashKeyPush(bi + 1) || !isHashKeyPush(bi + 2)){
+					goto badProg;
+				}
+				break;
+				
+			case OP_EXISTS_HASHKEY:
+				if(!isHashKeyPush(bi + 1)){
+					goto badProg;
+				}
+				break;
+				
+			default:
+				break;
+		}
+	}
+	if(OP_END != prog->code[prog->codeLen - 1].opcode){
+		goto badProg;
+	}
+	/* The stack is sized from the header, so it must be what the code needs */
+	if(stackDepth(prog) != prog->maxStack){
+		goto badProg;
+	}
+	
+	ParserAttachProgram(ph, prog);
+	return PASS;
+
+badProg:
+	talloc_free(prog);
+bad:
+	debug(DEBUG_UNEXPECTED, "Bytecode image is damaged");
+	return FAIL;
+}
+
+/*
+ * Take a reference to a bytecode program.
+ *
+ * A program is not changed once it has been compiled and optimized, so one copy
+ * can be used by any number of pcode headers, on any number of threads. It is 
+ * freed when the last reference is released.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ *
+ * Return value:
+ *
+ * The program passed in
+ */
+
+BCProgramPtr_t ParserProgramRetain(BCProgramPtr_t prog)
+{
+	ASSERT_FAIL(prog)
+	ASSERT_FAIL(BP_MAGIC == prog->magic)
+	
+	__sync_add_and_fetch(&prog->refCount, 1);
+	return prog;
+}
+
+/*
+ * Release a reference to a bytecode program, and free it if it was the last one.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the bytecode program.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserProgramRelease(BCProgramPtr_t prog)
+{
+	ASSERT_FAIL(prog)
+	ASSERT_FAIL(BP_MAGIC == prog->magic)
+	
+	if(0 == __sync_sub_and_fetch(&prog->refCount, 1)){
+		prog->magic = 0;
+		talloc_free(prog);
+	}
+}
+
+/*
+ * Talloc destructor for a pcode header. Releases the program it was running.
+ */
+
+static int pcodeHeaderDestructor(PcodeHeaderPtr_t ph)
+{
+	if(ph->prog){
+		ParserProgramRelease(ph->prog);
+		ph->prog = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Attach a bytecode program to a pcode header so it can be executed.
+ *
+ * The pcode header holds all of the state for running the program: the hashes,
+ * the operand stack, the inline caches and the error state. A reference to the 
+ * program is taken, and released when the pcode header is freed.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to the pcode header block. Must not have a program already.
+ * 2. Pointer to the bytecode program.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void ParserAttachProgram(PcodeHeaderPtr_t ph, BCProgramPtr_t prog)
+{
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(!ph->prog)
+	
+	ph->prog = ParserProgramRetain(prog);
+	
+	/* Allocate the operand stack */
+	MALLOC_FAIL(ph->stack = talloc_zero_array(ph, BCInstrPtr_t, prog->maxStack + 1))
+	talloc_set_destructor(ph, pcodeHeaderDestructor);
+}
+
+	
+/*
+ * Execute a built-in function
+ * Sets Jumps for control statements.
+ * Called by the Lemon grammar file when a control statement is seen.
+ *
+ * Arguments: 
+ *
+ * 1. Pointer to parse control block
+ * 2. Token id.
+ *
+ *
+ * Return value:
+ *
+ * None.
+ */
+ 
+void ParserSetJumps(ParseCtrlPtr_t this, int tokenID)
+{
+	int myCBRC;
+	PcodeHeaderPtr_t ph;
+	PcodePtr_t tail, p, elseblock = NULL;
+	
+	ASSERT_FAIL((tokenID == TOK_ELSE) || (tokenID == TOK_IF))
+	
+	ASSERT_FAIL(this)
+	
+	ASSERT_FAIL(ph = this->pcodeHeader)
+	
+	ASSERT_FAIL(tail = ph->tail)
+	
+	/* Must be currently on a close block instr */
+	ASSERT_FAIL((tail->opcode == OP_BLOCK) && (tail->operand == OPRB_END))
+	
+	p = tail;
+	
+	ASSERT_FAIL(p) /* Previous instruction must exist */
+
+	myCBRC = p->ctrlStructRefCount;
+	
+	if(tokenID == TOK_ELSE){
+		debug(DEBUG_ACTION,"Set Jumps TOK_ELSE");
+		/* Skip back before the current block close instruction */
+		ASSERT_FAIL(p = p->prev)
+		/* Now, go back in the pcode and find the prior close block instr */
+		for(; (p) ; p = p->prev){
+			ASSERT_FAIL(p->ctrlStructRefCount >= myCBRC)
+			ASSERT_FAIL(p->magic == PC_MAGIC)
+			if((p->ctrlStructRefCount == myCBRC) && (p->opcode == OP_BLOCK) && (p->operand == OPRB_END)){
+				p->skip = tail; /* Install jump over second block */
+				elseblock = p->next; /* Note the beginning of the else block */
+				ASSERT_FAIL(elseblock)
+				debug(DEBUG_ACTION, "tail seq = %d, elseblock seq = %d", tail->seq, elseblock->seq);
+				break;
+			}
+		}
+		ASSERT_FAIL(p)
+	
+		
+	}
+	/* Look for test or exists instruction */		
+	for(; (p); p = p->prev){
+		ASSERT_FAIL(p->ctrlStructRefCount >= myCBRC);
+		if((p->ctrlStructRefCount == myCBRC) && ((p->opcode == OP_TEST2)||(p->opcode == OP_EXISTS))){
+			if(tokenID == TOK_IF){
+				debug(DEBUG_ACTION,"Set Jumps TOK_IF, line = %d, seq = %d, CBRC = %d", p->lineNo, p->seq, p->ctrlStructRefCount);
+				ASSERT_FAIL(tail)
+				p->skip = tail; /* Note end of block for if test */	
+			}
+			else{
+				ASSERT_FAIL(elseblock)
+				p->skip = elseblock; /* Note start of else block for if-else */
+			}
+			break;	
+		}
+	}
+	ASSERT_FAIL(p);	
+}
+
+/*
+* Execute a function.
+* Called by the Lemon grammar file when a function keyword is seen.
+*
+* Arguments: 
+*
+* 1. Pointer to the pcode header block.
+* 2. Pointer to the pcode instruction containing the function to execute.
+*
+*
+*
+* Return value:
+*
+* None
+*/
+ 
+void ParserExecFunction(PcodeHeaderPtr_t ph, BCInstrPtr_t pi)
+{
+
+	
+	ASSERT_FAIL(ph);
+	ASSERT_FAIL(pi);
+	
+	
+	debug(DEBUG_ACTION,"Executing function with token id: %d, number of args: %d", pi->operand, ph->sp);
+	
+	
+	switch(pi->operand){
+		case TOK_XPLCMD:
+			sendXPLCommand(ph, pi); 
+			break;
+			
+		case TOK_SPAWN:
+			spawn(ph, pi);
+			break;
+			
+		case TOK_EXPIRE:
+			expire(ph, pi);
+			break;
+		
+		default:
+			ASSERT_FAIL(FALSE);
+	}	
+}
+
+
+
+
+/*
+ * Set the result of a value instruction to a number
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the string form off of.
+ * 2. Pointer to the result.
+ * 3. The number.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void setNumResult(TALLOC_CTX *ctx, ParseValuePtr_t res, double num)
+{
+	if(0.0 == num){
+		num = 0.0; /* No negative zero */
+	}
+	MALLOC_FAIL(res->str = talloc_asprintf(ctx, "%.15g", num))
+	res->num = num;
+	res->numState = PVN_VALID;
+}
+
+/*
+ * Format the arguments passed to format, printf style.
+ *
+ * Only flags, a field width, a precision and the conversion character are accepted
+ * in a specification. The matching argument is converted to the type the conversion
+ * needs, so a script can't make the formatter read anything it wasn't passed.
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the pcode header block.
+ * 3. Pointer to the format instruction.
+ * 4. Argument values. The first is the format string.
+ * 5. Number of arguments.
+ *
+ * Return value:
+ *
+ * The formatted string, or NULL if there was an error. ph->failReason is set on error.
+ */
+
+static String formatValues(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t ip, ParseValuePtr_t *args, int argc)
+{
+	const char *f = args[0]->str;
+	const char *spec;
+	char conv[24];
+	String res;
+	size_t n, flags, width, prec;
+	double num;
+	int next = 1;
+	char c;
+	
+	MALLOC_FAIL(res = talloc_strdup(ctx, ""))
+	
+	while(*f){
+		if('%' != *f){ /* Literal text */
+			n = strcspn(f, "%");
+			MALLOC_FAIL(res = talloc_strndup_append(res, f, n))
+			f += n;
+			continue;
+		}
+		if('%' == f[1]){
+			MALLOC_FAIL(res = talloc_strdup_append(res, "%"))
+			f += 2;
+			continue;
+		}
+		
+		/* Parse the specification */
+		spec = f++;
+		f += (flags = strspn(f, "-+ 0#"));
+		f += (width = strspn(f, "0123456789"));
+		prec = 0;
+		if('.' == *f){
+			f++;
+			f += (prec = strspn(f, "0123456789"));
+		}
+		c = *f;
+		if((flags > 5) || (width > 3) || (prec > 3) || !c || !strchr("sdiuoxXfFeEgG", c)){
+			ph->failReason = talloc_asprintf(ph, "Bad format specification on line %d", ip->lineNo);
+			return NULL;
+		}
+		f++;
+		if(next >= argc){
+			ph->failReason = talloc_asprintf(ph, "Not enough arguments passed to format on line %d", ip->lineNo);
+			return NULL;
+		}
+		
+		/* Copy it, with a length modifier added to the integer conversions */
+		n = (f - 1) - spec;
+		memcpy(conv, spec, n);
+		if(strchr("diuoxX", c)){
+			conv[n++] = 'l';
+			conv[n++] = 'l';
+		}
+		conv[n++] = c;
+		conv[n] = '\0';
+		
+		if('s' == c){
+			MALLOC_FAIL(res = talloc_asprintf_append(res, conv, args[next++]->str))
+			continue;
+		}
+		if(FAIL == getValueNum(args[next++], &num)){
+			ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", ip->lineNo);
+			return NULL;
+		}
+		if(strchr("diuoxX", c) && !(fabs(num) < 9.2e18)){
+			ph->failReason = talloc_asprintf(ph, "Number out of range for format on line %d", ip->lineNo);
+			return NULL;
+		}
+		if(('d' == c) || ('i' == c)){
+			MALLOC_FAIL(res = talloc_asprintf_append(res, conv, (long long) num))
+		}
+		else if(strchr("uoxX", c)){
+			MALLOC_FAIL(res = talloc_asprintf_append(res, conv, (unsigned long long) (long long) num))
+		}
+		else{
+			MALLOC_FAIL(res = talloc_asprintf_append(res, conv, num))
+		}
+	}
+	return res;
+}
+
+/*
+ * Execute a value instruction.
+ *
+ * The instruction's arguments are replaced on the stack by the instruction itself,
+ * and the result is left in its temp.
+ *
+ * Arguments: 
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the pcode header block.
+ * 3. Pointer to the value instruction.
+ *
+ * Return value:
+ *
+ * None. ph->failReason is set on error. The result is undefined if an argument is.
+ */
+
+static void execValueOp(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t ip)
+{
+	BCProgramPtr_t prog = ph->prog;
+	BCInstrPtr_t *base;
+	ParseValue_t scratch[PARSER_MAX_ARGS];
+	ParseValuePtr_t args[PARSER_MAX_ARGS];
+	ParseValuePtr_t res;
+	double nums[PARSER_MAX_ARGS];
+	double len, start, end;
+	String str;
+	unsigned id;
+	int argc = ip->operand;
+	int i;
+	
+	ASSERT_FAIL((argc > 0) && (argc <= PARSER_MAX_ARGS) && (ph->sp >= argc))
+	base = ph->stack + ph->sp - argc;
+	res = ph->temps + (ip - prog->code);
+	res->str = NULL;
+	
+	for(i = 0; i < argc; i++){
+		if(!(args[i] = getValueRef(ctx, ph, base[i], scratch + i))){
+			undefOperand(ph, base[i], ip->lineNo);
+			goto out;
+		}
+	}
+	
+	for(i = 0; i < argc; i++){
+		if((!(valueOpArgs[ip->opcode].strArgs & (1U << i))) && (FAIL == getValueNum(args[i], nums + i))){
+			ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", ip->lineNo);
+			goto out;
+		}
+	}
+	
+	switch(ip->opcode){
+		case OP_ADD:
+			setNumResult(ctx, res, nums[0] + nums[1]);
+			break;
+			
+		case OP_SUB:
+			setNumResult(ctx, res, nums[0] - nums[1]);
+			break;
+			
+		case OP_MUL:
+			setNumResult(ctx, res, nums[0] * nums[1]);
+			break;
+			
+		case OP_DIV:
+			if(0.0 == nums[1]){
+				ph->failReason = talloc_asprintf(ph, "Division by zero on line %d", ip->lineNo);
+				break;
+			}
+			setNumResult(ctx, res, nums[0] / nums[1]);
+			break;
+			
+		case OP_NEG:
+			setNumResult(ctx, res, -nums[0]);
+			break;
+			
+		case OP_ABS:
+			setNumResult(ctx, res, fabs(nums[0]));
+			break;
+			
+		case OP_MIN:
+		case OP_MAX:
+			for(i = 1; i < argc; i++){
+				if((OP_MIN == ip->opcode) ? (nums[i] < nums[0]) : (nums[i] > nums[0])){
+					nums[0] = nums[i];
+				}
+			}
+			setNumResult(ctx, res, nums[0]);
+			break;
+			
+		case OP_ROUND: /* Optional second argument is the number of decimal places */
+			if((argc > 1) && ((nums[1] < 0) || (nums[1] > 15) || (nums[1] != floor(nums[1])))){
+				ph->failReason = talloc_asprintf(ph, "Number of places passed to round is not valid on line %d", 
+				ip->lineNo);
+				break;
+			}
+			start = pow(10.0, (argc > 1) ? nums[1] : 0);
+			setNumResult(ctx, res, round(nums[0] * start) / start);
+			break;
+			
+		case OP_CONCAT:
+			MALLOC_FAIL(str = talloc_strdup(ctx, args[0]->str))
+			for(i = 1; i < argc; i++){
+				MALLOC_FAIL(str = talloc_strdup_append(str, args[i]->str))
+			}
+			res->str = str;
+			res->numState = PVN_UNKNOWN;
+			break;
+			
+		case OP_FORMAT:
+			if((res->str = formatValues(ctx, ph, ip, args, argc))){
+				res->numState = PVN_UNKNOWN;
+			}
+			break;
+			
+		case OP_SUBSTR: /* Negative start and length count back from the end of the string */
+			if(!isfinite(nums[1]) || ((argc > 2) && !isfinite(nums[2]))){
+				ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", ip->lineNo);
+				break;
+			}
+			len = strlen(args[0]->str);
+			start = trunc(nums[1]);
+			start = (start < 0) ? start + len : start;
+			start = (start < 0) ? 0 : ((start > len) ? len : start);
+			end = (argc < 3) ? len : ((nums[2] < 0) ? len + trunc(nums[2]) : start + trunc(nums[2]));
+			end = (end < start) ? start : ((end > len) ? len : end);
+			MALLOC_FAIL(res->str = talloc_strndup(ctx, args[0]->str + (size_t) start, (size_t) (end - start)))
+			res->numState = PVN_UNKNOWN;
+			break;
+			
+		case OP_AFTER: /* Run a script later. The result is the id to cancel it with */
+			if((nums[0] < 0) || (nums[0] > UINT_MAX)){
+				ph->failReason = talloc_asprintf(ph, "Number of seconds passed to after is not valid on line %d", 
+				ip->lineNo);
+				break;
+			}
+			if(!ph->delayQ){ /* Dry run */
+				debug(DEBUG_EXPECTED, "Run script %s in %s seconds", args[1]->str, args[0]->str);
+				setNumResult(ctx, res, 0);
+			}
+			else if(!(id = DelayQAdd(ph->delayQ, (unsigned) nums[0], args[1]->str))){
+				ph->failReason = talloc_asprintf(ph, "Too many delayed actions pending on line %d", ip->lineNo);
+			}
+			else{
+				setNumResult(ctx, res, id);
+			}
+			break;
+			
+		case OP_CANCEL: /* The result is 1 if the action was pending, else 0 */
+			id = ((nums[0] > 0) && (nums[0] <= UINT_MAX)) ? (unsigned) nums[0] : 0;
+			setNumResult(ctx, res, (ph->delayQ && id && (PASS == DelayQCancel(ph->delayQ, id))) ? 1 : 0);
+			break;
+			
+		case OP_WAITFOR: /* Wait for a message. The result is 1 if one came, or 0 on timeout */
+			if((nums[2] < 0) || (nums[2] > UINT_MAX)){
+				ph->failReason = talloc_asprintf(ph, "Timeout passed to waitfor is not valid on line %d", 
+				ip->lineNo);
+				break;
+			}
+			if(!ph->xplServicePtr){ /* Dry run */
+				debug(DEBUG_EXPECTED, "Wait for %s from %s for %s seconds", args[1]->str, args[0]->str, args[2]->str);
+				setNumResult(ctx, res, 0);
+			}
+			else if(!ph->waitHandler){
+				ph->failReason = talloc_asprintf(ph, "waitfor can't be used in this script on line %d", ip->lineNo);
+			}
+			else if(FAIL == (*ph->waitHandler)(ph, args[0]->str, args[1]->str, (unsigned) nums[2])){
+				ph->failReason = talloc_asprintf(ph, "Too many scripts waiting on line %d", ip->lineNo);
 			}
-		}
-		return PASS;
-	}	
+			else{
+				ph->suspended = TRUE; /* The result is set when resumed */
+			}
+			break;
+			
+		default:
+			ASSERT_FAIL(0)
+	}
+	
+out:
+	ph->sp -= argc - 1;
+	ph->stack[ph->sp - 1] = ip;
 }
 
 /*
- * Walk the list calling a callback function with each key/value
+ * Assign a value to a hash key
  *
  * Arguments: 
  *
- * 1. Pointer to the pcode header block.
- * 2. String containing the hash name
- * 3. Callback function (see below)
- * 
- *
- *
- * Return value:
- *
- * None
- *
- ************** Callback Function ***************
- *
- * Arguments:
- *
- * 1. Key found as a String
- * 2. Value found as a String
+ * 1. Talloc context for temporary allocations.
+ * 2. Pointer to the pcode header block.
+ * 3. Pointer to the instruction pushing the destination hash key.
+ * 4. Pointer to the value to assign.
+ * 5. Line number for error messages.
  *
  * Return value:
  *
- * None
+ * None. ph->failReason is set on error.
  */
- 
-void ParserHashWalk(PcodeHeaderPtr_t ph, const String name, void (*parseHashWalkCallback)(const String key, const String value))
+
+static void assignValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t dest, ParseValuePtr_t v, int lineNo)
 {
 	ParseHashKVPtr_t ke;
-	ParseHashSTEPtr_t h;
-	
-	ASSERT_FAIL(ph)
-	ASSERT_FAIL(name)
-	/* NULL function pointer is fatal */
-	ASSERT_FAIL(parseHashWalkCallback)
+	numState_t numState = v->numState;
+	double num = v->num;
+	
+	if((ke = icLookup(ph, dest, TRUE))){
+		/* Bound destination. Carry any numeric form already known over to it */
+		setKeyValue(ph->symtab[dest->sym], ke, v->str);
+		ke->val.numState = numState;
+		ke->val.num = num;
+	}
+	else{
+		if(ParserPcodePutValue(ctx, ph, dest, v->str)){
+			undefVar(ph, BC_CONST(ph->prog, dest->arg1), lineNo);
+			return;
+		}
+		if(dest->keySlot >= 0){
+			ph->lookupCache[dest->keySlot] = NULL; /* A merged lookup of it is now stale */
+		}
+	}
+	debug(DEBUG_ACTION,"Assign successful on line %d", lineNo);
+}
+
+/*
+ * Return the monotonic clock in milliseconds
+ */
 
-	h = findHash(ph, name, NULL);
+static unsigned long budgetNow(void)
+{
+	struct timespec ts;
 	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long) ts.tv_sec * 1000UL) + ((unsigned long) ts.tv_nsec / 1000000UL);
+}
+
+/*
+ * Set the instruction count the budgets are next checked at. The clock is only read 
+ * every BUDGET_CLOCK_INSTRS instructions, and not at all if there is no time limit.
+ */
 
+static void budgetSetCheck(PcodeHeaderPtr_t ph)
+{
+	unsigned long next = ULONG_MAX;
 	
-		
-	for(ke = h->head; (ke); ke = ke->next){ /* Traverse key list */
-		ASSERT_FAIL(KE_MAGIC == ke->magic)
-		(*parseHashWalkCallback)(ke->key, ke->value);
+	if(ph->maxMS){
+		next = ph->instrCount + BUDGET_CLOCK_INSTRS;
 	}
-	
+	if((ph->maxInstrs) && (ph->instrLimit < next)){
+		next = ph->instrLimit;
+	}
+	ph->budgetCheck = next;
 }
 
-
 /*
- * Return the value for the push instruction passed in
+ * Start the budgets for a run of the bytecode
  *
  * Arguments: 
  *
- * 1. Talloc context to hang the result off of.
- * 2. Pointer to the pcode header block.
- * 3. Pointer to the push instruction to extract the value from.
- * 4. Pointer to string to store value.
- *
+ * 1. Pointer to the pcode header block.
+ * 2. TRUE for a new execution, FALSE when resuming one. The instruction budget
+ *    carries over a wait. The time budget starts again, as waiting isn't running.
  *
  * Return value:
  *
- * Boolean. PASS if variable could be retrieved, else FAIL
+ * None
  */
- 
 
-Bool ParserPcodeGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, PcodePtr_t instr, String *pValue)
+static void budgetStart(PcodeHeaderPtr_t ph, Bool fresh)
 {
-	String value = NULL;
-	
-	ASSERT_FAIL(ph);
-	ASSERT_FAIL(instr)
-	ASSERT_FAIL(pValue)
-	
-	/* Do something based on the operand */
-	switch(instr->operand){
-		
-		case OPRD_STRINGLIT: /* Literals */
-		case OPRD_INTLIT:
-		case OPRD_FLOATLIT:
-			value = instr->data1;
-			break;
-			
-		case OPRD_HASHKV:  /* Assoc array key/value */
-			value = ParserHashGetValue(ctx, ph, instr->data1, instr->data2);
-			break;
-			
-		case OPRD_HASHREF: /* Hash reference */
-			value = instr->data1;
-			break;
-			
-		default:
-			ASSERT_FAIL(0)
+	if(fresh){
+		ph->overrun = FALSE;
+		ph->instrLimit = (ph->maxInstrs > ULONG_MAX - ph->instrCount) ? ULONG_MAX : ph->instrCount + ph->maxInstrs;
 	}
-	if(!value)
-		return FAIL;
-	else{
-		*pValue = value;
-		return PASS;
+	if(ph->maxMS){
+		ph->deadline = budgetNow() + ph->maxMS;
 	}
+	budgetSetCheck(ph);
 }
 
 /*
- * Put a value in a variable
+ * Check the budgets. Called from the dispatch loop when the instruction count reaches ph->budgetCheck.
  *
  * Arguments: 
  *
- * 1. Talloc context to hang the result off of.
- * 2. Pointer to the pcode header block.
- * 3. Pointer to the push instruction contining the lvalue.
- * 4. String containing the value to add to the hash
- *
+ * 1. Pointer to the pcode header block.
+ * 2. Pointer to the instruction about to be executed.
  *
  * Return value:
  *
- * Boolean. PASS if success, otherwise FAIL
+ * None. ph->failReason and ph->overrun are set if a budget is used up.
  */
 
-Bool ParserPcodePutValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, PcodePtr_t instr, String value)
+static void budgetCheck(PcodeHeaderPtr_t ph, BCInstrPtr_t ip)
 {
-	ASSERT_FAIL(ph)
-	ASSERT_FAIL(instr)
-	ASSERT_FAIL(value)
-	
-	if(instr->operand != OPRD_HASHKV){
-		return FAIL;
+	if((ph->maxInstrs) && (ph->instrCount >= ph->instrLimit)){
+		ph->failReason = talloc_asprintf(ph, "Instruction limit of %lu reached on line %d", ph->maxInstrs, ip->lineNo);
+		ph->overrun = TRUE;
+	}
+	else if((ph->maxMS) && (budgetNow() >= ph->deadline)){
+		ph->failReason = talloc_asprintf(ph, "Time limit of %u ms reached on line %d", ph->maxMS, ip->lineNo);
+		ph->overrun = TRUE;
 	}
+	else{
+		budgetSetCheck(ph);
+	}
+}
+
+/*
+ * Return the monotonic clock in nanoseconds
+ */
+
+static unsigned long long profileNow(void)
+{
+	struct timespec ts;
 	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long) ts.tv_sec * 1000000000ULL) + (unsigned long long) ts.tv_nsec;
+}
+
+/*
+ * Free the counts and release the program when a profile is freed
+ */
 
-	return ParserHashAddKeyValue(ctx, ph, instr->data1, instr->data2, value);
+static int profileDestructor(profilePtr_t pf)
+{
+	if(pf->prog){
+		ParserProgramRelease(pf->prog);
+	}
+	pf->magic = 0;
+	return 0;
 }
 
 /*
- * This is called by the parser when a pcode structure has to be added to the list. It adds
- * the new instruction to the end of the instruction list.
+ * Create an execution profile. Attach it to pcode headers with ph->profile to profile
+ * their executions. It can be shared by the executions of a script, one at a time.
  *
- *  Arguments: 
+ * Arguments: 
  *
- * 1. Pointer to parse control block
- * 2. Opcode type
- * 3. Operand
- * 4. Optional string 1 (Pass NULL if not used)
- * 5. Optional string 2 (Pass NULL if not used)
+ * 1. Talloc context to hang the profile off of.
+ *
+ * Return value:
+ *
+ * Generic pointer to the profile.
+ */
+
+void *ParserProfileNew(TALLOC_CTX *ctx)
+{
+	profilePtr_t pf;
+	
+	MALLOC_FAIL(pf = talloc_zero(ctx, profile_t))
+	pf->last = -1;
+	pf->magic = PF_MAGIC;
+	talloc_set_destructor(pf, profileDestructor);
+	return pf;
+}
+
+/*
+ * Start profiling a run of the bytecode. The counts start again if the program has changed.
+ *
+ * Arguments: 
  *
+ * 1. Pointer to the profile.
+ * 2. Pointer to the program about to run.
+ * 3. TRUE for a new execution, FALSE when resuming one.
  *
  * Return value:
  *
  * None
  */
 
-void ParserPcodeEmit(ParseCtrlPtr_t pc, opType_t op, int operand, String data1, String data2)
+static void profileStart(profilePtr_t pf, BCProgramPtr_t prog, Bool fresh)
 {
-	PcodeHeaderPtr_t ph;
-	PcodePtr_t new;
-	
-	ASSERT_FAIL(pc)
-	
-	ph = pc->pcodeHeader;
-	
-	if(ph){
-		
-		new = talloc_zero(ph, Pcode_t);
-		ASSERT_FAIL(new);
-		
-		/* Initialize new list entry */
-		new->magic = PC_MAGIC;
-		new->opcode = op;
-		new->operand = operand;
-		new->lineNo = pc->lineNo;
-		new->seq = ph->seq++;
-		new->ctrlStructRefCount = ph->ctrlStructRefCount;
-		
-		if(data1){
-			/* Make a copy of the string */
-			new->data1 = talloc_strdup(new, data1);
-			MALLOC_FAIL(new->data1);
-		}
-		if(data2){
-			/* Make a copy of the string */
-			new->data2 = talloc_strdup(new, data2);
-			MALLOC_FAIL(new->data2);
-		}
-		
-		if(!ph->head){
-			/* First entry */
-			ph->head = ph->tail = new;
-			return;
-		}
-		else{
-			/* Subsequent entry */
-			ph->tail->next = new;
-			new->prev = ph->tail;
-			ph->tail = new; 
+	ASSERT_FAIL(PF_MAGIC == pf->magic)
+	
+	if(pf->prog != prog){
+		if(pf->prog){
+			ParserProgramRelease(pf->prog);
+			talloc_free(pf->counts);
+			talloc_free(pf->ns);
+			talloc_free(pf->taken);
+			talloc_free(pf->skipped);
 		}
+		pf->prog = ParserProgramRetain(prog);
+		pf->runs = 0;
+		MALLOC_FAIL(pf->counts = talloc_zero_array(pf, unsigned long, prog->codeLen))
+		MALLOC_FAIL(pf->ns = talloc_zero_array(pf, unsigned long long, prog->codeLen))
+		MALLOC_FAIL(pf->taken = talloc_zero_array(pf, unsigned long, prog->codeLen))
+		MALLOC_FAIL(pf->skipped = talloc_zero_array(pf, unsigned long, prog->codeLen))
+	}
+	if(fresh){
+		pf->runs++;
 	}
+	pf->last = -1;
 }
 
 /*
- * Debug function.
- * 
- * Dump pcode list
+ * Stop timing the instruction running. Done when the bytecode stops running, so the time
+ * a script spends waiting isn't counted.
+ */
+
+static void profileStop(profilePtr_t pf)
+{
+	if(pf->last >= 0){
+		pf->ns[pf->last] += profileNow() - pf->lastNS;
+		pf->last = -1;
+	}
+}
+
+/*
+ * Count the dispatch of an instruction. The instruction dispatched before it is charged
+ * the time in between, and if it was a test, which way it went.
  *
  * Arguments: 
  *
- * 1. Pointer to the pcode header block.
+ * 1. Pointer to the profile.
+ * 2. Address of the instruction dispatched.
  *
  * Return value:
  *
  * None
  */
 
-void ParserPcodeDumpList(PcodeHeaderPtr_t ph)
+static void profileRecord(profilePtr_t pf, int addr)
 {
-
-	PcodePtr_t p;
-	int count;
-	
-	if(!ph)
-		return;
-	debug(DEBUG_EXPECTED, "*** begin p-code dump ***");
-	for(count = 0, p = ph->head; p; p = p->next, count++){
-		printOpcode(p);
+	unsigned long long now = profileNow();
+	BCInstrPtr_t prev;
+	
+	if(pf->last >= 0){
+		pf->ns[pf->last] += now - pf->lastNS;
+		prev = pf->prog->code + pf->last;
+		if(IS_COND_BRANCH(prev->opcode) && (prev->jump >= 0)){
+			if(addr == prev->jump){
+				pf->skipped[pf->last]++;
+			}
+			else{
+				pf->taken[pf->last]++;
+			}
+		}
 	}
-	debug(DEBUG_EXPECTED, "*** end p-code dump ***");
-	
+	pf->counts[addr]++;
+	pf->last = addr;
+	pf->lastNS = now;
 }
 
-	
 /*
- * Execute a built-in function
- * Sets Jumps for control statements.
- * Called by the Lemon grammar file when a control statement is seen.
+ * Make an annotated listing of a profile. Each source line is shown with the number of times
+ * it was run and the time spent on it, followed by its instructions, and for each test, how
+ * many times its block was run and how many times it was skipped.
  *
  * Arguments: 
  *
- * 1. Pointer to parse control block
- * 2. Token id.
- *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the profile.
+ * 3. Source the program was compiled from, or NULL if not available.
  *
  * Return value:
  *
- * None.
+ * The listing as a string.
  */
- 
-void ParserSetJumps(ParseCtrlPtr_t this, int tokenID)
+
+String ParserProfileListing(TALLOC_CTX *ctx, void *profile, const String source)
 {
-	int myCBRC;
-	PcodeHeaderPtr_t ph;
-	PcodePtr_t tail, p, elseblock = NULL;
-	
-	ASSERT_FAIL((tokenID == TOK_ELSE) || (tokenID == TOK_IF))
-	
-	ASSERT_FAIL(this)
-	
-	ASSERT_FAIL(ph = this->pcodeHeader)
-	
-	ASSERT_FAIL(tail = ph->tail)
-	
-	/* Must be currently on a close block instr */
-	ASSERT_FAIL((tail->opcode == OP_BLOCK) && (tail->operand == OPRB_END))
-	
-	p = tail;
+	profilePtr_t pf = profile;
+	BCProgramPtr_t prog;
+	BCInstrPtr_t p;
+	String listing, text, instr;
+	const char *line, *eol;
+	unsigned long count;
+	unsigned long long ns;
+	int addr, lineNo, maxLine, len;
+	
+	ASSERT_FAIL(pf)
+	ASSERT_FAIL(PF_MAGIC == pf->magic)
+	
+	if(!(prog = pf->prog)){
+		MALLOC_FAIL(listing = talloc_strdup(ctx, "No executions profiled\n"))
+		return listing;
+	}
 	
-	ASSERT_FAIL(p) /* Previous instruction must exist */
-
-	myCBRC = p->ctrlStructRefCount;
+	MALLOC_FAIL(listing = talloc_asprintf(ctx, "Executions: %lu\n%6s %10s %12s  %s\n", pf->runs, 
+	"Line", "Count", "Time (us)", "Source"))
 	
-	if(tokenID == TOK_ELSE){
-		debug(DEBUG_ACTION,"Set Jumps TOK_ELSE");
-		/* Skip back before the current block close instruction */
-		ASSERT_FAIL(p = p->prev)
-		/* Now, go back in the pcode and find the prior close block instr */
-		for(; (p) ; p = p->prev){
-			ASSERT_FAIL(p->ctrlStructRefCount >= myCBRC)
-			ASSERT_FAIL(p->magic == PC_MAGIC)
-			if((p->ctrlStructRefCount == myCBRC) && (p->opcode == OP_BLOCK) && (p->operand == OPRB_END)){
-				p->skip = tail; /* Install jump over second block */
-				elseblock = p->next; /* Note the beginning of the else block */
-				ASSERT_FAIL(elseblock)
-				debug(DEBUG_ACTION, "tail seq = %d, elseblock seq = %d", tail->seq, elseblock->seq);
-				break;
-			}
+	for(addr = 0, maxLine = 0; addr < prog->codeLen; addr++){
+		if(prog->code[addr].lineNo > maxLine){
+			maxLine = prog->code[addr].lineNo;
 		}
-		ASSERT_FAIL(p)
+	}
 	
+	/* Line numbers start at 1 */
+	for(lineNo = 0, line = source; lineNo <= maxLine; lineNo++){
+		/* Find the source text of the line */
+		text = NULL;
+		len = 0;
+		if((lineNo > 0) && line && *line){
+			eol = strchr(line, '\n');
+			len = eol ? (int) (eol - line) : (int) strlen(line);
+			text = (String) line;
+			line = eol ? eol + 1 : NULL;
+		}
 		
-	}
-	/* Look for test or exists instruction */		
-	for(; (p); p = p->prev){
-		ASSERT_FAIL(p->ctrlStructRefCount >= myCBRC);
-		if((p->ctrlStructRefCount == myCBRC) && ((p->opcode == OP_TEST2)||(p->opcode == OP_EXISTS))){
-			if(tokenID == TOK_IF){
-				debug(DEBUG_ACTION,"Set Jumps TOK_IF, line = %d, seq = %d, CBRC = %d", p->lineNo, p->seq, p->ctrlStructRefCount);
-				ASSERT_FAIL(tail)
-				p->skip = tail; /* Note end of block for if test */	
+		/* A line was run as many times as its most run instruction */
+		for(addr = 0, count = 0, ns = 0; addr < prog->codeLen; addr++){
+			if(prog->code[addr].lineNo == lineNo){
+				count = (pf->counts[addr] > count) ? pf->counts[addr] : count;
+				ns += pf->ns[addr];
+			}
+		}
+		if((!text) && (!count)){
+			continue;
+		}
+		MALLOC_FAIL(listing = talloc_asprintf_append(listing, "%6d %10lu %12.1f  %.*s\n", lineNo, count, 
+		ns / 1000.0, len, text ? text : ""))
+			
+		for(addr = 0; addr < prog->codeLen; addr++){
+			p = prog->code + addr;
+			if((p->lineNo != lineNo) || (!pf->counts[addr])){
+				continue;
+			}
+			instr = formatInstr(NULL, prog, addr);
+			if(IS_COND_BRANCH(p->opcode) && (p->jump >= 0)){
+				MALLOC_FAIL(listing = talloc_asprintf_append(listing, "%30s%s (%lu run, taken %lu, not taken %lu)\n", "",
+				instr, pf->counts[addr], pf->taken[addr], pf->skipped[addr]))
 			}
 			else{
-				ASSERT_FAIL(elseblock)
-				p->skip = elseblock; /* Note start of else block for if-else */
+				MALLOC_FAIL(listing = talloc_asprintf_append(listing, "%30s%s (%lu run)\n", "", instr, pf->counts[addr]))
 			}
-			break;	
+			talloc_free(instr);
 		}
 	}
-	ASSERT_FAIL(p);	
+	return listing;
 }
 
 /*
-* Execute a function.
-* Called by the Lemon grammar file when a function keyword is seen.
+ * Trace and profile an instruction as it is dispatched. Only called when tracing or profiling.
+ */
+
+static void vmHook(PcodeHeaderPtr_t ph, int addr)
+{
+	if(ph->tracePcode){
+		printInstr(ph->prog, addr);
+	}
+	if(ph->profile){
+		profileRecord(ph->profile, addr);
+	}
+}
+
+/*
+ * Bytecode dispatch. Each handler jumps straight to the handler for the next instruction
+ * using the GCC labels as values extension.
+ */
+
+#define VM_DISPATCH() do { \
+	if(ph->failReason) goto done; \
+	if(ph->instrCount >= ph->budgetCheck) goto budget; \
+	ph->instrCount++; \
+	if(slowPath) vmHook(ph, ip - code); \
+	goto *dispatchTable[ip->opcode]; \
+} while(0)
+
+/* Continue with the next instruction */
+#define VM_NEXT() do { ip++; VM_DISPATCH(); } while(0)
+
+/* Continue after the operand records of a superinstruction */
+#define VM_SKIP(n) do { ip += (n) + 1; VM_DISPATCH(); } while(0)
+
+/* Continue at the branch target of the current instruction */
+#define VM_JUMP() do { ASSERT_FAIL(ip->jump >= 0) ip = code + ip->jump; VM_DISPATCH(); } while(0)
+
+
+/*
+* Run the bytecode from the start, or from where a script waiting in waitfor() left off.
 *
 * Arguments: 
 *
 * 1. Pointer to the pcode header block.
-* 2. Pointer to the pcode instruction containing the function to execute.
-*
+* 2. Address to resume at, or -1 to start a new execution.
 *
 *
 * Return value:
 *
-* None
+* Boolean. PASS indicates success, otherwise FAIL. PASS is also returned when the script
+* suspends itself in waitfor(), with ph->suspended set.
+*
 */
  
-void ParserExecFunction(PcodeHeaderPtr_t ph, PcodePtr_t pi)
+static Bool runPcode(PcodeHeaderPtr_t ph, int resumeAddr)
 {
+	static void *dispatchTable[OP_NUMOPS] = {
+		[OP_NOP] = &&op_nop,
+		[OP_PUSH] = &&op_push,
+		[OP_ASSIGN] = &&op_assign,
+		[OP_FUNC] = &&op_func,
+		[OP_BLOCK] = &&op_block,
+		[OP_IF] = &&op_bad,
+		[OP_TEST2] = &&op_test2,
+		[OP_EXISTS] = &&op_exists,
+		[OP_ADD ... OP_WAITFOR] = &&op_value,
+		[OP_END] = &&done,
+		[OP_TEST_HASHKEY_LITERAL] = &&op_test_hashkey_literal,
+		[OP_ASSIGN_LITERAL] = &&op_assign_literal,
+		[OP_ASSIGN_HASH_TO_HASH] = &&op_assign_literal, /* Same operands, only the source differs */
+		[OP_EXISTS_HASHKEY] = &&op_exists_hashkey
+	};
+	BCProgramPtr_t prog;
+	BCInstrPtr_t code, ip, p;
+	ParseHashSTEPtr_t h;
+	String value;
+	ParseValue_t lscratch, rscratch;
+	ParseValuePtr_t lv, rv;
+	double leftNum, rightNum;
+	Bool testRes = FALSE;
+	TALLOC_CTX *ctx;
+	int res = PASS;
+	Bool slowPath;
 
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(prog = ph->prog)
+	ASSERT_FAIL(BP_MAGIC == prog->magic)
 	
-	ASSERT_FAIL(ph);
-	ASSERT_FAIL(pi);
+	slowPath = (ph->tracePcode || ph->profile); /* Call vmHook on each dispatch */
 	
+	code = prog->code;
+	if(resumeAddr < 0){
+		ASSERT_FAIL(ctx = talloc_new(getArena(ph)))
+		ip = code;
+		ph->sp = 0;
 	
-	debug(DEBUG_ACTION,"Executing function with token id: %d, number of args: %d", pi->operand, ph->pushCount);
+		/* Bind the symbol and key slots on first execution */
+		if(!ph->symtab){
+			bindSlots(ph);
+		}
+		ph->execCtx = ctx;
+	}
+	else{
+		/* The stack and scratch memory are as they were when the script suspended */
+		ASSERT_FAIL((ctx = ph->execCtx) && (resumeAddr < prog->codeLen))
+		ip = code + resumeAddr;
+	}
+	budgetStart(ph, (resumeAddr < 0));
+	if(ph->profile){
+		profileStart(ph->profile, prog, (resumeAddr < 0));
+	}
 	
+	/* Merged lookup results only last until the script stops running */
+	memset(ph->lookupCache, 0, prog->numKeySlots * sizeof(String));
 	
-	switch(pi->operand){
-		case TOK_XPLCMD:
-			sendXPLCommand(ph, pi); 
-			break;
-			
-		case TOK_SPAWN:
-			spawn(ph, pi);
-			break;
-		
-		default:
-			ASSERT_FAIL(FALSE);
+	/* Execution loop */
+	VM_DISPATCH();
+	
+op_nop:
+	ph->sp = 0;
+	VM_NEXT();
+	
+op_block:
+	ph->sp = 0;
+	if((ip->operand == OPRB_END) && (ip->jump >= 0)){
+		debug(DEBUG_ACTION, "Else Block skip");
+		VM_JUMP(); /* Skip over next block */
+	}
+	VM_NEXT();
+	
+op_push:
+	ASSERT_FAIL(ph->sp < prog->maxStack)
+	ph->stack[ph->sp++] = ip;
+	VM_NEXT();
+	
+op_assign: /* Assignment */
+	ASSERT_FAIL(ph->sp == 2)
+	ph->sp = 0;
+	p = ph->stack[1];
+	if(!(lv = getValueRef(ctx, ph, p, &lscratch))){
+		undefOperand(ph, p, ip->lineNo);
+		VM_NEXT();
+	}
+	assignValue(ctx, ph, ph->stack[0], lv, ip->lineNo);
+	VM_NEXT();
+	
+op_assign_literal: /* Assignment with the destination and source as operand records */
+	if(!(lv = getValueRef(ctx, ph, ip + 2, &lscratch))){
+		undefVar(ph, BC_CONST(prog, ip[2].arg1), ip->lineNo); 
+		VM_SKIP(2);
+	}
+	assignValue(ctx, ph, ip + 1, lv, ip->lineNo);
+	VM_SKIP(2);
+	
+op_test2: /* Double Variable test */
+	ASSERT_FAIL(ph->sp == 2)
+	ph->sp = 0;
+	leftNum = rightNum = 0.0;
+	p = ph->stack[0];
+	if(!(lv = getValueRef(ctx, ph, p, &lscratch))){ /* Left */
+		undefOperand(ph, p, ip->lineNo);
+		VM_NEXT();
+	}
+	debug(DEBUG_ACTION,"Left string: %s", lv->str);				
+	if((ip->operand != OPRT_STREQUALITY) && (FAIL == getValueNum(lv, &leftNum))){
+		ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", ip->lineNo);
+		VM_NEXT();
+	}
+	p = ph->stack[1];
+	if(!(rv = getValueRef(ctx, ph, p, &rscratch))){ /* Right */
+		undefOperand(ph, p, ip->lineNo);
+		VM_NEXT();
 	}	
+	debug(DEBUG_ACTION,"Right string: %s", rv->str);					
+	if((ip->operand != OPRT_STREQUALITY) && (FAIL == getValueNum(rv, &rightNum))){
+		ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", ip->lineNo);
+		VM_NEXT();
+	}
+	debug(DEBUG_ACTION,"leftNum = %e, rightNum = %e", leftNum, rightNum);
+	
+	testRes = evalTest(ip->operand, lv->str, rv->str, leftNum, rightNum);
+	debug(DEBUG_ACTION, "Test result: %d", testRes);
+	if(!testRes){
+		debug(DEBUG_ACTION,"Test Skip");
+		VM_JUMP();
+	}
+	VM_NEXT();
+	
+op_test_hashkey_literal: /* Test of a hash key against a literal, both as operand records */
+	leftNum = rightNum = 0.0;
+	if(!(lv = getValueRef(ctx, ph, ip + 1, &lscratch))){
+		undefVar(ph, BC_CONST(prog, ip[1].arg1), ip->lineNo); 
+		VM_SKIP(2);
+	}
+	rv = prog->consts + ip[2].arg1;
+	if((ip->operand != OPRT_STREQUALITY) && 
+	((FAIL == getValueNum(lv, &leftNum)) || (FAIL == getValueNum(rv, &rightNum)))){
+		ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", ip->lineNo);
+		VM_SKIP(2);
+	}
+	testRes = evalTest(ip->operand, lv->str, rv->str, leftNum, rightNum);
+	debug(DEBUG_ACTION, "Test result: %d", testRes);
+	if(!testRes){
+		debug(DEBUG_ACTION,"Test Skip");
+		VM_JUMP();
+	}
+	VM_SKIP(2);
+	
+op_exists_hashkey: /* Hash key exists, with the key as an operand record */
+	if(ParserPcodeGetValue(ctx, ph, ip + 1, &value) == FAIL){
+		debug(DEBUG_ACTION,"Key does not exist");
+		VM_JUMP(); /* Not present */
+	}
+	debug(DEBUG_ACTION,"Key exists");
+	VM_SKIP(1);
+	
+op_exists: /* Hash key exists */
+	ASSERT_FAIL(ph->sp == 1)
+	ph->sp = 0;
+	if(ParserPcodeGetValue(ctx, ph, ph->stack[0], &value) == FAIL){
+		debug(DEBUG_ACTION,"Key does not exist");
+		VM_JUMP(); /* Not present */
+	}
+	debug(DEBUG_ACTION,"Key exists");
+	VM_NEXT();
+	
+op_value: /* Arithmetic and value functions */
+	execValueOp(ctx, ph, ip);
+	if(ph->suspended){
+		goto suspend;
+	}
+	VM_NEXT();
+	
+op_func:
+	ParserExecFunction(ph, ip);
+	ph->sp = 0;
+	/* Functions can change hashes, so merged lookups have to be done again */
+	memset(ph->lookupCache, 0, prog->numKeySlots * sizeof(String));
+	VM_NEXT();
+	
+op_bad:
+	debug(DEBUG_UNEXPECTED,"Unrecognized op-code: %d", ip->opcode);
+	ASSERT_FAIL(0);
+	
+budget: /* Instruction count reached ph->budgetCheck. Dispatches again if there is budget left */
+	budgetCheck(ph, ip);
+	VM_DISPATCH();
+	
+suspend: /* Waiting in waitfor(). Views are copied, as what they view is gone by the time the script resumes */
+	ph->resumeAddr = ip - code;
+	if(ph->profile){
+		profileStop(ph->profile);
+	}
+	for(h = ph->steHead; h; h = h->next){
+		hashDetachView(h);
+	}
+	debug(DEBUG_ACTION, "Script suspended on line %d", ip->lineNo);
+	return PASS;
+	
+done:
+	if(ph->profile){
+		profileStop(ph->profile);
+	}
+	if(ph->failReason){
+		res = FAIL;
+	}
+	ph->execCtx = NULL;
+	debug(DEBUG_ACTION, "Inline caches: %lu hits, %lu misses", ph->icHits, ph->icMisses);
+	/* Measure the arena before the scratch memory goes */
+	ph->arenaBytes = talloc_total_size(ph->arena);
+	ph->arenaBlocks = talloc_total_blocks(ph->arena);
+	debug(DEBUG_ACTION, "Arena: %lu bytes in %lu allocations", (unsigned long) ph->arenaBytes, 
+	(unsigned long) ph->arenaBlocks);
+	talloc_free(ctx);
+	return res;	
 }
 
-
-
-
 /*
 * Execute  p-code generated by parser
 *
@@ -1092,181 +3739,52 @@ void ParserExecFunction(PcodeHeaderPtr_t ph, PcodePtr_t pi)
 *
 * Return value:
 *
-* Boolean. PASS indicates success, otherwise FAIL.
+* Boolean. PASS indicates success, otherwise FAIL. If ph->suspended is set afterwards, the
+* script is waiting in waitfor(), and the pcode header must be kept until it is resumed.
 *
 */
  
 Bool ParserExecPcode(PcodeHeaderPtr_t ph)
 {
-	PcodePtr_t pe,p;
-	String value,rvalue;
-	double leftNum, rightNum;
-	Bool testRes = FALSE;
-	TALLOC_CTX *ctx;
-	int res = PASS;
-
 	ASSERT_FAIL(ph)
-	ASSERT_FAIL(ph->head)
-	
-	ASSERT_FAIL(ctx = talloc_new(ph))
+	ASSERT_FAIL(!ph->suspended)
 	
+	return runPcode(ph, -1);
+}
 
-	/* Execution loop */
-	for(pe = ph->head;(pe) && (!ph->failReason); pe = pe->next){
-		ASSERT_FAIL(pe->magic == PC_MAGIC);
-		
-		/* Print instruction if trace enabled */
-		if(ph->tracePcode){
-			printOpcode(pe);
-		}
-
-		/* If not a push opcode reset first push location */
-		if(pe->opcode != OP_PUSH){
-			ph->firstPush = NULL;
-		}
-		/* Act on op code */	
-		switch(pe->opcode){
-			
-			case OP_NOP:
-				break;
-				
-			case OP_BLOCK:
-				if((pe->operand == OPRB_END) && pe->skip){
-					debug(DEBUG_ACTION, "Else Block skip");
-					pe = pe->skip; /* Skip over next block */
-				}
-				break;
-				
-			case OP_PUSH:
-				if(!ph->firstPush){
-					ph->pushCount = 0;
-					ph->firstPush = pe; /* Note first push */
-				}
-				ph->pushCount++;
-				break;
-				
-			case OP_ASSIGN: /* Assignment */
-				ASSERT_FAIL(ph->pushCount == 2)
-				p = pe->prev;
-				if(ParserPcodeGetValue(ctx, ph, p, &value)){
-					undefVar(ph, p->data1, pe->lineNo); 
-					break;
-				}
-				MALLOC_FAIL(value)
-				p = pe->prev->prev;
-			    if(ParserPcodePutValue(ctx, ph, p, value)){
-					undefVar(ph, p->data1, pe->lineNo);
-					break;
-				}	
-				debug(DEBUG_ACTION,"Assign successful on line %d", pe->lineNo);
-				break;
-				
-				
-			case OP_TEST2: /* Double Variable test */
-				ASSERT_FAIL(ph->pushCount == 2)
-				leftNum = rightNum = 0.0;
-				p = pe->prev->prev;
-				if(ParserPcodeGetValue(ctx, ph, p, &value)){ /* Left */
-					undefVar(ph, p->data1, pe->lineNo); 
-					break;
-				}
-				debug(DEBUG_ACTION,"Left string: %s", value);				
-				if((pe->operand != OPRT_STREQUALITY) && (FAIL == UtilStod(value, &leftNum))){
-					ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", pe->lineNo);
-					break;
-				}
-				p = pe->prev;
-				if(ParserPcodeGetValue(ctx, ph, p, &rvalue)){ /* Right */
-					undefVar(ph, p->data1, pe->lineNo); 
-					break;
-				}	
-				debug(DEBUG_ACTION,"Right string: %s", rvalue);					
-				if((pe->operand != OPRT_STREQUALITY) && (FAIL == UtilStod(rvalue, &rightNum))){
-					ph->failReason = talloc_asprintf(ph, "Invalid numeric value on line %d", pe->lineNo);
-					break;
-				}
-				debug(DEBUG_ACTION,"leftNum = %e, rightNum = %e", leftNum, rightNum);
-				
-				switch(pe->operand){
-					case OPRT_NUMEQUALITY:
-						testRes = (leftNum == rightNum);
-						break;
-						
-					case OPRT_NUMINEQUALITY:
-						testRes = (leftNum != rightNum);
-						break;
-						
-					case OPRT_NUMGTRTHAN:
-						testRes = (leftNum > rightNum);
-						break;
-					
-					case OPRT_NUMLESSTHAN:
-						testRes = (leftNum < rightNum);
-						break;
-					
-					case OPRT_NUMGTREQTHAN:
-						testRes = (leftNum >= rightNum);
-						break;
-					
-					case OPRT_NUMLESSEQTHAN:
-						testRes = (leftNum <= rightNum);
-						break;
-					
-					case OPRT_STREQUALITY:
-						testRes = (0 == strcmp(rvalue, value));
-						break;
-					
-					default:
-						ASSERT_FAIL(0);
-				}
-				debug(DEBUG_ACTION, "Test result: %d", testRes);
-				if(!testRes){
-					debug(DEBUG_ACTION,"Test Skip");
-					ASSERT_FAIL(pe->skip);
-					pe = pe->skip;
+/*
+* Resume a script waiting in waitfor()
+*
+* Arguments: 
+*
+* 1. Pointer to the pcode header block of the suspended script.
+* 2. TRUE if the message waited for came, FALSE if the wait timed out. This is the result of waitfor().
+*
+*
+* Return value:
+*
+* Boolean. PASS indicates success, otherwise FAIL. The script may be suspended again.
+*
+*/
 
-				}
-				break;
-				
-			case OP_EXISTS: /* Hash key exists */
-				ASSERT_FAIL(ph->pushCount == 1)
-				p = pe->prev;
-				if(ParserPcodeGetValue(ctx, ph, p, &value) == FAIL){
-					debug(DEBUG_ACTION,"Key does not exist");
-					ASSERT_FAIL(pe->skip);
-					pe = pe->skip; /* Not present */
-				}
-				else{
-					debug(DEBUG_ACTION,"Key exists");
-				}
-				
-				break;
-			
-				
-			case OP_FUNC:
+Bool ParserResumePcode(PcodeHeaderPtr_t ph, Bool matched)
+{
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(ph->suspended && ph->execCtx)
 	
-				ParserExecFunction(ph, pe);
-				break;
-				
-			
-			default:
-				debug(DEBUG_UNEXPECTED,"Unrecognized op-code: %d", pe->opcode);
-				ASSERT_FAIL(0);
-			
-		}	
-	}
+	ph->suspended = FALSE;
+	setNumResult(ph->execCtx, ph->temps + ph->resumeAddr, matched ? 1 : 0);
+	debug(DEBUG_ACTION, "Script resumed, %s", matched ? "message received" : "timed out");
 	
-	if(ph->failReason){
-		res = FAIL;
-	}
-	talloc_free(ctx);
-	return res;	
+	return runPcode(ph, ph->resumeAddr + 1);
 }
 
 
 /*
 * Lex, parse and execute event code
 *
+* All lexer and parser state is kept in the parse control block, so separate 
+* parse control blocks can be compiled concurrently.
 *
 * Arguments: 
 *
@@ -1308,26 +3826,26 @@ Bool ParserParseHCL(ParseCtrlPtr_t this, Bool fileMode, const String str)
 	/* Check for error */
 	ASSERT_FAIL(pParser)
 	
-	/* Give parse control context to lexer */	
-	yyInit(this); 
-	
 	/* Set up flex input mode */
-	if(!fileMode)
-		yyScanString(str);
-	else{
+	if(fileMode){
 		file = fopen(str, "r");
-		if(file)
-			yySetInputFile(file);
-		else{
+		if(!file){
 			this->failReason = talloc_asprintf(this, "Can't open file: \"%s\". %s", str, strerror(errno));
 			MALLOC_FAIL(this->failReason)
+			ParseFree(pParser, parserFree);
 			return res;
 		}
 	}
-
-	/* Set lexer up for string input */
 	
-	while((!this->failReason) && (tokenID = yyLex())){
+	/* Create a scanner for this parse. The scanner state lives in the parse control block */	
+	yyInit(this); 
+	
+	if(!fileMode)
+		yyScanString(this, str);
+	else
+		yySetInputFile(this, file);
+
+	while((!this->failReason) && (tokenID = yyLex(this))){
 		pToken = yyTokenVal(this);
 		this->lineNo = pToken->lineNo;
 		pToken->tokenID = tokenID;
@@ -1338,16 +3856,24 @@ Bool ParserParseHCL(ParseCtrlPtr_t this, Bool fileMode, const String str)
 	/* Force parser to terminate */
 	if(!this->failReason){
 		Parse(pParser, 0, NULL, this);
+	}
+	
+	/* Lower the pcode to bytecode, and optimize it */
+	if(!this->failReason){
+		ParserLowerPcode(ph);
+		ParserOptimize(ph->prog, this->skipPasses);
 		res = PASS;
 	}
 	
 	/* Free flex buffer if string mode */
 	if(!fileMode)
-		yyDeleteBuffer();	
+		yyDeleteBuffer(this);
+	else
+		fclose(file);
 	
-	/* Reset the lexer */
+	/* Destroy the scanner */
 	
-	yyLexDestroy();
+	yyLexDestroy(this);
 	
 	/* Free parser */
 	ParseFree(pParser, parserFree);
@@ -1356,25 +3882,113 @@ Bool ParserParseHCL(ParseCtrlPtr_t this, Bool fileMode, const String str)
 }
 
 /*
+* Compile a script, and return a serialized bytecode image of it.
+* Nothing is executed.
 *
-* Check syntax of script file passed in.
 * Arguments: 
 *
-* 1. Pointer to the parser control block.
+* 1. Talloc context to hang the result off of.
+* 2. String containing the script text.
+* 3. Pointer to a generic pointer to store the image.
+* 4. Pointer to an integer to store the length of the image in bytes.
+*
+* Return value:
+*
+* NULL if the script compiled, otherwise a String containing the reason it did not.
+*/
+
+String ParserCompileScript(TALLOC_CTX *ctx, const String script, void **pImage, int *pLen)
+{
+	ParseCtrlPtr_t parseCtrl;
+	PcodeHeaderPtr_t ph;
+	String s = NULL;
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(script)
+	ASSERT_FAIL(pImage)
+	ASSERT_FAIL(pLen)
+	
+	MALLOC_FAIL(parseCtrl = talloc_zero(ctx, ParseCtrl_t))
+	MALLOC_FAIL(ph = talloc_zero(parseCtrl, PcodeHeader_t))
+	parseCtrl->pcodeHeader = ph;
+	
+	if(FAIL == ParserParseHCL(parseCtrl, FALSE, script)){
+		MALLOC_FAIL(s = talloc_asprintf(ctx, "Parse error: %s", parseCtrl->failReason))
+	}
+	else{
+		*pImage = ParserSerializeProgram(ctx, ph->prog, UtilHash(script), pLen);
+	}
+	
+	talloc_free(parseCtrl);
+	return s;
+}
+
+/*
+* Load a sample trigger message into %xplnvin for a syntax check. 
+* The file has a name=value pair on each line. Blank lines and lines starting with # are skipped.
+*
+* Arguments: 
+*
+* 1. Pointer to the pcode header block.
+* 2. String containing the path to the sample input file.
+*
+*
+* Return value:
+*
+* Error message, or NULL if the input was loaded.
+*/
+
+static String loadSampleInput(PcodeHeaderPtr_t ph, const String input)
+{
+	String text, line, eol, eq, s = NULL;
+	int lineNo;
+	
+	if(!(text = UtilFileReadString(ph, input))){
+		MALLOC_FAIL(s = talloc_asprintf(ph, "Could not read sample input file %s", input))
+		return s;
+	}
+	for(line = text, lineNo = 1; line && *line; line = eol, lineNo++){
+		if((eol = strchr(line, '\n'))){
+			*eol++ = 0;
+		}
+		if((!*line) || (*line == '#')){
+			continue;
+		}
+		if(!(eq = strchr(line, '=')) || (eq == line)){
+			MALLOC_FAIL(s = talloc_asprintf(ph, "Sample input line %d is not name=value", lineNo))
+			break;
+		}
+		*eq = 0;
+		ParserHashAddKeyValue(ph, ph, "xplnvin", line, eq + 1);
+	}
+	talloc_free(text);
+	return s;
+}
+
+/*
+*
+* Check syntax of script file passed in, and run it without side effects.
+* Arguments: 
+*
+* 1. Talloc context to hang the result off of.
 * 2. String containing the path to a script file.
+* 3. String containing the path to a sample input file to load into %xplnvin, or NULL for none.
+* 4. Pointer to a string to receive an annotated listing with a profile of the run, 
+*    or NULL if not required.
 *
 *
 *
 * Return value:
 *
-* Boolean. PASS indicates success, otherwise FAIL.
+* Error message, or NULL if the script is OK.
 */
 
-String ParserCheckSyntax(TALLOC_CTX *ctx, String file)
+String ParserCheckSyntax(TALLOC_CTX *ctx, String file, const String input, String *pListing)
 {
 	ParseCtrlPtr_t parseCtrl;
 	PcodeHeaderPtr_t ph;
 	String s = NULL;
+	String source;
 	
 	/* Allocate memory */
 	MALLOC_FAIL(parseCtrl = talloc_zero(ctx, ParseCtrl_t))
@@ -1398,15 +4012,39 @@ String ParserCheckSyntax(TALLOC_CTX *ctx, String file)
 	
 	talloc_free(parseCtrl);
 	
+	/* Report what the optimizer did */
+	note("%s: %d instructions before optimization, %d after. %d tests folded, %d lookups merged, %d superinstructions", file,
+	ph->prog->optStats.instrsIn, ph->prog->optStats.instrsOut, ph->prog->optStats.testsFolded, 
+	ph->prog->optStats.lookupsMerged, ph->prog->optStats.instrsFused);
+	
 	if(Globals->debugLvl >= 3 ){
 		ph->tracePcode = TRUE;
 	}
 	
 	ph->ignoreAssignErrors = TRUE;
+	
+	if(input && (s = loadSampleInput(ph, input))){
+		s = talloc_steal(ctx, s);
+		talloc_free(ph);
+		return s;
+	}
+	
+	if(pListing){
+		ph->profile = ParserProfileNew(ph);
+	}
+	
 	ParserExecPcode(ph);
 	if(ph->failReason){
 		MALLOC_FAIL(s = talloc_asprintf(ctx, "Pcode execution error: %s", ph->failReason))
 	}
+	
+	if(pListing){
+		source = UtilFileReadString(ph, file);
+		*pListing = ParserProfileListing(ctx, ph->profile, source);
+	}
+	note("%s: %lu inline cache hits, %lu misses", file, ph->icHits, ph->icMisses);
+	note("%s: %lu bytes in %lu allocations used from the arena", file, (unsigned long) ph->arenaBytes, 
+	(unsigned long) ph->arenaBlocks);
 	talloc_free(ph);
 	
 	return s;
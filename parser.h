@@ -5,13 +5,30 @@ enum {OPRD_STRINGLIT=0, OPRD_INTLIT, OPRD_FLOATLIT, OPRD_HASHKV, OPRD_HASHREF};
 enum {OPRT_NUMEQUALITY=0, OPRT_NUMINEQUALITY, OPRT_NUMGTRTHAN, OPRT_NUMLESSTHAN,
 OPRT_NUMGTREQTHAN, OPRT_NUMLESSEQTHAN, OPRT_STREQUALITY};
 enum {OPRB_BEGIN=0, OPRB_END=1};
+enum {BIF_LOOKUP_FILL = 1, BIF_LOOKUP_REUSE = 2}; /* Instruction flags set by the optimizer */
 enum {EXS_NORMAL = 0, EXS_IF_BLOCK = 1, EXS_ELSE_BLOCK = 2, EXS_BLOCK_SKIP = 3};
 
-typedef enum {OP_NOP =0, OP_PUSH, OP_ASSIGN, OP_FUNC, OP_BLOCK, OP_IF, OP_TEST2, OP_EXISTS } opType_t;
+/* 
+ * The opcodes from OP_ADD to OP_WAITFOR are value instructions. Each pops the number of arguments in its
+ * operand, and pushes itself in their place. Its result is kept in the pcode header, by instruction address.
+ *
+ * The opcodes after OP_END are superinstructions made by the optimizer. Each is followed by the push 
+ * instructions it replaces, which are kept as operand records and are skipped over when it executes.
+ */
+
+typedef enum {OP_NOP =0, OP_PUSH, OP_ASSIGN, OP_FUNC, OP_BLOCK, OP_IF, OP_TEST2, OP_EXISTS, 
+OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG, OP_CONCAT, OP_FORMAT, OP_SUBSTR, OP_ABS, OP_MIN, OP_MAX, OP_ROUND, 
+OP_AFTER, OP_CANCEL, OP_WAITFOR, OP_END,
+OP_TEST_HASHKEY_LITERAL, OP_ASSIGN_LITERAL, OP_ASSIGN_HASH_TO_HASH, OP_EXISTS_HASHKEY, OP_NUMOPS } opType_t;
+#define PARSER_MAX_ARGS 16 /* Most arguments a value function can take */
+enum {OPT_FOLD = 1, OPT_MERGE = 2, OPT_FUSE = 4}; /* Optimizer passes */
 
 
 typedef enum {ATYPE_STRING = 0, ATYPE_HASH = 1} argType_t;
 
+/* State of the cached numeric form of a value */
+typedef enum {PVN_UNKNOWN = 0, PVN_VALID = 1, PVN_INVALID = 2} numState_t;
+
 
 /* Token control block */
 
@@ -37,35 +54,76 @@ typedef struct argListEntry_s {
 typedef argListEntry_t * argListEntryPtr_t;
 
 
+/* 
+ * Script value 
+ *
+ * The string is the value. The numeric form is converted on first 
+ * numeric use and cached until the string changes.
+ */
+
+typedef struct ParseValue_s {
+	String str; /* NULL if undefined */
+	numState_t numState;
+	double num;
+} ParseValue_t;
+
+typedef ParseValue_t * ParseValuePtr_t;
+
+
 /* Hash linked list entry */
 
 typedef struct ParseHashKV_s {
 	unsigned magic;
 	unsigned hash;
 	String key;
-	String value;
-	struct ParseHashKV_s *next;
+	ParseValue_t val; /* String is NULL if the key is not defined */
+	struct ParseHashKV_s *prevLive; /* Defined entries in insertion order */
+	struct ParseHashKV_s *nextLive;
 } ParseHashKV_t;
 
 typedef ParseHashKV_t * ParseHashKVPtr_t;
 typedef ParseHashKVPtr_t * ParseHashKVPtrPtr_t;
 
 
+/* Read only view of name/value pairs stored elsewhere, which a hash can be backed by */
+
+typedef void (*ParserViewCallback_t)(void *userObj, const String key, const String value);
+typedef const String (*ParserViewGet_t)(void *viewObj, const String key);
+typedef void (*ParserViewIterate_t)(void *viewObj, void *userObj, ParserViewCallback_t callback);
+
 /* Hash symbol table entry */
 
 typedef struct ParseHashSTE_s {
 	unsigned magic;
 	unsigned hash;
 	Bool writable;
+	unsigned generation; /* Bumped when entries are freed. Guards inline caches */
 	String name;
+	void *viewObj; /* Object the hash is a view of, or NULL. Copied into the hash on the first write */
+	ParserViewGet_t viewGet;
+	ParserViewIterate_t viewIterate;
+	unsigned tableSize; /* Power of 2 */
+	unsigned count;
 	TALLOC_CTX *context;
-	ParseHashKVPtr_t head;
+	ParseHashKVPtr_t *table; /* Open addressing index of all entries */
+	ParseHashKVPtr_t liveHead;
+	ParseHashKVPtr_t liveTail;
 	struct ParseHashSTE_s *next;
 } ParseHashSTE_t;
 
 typedef ParseHashSTE_t * ParseHashSTEPtr_t;
 typedef ParseHashSTEPtr_t * ParseHashSTEPtrPtr_t;
 
+/* Inline cache for a hash access instruction */
+
+typedef struct ParseInlineCache_s {
+	ParseHashSTEPtr_t ste; /* Hash the entry was found in */
+	ParseHashKVPtr_t ke; /* Entry found, or NULL if the cache is empty */
+	unsigned generation; /* Generation of the hash when the entry was found */
+} ParseInlineCache_t;
+
+typedef ParseInlineCache_t * ParseInlineCachePtr_t;
+
 /* 
  * Pcode control block
  */
@@ -88,21 +146,123 @@ typedef struct pcode_s {
 typedef Pcode_t * PcodePtr_t;
 typedef PcodePtr_t * PcodePtrPtr_t;
 
+/*
+ * Bytecode instruction
+ * 
+ * The pcode list is lowered to an array of these once parsing is complete.
+ * Strings are stored in the program's constant pool and referenced by index.
+ */
+
+typedef struct bcInstr_s {
+	opType_t opcode;
+	int operand;
+	int lineNo;
+	int jump; /* Index of the instruction to continue at when a branch is taken, or -1 */
+	int arg1; /* Constant pool index of data1, or -1 */
+	int arg2; /* Constant pool index of data2, or -1 */
+	int sym; /* Symbol slot of the hash referenced, or -1 */
+	int keySlot; /* Key slot of the hash key referenced, or -1 */
+	int flags; /* BIF_ flags */
+} BCInstr_t;
+
+typedef BCInstr_t * BCInstrPtr_t;
+
+/* Hash key known at compile time */
+
+typedef struct bcKeySlot_s {
+	int sym; /* Symbol slot of the hash */
+	int key; /* Constant pool index of the key */
+	unsigned hash; /* Hash of the key */
+} BCKeySlot_t;
+
+typedef BCKeySlot_t * BCKeySlotPtr_t;
+
+/* Optimizer results */
+
+typedef struct bcOptStats_s {
+	int instrsIn; /* Instruction count before optimization */
+	int instrsOut; /* Instruction count after optimization */
+	int testsFolded;
+	int lookupsMerged;
+	int instrsFused; /* Superinstructions made */
+} BCOptStats_t;
+
+/* 
+ * Bytecode program 
+ *
+ * Not changed after compilation, so it can be shared by pcode headers on different
+ * threads. Reference counted, and freed when the last pcode header using it is.
+ */
+
+typedef struct bcProgram_s {
+	unsigned magic;
+	int refCount; /* Not serialized */
+	int codeLen;
+	int numConsts;
+	int maxStack; /* Deepest the operand stack gets */
+	int numSyms;
+	int numKeySlots;
+	BCInstrPtr_t code;
+	ParseValuePtr_t consts; /* Numeric literals are converted when added */
+	int *syms; /* Constant pool index of each hash name */
+	BCKeySlotPtr_t keySlots;
+	BCOptStats_t optStats; /* Not serialized */
+} BCProgram_t;
+
+typedef BCProgram_t * BCProgramPtr_t;
+
 /* pcode header */
 
+struct pcheader_s;
+
+/* 
+ * Called when a script waits for a message. Returns PASS if the wait was set up, and the script is 
+ * then resumed with ParserResumePcode once the message comes or the timeout expires.
+ */
+typedef Bool (*ParserWaitHandler_t)(struct pcheader_s *ph, const String source, const String schema, unsigned timeout);
+
 typedef struct pcheader_s {
 	PcodePtr_t head;
 	PcodePtr_t tail;
 	ParseHashSTEPtr_t steHead;
-	PcodePtr_t firstPush;
+	ParseHashSTEPtr_t *steTable; /* Open addressing index of the symbol table */
+	unsigned steTableSize;
+	unsigned steCount;
+	BCProgramPtr_t prog;
+	BCInstrPtr_t *stack; /* Push and value instructions seen since the start of the statement */
+	ParseValuePtr_t temps; /* Results of value instructions, by instruction address */
+	ParseHashSTEPtr_t *symtab; /* Hashes bound to the program's symbol slots */
+	ParseInlineCachePtr_t icache; /* Inline caches, by instruction address */
+	unsigned long icHits; /* Inline cache hits */
+	unsigned long icMisses; /* Inline cache misses */
+	String *lookupCache; /* Results of merged lookups, by key slot */
+	TALLOC_CTX *arena; /* Pool the hashes and execution scratch memory come from */
+	TALLOC_CTX *execCtx; /* Scratch context for the execution in progress, in the arena */
+	size_t arenaBytes; /* Arena use at the end of the last execution */
+	size_t arenaBlocks;
 	String failReason;
 	int ctrlStructRefCount;
 	int seq;
-	int pushCount;
+	int sp;
 	Bool tracePcode;
 	Bool ignoreAssignErrors;
+	unsigned long instrCount; /* Instructions dispatched */
+	unsigned long maxInstrs; /* Instructions an execution may dispatch, or 0 for no limit */
+	unsigned maxMS; /* Milliseconds an execution may run for between waits, or 0 for no limit */
+	unsigned long instrLimit; /* Instruction count the execution is stopped at */
+	unsigned long deadline; /* Monotonic clock in milliseconds the execution is stopped at */
+	unsigned long budgetCheck; /* Instruction count the budgets are next checked at */
+	Bool overrun; /* The last execution was stopped for going over budget */
+	String scriptName; /* For the caller's use. May be NULL */
+	void *profile; /* Per line counts and times are added to this when profiling, else NULL */
 	void *xplServicePtr;
 	void *DB;
+	void *memState; /* Backs the mem hash when it is shared between executions */
+	void *delayQ; /* Delayed actions scheduled with after() */
+	ParserWaitHandler_t waitHandler; /* Sets up waitfor(). NULL if the script can't wait */
+	void *waitObj; /* For the wait handler's use */
+	Bool suspended; /* Waiting in waitfor(). The execution context is kept until resumed */
+	int resumeAddr; /* Address of the waitfor instruction */
 	
 } PcodeHeader_t;
 
@@ -110,11 +270,13 @@ typedef PcodeHeader_t * PcodeHeaderPtr_t;
 typedef PcodeHeaderPtr_t * PcodeHeaderPtrPtr_t;
 	
 
-/* Parse Control Block */
+/* Parse Control Block. One per compile, so compiles can run concurrently */
 
 typedef struct ParseCtrl_s {
 	PcodeHeaderPtr_t pcodeHeader;
 	String failReason;
+	void *scanner; /* Reentrant flex scanner state */
+	unsigned skipPasses; /* OPT_ optimizer passes not to run */
 	short lineNo;
 }ParseCtrl_t;	
 	
@@ -124,17 +286,31 @@ typedef ParseCtrl_t * ParseCtrlPtr_t;
 
 Bool ParserSplitXPLTag(TALLOC_CTX *ctx, const String tag, String *vendor, String *device, String *instance);
 void ParserHashWalk(PcodeHeaderPtr_t ph, const String name, void (*parseHashWalkCallback)(const String key, const String value));
+void ParserHashAttachView(PcodeHeaderPtr_t ph, const String hashName, void *viewObj, ParserViewGet_t viewGet, 
+ParserViewIterate_t viewIterate);
 Bool ParserHashAddKeyValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, const String hashName, const String key, const String value);
 const String ParserHashGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, const String hashName, const String key);
-void ParserExecFunction(PcodeHeaderPtr_t ph, PcodePtr_t pi);
+void ParserExecFunction(PcodeHeaderPtr_t ph, BCInstrPtr_t pi);
 void ParserPcodeEmit(ParseCtrlPtr_t pc, opType_t op, int operand, String data1, String data2);
+void ParserEmitValueOp(ParseCtrlPtr_t pc, opType_t op, int argc, String name);
 void ParserPcodeDumpList(PcodeHeaderPtr_t ph);
 void ParserSetJumps(ParseCtrlPtr_t this, int tokenID);
-Bool ParserPcodeGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, PcodePtr_t instr, String *pValue);
-Bool ParserPcodePutValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, PcodePtr_t instr, String value);
+void ParserLowerPcode(PcodeHeaderPtr_t ph);
+void ParserOptimize(BCProgramPtr_t prog, unsigned skipPasses);
+void *ParserSerializeProgram(TALLOC_CTX *ctx, BCProgramPtr_t prog, unsigned srcHash, int *pLen);
+Bool ParserLoadProgram(PcodeHeaderPtr_t ph, const void *image, int len, unsigned srcHash);
+BCProgramPtr_t ParserProgramRetain(BCProgramPtr_t prog);
+void ParserProgramRelease(BCProgramPtr_t prog);
+void ParserAttachProgram(PcodeHeaderPtr_t ph, BCProgramPtr_t prog);
+Bool ParserPcodeGetValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t instr, String *pValue);
+Bool ParserPcodePutValue(TALLOC_CTX *ctx, PcodeHeaderPtr_t ph, BCInstrPtr_t instr, String value);
 Bool ParserExecPcode(PcodeHeaderPtr_t ph);
+Bool ParserResumePcode(PcodeHeaderPtr_t ph, Bool matched);
 Bool ParserParseHCL(ParseCtrlPtr_t this, Bool fileMode, const String str);
-String ParserCheckSyntax(TALLOC_CTX *ctx, String file);
+String ParserCompileScript(TALLOC_CTX *ctx, const String script, void **pImage, int *pLen);
+String ParserCheckSyntax(TALLOC_CTX *ctx, String file, const String input, String *pListing);
+void *ParserProfileNew(TALLOC_CTX *ctx);
+String ParserProfileListing(TALLOC_CTX *ctx, void *profile, const String source);
 
 
 #endif
@@ -17,7 +17,7 @@
 *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *
 *
-*    Interface to epoll
+*    Interface to epoll, or to io_uring when built with liburing
 *   
 * 
 * 
@@ -35,7 +35,14 @@
 #include <limits.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <sys/poll.h>
+#include <liburing.h>
+#endif
 #include <talloc.h>
 #include "defs.h"
 #include "types.h"
@@ -45,13 +52,36 @@
 #define PH_MAGIC 0x561A0F2C
 #define PE_MAGIC 0x6812AC45
 #define TE_MAGIC 0x4A2E7F35
+#define PS_MAGIC 0x2B90D61E
+
+#define URING_ENTRIES 256
+
+/* Room for the control messages a receive entry can get */
+#define RECV_CTRL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/* Poll entry kinds */
+#define PEK_EVENT 0
+#define PEK_RECV 1
 
 /* Poll list entry */
 typedef struct PollEntry_s {
 	unsigned magic;
 	int fd;
+	int kind;
+	uint32_t watchType;
+	Bool dead; /* Unregistered, but the kernel may still hold a reference to it */
+	Bool armed; /* An io_uring request is outstanding for this entry */
 	void *userObject;
 	void (*action)(int fd, int event, void *userObject);
+	void (*recvAction)(int fd, void *buf, int len, const PollRecvInfoPtr_t info, void *userObject);
+	unsigned bufSize;
+	unsigned bufCount;
+	unsigned slotSize;
+	int bufGroup;
+	char *bufs;
+	char *ctrl;
+	void *bufRing;
+	struct msghdr msgTemplate;
 	struct PollEntry_s *prev;
 	struct PollEntry_s *next;
 } PollEntry_t;
@@ -59,15 +89,33 @@ typedef struct PollEntry_s {
 
 typedef PollEntry_t  * PollEntryPtr_t;
 
+/* Queued send operation */
+typedef struct PollSendOp_s {
+	unsigned magic;
+	int fd;
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage addr;
+} PollSendOp_t;
+
+typedef PollSendOp_t * PollSendOpPtr_t;
+
 
 /* Poll header */
 typedef struct PollHeader_s {
 	unsigned magic;
 	int fd;
 	unsigned maxevents;
+	Bool useURing;
+	Bool inDispatch;
+	int nextBufGroup;
 	struct epoll_event *eventlist;
 	PollEntryPtr_t peHead;
 	PollEntryPtr_t peTail;
+	PollEntryPtr_t deadHead;
+#ifdef HAVE_LIBURING
+	struct io_uring ring;
+#endif
 
 } PollHeader_t;
 
@@ -111,59 +159,582 @@ static void removePollItem(PollHeaderPtr_t ph, PollEntryPtr_t e)
 		e->next->prev = e->prev;
 
 	}
+	e->prev = e->next = NULL;
 }
 
+/*
+ * Append a poll item to the list
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. Pointer to entry to append
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void appendPollItem(PollHeaderPtr_t ph, PollEntryPtr_t e)
+{
+	if(!ph->peHead){
+		/* Append to empty list */
+		ph->peHead = ph->peTail = e;
+	}
+	else{
+		/* Append to existing list */
+		e->prev = ph->peTail;
+		e->prev->next = e;
+		ph->peTail = e;
+	}
+}
 
 /*
- * Create/Modify/Delete a poll event
+ * Free a poll entry, and any receive buffers associated with it.
+ *
  * Arguments:
  *
  * 1. Pointer to poll object 
- * 2. File descriptor to register/modify/unregister
- * 3. Watch type (See poll.h)
- * 4. Function to call when event occurs.
- * 5. A user object to pass to the function when the event occurs.
+ * 2. Pointer to entry to free. It must not be in the active list.
  *
  * Return value
  *
- * PASS if success, otherwise FAIL
+ * None
  */
- 
-static Bool pollFDOp(void *pHead, int regFD, int op, uint32_t watchType, 
-void (*action)(int fd, int event, void *userObject), void *userObject)
+
+static void freePollItem(PollHeaderPtr_t ph, PollEntryPtr_t e)
 {
-	PollEntryPtr_t e;
-	PollHeaderPtr_t ph = pHead;
-	struct epoll_event event = (struct epoll_event) {0};
+	PollEntryPtr_t *pp;
+	
+	/* If on the dead list, unlink it */
+	if(e->dead){
+		for(pp = &ph->deadHead; *pp; pp = &(*pp)->next){
+			if(*pp == e){
+				*pp = e->next;
+				break;
+			}
+		}
+	}
+#ifdef HAVE_LIBURING
+	/* Release the provided buffer ring */
+	if(e->bufRing){
+		io_uring_free_buf_ring(&ph->ring, e->bufRing, e->bufCount, e->bufGroup);
+		e->bufRing = NULL;
+	}
+#endif
+	e->magic = 0;
+	talloc_free(e);
+}
+
+/*
+ * Retire a poll entry which has been removed from the active list.
+ *
+ * If the entry can't be freed yet because a kernel request or the event list currently
+ * being dispatched may still refer to it, it is placed on the dead list and freed later.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. Pointer to entry to retire
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void retirePollItem(PollHeaderPtr_t ph, PollEntryPtr_t e)
+{
+	if(e->armed || ph->inDispatch){
+		e->dead = TRUE;
+		e->next = ph->deadHead;
+		ph->deadHead = e;
+	}
+	else{
+		freePollItem(ph, e);
+	}
+}
+
+/*
+ * Free the entries on the dead list which the kernel no longer refers to
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void sweepDeadItems(PollHeaderPtr_t ph)
+{
+	PollEntryPtr_t e, next;
+	
+	for(e = ph->deadHead; e; e = next){
+		next = e->next;
+		if(!e->armed){
+			freePollItem(ph, e);
+		}
+	}
+}
+
+/*
+ * Note a control message from a received datagram
+ *
+ * Arguments:
+ *
+ * 1. Pointer to control message
+ * 2. Pointer to receive info to update
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void noteRecvCmsg(struct cmsghdr *cmsg, PollRecvInfoPtr_t info)
+{
+	if(SOL_SOCKET != cmsg->cmsg_level){
+		return;
+	}
+	if(SCM_TIMESTAMPNS == cmsg->cmsg_type){
+		memcpy(&info->timestamp, CMSG_DATA(cmsg), sizeof(struct timespec));
+		info->haveTimestamp = TRUE;
+	}
+	else if(SO_RXQ_OVFL == cmsg->cmsg_type){
+		memcpy(&info->dropCount, CMSG_DATA(cmsg), sizeof(uint32_t));
+		info->haveDropCount = TRUE;
+	}
+}
+
+/*
+ * Read datagrams from a socket until there are no more waiting
+ *
+ * Used for receive entries when there is no provided buffer ring.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll entry
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void drainRecv(PollEntryPtr_t e)
+{
+	int bytesRead;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	PollRecvInfo_t info;
+	
+	while(!e->dead){
+		/* Set up for recvmsg */
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = e->bufs;
+		iov.iov_len = e->bufSize;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = e->ctrl;
+		msg.msg_controllen = RECV_CTRL_SIZE;
+		
+		if((bytesRead = recvmsg(e->fd, &msg, MSG_DONTWAIT)) < 0){
+			if(EINTR == errno){
+				continue;
+			}
+			if((EAGAIN != errno) && (EWOULDBLOCK != errno)){
+				debug(DEBUG_UNEXPECTED, "%s: recvmsg() error: %s", __func__, strerror(errno));
+			}
+			break;
+		}
+		
+		/* Pick up the ancillary data */
+		memset(&info, 0, sizeof(info));
+		info.truncated = (msg.msg_flags & MSG_TRUNC) ? TRUE : FALSE;
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+			noteRecvCmsg(cmsg, &info);
+		}
+		
+		(*e->recvAction)(e->fd, e->bufs, bytesRead, &info, e->userObject);
+	}
+}
+
+/*
+ * Translate our watch type flags to poll(2) style event flags
+ *
+ * Arguments:
+ *
+ * 1. Watch type (See poll.h)
+ *
+ * Return value
+ *
+ * EPOLL event flags. Only EPOLLIN through EPOLLRDHUP have the same values as their poll(2) counterparts.
+ */
+
+static uint32_t watchTypeToEvents(uint32_t watchType)
+{
+	uint32_t events = 0;
 	
-	/* Translate our watch type flags to EPOLL flags */	
 	if(watchType & POLL_WT_IN){
-		event.events |= EPOLLIN;
+		events |= EPOLLIN;
 	}
 	if(watchType & POLL_WT_OUT){
-		event.events |= EPOLLOUT;
+		events |= EPOLLOUT;
 	}
 	if(watchType & POLL_WT_RD_HUP){
-		event.events |= EPOLLRDHUP;
+		events |= EPOLLRDHUP;
 	}
 	if(watchType & POLL_WT_PRI){
-		event.events |= EPOLLPRI;
+		events |= EPOLLPRI;
 	}
 	if(watchType & POLL_WT_ERR){
-		event.events |= EPOLLERR;
-	}
-	if(watchType & POLL_WT_HUP){
-		event.events |= EPOLLHUP;
+		events |= EPOLLERR;
 	}
 	if(watchType & POLL_WT_HUP){
-		event.events |= EPOLLHUP;
+		events |= EPOLLHUP;
 	}
 	if(watchType & POLL_WT_ET){
-		event.events |= EPOLLET;
+		events |= EPOLLET;
 	}
 	if(watchType & POLL_WT_OS){
-		event.events |= EPOLLONESHOT;
+		events |= EPOLLONESHOT;
 	}	
+	return events;
+}
+
+/*
+ * Translate event flags back to our watch type flags
+ *
+ * Arguments:
+ *
+ * 1. Event flags
+ *
+ * Return value
+ *
+ * Watch type flags
+ */
+
+static uint32_t eventsToWatchType(uint32_t events)
+{
+	uint32_t watchType = 0;
+	
+	if(events & EPOLLIN){
+		watchType |= POLL_WT_IN;
+	}
+	if(events & EPOLLOUT){
+		watchType |= POLL_WT_OUT;
+	}
+	if(events & EPOLLRDHUP){
+		watchType |= POLL_WT_RD_HUP;
+	}	
+	if(events & EPOLLPRI){
+		watchType |= POLL_WT_PRI;
+	}	
+	if(events & EPOLLERR){
+		watchType |= POLL_WT_ERR;
+	}
+	if(events & EPOLLHUP){
+		watchType |= POLL_WT_HUP;
+	}
+	if(events & EPOLLET){
+		watchType |= POLL_WT_ET;
+	}
+	if(events & EPOLLONESHOT){
+		watchType |= POLL_WT_OS;
+	}
+	return watchType;
+}
+
+#ifdef HAVE_LIBURING
+
+/*
+ * Get a submission queue entry, submitting what is queued if the submission queue is full
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ *
+ * Return value
+ *
+ * Pointer to a submission queue entry
+ */
+
+static struct io_uring_sqe *uringGetSQE(PollHeaderPtr_t ph)
+{
+	struct io_uring_sqe *sqe;
+	
+	if(!(sqe = io_uring_get_sqe(&ph->ring))){
+		io_uring_submit(&ph->ring);
+		sqe = io_uring_get_sqe(&ph->ring);
+	}
+	ASSERT_FAIL(sqe)
+	return sqe;
+}
+
+/*
+ * Submit queued requests now unless we are dispatching events.
+ * When dispatching, they are submitted in one batch when PollWait next waits.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ *
+ * Return value
+ *
+ * None
+ */
+ 
+static void uringFlushIfIdle(PollHeaderPtr_t ph)
+{
+	if(!ph->inDispatch){
+		io_uring_submit(&ph->ring);
+	}
+}
+
+/*
+ * Arm an io_uring request for a poll entry
+ *
+ * Event entries use single shot poll requests which are re-armed after each callback. This gives the 
+ * same level triggered behaviour as epoll. Edge triggered entries use a multishot poll request.
+ * Receive entries use a multishot recvmsg into the provided buffer ring, or fall back to a poll request
+ * if there is no buffer ring.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. Pointer to entry to arm
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void uringArm(PollHeaderPtr_t ph, PollEntryPtr_t e)
+{
+	struct io_uring_sqe *sqe = uringGetSQE(ph);
+	
+	if((PEK_RECV == e->kind) && e->bufRing){
+		io_uring_prep_recvmsg_multishot(sqe, e->fd, &e->msgTemplate, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = e->bufGroup;
+	}
+	else if(e->watchType & POLL_WT_ET){
+		io_uring_prep_poll_multishot(sqe, e->fd, watchTypeToEvents(e->watchType & ~(POLL_WT_ET | POLL_WT_OS)));
+	}
+	else{
+		io_uring_prep_poll_add(sqe, e->fd, watchTypeToEvents(e->watchType & ~(POLL_WT_ET | POLL_WT_OS)));
+	}
+	io_uring_sqe_set_data(sqe, e);
+	e->armed = TRUE;
+}
+
+/*
+ * Cancel the outstanding io_uring request for a poll entry
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. Pointer to entry 
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void uringCancel(PollHeaderPtr_t ph, PollEntryPtr_t e)
+{
+	struct io_uring_sqe *sqe = uringGetSQE(ph);
+	
+	io_uring_prep_cancel64(sqe, (uint64_t) (uintptr_t) e, 0);
+	/* The cancel request's own completion is ignored */
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+/*
+ * Set up a provided buffer ring for a receive entry
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. Pointer to receive entry with bufs, slotSize and bufCount filled in
+ *
+ * Return value
+ *
+ * PASS if the buffer ring was set up, otherwise FAIL
+ */
+
+static Bool uringSetupBufRing(PollHeaderPtr_t ph, PollEntryPtr_t e)
+{
+	struct io_uring_buf_ring *br;
+	unsigned i;
+	int res;
+	
+	e->bufGroup = ph->nextBufGroup++;
+	if(!(br = io_uring_setup_buf_ring(&ph->ring, e->bufCount, e->bufGroup, 0, &res))){
+		debug(DEBUG_EXPECTED, "%s: Can't set up provided buffer ring: %s", __func__, strerror(-res));
+		return FAIL;
+	}
+	/* Hand all of the buffers to the kernel */
+	for(i = 0; i < e->bufCount; i++){
+		io_uring_buf_ring_add(br, e->bufs + (i * e->slotSize), e->slotSize, i, 
+		io_uring_buf_ring_mask(e->bufCount), i);
+	}
+	io_uring_buf_ring_advance(br, e->bufCount);
+	e->bufRing = br;
+	return PASS;
+}
+
+/*
+ * Process a completion
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. User data from the completion
+ * 3. Result from the completion
+ * 4. Flags from the completion
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void uringComplete(PollHeaderPtr_t ph, void *data, int res, unsigned flags)
+{
+	PollEntryPtr_t e = data;
+	PollSendOpPtr_t so = data;
+	struct io_uring_recvmsg_out *out;
+	struct cmsghdr *cmsg;
+	PollRecvInfo_t info;
+	unsigned bid;
+	char *buf;
+	
+	/* Completions of cancel requests carry no data */
+	if(!data){
+		return;
+	}
+	
+	/* Send completion? */
+	if(PS_MAGIC == so->magic){
+		if(res < 0){
+			debug(DEBUG_UNEXPECTED, "%s: sendmsg() on fd %d failed: %s", __func__, so->fd, strerror(-res));
+		}
+		else if(res != so->iov.iov_len){
+			debug(DEBUG_UNEXPECTED, "%s: Short send on fd %d: %d of %u bytes", __func__, so->fd, res, 
+			(unsigned) so->iov.iov_len);
+		}
+		so->magic = 0;
+		talloc_free(so);
+		return;
+	}
+	
+	ASSERT_FAIL(PE_MAGIC == e->magic)
+	
+	/* If the kernel won't post any more completions for this request, note it */
+	if(!(flags & IORING_CQE_F_MORE)){
+		e->armed = FALSE;
+	}
+	
+	if(!e->dead){
+		if((PEK_RECV == e->kind) && e->bufRing){
+			/* Multishot recvmsg */
+			if((res >= 0) && (flags & IORING_CQE_F_BUFFER)){
+				bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				ASSERT_FAIL(bid < e->bufCount)
+				buf = e->bufs + (bid * e->slotSize);
+				/* The buffer starts with a header, then the control messages, then the payload */
+				if((out = io_uring_recvmsg_validate(buf, res, &e->msgTemplate))){
+					memset(&info, 0, sizeof(info));
+					info.truncated = (out->flags & MSG_TRUNC) ? TRUE : FALSE;
+					for(cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &e->msgTemplate); cmsg; 
+					cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &e->msgTemplate, cmsg)){
+						noteRecvCmsg(cmsg, &info);
+					}
+					(*e->recvAction)(e->fd, io_uring_recvmsg_payload(out, &e->msgTemplate),
+					io_uring_recvmsg_payload_length(out, res, &e->msgTemplate), &info, e->userObject);
+				}
+				else{
+					debug(DEBUG_UNEXPECTED, "%s: Invalid recvmsg buffer on fd %d", __func__, e->fd);
+				}
+				/* Give the buffer back to the kernel */
+				io_uring_buf_ring_add(e->bufRing, buf, e->slotSize, bid, io_uring_buf_ring_mask(e->bufCount), 0);
+				io_uring_buf_ring_advance(e->bufRing, 1);
+			}
+			else if((-EINVAL == res) && !e->armed){
+				/* Kernel can't do multishot recvmsg. Poll for readiness and read instead */
+				debug(DEBUG_EXPECTED, "%s: multishot recvmsg not supported, falling back to poll", __func__);
+				io_uring_free_buf_ring(&ph->ring, e->bufRing, e->bufCount, e->bufGroup);
+				e->bufRing = NULL;
+			}
+			else if((res < 0) && (-ENOBUFS != res) && (-ECANCELED != res)){
+				debug(DEBUG_UNEXPECTED, "%s: multishot recvmsg on fd %d failed: %s", __func__, e->fd, strerror(-res));
+			}
+		}
+		else if(res < 0){
+			if(-ECANCELED != res){
+				debug(DEBUG_UNEXPECTED, "%s: poll on fd %d failed: %s", __func__, e->fd, strerror(-res));
+			}
+		}
+		else if(PEK_RECV == e->kind){
+			/* Receive without a buffer ring */
+			drainRecv(e);
+		}
+		else{
+			/* Call the specified action callback */
+			(*e->action)(e->fd, eventsToWatchType(res), e->userObject);
+		}
+		
+		/* A one-shot item needs to be removed */
+		if(!e->dead && (e->watchType & POLL_WT_OS)){
+			removePollItem(ph, e);
+			retirePollItem(ph, e);
+		}
+	}
+	
+	if(e->dead){
+		/* Free it once the kernel is done with it */
+		if(!e->armed){
+			freePollItem(ph, e);
+		}
+		else if(flags & IORING_CQE_F_MORE){
+			/* Multishot request still running, make sure it gets cancelled */
+			uringCancel(ph, e);
+		}
+		return;
+	}
+	
+	/* Re-arm if the request finished */
+	if(!e->armed){
+		uringArm(ph, e);
+	}
+}
+
+#endif
+
+/*
+ * Create/Modify/Delete a poll event
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. File descriptor to register/modify/unregister
+ * 3. Watch type (See poll.h)
+ * 4. Function to call when event occurs.
+ * 5. A user object to pass to the function when the event occurs.
+ *
+ * Return value
+ *
+ * PASS if success, otherwise FAIL
+ */
+ 
+static Bool pollFDOp(void *pHead, int regFD, int op, uint32_t watchType, 
+void (*action)(int fd, int event, void *userObject), void *userObject)
+{
+	PollEntryPtr_t e;
+	PollHeaderPtr_t ph = pHead;
+	struct epoll_event event = (struct epoll_event) {0};
+	
+	/* Translate our watch type flags to EPOLL flags */	
+	event.events = watchTypeToEvents(watchType);
 	
 	/* Allocate a list entry */
 	MALLOC_FAIL(e = talloc_zero(pHead, PollEntry_t))
@@ -171,6 +742,17 @@ void (*action)(int fd, int event, void *userObject), void *userObject)
 	e->userObject = userObject;
 	e->fd = regFD;
 	e->action = action;
+	e->kind = PEK_EVENT;
+	e->watchType = watchType;
+	
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		uringArm(ph, e);
+		uringFlushIfIdle(ph);
+		appendPollItem(ph, e);
+		return PASS;
+	}
+#endif
 	
 	/* Store the entry object in the event structure */
 	event.data.ptr = e;
@@ -183,18 +765,7 @@ void (*action)(int fd, int event, void *userObject), void *userObject)
 	}
 	
 	/* Append entry to list */
-	if(!ph->peHead){
-		/* Append to empty list */
-		ph->peHead = ph->peTail = e;
-	}
-	else{
-		/* Append to existing list */
-		e->prev = ph->peTail;
-		e->prev->next = e;
-		ph->peTail = e;
-		
-		
-	}
+	appendPollItem(ph, e);
 	
 	return PASS;
 }
@@ -222,46 +793,34 @@ static void doEventList(PollHeaderPtr_t ph, int numEvents)
 		e = ph->eventlist[i].data.ptr; /* Recover the list entry */
 		events = ph->eventlist[i].events;
 		ASSERT_FAIL(PE_MAGIC == e->magic)
-		ASSERT_FAIL(e->action);
-		/* convert flags to our format */
-		if(events & EPOLLIN){
-			watchType |= POLL_WT_IN;
-		}
-		if(events & EPOLLOUT){
-			watchType |= POLL_WT_OUT;
-		}
-		if(events & EPOLLRDHUP){
-			watchType |= POLL_WT_RD_HUP;
-		}	
-		if(events & EPOLLPRI){
-			watchType |= POLL_WT_PRI;
-		}	
-		if(events & EPOLLERR){
-			watchType |= POLL_WT_ERR;
-		}
-		if(events & EPOLLHUP){
-			watchType |= POLL_WT_HUP;
-		}
-		if(events & EPOLLET){
-			watchType |= POLL_WT_ET;
+		
+		/* Skip entries unregistered by an earlier action in this list */
+		if(e->dead){
+			continue;
 		}
-		if(events & EPOLLONESHOT){
-			watchType |= POLL_WT_OS;
+		
+		if(PEK_RECV == e->kind){
+			/* Read everything waiting on the socket */
+			drainRecv(e);
 		}
+		else{
+			ASSERT_FAIL(e->action);
+			/* convert flags to our format */
+			watchType = eventsToWatchType(events);
 		
-		/* Call the specified action callback */
+			/* Call the specified action callback */
 		
-		(*e->action)(e->fd, watchType, e->userObject);
+			(*e->action)(e->fd, watchType, e->userObject);
+		}
 		
 		/* A one-shot item needs to be removed */
-		if(events & EPOLLONESHOT){
+		if((!e->dead) && (e->watchType & POLL_WT_OS)){
 			/* Remove item from list */
 			removePollItem(ph, e);
-			e->magic = 0;
-			talloc_free(e);
+			retirePollItem(ph, e);
 		}
 		
-	}	
+	}
 }
 
 
@@ -270,6 +829,9 @@ static void doEventList(PollHeaderPtr_t ph, int numEvents)
 /*
  * Create a poll object
  *
+ * If built with liburing, an io_uring is used when the kernel supports it.
+ * Otherwise epoll is used.
+ *
  * Arguments:
  *
  * 1. Talloc context to use to allocate memory. 
@@ -285,18 +847,44 @@ void *PollInit(TALLOC_CTX *ctx, unsigned maxEvents)
 {
 	PollHeaderPtr_t ph;
 	int fd;
+#ifdef HAVE_LIBURING
+	struct io_uring_params params;
+	int res;
+#endif
 	
 	ASSERT_FAIL(ctx)
 	ASSERT_FAIL(maxEvents > 0)
 	
+	/* Allocate the object structure */
+	MALLOC_FAIL(ph = talloc_zero(ctx, PollHeader_t))
+	ph->fd = -1;
+	
+#ifdef HAVE_LIBURING
+	/* Try for an io_uring first. Waiting with a signal mask requires IORING_FEAT_EXT_ARG */
+	memset(&params, 0, sizeof(params));
+	if((res = io_uring_queue_init_params(URING_ENTRIES, &ph->ring, &params)) < 0){
+		debug(DEBUG_EXPECTED, "%s: io_uring not available (%s), using epoll", __func__, strerror(-res));
+	}
+	else if(!(params.features & IORING_FEAT_EXT_ARG)){
+		debug(DEBUG_EXPECTED, "%s: io_uring lacks IORING_FEAT_EXT_ARG, using epoll", __func__);
+		io_uring_queue_exit(&ph->ring);
+	}
+	else{
+		ph->useURing = TRUE;
+		ph->magic = PH_MAGIC;
+		ph->maxevents = maxEvents;
+		debug(DEBUG_ACTION, "%s: Using io_uring", __func__);
+		return ph;
+	}
+#endif
+	
 	/* Try and get an epoll FD */
 	if ((fd = epoll_create1(EPOLL_CLOEXEC)) < 0){
 		/* Error encountered */
 		debug(DEBUG_UNEXPECTED, "%s: epoll_create() error: %s", __func__, strerror(errno));
+		talloc_free(ph);
 		return NULL;
 	}
-	/* Allocate the object structure */
-	MALLOC_FAIL(ph = talloc_zero(ctx, PollHeader_t))
 	
 	/* Fill it in */
 	ph->magic = PH_MAGIC;
@@ -328,6 +916,23 @@ Bool PollDestroy(void *pHead)
 	PollHeaderPtr_t ph = pHead;
 	ASSERT_FAIL(ph)
 	ASSERT_FAIL(PH_MAGIC == ph->magic)
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		/* Release the buffer rings, then tear down the ring */
+		while(ph->peHead){
+			PollEntryPtr_t e = ph->peHead;
+			removePollItem(ph, e);
+			freePollItem(ph, e);
+		}
+		while(ph->deadHead){
+			freePollItem(ph, ph->deadHead);
+		}
+		io_uring_queue_exit(&ph->ring);
+		ph->magic = 0;
+		talloc_free(ph);
+		return PASS;
+	}
+#endif
 	if(close(ph->fd) < 0){
 		debug(DEBUG_UNEXPECTED, "%s: close() error: %s", __func__, strerror(errno));
 		return FAIL;
@@ -368,6 +973,92 @@ Bool PollRegEvent(void *pHead, int regFD, uint32_t watchType, void (*action)(int
 	return res;
 }
 
+/*
+ * Register a datagram receiver
+ *
+ * The poller reads the datagrams and passes them to the action function.
+ * With io_uring, a multishot recvmsg into a ring of provided buffers is used, so each datagram
+ * costs no system calls. With epoll, all waiting datagrams are read each time the socket 
+ * becomes readable.
+ *
+ * The buffer passed to the action function is only valid for the duration of the call.
+ * The receive info passed with it has the kernel arrival time and socket drop count, if
+ * SO_TIMESTAMPNS and SO_RXQ_OVFL are enabled on the socket.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. The socket file descriptor to register
+ * 3. Size of each receive buffer
+ * 4. Number of receive buffers. Must be a power of 2 less than 32768.
+ * 5. A pointer to a function to call with each datagram received 
+ * 6. A pointer to a user object.
+ *
+ * Return value
+ *
+ * PASS if successful, otherwise FAIL
+ */
+ 
+Bool PollRegRecv(void *pHead, int regFD, unsigned bufSize, unsigned bufCount,
+void (*recvAction)(int fd, void *buf, int len, const PollRecvInfoPtr_t info, void *userObject), void *userObject)
+{
+	PollHeaderPtr_t ph = pHead;
+	PollEntryPtr_t e;
+	struct epoll_event event = (struct epoll_event) {0};
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(PH_MAGIC == ph->magic)
+	ASSERT_FAIL(recvAction)
+	ASSERT_FAIL(regFD >= 0)
+	ASSERT_FAIL(bufSize > 0)
+	ASSERT_FAIL(bufCount && (bufCount < 32768) && !(bufCount & (bufCount - 1)))
+	
+	/* Allocate a list entry */
+	MALLOC_FAIL(e = talloc_zero(pHead, PollEntry_t))
+	e->magic = PE_MAGIC;
+	e->userObject = userObject;
+	e->fd = regFD;
+	e->recvAction = recvAction;
+	e->kind = PEK_RECV;
+	e->watchType = POLL_WT_IN;
+	e->bufSize = bufSize;
+	e->bufCount = bufCount;
+	
+	/* Control message buffer for recvmsg */
+	MALLOC_FAIL(e->ctrl = talloc_array(e, char, RECV_CTRL_SIZE))
+	
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		/* Each provided buffer holds the recvmsg header, control messages, and the payload */
+		e->msgTemplate.msg_controllen = RECV_CTRL_SIZE;
+		e->slotSize = sizeof(struct io_uring_recvmsg_out) + RECV_CTRL_SIZE + bufSize;
+		MALLOC_FAIL(e->bufs = talloc_array(e, char, e->slotSize * bufCount))
+		/* If the kernel can't do provided buffer rings, poll for readiness and read */
+		uringSetupBufRing(ph, e);
+		uringArm(ph, e);
+		uringFlushIfIdle(ph);
+		appendPollItem(ph, e);
+		return PASS;
+	}
+#endif
+	/* Only one buffer needed for epoll */
+	e->bufCount = 1;
+	e->slotSize = bufSize;
+	MALLOC_FAIL(e->bufs = talloc_array(e, char, bufSize))
+	
+	/* Tell the kernel about the new poll entry */
+	event.events = EPOLLIN;
+	event.data.ptr = e;
+	if(epoll_ctl(ph->fd, EPOLL_CTL_ADD, regFD, &event)){
+		 debug(DEBUG_UNEXPECTED, "%s: epoll_ctl() error: %s", __func__, strerror(errno));
+		 talloc_free(e); /* Free the entry */
+		 return FAIL;
+	}
+	
+	appendPollItem(ph, e);
+	return PASS;
+}
+
 /*
  * Unregister an event
  *
@@ -412,24 +1103,132 @@ Bool PollUnRegEvent(void *pHead, int regFD)
 	/* Remove it */
 	removePollItem(ph, e);
 	
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		/* Cancel the outstanding request. The entry is freed when the kernel lets go of it */
+		if(e->armed){
+			uringCancel(ph, e);
+			uringFlushIfIdle(ph);
+		}
+		retirePollItem(ph, e);
+		return PASS;
+	}
+#endif
+	
 	/* Tell the kernel to remove the poll entry */
 	if(epoll_ctl(ph->fd, EPOLL_CTL_DEL , e->fd, pHead)){
 		 debug(DEBUG_UNEXPECTED, "%s: epoll_ctl() error: %s", __func__, strerror(errno));
-		 e->magic = 0;
-		 talloc_free(e); /* Free the entry anyway*/
+		 retirePollItem(ph, e); /* Free the entry anyway*/
 		 return FAIL;
 	}
 	
 	/* Free the poll entry */
 	
-	talloc_free(e);
+	retirePollItem(ph, e);
 	
 	return PASS;
 }
 
+/*
+ * Send a datagram
+ *
+ * With io_uring, the send is queued and submitted in a batch with any other sends
+ * and re-arms queued while dispatching events. Errors are logged when the send completes.
+ * Outside of event dispatch, the send is submitted immediately.
+ * With epoll, sendto() is called directly.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ * 2. The socket file descriptor to send on
+ * 3. Pointer to the data to send. It is copied if the send is queued.
+ * 4. Length of the data
+ * 5. Destination address
+ * 6. Length of the destination address
+ *
+ * Return value
+ *
+ * PASS if the datagram was sent or queued, otherwise FAIL
+ */
 
+Bool PollSendTo(void *pHead, int fd, const void *buf, unsigned len, const struct sockaddr *addr, socklen_t addrLen)
+{
+	PollHeaderPtr_t ph = pHead;
+	int bytesSent;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(PH_MAGIC == ph->magic)
+	ASSERT_FAIL(buf)
+	ASSERT_FAIL(fd >= 0)
+	ASSERT_FAIL(addrLen <= sizeof(struct sockaddr_storage))
+	
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		PollSendOpPtr_t so;
+		struct io_uring_sqe *sqe;
+		
+		/* Copy the data and destination so the caller can free them */
+		MALLOC_FAIL(so = talloc_zero(ph, PollSendOp_t))
+		MALLOC_FAIL(so->iov.iov_base = talloc_memdup(so, buf, len))
+		so->magic = PS_MAGIC;
+		so->fd = fd;
+		so->iov.iov_len = len;
+		if(addr){
+			memcpy(&so->addr, addr, addrLen);
+			so->msg.msg_name = &so->addr;
+			so->msg.msg_namelen = addrLen;
+		}
+		so->msg.msg_iov = &so->iov;
+		so->msg.msg_iovlen = 1;
+		
+		sqe = uringGetSQE(ph);
+		io_uring_prep_sendmsg(sqe, fd, &so->msg, 0);
+		io_uring_sqe_set_data(sqe, so);
+		uringFlushIfIdle(ph);
+		return PASS;
+	}
+#endif
+	if((bytesSent = sendto(fd, buf, len, 0, addr, addrLen)) != len){
+		debug(DEBUG_UNEXPECTED, "%s: sendto() error: %s", __func__, strerror(errno));
+		return FAIL;
+	}
+	return PASS;
+}
 
 
+/*
+ * Submit any queued sends and requests now
+ *
+ * Used before shutting down, when PollWait won't be called again.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to poll object 
+ *
+ * Return value
+ *
+ * PASS if successful, otherwise FAIL
+ */
+
+Bool PollFlush(void *pHead)
+{
+	PollHeaderPtr_t ph = pHead;
+	
+	ASSERT_FAIL(ph)
+	ASSERT_FAIL(PH_MAGIC == ph->magic)
+	
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		int res;
+		if((res = io_uring_submit(&ph->ring)) < 0){
+			debug(DEBUG_UNEXPECTED, "%s: io_uring_submit() failed: %s",__func__, strerror(-res));
+			return FAIL;
+		}
+	}
+#endif
+	return PASS;
+}
+
 /* 
  * Wait for a poll event to occur
  *
@@ -454,6 +1253,39 @@ Bool PollWait(void *pHead, const sigset_t *sigmask )
 	ASSERT_FAIL(ph)
 	ASSERT_FAIL(PH_MAGIC == ph->magic)
 	
+#ifdef HAVE_LIBURING
+	if(ph->useURing){
+		struct io_uring_cqe *cqe;
+		void *data;
+		int res;
+		unsigned flags;
+		
+		for(;;){ /* Loop until a serious error occurs */
+			/* Submit everything queued, and wait for at least one completion */
+			if((res = io_uring_submit_and_wait_timeout(&ph->ring, &cqe, 1, NULL, (sigset_t *) sigmask)) < 0){
+				if((-EINTR == res) || (-ETIME == res)){
+					continue;
+				}
+				debug(DEBUG_UNEXPECTED, "%s: io_uring wait failed: %s",__func__, strerror(-res));
+				break;
+			}
+			ph->inDispatch = TRUE;
+			/* Process all completions */
+			while(0 == io_uring_peek_cqe(&ph->ring, &cqe)){
+				data = io_uring_cqe_get_data(cqe);
+				res = cqe->res;
+				flags = cqe->flags;
+				io_uring_cqe_seen(&ph->ring, cqe);
+				uringComplete(ph, data, res, flags);
+			}
+			ph->inDispatch = FALSE;
+			/* Free any entries unregistered during the actions */
+			sweepDeadItems(ph);
+		}
+		return FAIL;
+	}
+#endif
+	
 	for(;;){ /* Loop until a serious error occurs */
 		if((eventCount = epoll_pwait(ph->fd, ph->eventlist, ph->maxevents, -1, sigmask)) < 0){
 			if(EINTR == errno){
@@ -469,7 +1301,11 @@ Bool PollWait(void *pHead, const sigset_t *sigmask )
 		else{
 			if(eventCount){
 				/* got an event or series of events */
+				ph->inDispatch = TRUE;
 				doEventList(ph, eventCount);
+				ph->inDispatch = FALSE;
+				/* Free any entries unregistered during the actions */
+				sweepDeadItems(ph);
 			}
 			
 		}
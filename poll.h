@@ -15,6 +15,20 @@
 #define POLL_WT_OS		0x80
 
 
+/*
+ * Per datagram information passed to receive actions
+ */
+ 
+typedef struct PollRecvInfo_s {
+	Bool haveTimestamp; /* Kernel arrival time is valid (needs SO_TIMESTAMPNS) */
+	Bool haveDropCount; /* Socket drop count is valid (needs SO_RXQ_OVFL) */
+	Bool truncated; /* Datagram was larger than the buffer */
+	uint32_t dropCount; /* Total datagrams dropped by the socket so far */
+	struct timespec timestamp; /* Kernel arrival time, CLOCK_REALTIME */
+} PollRecvInfo_t;
+
+typedef PollRecvInfo_t * PollRecvInfoPtr_t;
+
 /*
  * Public functions
  */
@@ -24,7 +38,11 @@ Bool PollDestroy(void *pHead);
 
 Bool PollRegEvent(void *pHead, int regFD, uint32_t watchType, 
 void (*action)(int fd, int event, void *userObject), void *userObject);
+Bool PollRegRecv(void *pHead, int regFD, unsigned bufSize, unsigned bufCount,
+void (*recvAction)(int fd, void *buf, int len, const PollRecvInfoPtr_t info, void *userObject), void *userObject);
 Bool PollUnRegEvent(void *pHead, int regFD);
+Bool PollSendTo(void *pHead, int fd, const void *buf, unsigned len, const struct sockaddr *addr, socklen_t addrLen);
+Bool PollFlush(void *pHead);
 Bool PollWait(void *pHead, const sigset_t *sigmask);
 
 #endif
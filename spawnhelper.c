@@ -0,0 +1,463 @@
+/*
+* spawnhelper.c
+*
+* Copyright (C) 2013 Stephen Rodgers
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 3
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*
+*
+* Stephen "Steve" Rodgers <hwstar@rodgers.sdcoxmail.com>
+*
+* Spawn helper. A small process is forked before the receive threads are started.
+* Commands from the spawn() script function are passed to it over a socket pair,
+* and it starts them with posix_spawn(), so the daemon itself is never forked.
+* The helper reaps its children, limits how many run at once, and queues the rest.
+*
+* For each command, the helper sends back a result, which is read through the poller
+* to keep the statistics and log failures.
+*
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <talloc.h>
+
+#include "defs.h"
+#include "types.h"
+#include "notify.h"
+#include "util.h"
+#include "poll.h"
+#include "spawnhelper.h"
+
+#define SPAWN_MAX_COMMAND 4096 /* Longest command, including the terminating nul */
+#define SPAWN_MAX_QUEUED 64 /* Commands waiting for a child to finish */
+
+extern char **environ;
+
+/* Result types */
+
+enum {SR_SPAWNED = 0, SR_FAILED, SR_EXITED};
+
+/* Request from the daemon to the helper */
+
+typedef struct spawnRequest_s {
+	struct timespec queued; /* When spawn() was called. CLOCK_MONOTONIC */
+	char command[SPAWN_MAX_COMMAND];
+} spawnRequest_t, *spawnRequestPtr_t;
+
+/* Result from the helper to the daemon */
+
+typedef struct spawnResult_s {
+	int type;
+	int err; /* errno for SR_FAILED, wait status for SR_EXITED */
+	pid_t pid;
+	unsigned latencyUs; /* Time from spawn() to the child starting */
+} spawnResult_t, *spawnResultPtr_t;
+
+/* Daemon side. Statistics are only touched by the poller thread */
+
+static void *helperPoller = NULL;
+static int helperSock = -1;
+static pid_t helperPid = -1;
+static unsigned statSpawned, statFailed, statExited, statExitErrors;
+static double statLatencySumUs, statLatencyMaxUs;
+
+
+/*
+ * Return the microseconds between two monotonic times
+ */
+
+static unsigned usSince(const struct timespec *then, const struct timespec *now)
+{
+	long long us = ((now->tv_sec - then->tv_sec) * 1000000LL) + ((now->tv_nsec - then->tv_nsec) / 1000);
+
+	return (us < 0) ? 0 : (unsigned) us;
+}
+
+/*
+ * Helper: send a result to the daemon
+ *
+ * Arguments:
+ *
+ * 1. Socket to the daemon
+ * 2. Result type
+ * 3. errno or wait status
+ * 4. Child process id
+ * 5. Spawn latency in microseconds
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void helperResult(int sock, int type, int err, pid_t pid, unsigned latencyUs)
+{
+	spawnResult_t sr = {type, err, pid, latencyUs};
+
+	/* The daemon may have gone. The helper notices on its next read */
+	(void) send(sock, &sr, sizeof(sr), MSG_NOSIGNAL);
+}
+
+/*
+ * Helper: start a command with posix_spawn, and report the result
+ *
+ * Arguments:
+ *
+ * 1. Socket to the daemon
+ * 2. Spawn attributes
+ * 3. Request containing the command
+ *
+ * Return value:
+ *
+ * TRUE if a child was started
+ */
+
+static Bool helperLaunch(int sock, posix_spawnattr_t *attr, spawnRequestPtr_t req)
+{
+	struct timespec now;
+	pid_t pid;
+	int err;
+	char *argv[] = {"sh", "-c", req->command, NULL};
+
+	err = posix_spawnp(&pid, "sh", NULL, attr, argv, environ);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(err){
+		helperResult(sock, SR_FAILED, err, 0, usSince(&req->queued, &now));
+		return FALSE;
+	}
+	helperResult(sock, SR_SPAWNED, 0, pid, usSince(&req->queued, &now));
+	return TRUE;
+}
+
+/*
+ * Helper process main loop. Never returns.
+ *
+ * Arguments:
+ *
+ * 1. Socket to the daemon
+ * 2. Maximum number of children to run at once
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void helperMain(int sock, unsigned maxChildren)
+{
+	sigset_t mask, empty;
+	posix_spawnattr_t attr;
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	spawnRequestPtr_t queue;
+	spawnRequest_t req;
+	unsigned running = 0, qHead = 0, qCount = 0;
+	int sfd, fd, status, maxFD;
+	ssize_t len;
+	pid_t pid;
+
+	/* Drop everything inherited from the daemon which is not needed */
+	maxFD = sysconf(_SC_OPEN_MAX);
+	for(fd = 3; fd < maxFD; fd++){
+		if(fd != sock){
+			close(fd);
+		}
+	}
+
+	/* The daemon lets the kernel reap its children. Here they are waited on */
+	signal(SIGCHLD, SIG_DFL);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	if(-1 == (sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC))){
+		_exit(1);
+	}
+
+	/* Children start with no signals blocked, and default actions */
+	sigemptyset(&empty);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &empty);
+	sigfillset(&mask);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	if(!(queue = malloc(SPAWN_MAX_QUEUED * sizeof(spawnRequest_t)))){
+		_exit(1);
+	}
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sfd;
+	pfd[1].events = POLLIN;
+
+	for(;;){
+		if(poll(pfd, 2, -1) < 0){
+			if(EINTR == errno){
+				continue;
+			}
+			_exit(1);
+		}
+
+		/* Reap children, and start queued commands in their place */
+		if(pfd[1].revents & POLLIN){
+			while(sizeof(si) == read(sfd, &si, sizeof(si)));
+			while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+				running--;
+				helperResult(sock, SR_EXITED, status, pid, 0);
+			}
+			while(qCount && (running < maxChildren)){
+				if(helperLaunch(sock, &attr, queue + qHead)){
+					running++;
+				}
+				qHead = (qHead + 1) % SPAWN_MAX_QUEUED;
+				qCount--;
+			}
+		}
+
+		if(pfd[0].revents & (POLLIN | POLLHUP)){
+			len = recv(sock, &req, sizeof(req), 0);
+			if(0 == len){
+				_exit(0); /* The daemon has gone. Children carry on */
+			}
+			if(len < (ssize_t) (sizeof(req.queued) + 1)){
+				continue;
+			}
+			req.command[SPAWN_MAX_COMMAND - 1] = 0;
+			if(running < maxChildren){
+				if(helperLaunch(sock, &attr, &req)){
+					running++;
+				}
+			}
+			else if(qCount < SPAWN_MAX_QUEUED){
+				memcpy(queue + ((qHead + qCount) % SPAWN_MAX_QUEUED), &req, len);
+				qCount++;
+			}
+			else{
+				helperResult(sock, SR_FAILED, EAGAIN, 0, 0);
+			}
+		}
+	}
+}
+
+/*
+ * Poller callback. Read results from the helper.
+ *
+ * Arguments:
+ *
+ * 1. Socket to the helper
+ * 2. Events (not used)
+ * 3. User object (not used)
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void resultAction(int fd, int event, void *userObject)
+{
+	spawnResult_t sr;
+	ssize_t len;
+
+	while((len = recv(fd, &sr, sizeof(sr), MSG_DONTWAIT)) == sizeof(sr)){
+		switch(sr.type){
+			case SR_SPAWNED:
+				statSpawned++;
+				statLatencySumUs += sr.latencyUs;
+				if(sr.latencyUs > statLatencyMaxUs){
+					statLatencyMaxUs = sr.latencyUs;
+				}
+				debug(DEBUG_ACTION, "Spawned pid %d in %u us", sr.pid, sr.latencyUs);
+				break;
+
+			case SR_FAILED:
+				statFailed++;
+				debug(DEBUG_UNEXPECTED, "Spawn failed: %s", (EAGAIN == sr.err) ? "too many commands queued" : strerror(sr.err));
+				break;
+
+			case SR_EXITED:
+				statExited++;
+				if(!WIFEXITED(sr.err) || WEXITSTATUS(sr.err)){
+					statExitErrors++;
+					debug(DEBUG_EXPECTED, "Spawned pid %d exited with status 0x%X", sr.pid, sr.err);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	if((0 == len) || ((len < 0) && (EAGAIN != errno) && (EINTR != errno))){
+		/* 
+		 * It can't be forked again now the threads are running, 
+		 * so commands are started directly from here on 
+		 */
+		debug(DEBUG_UNEXPECTED, "Spawn helper exited, starting commands directly");
+		PollUnRegEvent(helperPoller, fd);
+		close(fd);
+		helperSock = -1;
+		helperPid = -1;
+	}
+}
+
+/*
+ * Fork the spawn helper. Must be called before any threads are started.
+ *
+ * Arguments:
+ *
+ * 1. Poller to read the helper's results with
+ * 2. Maximum number of spawned commands to run at once
+ *
+ * Return value:
+ *
+ * Boolean. PASS indicates success, FAIL indicates failure.
+ */
+
+Bool SpawnHelperStart(void *poller, unsigned maxChildren)
+{
+	int sv[2];
+	pid_t pid;
+
+	ASSERT_FAIL(poller)
+	ASSERT_FAIL(maxChildren)
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: socketpair: %s", __func__, strerror(errno));
+		return FAIL;
+	}
+
+	if((pid = fork()) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: fork: %s", __func__, strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return FAIL;
+	}
+	if(!pid){ /* Helper */
+		close(sv[0]);
+		helperMain(sv[1], maxChildren);
+	}
+
+	close(sv[1]);
+	if(FAIL == PollRegEvent(poller, sv[0], POLL_WT_IN, resultAction, NULL)){
+		close(sv[0]);
+		return FAIL;
+	}
+	helperPoller = poller;
+	helperSock = sv[0];
+	helperPid = pid;
+	debug(DEBUG_STATUS, "Spawn helper started as pid %d, running up to %u commands", pid, maxChildren);
+	return PASS;
+}
+
+/*
+ * Stop the spawn helper. Commands it has started are left running.
+ *
+ * Arguments:
+ *
+ * None
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void SpawnHelperStop(void)
+{
+	if(helperSock >= 0){
+		PollUnRegEvent(helperPoller, helperSock);
+		/* The helper exits when it sees the socket close */
+		close(helperSock);
+		helperSock = -1;
+	}
+}
+
+/*
+ * Run a command with the shell.
+ * If the helper is not running, the command is started directly.
+ *
+ * Arguments:
+ *
+ * 1. The command.
+ *
+ * Return value:
+ *
+ * Boolean. PASS if the command was handed off, FAIL otherwise. Whether it
+ * started is reported by the helper, and logged.
+ */
+
+Bool SpawnHelperCommand(const String command)
+{
+	spawnRequest_t req;
+	size_t len;
+
+	ASSERT_FAIL(command)
+
+	if(helperSock < 0){
+		return UtilSpawn(command, NULL);
+	}
+
+	if((len = strlen(command)) >= SPAWN_MAX_COMMAND){
+		debug(DEBUG_UNEXPECTED, "Spawn command too long: %u characters", (unsigned) len);
+		return FAIL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &req.queued);
+	memcpy(req.command, command, len + 1);
+
+	/* Only the bytes in use are sent */
+	if(send(helperSock, &req, sizeof(req.queued) + len + 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0){
+		if((EPIPE == errno) || (ECONNRESET == errno)){
+			/* The helper has gone, and resultAction() hasn't seen it yet */
+			return UtilSpawn(command, NULL);
+		}
+		debug(DEBUG_UNEXPECTED, "Could not pass command to the spawn helper: %s", strerror(errno));
+		return FAIL;
+	}
+	return PASS;
+}
+
+/*
+ * Return the spawn statistics
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the result off of.
+ *
+ * Return value:
+ *
+ * String with the statistics as key=value pairs.
+ */
+
+String SpawnHelperGetStats(TALLOC_CTX *ctx)
+{
+	String res;
+
+	ASSERT_FAIL(ctx)
+
+	MALLOC_FAIL(res = talloc_asprintf(ctx, "spawn-helper-pid=%d spawned=%u spawn-failed=%u spawn-running=%u "
+	"spawn-exit-errors=%u spawn-latency-avg-us=%.0f spawn-latency-max-us=%.0f",
+	(helperSock >= 0) ? helperPid : -1, statSpawned, statFailed, statSpawned - statExited, statExitErrors,
+	(statSpawned) ? statLatencySumUs / statSpawned : 0.0, statLatencyMaxUs))
+
+	return res;
+}
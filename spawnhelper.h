@@ -0,0 +1,11 @@
+#ifndef SPAWNHELPER_H
+#define SPAWNHELPER_H
+
+#define SPAWN_DEF_MAX_CHILDREN 8
+
+Bool SpawnHelperStart(void *poller, unsigned maxChildren);
+void SpawnHelperStop(void);
+Bool SpawnHelperCommand(const String command);
+String SpawnHelperGetStats(TALLOC_CTX *ctx);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * bench.c
+ *
+ *  Copyright (C) 2013  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ *
+ * Stephen "Steve" Rodgers <hwstar@rodgers.sdcoxmail.com>
+ *
+ * Script engine benchmarks. Build with "make bench", and run tests/bench [rounds]
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <talloc.h>
+
+#include "defs.h"
+#include "types.h"
+#include "notify.h"
+#include "parser.h"
+#include "xplevent.h"
+
+#define DEFAULT_ROUNDS 1000
+#define EXEC_ROUNDS_MULT 100
+
+/* Thermostat style script with no functions, so it runs without an xPL service */
+static const String benchScript = 
+	"$xplout{setpoint} = 71.5;\n"
+	"$xplout{temp} = $xplnvin{current};\n"
+	"if($xplout{temp} >= $xplout{setpoint}){\n"
+	"	$xplout{command} = \"cool\";\n"
+	"	$xplout{level} = $xplnvin{fan};\n"
+	"}\n"
+	"else{\n"
+	"	if($xplnvin{current} <= 65){\n"
+	"		$xplout{command} = \"heat\";\n"
+	"	}\n"
+	"	else{\n"
+	"		$xplout{command} = \"off\";\n"
+	"	}\n"
+	"}\n"
+	"if($xplnvin{mode} eq \"auto\"){\n"
+	"	$xplout{mode} = $xplnvin{mode};\n"
+	"}\n";
+
+XPLEvGlobalsPtr_t Globals = NULL;
+
+/*
+ * Return the time in seconds from the monotonic clock
+ *
+ * Arguments:
+ *
+ * None
+ *
+ * Return value:
+ *
+ * Time in seconds
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/*
+ * Benchmark hash inserts and lookups through the ParserHash API
+ *
+ * Arguments:
+ *
+ * 1. Number of keys to put in the hash
+ * 2. Number of rounds to run
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void benchHash(unsigned numKeys, unsigned rounds)
+{
+	PcodeHeaderPtr_t ph;
+	String *keys;
+	const char *value;
+	unsigned i, r, misses = 0;
+	double start, insertTime = 0.0, lookupTime = 0.0;
+
+	MALLOC_FAIL(keys = talloc_array(NULL, String, numKeys))
+	for(i = 0; i < numKeys; i++){
+		MALLOC_FAIL(keys[i] = talloc_asprintf(keys, "key%u", i))
+	}
+
+	for(r = 0; r < rounds; r++){
+		MALLOC_FAIL(ph = talloc_zero(NULL, PcodeHeader_t))
+
+		start = now();
+		for(i = 0; i < numKeys; i++){
+			ParserHashAddKeyValue(ph, ph, "xplnvin", keys[i], keys[i]);
+		}
+		insertTime += now() - start;
+
+		start = now();
+		for(i = 0; i < numKeys; i++){
+			if(!(value = ParserHashGetValue(ph, ph, "xplnvin", keys[i]))){
+				misses++;
+			}
+			talloc_free((void *) value);
+		}
+		lookupTime += now() - start;
+
+		talloc_free(ph);
+	}
+
+	printf("hash keys=%-5u inserts/sec=%-12.0f lookups/sec=%-12.0f%s\n", numKeys,
+	(numKeys * rounds) / insertTime, (numKeys * rounds) / lookupTime, (misses) ? " LOOKUP MISSES" : "");
+
+	talloc_free(keys);
+}
+
+/*
+ * Benchmark script execution
+ *
+ * Arguments:
+ *
+ * 1. Label to print with the results
+ * 2. OPT_ optimizer passes to skip
+ * 3. Current temperature to run the script with
+ * 4. Number of executions
+ *
+ * Return value:
+ *
+ * None
+ */
+
+static void benchExec(const String label, unsigned skipPasses, const String current, unsigned rounds)
+{
+	ParseCtrlPtr_t parseCtrl;
+	PcodeHeaderPtr_t ph;
+	unsigned r;
+	double start, execTime;
+
+	MALLOC_FAIL(ph = talloc_zero(NULL, PcodeHeader_t))
+	MALLOC_FAIL(parseCtrl = talloc_zero(NULL, ParseCtrl_t))
+	parseCtrl->pcodeHeader = ph;
+	parseCtrl->skipPasses = skipPasses;
+
+	if(FAIL == ParserParseHCL(parseCtrl, FALSE, benchScript)){
+		fatal("Bench script did not compile: %s", parseCtrl->failReason);
+	}
+	talloc_free(parseCtrl);
+
+	ParserHashAddKeyValue(ph, ph, "xplnvin", "current", current);
+	ParserHashAddKeyValue(ph, ph, "xplnvin", "fan", "high");
+	ParserHashAddKeyValue(ph, ph, "xplnvin", "mode", "auto");
+
+	start = now();
+	for(r = 0; r < rounds; r++){
+		if(FAIL == ParserExecPcode(ph)){
+			fatal("Bench script failed: %s", ph->failReason);
+		}
+	}
+	execTime = now() - start;
+
+	printf("exec %-10s current=%-4s execs/sec=%-12.0f instrs/exec=%-4lu instrs/sec=%-12.0f ic hits=%lu misses=%lu\n", label, current,
+	rounds / execTime, ph->instrCount / rounds, ph->instrCount / execTime, ph->icHits, ph->icMisses);
+	printf("exec %-10s arena bytes=%lu allocations=%lu\n", label, (unsigned long) ph->arenaBytes, (unsigned long) ph->arenaBlocks);
+
+	talloc_free(ph);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned rounds = DEFAULT_ROUNDS;
+
+	notify_init("bench");
+	notify_set_debug_level(0);
+
+	if(argc > 1){
+		rounds = atoi(argv[1]);
+	}
+	if(!rounds){
+		rounds = 1;
+	}
+
+	benchHash(10, rounds);
+	benchHash(100, rounds);
+	benchHash(1000, rounds);
+
+	/* Before and after superinstructions */
+	benchExec("unfused", OPT_FUSE, "80", rounds * EXEC_ROUNDS_MULT);
+	benchExec("fused", 0, "80", rounds * EXEC_ROUNDS_MULT);
+	benchExec("unfused", OPT_FUSE, "60", rounds * EXEC_ROUNDS_MULT);
+	benchExec("fused", 0, "60", rounds * EXEC_ROUNDS_MULT);
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+* timerwheel.c
+*
+* Copyright (C) 2013 Stephen Rodgers
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 3
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*
+*
+* Stephen "Steve" Rodgers <hwstar@rodgers.sdcoxmail.com>
+*
+* Hashed timer wheel. Timers are kept in the slot for their expiry tick modulo
+* the number of slots, so adding and removing a timer is constant time, and
+* advancing the wheel only looks at the slots for the ticks which have passed.
+*
+* The caller chooses what a tick is, and does any locking.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+
+#include "defs.h"
+#include "types.h"
+#include "notify.h"
+#include "timerwheel.h"
+
+#define TW_MAGIC 0x5C1E4B07
+
+typedef struct timerWheel_s {
+	unsigned magic;
+	unsigned numSlots;
+	unsigned count; /* Armed timers */
+	unsigned long now; /* Last tick advanced to */
+	TimerWheelTimerPtr_t *slots;
+} timerWheel_t;
+
+typedef timerWheel_t * timerWheelPtr_t;
+
+
+/*
+ * Create a timer wheel
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the wheel off of.
+ * 2. Number of slots. More slots means fewer timers looked at per tick.
+ * 3. The current tick.
+ *
+ * Return value:
+ *
+ * Generic pointer to the wheel.
+ */
+
+void *TimerWheelNew(TALLOC_CTX *ctx, unsigned numSlots, unsigned long now)
+{
+	timerWheelPtr_t tw;
+
+	ASSERT_FAIL(numSlots)
+
+	MALLOC_FAIL(tw = talloc_zero(ctx, timerWheel_t))
+	MALLOC_FAIL(tw->slots = talloc_zero_array(tw, TimerWheelTimerPtr_t, numSlots))
+	tw->magic = TW_MAGIC;
+	tw->numSlots = numSlots;
+	tw->now = now;
+	return tw;
+}
+
+/*
+ * Arm a timer. If the timer is already armed, it is moved to the new expiry tick.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the wheel.
+ * 2. Pointer to the timer.
+ * 3. Tick the timer expires on. Ticks already passed expire on the next advance.
+ * 4. User object passed to the callback when the timer expires.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void TimerWheelAdd(void *wheel, TimerWheelTimerPtr_t timer, unsigned long expiry, void *userObj)
+{
+	timerWheelPtr_t tw = wheel;
+	TimerWheelTimerPtr_t *slot;
+
+	ASSERT_FAIL(tw && timer)
+	ASSERT_FAIL(TW_MAGIC == tw->magic)
+
+	TimerWheelRemove(tw, timer);
+
+	if(expiry <= tw->now){
+		expiry = tw->now + 1;
+	}
+	timer->expiry = expiry;
+	timer->userObj = userObj;
+	timer->armed = TRUE;
+
+	slot = tw->slots + (expiry % tw->numSlots);
+	timer->prev = NULL;
+	timer->next = *slot;
+	if(*slot){
+		(*slot)->prev = timer;
+	}
+	*slot = timer;
+	tw->count++;
+}
+
+/*
+ * Disarm a timer. Does nothing if the timer is not armed.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the wheel.
+ * 2. Pointer to the timer.
+ *
+ * Return value:
+ *
+ * None
+ */
+
+void TimerWheelRemove(void *wheel, TimerWheelTimerPtr_t timer)
+{
+	timerWheelPtr_t tw = wheel;
+
+	ASSERT_FAIL(tw && timer)
+	ASSERT_FAIL(TW_MAGIC == tw->magic)
+
+	if(!timer->armed){
+		return;
+	}
+	if(timer->prev){
+		timer->prev->next = timer->next;
+	}
+	else{
+		tw->slots[timer->expiry % tw->numSlots] = timer->next;
+	}
+	if(timer->next){
+		timer->next->prev = timer->prev;
+	}
+	timer->next = timer->prev = NULL;
+	timer->armed = FALSE;
+	tw->count--;
+}
+
+/*
+ * Advance the wheel, calling the callback for each timer which expires.
+ *
+ * Timers are disarmed before the callback is called, so the callback may
+ * re-arm them, or free the objects they are embedded in. It must not disarm
+ * other timers.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the wheel.
+ * 2. The current tick.
+ * 3. Callback to call for each expired timer.
+ * 4. Object passed through to the callback.
+ *
+ * Return value:
+ *
+ * The number of timers which expired.
+ */
+
+unsigned TimerWheelAdvance(void *wheel, unsigned long now, TimerWheelCallback_t callback, void *cbObj)
+{
+	timerWheelPtr_t tw = wheel;
+	TimerWheelTimerPtr_t timer, next;
+	unsigned long tick, last;
+	unsigned expired = 0;
+
+	ASSERT_FAIL(tw && callback)
+	ASSERT_FAIL(TW_MAGIC == tw->magic)
+
+	if(now <= tw->now){
+		return 0;
+	}
+
+	/* A full turn visits every slot, so there is no need to go round again */
+	last = (now - tw->now > tw->numSlots) ? tw->now + tw->numSlots : now;
+
+	for(tick = tw->now + 1; tick <= last; tick++){
+		for(timer = tw->slots[tick % tw->numSlots]; timer && tw->count; timer = next){
+			next = timer->next;
+			/* Timers for later turns of the wheel share the slot */
+			if(timer->expiry > now){
+				continue;
+			}
+			TimerWheelRemove(tw, timer);
+			expired++;
+			(*callback)(timer, timer->userObj, cbObj);
+		}
+	}
+	tw->now = now;
+	return expired;
+}
+
+/*
+ * Return the tick the wheel was last advanced to
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the wheel.
+ *
+ * Return value:
+ *
+ * The tick
+ */
+
+unsigned long TimerWheelNow(void *wheel)
+{
+	timerWheelPtr_t tw = wheel;
+
+	ASSERT_FAIL(tw)
+	ASSERT_FAIL(TW_MAGIC == tw->magic)
+
+	return tw->now;
+}
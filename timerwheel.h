@@ -0,0 +1,24 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+/* Timer, embedded in the object it times */
+
+typedef struct TimerWheelTimer_s {
+	struct TimerWheelTimer_s *next;
+	struct TimerWheelTimer_s *prev;
+	unsigned long expiry; /* Tick the timer expires on */
+	Bool armed;
+	void *userObj;
+} TimerWheelTimer_t;
+
+typedef TimerWheelTimer_t * TimerWheelTimerPtr_t;
+
+typedef void (*TimerWheelCallback_t)(TimerWheelTimerPtr_t timer, void *userObj, void *cbObj);
+
+void *TimerWheelNew(TALLOC_CTX *ctx, unsigned numSlots, unsigned long now);
+void TimerWheelAdd(void *wheel, TimerWheelTimerPtr_t timer, unsigned long expiry, void *userObj);
+void TimerWheelRemove(void *wheel, TimerWheelTimerPtr_t timer);
+unsigned TimerWheelAdvance(void *wheel, unsigned long now, TimerWheelCallback_t callback, void *cbObj);
+unsigned long TimerWheelNow(void *wheel);
+
+#endif
@@ -32,12 +32,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <time.h>
 #include <talloc.h>
 #include "defs.h"
 #include "types.h"
 #include "notify.h"
 #include "util.h"
 
+extern char **environ;
+
 /*
  * Replace a string with a new one freeing the existing string if the pointer is non-null, or
  * initializing the pointer with a copy of the new string if it is null. This is useful for
@@ -667,7 +671,8 @@ Bool UtilPIDWrite(const String filename, pid_t pid) {
 }
 
 /*
-* Fork and execute a command by invoking the shell and passing the command to it. 
+* Execute a command by invoking the shell and passing the command to it. 
+* posix_spawn() is used, so the caller's memory is not copied.
 *
 * Arguments:
 *
@@ -681,32 +686,41 @@ Bool UtilPIDWrite(const String filename, pid_t pid) {
 
 Bool UtilSpawn(const String command, pid_t *pid)
 {
-	String id = "UtilForkAndExec";
-	pid_t retval;
+	String id = "UtilSpawn";
+	pid_t child;
+	int err;
+	char *argv[] = {"sh", "-c", command, NULL};
 	
 	ASSERT_FAIL(command)
 	
-	if((retval = fork())){
-		if(retval > 0){
-			if(pid){
-				*pid = retval;
-			}
-			/*  Parent */
-			return PASS;
-		}
-		else{
-			/* Error */
-			debug(DEBUG_UNEXPECTED, "%s: Fork failure: %s", id, strerror(errno));
-			return FAIL;
-		}
+	if((err = posix_spawnp(&child, "sh", NULL, NULL, argv, environ))){
+		debug(DEBUG_UNEXPECTED, "%s: Spawn failure: %s", id, strerror(err));
+		return FAIL;
 	}
-	else{ /* Child */
-		execlp("sh","sh","-c", command, (String) NULL);
-		exit(1);
+	if(pid){
+		*pid = child;
 	}
-	return FAIL;
+	return PASS;
 }
 
+/*
+* Return the seconds from the monotonic clock. Setting the time of day doesn't move it,
+* so it is used for timeouts.
+*
+* Arguments:
+*
+* None
+*
+* Return value:
+*
+* Seconds since some unspecified point in the past.
+*/
 
-
+unsigned long UtilMonoSeconds(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec;
+}
 
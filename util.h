@@ -16,6 +16,7 @@ Bool UtilStoi(const String val, int *res);
 Bool UtilStou(const String val, unsigned *res);
 String UtilStripWhite(TALLOC_CTX *ctx, String orig);
 String UtilReplaceString(String *ptrToStringPtr, TALLOC_CTX *newCTX, String newStringToCopy);
+unsigned long UtilMonoSeconds(void);
 
 
 #endif
@@ -66,6 +66,7 @@
 #define XM_MAGIC 0x5719034F
 #define XS_MAGIC 0xA68C9F24
 #define XNV_MAGIC 0x7983E098
+#define XF_MAGIC 0x2E6B91D4
 
 #define GENERAL_POOL_SIZE 128*1024
 #define MSG_MAX_SIZE 1500
@@ -155,6 +156,17 @@ typedef struct xplService_s {
 	
 } xplService_t, *xplServicePtr_t;
 
+typedef struct xplFilter_s {
+	unsigned magic;
+	String source; /* vendor-device.instance, or * for any */
+	String schema; /* class.type, or * for any */
+	void *userObj; /* User-supplied object for filter callback */
+	XPLFilterFunc_t func; /* Called on a match */
+	void *xplObj; /* Pointer back to master object */
+	struct xplFilter_s *prev;
+	struct xplFilter_s *next;
+} xplFilter_t, *xplFilterPtr_t;
+
 typedef struct xplObj_s {
 	unsigned magic;
 	int localConnFD; /* FD for packets from HUB */
@@ -164,6 +176,8 @@ typedef struct xplObj_s {
 	int broadcastAddrLen; /* Indicates length of data in broadcastAddr stuct below */
 	int localConnPort; /* Ephemeral port for packets sent from local hub */
 	int ticks; /* Tick counter */
+	unsigned rxThreads; /* Number of receive threads to use */
+	unsigned rcvBufSize; /* Receive socket buffer size, or 0 for the system default */
 	void *poller; /* Pointer to the poller object supplied by the user */
 	void *rcvr; /* Pointer to the receiver object */
 	void *generalPool; /* Pointer to general memory pool for strings and structs */
@@ -173,6 +187,7 @@ typedef struct xplObj_s {
 	String uniqPrefix; /* Unique 4 digit prefix based on IP address passed in */
 	xplServicePtr_t servHead; /* Head for linked list of services */
 	xplServicePtr_t servTail; /* Tail for linked list of services */
+	xplFilterPtr_t filterHead; /* Head for linked list of message filters */
 	struct sockaddr_storage broadcastAddr; /* Holds the broadcast address data for sending XPL packets */
 } xplObj_t, *xplObjPtr_t;
 
@@ -183,8 +198,10 @@ typedef enum { HBEAT_NORMAL, HBEAT_CONFIG, HBEAT_NORMAL_END, HBEAT_CONFIG_END }
 */
 
 static Bool sendHeartbeat(xplServicePtr_t theService);
+static void updateEchoFilter(xplObjPtr_t xp);
 static xplMessagePtr_t parseMessage(xplObjPtr_t xp, String theText);
 static void releaseMessage(xplMessagePtr_t xm);
+static void runFilters(xplObjPtr_t xp, xplMessagePtr_t xm);
 
 /*
  * In memory constants
@@ -415,6 +432,8 @@ static void rxReadyAction(int fd, int event, void *objPtr)
 			if(xm){
 				debug(DEBUG_ACTION, "Message parsed OK");
 
+				/* Give the message to any filters first */
+				runFilters(xp, xm);
 				
 				/* Dispatch message to appropriate handler */
 				
@@ -481,6 +500,8 @@ static void rxReadyAction(int fd, int event, void *objPtr)
 								debug(DEBUG_EXPECTED, "******* Hub confirmed! *******");
 								cse->discoveryState = XPL_HUB_CONFIRMED;
 								cse->heartbeatTimer = cse->heartbeatInterval;
+								/* Echoes other than heartbeats may now be dropped early */
+								updateEchoFilter(xp);
 							}
 							
 							
@@ -597,6 +618,13 @@ static int addLocalSock(int sock, void *addr, int addrlen, int family, int sockt
 	if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &flag, sizeof(flag)) < 0){
 		fatal("%s: Unable to set SO_BROADCAST on socket %s (%d)", __func__, strerror_r(errno, eStr, 64), errno);
 	}
+	
+	/* If there will be more than one receive thread, the port must be shareable */
+	if (xp->rxThreads > 1){
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0){
+			fatal("%s: Unable to set SO_REUSEPORT on socket %s (%d)", __func__, strerror_r(errno, eStr, 64), errno);
+		}
+	}
 
 	/* Attempt to bind */
 	if ((bind(sock, addr, addrlen)) < 0){
@@ -784,6 +812,60 @@ static void releaseMessage(xplMessagePtr_t xm)
 	talloc_free(xm);
 }
 
+/*
+ * Test one field of a message against a filter pattern. * or an empty pattern matches anything.
+ */
+
+static Bool filterFieldMatches(const String pattern, const String field)
+{
+	return ((!pattern[0]) || (!strcmp(pattern, "*")) || (!strcmp(pattern, field)));
+}
+
+/*
+ * Call the function of each filter which matches a received message
+ *
+ * A filter function may remove its own filter, and add new ones. New filters
+ * go on the head of the list, so they don't see the message which caused them
+ * to be added.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the master xpl object.
+ * 2. Pointer to the received message.
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void runFilters(xplObjPtr_t xp, xplMessagePtr_t xm)
+{
+	xplFilterPtr_t xf, next;
+	char source[128];
+	char schema[64];
+
+	if(!xp->filterHead){
+		return; /* Nothing waiting */
+	}
+
+	if((!xm->sourceVendor) || (!xm->sourceDeviceID) || (!xm->sourceInstanceID) ||
+	(!xm->schemaClass) || (!xm->schemaType)){
+		return;
+	}
+
+	snprintf(source, sizeof(source), "%s-%s.%s", xm->sourceVendor, xm->sourceDeviceID, xm->sourceInstanceID);
+	snprintf(schema, sizeof(schema), "%s.%s", xm->schemaClass, xm->schemaType);
+
+	for(xf = xp->filterHead; xf; xf = next){
+		ASSERT_FAIL(XF_MAGIC == xf->magic)
+		next = xf->next;
+		if(filterFieldMatches(xf->source, source) && filterFieldMatches(xf->schema, schema)){
+			debug(DEBUG_ACTION, "Message from %s schema %s matched a filter", source, schema);
+			(*xf->func)(xm, xf->userObj);
+		}
+	}
+}
+
 
 /* 
  * Send a message string in the tx Buffer in the service object. 
@@ -802,19 +884,17 @@ static void releaseMessage(xplMessagePtr_t xm)
 static Bool sendRawMessage(xplMessagePtr_t xm)
 {
 	
-	int bytesSent;
-	char eStr[64];
 	xplObjPtr_t xp = xm->xplObj;
 	
 	unsigned buffLen = xm->txBuffBytesWritten;
 
-	/* Try to send the message */
-	if ((bytesSent = sendto(xp->broadcastFD, xm->txBuff, buffLen, 0, 
-		(struct sockaddr *) &xp->broadcastAddr, sizeof(struct sockaddr_storage))) != buffLen) {
-		debug(DEBUG_UNEXPECTED, "Unable to broadcast message, %s (%d)", strerror_r(errno, eStr, 64), errno);
+	/* Try to send the message. The poller may queue it and send it in a batch with others */
+	if (FAIL == PollSendTo(xp->poller, xp->broadcastFD, xm->txBuff, buffLen,  
+		(struct sockaddr *) &xp->broadcastAddr, sizeof(struct sockaddr_storage))) {
+		debug(DEBUG_UNEXPECTED, "Unable to broadcast message");
 		return FALSE;
 	}
-	debug(DEBUG_INCOMPLETE, "Broadcasted %d bytes (of %d attempted)", bytesSent, buffLen);
+	debug(DEBUG_INCOMPLETE, "Broadcasted %d bytes", buffLen);
 	return TRUE;
 }
 
@@ -1774,6 +1854,57 @@ static xplServicePtr_t createService(xplObjPtr_t xp, String theVendor, String th
 	return xs;
 }
 
+/*
+ * Tell the receiver which of our own messages it can drop without queueing them
+ *
+ * Only done when a single service is enabled, since with more than one, each service
+ * needs to see the others' messages. The service must have a confirmed hub, and a report mode
+ * which ignores its own messages. Heartbeat echoes are always kept by the receiver so that
+ * the hub confirmation logic keeps working.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the master XPL object
+ *
+ * Return value
+ *
+ * None
+ */
+
+static void updateEchoFilter(xplObjPtr_t xp)
+{
+	xplServicePtr_t xs, enabled = NULL;
+	unsigned numEnabled = 0;
+	String tag = NULL;
+	
+	ASSERT_FAIL(xp)
+	ASSERT_FAIL(XP_MAGIC == xp->magic)
+	
+	if(!xp->rcvr){
+		return;
+	}
+	
+	for(xs = xp->servHead; xs; xs = xs->next){
+		if(xs->serviceEnabled){
+			enabled = xs;
+			numEnabled++;
+		}
+	}
+	
+	if((1 == numEnabled) && (XPL_HUB_CONFIRMED == enabled->discoveryState) &&
+		(((XPL_REPORT_MODE_NORMAL == enabled->reportMode) && !enabled->reportGroupMessages) ||
+		(XPL_REPORT_CONFIG_MESSAGES_ONLY == enabled->reportMode))){
+		MALLOC_FAIL(tag = talloc_asprintf(xp, "%s-%s.%s", enabled->serviceVendor, 
+		enabled->serviceDeviceID, enabled->serviceInstanceID))
+		debug(DEBUG_ACTION, "%s: Dropping non-heartbeat echoes from %s", __func__, tag);
+		XplrxSetEchoFilter(xp->rcvr, &tag, 1);
+		talloc_free(tag);
+	}
+	else{
+		XplrxSetEchoFilter(xp->rcvr, NULL, 0);
+	}
+}
+
 /* 
  * Set service state
  *
@@ -1818,6 +1949,9 @@ static void setServiceState(xplServicePtr_t xs, Bool newState)
 		/* Send goodbye heartbeat */
 		sendGoodbyeHeartbeat(xs);
 	}
+	
+	/* The set of echoes which can be dropped may have changed */
+	updateEchoFilter(xs->xplObj);
 }
 
 
@@ -1859,6 +1993,9 @@ void XplDestroy(void *xplObj)
 		}	
 	}
 	
+	/* Make sure the goodbye heartbeats go out if the poller queued them */
+	PollFlush(xp->poller);
+	
 	/* Destroy the receiver object */
 	if(xp->rcvr){
 		XplRXDestroy(xp->rcvr);
@@ -1906,6 +2043,9 @@ void XplDestroy(void *xplObj)
  * 2. A poll object. (See poll.c for details).
  * 3. A string containing an IP address of the interface to use to broadcast messages.
  * 4. A string containing the service name or port number to use. Usually set to "3865".
+ * 5. The number of receive threads to use. Values greater than 1 bind several sockets to the
+ *    ephemeral port using SO_REUSEPORT, each one served by its own thread.
+ * 6. The receive socket buffer size in bytes, or 0 to use the system default.
  *
  * Return value
  *
@@ -1914,7 +2054,7 @@ void XplDestroy(void *xplObj)
  */
  
 
-void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort)
+void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort, unsigned rxThreads, unsigned rcvBufSize)
 {
 	xplObjPtr_t xp = NULL;
 	char interfaceAddr[INET6_ADDRSTRLEN];
@@ -1998,6 +2138,10 @@ void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort)
 	/* Save the poller object passed in */
 	xp->poller = Poller;
 	
+	/* Save the number of receive threads and the receive buffer size */
+	xp->rxThreads = rxThreads;
+	xp->rcvBufSize = rcvBufSize;
+	
 	
 	/* Allocate a working string pool */
 	MALLOC_FAIL(xp->generalPool = talloc_pool(xp, GENERAL_POOL_SIZE))
@@ -2055,7 +2199,7 @@ void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort)
 	}
 	
 	/* Initialize receiver thread */
-	if(NULL == (xp->rcvr = XplRXInit(xp->localConnFD, xp->localConnPort, xp->rxReadyFD))){
+	if(NULL == (xp->rcvr = XplRXInit(xp->localConnFD, xp->localConnPort, xp->rxReadyFD, xp->rxThreads, xp->rcvBufSize))){
 		debug(DEBUG_UNEXPECTED, "%s: Could not initialize xpl recever thread", __func__);
 		XplDestroy(xp);
 		return NULL;
@@ -2063,6 +2207,31 @@ void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort)
 	
 	return xp;
 }
+
+/*
+ * Return xPL statistics
+ *
+ * Arguments:
+ *
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to the master XPL object
+ *
+ * Return value:
+ *
+ * A string of space separated name=value pairs.
+ */
+ 
+String XplGetStats(TALLOC_CTX *ctx, void *xplObj)
+{
+	xplObjPtr_t xp = xplObj;
+	
+	ASSERT_FAIL(ctx)
+	ASSERT_FAIL(xp)
+	ASSERT_FAIL(XP_MAGIC == xp->magic)
+	
+	return XplrxGetStats(ctx, xp->rcvr);
+}
+
 /*
  * Create a new service object
  * Service will be created in the disabled state.
@@ -2189,6 +2358,9 @@ Bool XplDestroyService(void *servToDestroy)
 	/* Free all of its memory and any children it allocated */
 	talloc_free(xst);
 	
+	/* The set of echoes which can be dropped may have changed */
+	updateEchoFilter(xp);
+	
 	return TRUE;
 	
 }
@@ -2516,6 +2688,9 @@ void XplAddMessageListener(void *XPLService, XPLListenerReportMode_t reportMode,
 	xs->reportGroupMessages = reportGroupMessages;
 	xs->userListenerObject = userObj;
 	xs->listener = listener;
+	
+	/* The report mode decides which echoes can be dropped */
+	updateEchoFilter(xs->xplObj);
 }
 
 /*
@@ -2540,6 +2715,93 @@ void XplRemoveMessageListener(void *XPLService)
 	xs->listener = NULL;
 }
 
+/*
+ * Add a message filter
+ *
+ * The filter function is called with every received message which matches the source and schema,
+ * whether or not it is addressed to the service. Filters are checked before service listeners.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to service object
+ * 2. Source to match as vendor-device.instance, or * for any source.
+ * 3. Schema to match as class.type, or * for any schema.
+ * 4. User-supplied object to pass to the filter function.
+ * 5. Filter function.
+ *
+ * Return value:
+ *
+ * Generic pointer to the filter. Pass it to XplRemoveMessageFilter when it is no longer required.
+ *
+ */
+
+void *XplAddMessageFilter(void *XPLService, const String source, const String schema, void *userObj, XPLFilterFunc_t func)
+{
+	xplServicePtr_t xs = XPLService;
+	xplObjPtr_t xp;
+	xplFilterPtr_t xf;
+
+	ASSERT_FAIL(xs) /* Object must exist */
+	ASSERT_FAIL(XS_MAGIC == xs->magic) /* Object must be valid */
+	ASSERT_FAIL(source && schema && func)
+	xp = xs->xplObj;
+	ASSERT_FAIL(XP_MAGIC == xp->magic)
+
+	MALLOC_FAIL(xf = talloc_zero(xp, xplFilter_t))
+	MALLOC_FAIL(xf->source = talloc_strdup(xf, source))
+	MALLOC_FAIL(xf->schema = talloc_strdup(xf, schema))
+	xf->userObj = userObj;
+	xf->func = func;
+	xf->xplObj = xp;
+	xf->magic = XF_MAGIC;
+
+	/* Insert at head of list */
+	if(xp->filterHead){
+		xp->filterHead->prev = xf;
+	}
+	xf->next = xp->filterHead;
+	xp->filterHead = xf;
+
+	return xf;
+}
+
+/*
+ * Remove a message filter
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the filter returned by XplAddMessageFilter
+ *
+ *
+ * Return value:
+ *
+ * None
+ *
+ */
+
+void XplRemoveMessageFilter(void *XPLFilter)
+{
+	xplFilterPtr_t xf = XPLFilter;
+	xplObjPtr_t xp;
+
+	ASSERT_FAIL(xf)
+	ASSERT_FAIL(XF_MAGIC == xf->magic)
+	xp = xf->xplObj;
+
+	/* Unlink */
+	if(xf->prev){
+		xf->prev->next = xf->next;
+	}
+	else{
+		xp->filterHead = xf->next;
+	}
+	if(xf->next){
+		xf->next->prev = xf->prev;
+	}
+	xf->magic = 0;
+	talloc_free(xf);
+}
+
 /*
  * Set user supplied pointer to string pointers with the  3 elements of the source tag:
  * 
@@ -2699,6 +2961,38 @@ String XplGetMessageValueByName(void *XPLMessage, TALLOC_CTX *stringCTX, String
 	return NULL;
 }
 
+/*
+ * Return a value for a given name without copying it
+ * 
+ * If the value doesn't exist, return NULL
+ * 
+ * The string returned belongs to the message, and is only valid until the message is destroyed.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to message object 
+ * 2. The name to look up.
+ *
+ * Return value
+ *
+ * String with the associated value.
+ */
+ 
+const String XplPeekMessageValueByName(void *XPLMessage, const String theName)
+{
+	xplNameValueLEPtr_t xnv;
+	xplMessagePtr_t xm = XPLMessage;
+	ASSERT_FAIL(xm) /* Object must exist */
+	ASSERT_FAIL(XM_MAGIC == xm->magic) /* Object must be valid */
+	ASSERT_FAIL(theName)
+	
+	if((xnv = getNamedValue(xm->nvHead, theName))){
+		return xnv->itemValue;
+	}
+	/* Value does not exist */
+	return NULL;
+}
+
 /* 
  * Return a string containing comma-separated list of all name-value pairs associated with the message
  * String must be talloc_freed, when it is no longer required.
@@ -16,11 +16,14 @@ typedef void (* XPLListenerFunc_t )(void *XPLMessage, void *XPLService, void *us
 Bool isUs, Bool broadcast);
 /* Signature of a name-value callback function */
 typedef void (* XPLIterateNVCallback_t)(void *userObj, const String name, const String value);
+/* Signature of a message filter function */
+typedef void (* XPLFilterFunc_t)(void *XPLMessage, void *userObj);
 
 /* Master object creation and destruction */
 
 void XplDestroy(void *objPtr);
-void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort);
+void *XplInit(TALLOC_CTX *ctx, void *Poller, String IPAddr, String servicePort, unsigned rxThreads, unsigned rcvBufSize);
+String XplGetStats(TALLOC_CTX *ctx, void *objPtr);
 
 
 /* Service support */
@@ -45,6 +48,8 @@ Bool XplSendMessage(void *XPLMessage);
 void XplAddMessageListener(void *XPLService, XPLListenerReportMode_t reportMode, Bool reportGroupMessages,
 	void *userObj, XPLListenerFunc_t listener);
 void XplRemoveMessageListener(void *XPLService);
+void *XplAddMessageFilter(void *XPLService, const String source, const String schema, void *userObj, XPLFilterFunc_t func);
+void XplRemoveMessageFilter(void *XPLFilter);
 void XplGetMessageSourceTagComponents(void *XPLMessage, TALLOC_CTX *stringCTX,
 	String *theVendor, String *theDeviceID, String *theInstanceID);
 XPLMessageType_t XplGetMessageType(void *XPLMessage);
@@ -53,5 +58,6 @@ Bool XplMessageIsReceive(void *XPLMessage);
 String XplGetMessageNameValuesAsString(TALLOC_CTX *stringCTX, void *XPLMessage);
 void XplMessageIterateNameValues(void *XPLMessage, void *userObj, XPLIterateNVCallback_t callback );
 String XplGetMessageValueByName(void *XPLMessage, TALLOC_CTX *stringCTX, String theName);
+const String XplPeekMessageValueByName(void *XPLMessage, const String theName);
 
 #endif
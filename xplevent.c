@@ -47,6 +47,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <string.h>
 #include <talloc.h>
 #include  "defs.h"
@@ -61,12 +62,14 @@
 #include "socket.h"
 #include "xplevent.h"
 #include "xplcore.h"
+#include "xplrx.h"
+#include "spawnhelper.h"
 
 
 enum {UC_CHECK_SYNTAX = 1, UC_GET_SCRIPT, UC_PUT_SCRIPT, UC_SEND_CMD, UC_GENERATE};
 
 
-#define SHORT_OPTIONS "b:C:cd:Def:Fg:GHh:i:L:nO:o:P:p:s:S:Vx:"
+#define SHORT_OPTIONS "b:C:cd:Def:Fg:GHh:I:i:L:nO:o:P:p:Rs:S:Vx:"
 
 #define DEF_CONFIG_FILE		"./xplevent.conf,/etc/xplevent/xplevent.conf"
 #define DEF_PID_FILE		"/tmp/xplevent.pid"
@@ -79,6 +82,9 @@ enum {UC_CHECK_SYNTAX = 1, UC_GET_SCRIPT, UC_PUT_SCRIPT, UC_SEND_CMD, UC_GENERAT
 
 #define DEF_XPL_SERVICE_NAME "3865"
 
+#define DEF_SCRIPT_MAX_INSTRS 100000
+#define DEF_SCRIPT_MAX_MS 2000
+
 
  
 typedef union cloverrides{
@@ -102,6 +108,8 @@ XPLEvGlobalsPtr_t Globals = NULL;
 static clOverride_t clOverride;
 static Bool forceFlag = FALSE;
 static Bool dbDirectFlag = FALSE;
+static Bool profileFlag = FALSE;
+static String sampleInputFile = NULL;
 static int utilityCommand = 0;
 static String utilityArg = NULL;
 static String utilityFile = NULL;
@@ -126,6 +134,7 @@ static struct option longOptions[] = {
 	{"generate", 0, 0, 'G'},
 	{"help", 0, 0, 'H'},
 	{"host", 1, 0, 'h'},
+	{"input", 1, 0, 'I'},
 	{"ipaddr", 1, 0, 'i'},
 	{"log", 1, 0, 'L'},
 	{"no-background", 0, 0, 'n'},	
@@ -133,6 +142,7 @@ static struct option longOptions[] = {
 	{"db-file", 1, 0, 'o'},
 	{"put", 1, 0, 'p'},
 	{"pidfile", 1, 0, 'P'},
+	{"profile", 0, 0, 'R'},
 	{"lstport", 1, 0, 'S'},
 	{"instance", 1, 0, 's'},
 	{"version", 0, 0, 'V'},
@@ -175,6 +185,7 @@ static void showHelp(void)
 	printf("  -G, --generate          Utility function: Generate an empty database file\n");
 	printf("  -H, --help              Shows this\n");
 	printf("  -h, --host HOST         Set host name for utility client mode\n");
+	printf("  -I, --input PATH        Sample trigger message for -c, as name=value lines loaded into %%xplnvin\n");
 	printf("  -i, --ipaddr ADDR       Set the broadcast interface IP address\n");
 	printf("  -L, --log  PATH         Path name to debug log file when daemonized\n");
 	printf("  -n, --no-background     Do not fork into the background (useful for debugging)\n");
@@ -182,6 +193,7 @@ static void showHelp(void)
 	printf("  -o, --db-file           Database file\n");
 	printf("  -P, --pidfile PATH      Set new pid file path, default is: %s\n", Globals->pidFile);
 	printf("  -p, --put scriptname    Utility function: Put file in script name\n");
+	printf("  -R, --profile           Print a listing of the script run by -c, with per line counts and times\n");
 	printf("  -s, --instance ID       Set instance id. Default is %s\n", Globals->instanceID);
 	printf("  -S, --lstport NAME/PORT Set service name or port number for command listener\n");
 	printf("  -V, --version           Display program version\n");
@@ -435,7 +447,7 @@ static void putScript(String utilityArg, String utilityFile)
 			fatal("%s: Can't open %s for reading", id, utilityFile);
 		}
 		/* Check syntax locally before sending to server */
-		s = ParserCheckSyntax(Globals, utilityFile);
+		s = ParserCheckSyntax(Globals, utilityFile, NULL, NULL);
 		if(s){
 			fatal("%s:%s: script not added to database",id, s);
 		}
@@ -541,6 +553,7 @@ static void doUtilityCommand(int utilityCommand, String utilityArg, String utili
 {
 	int res = 0;
 	String s;
+	String listing = NULL;
 	
 	
 	debug(DEBUG_ACTION, "Util cmd: %d, arg: %s, extra: %s", utilityCommand,
@@ -553,7 +566,10 @@ static void doUtilityCommand(int utilityCommand, String utilityArg, String utili
 				if(access(utilityFile, R_OK | F_OK)){
 					fatal("Can't open %s for reading", utilityFile);
 				}
-				s = ParserCheckSyntax(Globals, utilityFile);
+				s = ParserCheckSyntax(Globals, utilityFile, sampleInputFile, (profileFlag) ? &listing : NULL);
+				if(listing){
+					fputs(listing, stdout);
+				}
 				if(s){
 					fatal("%s", s);
 				}
@@ -723,6 +739,10 @@ int main(int argc, char *argv[])
 	Globals->xplService = DEF_XPL_SERVICE_NAME;
 	Globals->lat = 33.0;
 	Globals->lon = -117.0;
+	Globals->rxThreads = 1;
+	Globals->spawnMax = SPAWN_DEF_MAX_CHILDREN;
+	Globals->scriptMaxInstrs = DEF_SCRIPT_MAX_INSTRS;
+	Globals->scriptMaxMS = DEF_SCRIPT_MAX_MS;
 	
 	/* Add the shutdown hook */
 	
@@ -806,6 +826,10 @@ int main(int argc, char *argv[])
 				MALLOC_FAIL(Globals->cmdHostName = talloc_strdup(Globals, optarg));
 				break;
 
+			case 'I': /* Sample input for a syntax check */
+				MALLOC_FAIL(sampleInputFile = talloc_strndup(Globals, optarg, PATH_MAX))
+				break;
+
 				/* Specify interface to broadcast on */
 			case 'i': 
 				clOverride.interface = 1;
@@ -849,6 +873,10 @@ int main(int argc, char *argv[])
 				debug(DEBUG_ACTION,"New pid file path is: %s", Globals->pidFile);
 				break;
 				
+			case 'R': /* Profile the syntax check run */
+				profileFlag = TRUE;
+				break;
+				
 			case 'S': /* Listening Service port name or number */
 				clOverride.cmdserv = 1;
 				MALLOC_FAIL(Globals->cmdService = talloc_strdup(Globals, optarg));
@@ -969,6 +997,58 @@ int main(int argc, char *argv[])
 			UtilStod(p, &Globals->lon);
 		}
 		
+		/* Number of xPL receive threads */
+		if((p = ConfReadValueBySectKey(configInfo, "general", "rx-threads"))){
+			if((FAIL == UtilStou(p, &Globals->rxThreads)) || (Globals->rxThreads < 1) || 
+			(Globals->rxThreads > XPLRX_MAX_THREADS)){
+				fatal("rx-threads must be between 1 and %d", XPLRX_MAX_THREADS);
+			}
+		}
+		
+		/* xPL receive socket buffer size */
+		if((p = ConfReadValueBySectKey(configInfo, "general", "rcvbuf-size"))){
+			if(FAIL == UtilStou(p, &Globals->rcvBufSize)){
+				fatal("rcvbuf-size must be a number of bytes");
+			}
+		}
+		
+		/* Number of spawned commands which can run at once */
+		if((p = ConfReadValueBySectKey(configInfo, "general", "spawn-max"))){
+			if((FAIL == UtilStou(p, &Globals->spawnMax)) || (!Globals->spawnMax)){
+				fatal("spawn-max must be a number greater than 0");
+			}
+		}
+		
+		/* Instructions a script execution may run before it is stopped */
+		if((p = ConfReadValueBySectKey(configInfo, "general", "script-max-instrs"))){
+			if(FAIL == UtilStou(p, &Globals->scriptMaxInstrs)){
+				fatal("script-max-instrs must be a number of instructions");
+			}
+		}
+		
+		/* Milliseconds a script execution may run for before it is stopped */
+		if((p = ConfReadValueBySectKey(configInfo, "general", "script-max-ms"))){
+			if(FAIL == UtilStou(p, &Globals->scriptMaxMS)){
+				fatal("script-max-ms must be a number of milliseconds");
+			}
+		}
+		
+		/* When nvstate changes are written to the database */
+		if((p = ConfReadValueBySectKey(configInfo, "general", "nvstate-flush"))){
+			if(!strcmp(p, "script")){
+				Globals->nvFlushMode = NVF_SCRIPT;
+			}
+			else if(!strcmp(p, "timer")){
+				Globals->nvFlushMode = NVF_TIMER;
+			}
+			else if(!strcmp(p, "sync")){
+				Globals->nvFlushMode = NVF_SYNC;
+			}
+			else{
+				fatal("nvstate-flush must be one of script, timer, or sync");
+			}
+		}
+		
 		/* Control ACL */
 		
 		allow = ConfReadValueBySectKey(configInfo, "control", "allow");
@@ -1001,6 +1081,7 @@ int main(int argc, char *argv[])
 			if(!(Globals->db = DBOpen(Globals, Globals->dbFile))){
 				fatal("Database file does not exist or is not writaeble: %s", Globals->dbFile);
 			}
+			DBSetNVStateSync(Globals->db, (NVF_SYNC == Globals->nvFlushMode));
  		}
 	}
 	
@@ -9,6 +9,13 @@ typedef struct XPLEvGlobals_s {
 	Bool weWroteThePIDFile;
 	int debugLvl;
 	int timerFD;
+	int secTimerFD;
+	unsigned rxThreads;
+	unsigned rcvBufSize;
+	unsigned nvFlushMode;
+	unsigned spawnMax;
+	unsigned scriptMaxInstrs; /* Default instruction budget per script execution, 0 for none */
+	unsigned scriptMaxMS; /* Default run time budget per script execution, 0 for none */
 	String progName;
 	String cmdBindAddress;
 	String cmdHostName;
@@ -25,6 +32,8 @@ typedef struct XPLEvGlobals_s {
 	void *xplEventService;
 	void *db;	
 	void *sch;
+	void *memState;
+	void *delayQ;
 	void *controlACL;
 	double lat;
 	double lon;
@@ -43,6 +43,7 @@
 #include <sys/fcntl.h>
 
 #include <errno.h>
+#include <string.h>
 #include <pthread.h>
 #include <sqlite3.h>
 #include <talloc.h>
@@ -57,43 +58,85 @@
 #include "xplevent.h"
 #include "xplrx.h"
 
-#define XH_LOCK pthread_mutex_lock(&xh->lock);
-#define XH_UNLOCK pthread_mutex_unlock(&xh->lock);
+#define RS_LOCK pthread_mutex_lock(&rs->lock);
+#define RS_UNLOCK pthread_mutex_unlock(&rs->lock);
 
 
 #define RXBUFFSIZE 1501
+#define RXBUFFCOUNT 64
 #define RXBUFFPOOLSIZE 1024*128
 #define RXQEPOOLSIZE sizeof(rxQEntry_t) * 1024
 #define RXTHREADSTACKSIZE 32768
+#define RXSTARVELIMIT 8
 #define XH_MAGIC 0x7A1F0CE2
+#define RS_MAGIC 0x5C2D86B1
 #define RQ_MAGIC 0x39CF41A2
 
+/* Traffic classes, highest priority first */
+typedef enum {RXC_TRIGGER = 0, RXC_COMMAND, RXC_STATUS, RXC_HEARTBEAT, RXC_NUMCLASSES} rxClass_t;
+
+static const char *rxClassNames[RXC_NUMCLASSES] = {"trig", "cmnd", "stat", "hbeat"};
+
 typedef struct rxQEntry_s {
 	unsigned magic;
+	Bool haveArrival;
+	struct timespec arrival; /* Kernel arrival time */
 	String rawStr;
 	struct rxQEntry_s *prev;
 	struct rxQEntry_s *next;
 } rxQEntry_t, *rxQEntryPtr_t;
 
-typedef struct rxHead_s {
+/*
+ * One receive shard: a socket, the thread which reads it, and the queue it feeds.
+ * When there is more than one shard, all of the shard sockets are bound to
+ * the same ephemeral port with SO_REUSEPORT.
+ */
+
+typedef struct rxShard_s {
 	unsigned magic;
+	unsigned index;
 	pthread_t rxThread;
 	pthread_mutex_t lock;
+	Bool ownsConnFD;
+	Bool terminated;
 	unsigned numRxEntries;
-	unsigned localConnPort;
 	int localConnFD;
-	int rxReadyFD;
 	int rxControlFD;
 	int timerFD;
 	int wdogCounter;
 	unsigned rxControlVal;
-	unsigned rxBuffSize;
+	unsigned rxPackets;
+	unsigned rxTruncated;
+	unsigned echoDrops;
+	unsigned numEchoTags;
+	uint32_t kernelDrops; /* Latest SO_RXQ_OVFL count for the socket */
+	unsigned long long rxBytes;
 	void *rxStringPool;
 	void *rxQEPool;
-	String rxBuff;
 	void *rxPoller;
-	rxQEntryPtr_t head;
-	rxQEntryPtr_t tail;
+	void *echoCTX; /* Holds the echo match strings */
+	String *echoSource; /* "\nsource=<tag>\n" for each of our tags */
+	String *echoTarget; /* "\ntarget=<tag>\n" for each of our tags */
+	unsigned classEntries[RXC_NUMCLASSES];
+	rxQEntryPtr_t head[RXC_NUMCLASSES];
+	rxQEntryPtr_t tail[RXC_NUMCLASSES];
+	struct rxHead_s *xh;
+} rxShard_t, *rxShardPtr_t;
+
+typedef struct rxHead_s {
+	unsigned magic;
+	unsigned localConnPort;
+	unsigned numShards;
+	int rxReadyFD;
+	unsigned nextShard[RXC_NUMCLASSES]; /* Main thread only from here down */
+	unsigned passedOver[RXC_NUMCLASSES]; /* Times a waiting class was passed over for a higher one */
+	unsigned dqClassCount[RXC_NUMCLASSES];
+	unsigned starveCount;
+	unsigned dqCount;
+	unsigned delayCount;
+	double delaySumUs;
+	double delayMaxUs;
+	rxShardPtr_t *shards;
 } rxHead_t, *rxHeadPtr_t;
 
 
@@ -138,7 +181,7 @@ static Bool rxSendReady(rxHeadPtr_t xh )
  *
  * 1. FD with message
  * 2. event ID (not used)
- * 3. A pointer to the receive header object
+ * 3. A pointer to the receive shard object
  *
  * Return value
  *
@@ -147,28 +190,29 @@ static Bool rxSendReady(rxHeadPtr_t xh )
 
 static void rxControlAction(int fd, int event, void *objPtr)
 {
-	rxHeadPtr_t xh = objPtr;
+	rxShardPtr_t rs = objPtr;
 	char buf[8];
 	int val;
 	
-	ASSERT_FAIL(xh);
+	ASSERT_FAIL(rs);
 	
-	XH_LOCK
-	ASSERT_FAIL(XH_MAGIC == xh->magic);
-	val = xh->rxControlVal;
-	XH_UNLOCK
+	RS_LOCK
+	ASSERT_FAIL(RS_MAGIC == rs->magic);
+	val = rs->rxControlVal;
+	RS_UNLOCK
 	
 	if(read(fd, buf, 8) < 0){
 		debug(DEBUG_UNEXPECTED,"%s: read error", __func__);
 	}
 	else{	
 
-		debug(DEBUG_EXPECTED, "%s: Ding! RX control value: %d", __func__, val);
+		debug(DEBUG_EXPECTED, "%s: Ding! RX control value: %d, shard %u", __func__, val, rs->index);
 		if(val == XHCM_TERM_REQUEST){
 			debug(DEBUG_ACTION, "Received terminate request");
-			XH_LOCK
-			rxSendReady(xh); /* Send Dying gasp */
-			XH_UNLOCK
+			RS_LOCK
+			rs->terminated = TRUE;
+			rxSendReady(rs->xh); /* Send Dying gasp */
+			RS_UNLOCK
 			pthread_exit(0);
 		}
 	
@@ -177,13 +221,157 @@ static void rxControlAction(int fd, int event, void *objPtr)
 }
 
 /*
- * Place new queue entry on at the end of the list.
- * Make a copy of the string passed in.
+ * Find the schema line in a raw packet
+ *
+ * The schema line follows the closing brace of the header block.
  *
  * Arguments:
  *
- * 1. Pointer to receive header 
- * 2. The raw message string to queue.
+ * 1. The raw message packet
+ * 2. The length of the packet in bytes
+ * 3. Pointer to an int to receive the number of bytes from the schema line to the end of the packet
+ *
+ * Return value
+ *
+ * Pointer to the start of the schema line, or NULL if it could not be found
+ */
+
+static const char *rxFindSchema(const char *rawStr, int len, int *schemaLen)
+{
+	const char *schema;
+	
+	if(!(schema = memmem(rawStr, len, "\n}\n", 3))){
+		return NULL;
+	}
+	schema += 3;
+	*schemaLen = len - (schema - rawStr);
+	return schema;
+}
+
+/*
+ * Test for a heartbeat or config schema
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the schema line
+ * 2. Number of bytes from the schema line to the end of the packet
+ *
+ * Return value
+ *
+ * TRUE if the schema class is hbeat or config, otherwise FALSE
+ */
+
+static Bool rxIsHeartbeatSchema(const char *schema, int schemaLen)
+{
+	return (((schemaLen >= 6) && !memcmp(schema, "hbeat.", 6)) ||
+		((schemaLen >= 7) && !memcmp(schema, "config.", 7)));
+}
+
+/*
+ * Classify a raw packet into a traffic class
+ *
+ * Only the first header line and the schema line are looked at. The packet isn't 
+ * parsed or validated here, that's left to the main thread. 
+ * Status messages with an hbeat.* or config.* schema are classed as heartbeats.
+ * Anything unrecognizable is classed as status.
+ *
+ * Arguments:
+ *
+ * 1. The raw message packet
+ * 2. The length of the packet in bytes
+ *
+ * Return value
+ *
+ * Traffic class
+ */
+
+static rxClass_t rxClassify(const char *rawStr, int len)
+{
+	const char *schema;
+	int schemaLen;
+	
+	if(len < 8){
+		return RXC_STATUS;
+	}
+	
+	/* Message type is the first header line */
+	if(!memcmp(rawStr, "xpl-trig", 8)){
+		return RXC_TRIGGER;
+	}
+	if(!memcmp(rawStr, "xpl-cmnd", 8)){
+		return RXC_COMMAND;
+	}
+	
+	/* Status messages with a heartbeat or config schema are classed as heartbeats */
+	if((schema = rxFindSchema(rawStr, len, &schemaLen)) && rxIsHeartbeatSchema(schema, schemaLen)){
+		return RXC_HEARTBEAT;
+	}
+		
+	return RXC_STATUS;
+}
+
+/*
+ * Test a raw packet to see if it is an echo of one of our own messages which can be dropped.
+ *
+ * The hub sends our own broadcasts back to us unchanged, so a byte match on the source line
+ * is enough. Heartbeat and config schema echoes are never dropped, as these are needed for hub 
+ * confirmation. Messages we targeted at ourselves are never dropped either.
+ *
+ * Must be called locked
+ *
+ * Arguments:
+ *
+ * 1. Pointer to receive shard
+ * 2. The raw message packet
+ * 3. The length of the packet in bytes
+ *
+ * Return value
+ *
+ * TRUE if the packet should be dropped, otherwise FALSE
+ */
+
+static Bool rxIsDroppableEcho(rxShardPtr_t rs, const char *rawStr, int len)
+{
+	const char *schema;
+	int schemaLen, headerLen;
+	unsigned i;
+	
+	if(!rs->numEchoTags){
+		return FALSE;
+	}
+	
+	if(!(schema = rxFindSchema(rawStr, len, &schemaLen))){
+		return FALSE;
+	}
+	
+	if(rxIsHeartbeatSchema(schema, schemaLen)){
+		return FALSE;
+	}
+	
+	/* Only search the header block. Include the newline before the closing brace */
+	headerLen = (schema - rawStr) - 2;
+	
+	for(i = 0; i < rs->numEchoTags; i++){
+		if(memmem(rawStr, headerLen, rs->echoSource[i], strlen(rs->echoSource[i]))){
+			/* It's ours. Keep it if it was sent to us */
+			return (NULL == memmem(rawStr, headerLen, rs->echoTarget[i], strlen(rs->echoTarget[i])));
+		}
+	}
+		
+	return FALSE;
+}
+
+/*
+ * Place new queue entry on at the end of the list for its traffic class.
+ * Make a string copy of the packet passed in.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to receive shard
+ * 2. Traffic class of the packet
+ * 3. The raw message packet to queue.
+ * 4. The length of the packet in bytes.
+ * 5. Receive information for the packet from the poller
  *
  * Return value
  *
@@ -192,83 +380,94 @@ static void rxControlAction(int fd, int event, void *objPtr)
  * Must be called locked
  */
  
-static void rxQueueRawString(rxHeadPtr_t xh, String rawStr)
+static void rxQueueRawString(rxShardPtr_t rs, rxClass_t class, const char *rawStr, int len, const PollRecvInfoPtr_t info)
 {
 	rxQEntryPtr_t rq;
 	
 	/* Make a queue entry */
-	MALLOC_FAIL(rq = talloc_zero(xh->rxQEPool, rxQEntry_t))
-	/* Make a copy of the raw string and store it in the queue entry */
-	MALLOC_FAIL(rq->rawStr = talloc_strdup(xh->rxStringPool, rawStr))
+	MALLOC_FAIL(rq = talloc_zero(rs->rxQEPool, rxQEntry_t))
+	/* Make a string copy of the packet and store it in the queue entry */
+	MALLOC_FAIL(rq->rawStr = talloc_strndup(rs->rxStringPool, rawStr, len))
 	rq->magic = RQ_MAGIC;
 	
-	if(!xh->tail){
+	/* Note when the kernel received it */
+	if(info->haveTimestamp){
+		rq->arrival = info->timestamp;
+		rq->haveArrival = TRUE;
+	}
+	
+	if(!rs->tail[class]){
 		/* First entry */
-		xh->head = xh->tail = rq;
+		rs->head[class] = rs->tail[class] = rq;
 	}
 	else{
 		/* Insert on end */
-		rq->prev = xh->tail;
-		xh->tail->next = rq;
-		xh->tail = rq;
+		rq->prev = rs->tail[class];
+		rs->tail[class]->next = rq;
+		rs->tail[class] = rq;
 	}
-	/* Increment the entry count */
-	xh->numRxEntries++;
+	/* Increment the entry counts */
+	rs->classEntries[class]++;
+	rs->numRxEntries++;
 }
 
 /*
  * RX Incoming Action
  *
- * Called from poller
+ * Called from poller with each packet received
  *
  * Arguments:
  *
- * 1. FD with message to read 
- * 2. Event (not used)
- * 3. Pointer to the receive header
+ * 1. FD the message was read from 
+ * 2. Buffer holding the packet
+ * 3. Length of the packet
+ * 4. Receive information (kernel arrival time, socket drop count)
+ * 5. Pointer to the receive shard
  *
  * Return value
  *
  * None
  */
 
-static void rxIncomingAction(int fd, int event, void *objPtr)
+static void rxIncomingAction(int fd, void *buf, int bytesRead, const PollRecvInfoPtr_t info, void *objPtr)
 {
-	int bytesRead;
-	rxHeadPtr_t xh = objPtr;
-	char eStr[64];
+	rxShardPtr_t rs = objPtr;
 	
 	
-	ASSERT_FAIL(xh);
+	ASSERT_FAIL(rs);
 	
-	XH_LOCK
-	ASSERT_FAIL(XH_MAGIC == xh->magic);
-	XH_UNLOCK
+	RS_LOCK
+	ASSERT_FAIL(RS_MAGIC == rs->magic);
 	
-	/* Get the packet */
-	if ((bytesRead = recvfrom(xh->localConnFD, xh->rxBuff, xh->rxBuffSize - 1, 0, NULL, NULL)) < 0){
-		debug(DEBUG_UNEXPECTED,"%s: recvfrom error: %s", __func__, strerror_r(errno, eStr, 64));
-		return;
+	/* Update the statistics */
+	rs->rxPackets++;
+	rs->rxBytes += bytesRead;
+	if(info->truncated){
+		rs->rxTruncated++;
+	}
+	if(info->haveDropCount){
+		rs->kernelDrops = info->dropCount;
 	}
 	
-	XH_LOCK
-	
-	/* Make it a string */
-	xh->rxBuff[bytesRead] = 0;
-	
-	/* Place it in the queue */
-	rxQueueRawString(xh, xh->rxBuff);
+	/* Drop echoes of our own messages which nobody needs to see */
+	if(rxIsDroppableEcho(rs, buf, bytesRead)){
+		rs->echoDrops++;
+	}
+	else{
+		/* Place it in the queue for its traffic class */
+		rxQueueRawString(rs, rxClassify(buf, bytesRead), buf, bytesRead, info);
 
-	/* Send notification of buffer add */
-	rxSendReady(xh);
+		/* Send notification of buffer add */
+		rxSendReady(rs->xh);
+	}
 
-	XH_UNLOCK
+	RS_UNLOCK
 	
 	
 }
 
 /*
- * Remove a queue entry from the queue, and return the string.
+ * Remove a queue entry from the queue for a traffic class, and return the string.
  * 
  * 
  * Must be called locked
@@ -276,25 +475,27 @@ static void rxIncomingAction(int fd, int event, void *objPtr)
  *
  * Arguments:
  *
- * 1. Pointer to receive header
+ * 1. Pointer to receive shard
+ * 2. Traffic class queue to remove the entry from
+ * 3. Pointer to a timespec to receive the kernel arrival time. Zeroed if not known.
  *
  * Return value:
  *
  * String with message text
  */
  
-static String rxDQRawString(rxHeadPtr_t xh)
+static String rxDQRawString(rxShardPtr_t rs, rxClass_t class, struct timespec *arrival)
 {
 	rxQEntryPtr_t rq;
 	String res;
 	
 	/* Return if nothing in the queue */
-	if(!xh->head){
+	if(!rs->head[class]){
 		return NULL;
 	}
 	
 	/* Get the entry to remove */
-	rq = xh->head;
+	rq = rs->head[class];
 	
 	/* Is it real? */
 	ASSERT_FAIL(RQ_MAGIC == rq->magic)
@@ -304,20 +505,27 @@ static String rxDQRawString(rxHeadPtr_t xh)
 	if(rq->next){
 		/* Remove one entry from the beginning of the queue */
 		rq->next->prev = NULL;
-		xh->head = rq->next;
+		rs->head[class] = rq->next;
 	}
 	else{
 		/* Queue is now empty */
-		xh->head = xh->tail = NULL;
+		rs->head[class] = rs->tail[class] = NULL;
 	}
-	/* Note the string pointer */
+	/* Note the string pointer and arrival time */
 	res = rq->rawStr;
+	if(rq->haveArrival){
+		*arrival = rq->arrival;
+	}
+	else{
+		arrival->tv_sec = arrival->tv_nsec = 0;
+	}
 	/* Clear the magic */
 	rq->magic = 0;
 	/* Free the queue entry */
 	talloc_free(rq);
-	/* Decerement the entry count */
-	xh->numRxEntries--;
+	/* Decerement the entry counts */
+	rs->classEntries[class]--;
+	rs->numRxEntries--;
 	/* Return the string */
 	return res;	
 }
@@ -329,7 +537,7 @@ static String rxDQRawString(rxHeadPtr_t xh)
  *
  * 1. timer file descriptor
  * 2. event flags (not used)
- * 3. Pointer to the receive header
+ * 3. Pointer to the receive shard
  *
  * Return value
  *
@@ -338,26 +546,26 @@ static String rxDQRawString(rxHeadPtr_t xh)
  
 static void rxTick(int fd, int event, void *objPtr)
 {
-	rxHeadPtr_t xh = objPtr;
+	rxShardPtr_t rs = objPtr;
 	char tickBuff[8];
 	char eBuff[64];
 	
 
-	ASSERT_FAIL(xh)
-	ASSERT_FAIL(XH_MAGIC == xh->magic)
+	ASSERT_FAIL(rs)
+	ASSERT_FAIL(RS_MAGIC == rs->magic)
 		
 	if(sizeof(tickBuff) != read(fd, tickBuff, sizeof(tickBuff))){
 		debug(DEBUG_UNEXPECTED, "%s: Could not read timerfd: %s", __func__, strerror_r(errno, eBuff, sizeof(eBuff)));
 		return;
 	}
 	/* Bump watchdog counter each time through */
-	XH_LOCK
-	if(xh->wdogCounter < INT_MAX){
-		xh->wdogCounter++;
+	RS_LOCK
+	if(rs->wdogCounter < INT_MAX){
+		rs->wdogCounter++;
 	}
-	XH_UNLOCK
+	RS_UNLOCK
 	
-	debug(DEBUG_INCOMPLETE, "RX thread tick");
+	debug(DEBUG_INCOMPLETE, "RX thread tick, shard %u", rs->index);
 
 }
 
@@ -369,7 +577,7 @@ static void rxTick(int fd, int event, void *objPtr)
  *
  * Arguments:
  *
- * 1. Pointer to receive header
+ * 1. Pointer to receive shard
  *
  * Return value
  *
@@ -378,22 +586,22 @@ static void rxTick(int fd, int event, void *objPtr)
  
 static void *rxThread(void *objPtr)
 {
-	rxHeadPtr_t xh = objPtr;
+	rxShardPtr_t rs = objPtr;
 	void *poller;
 
 		
 
-	debug(DEBUG_ACTION, "xpl RX thread started");
+	debug(DEBUG_ACTION, "xpl RX thread started, shard %u", rs->index);
 	
-	XH_LOCK
-	ASSERT_FAIL(XH_MAGIC == xh->magic)
+	RS_LOCK
+	ASSERT_FAIL(RS_MAGIC == rs->magic)
 	
 
 	
 	/* Copy the polling resource pointer */
-	poller = xh->rxPoller;
+	poller = rs->rxPoller;
 	
-	XH_UNLOCK
+	RS_UNLOCK
 	
 
 	PollWait(poller, NULL);
@@ -404,39 +612,162 @@ static void *rxThread(void *objPtr)
 }
 
 /*
- * Cleanup RX FD's and resources, then destroy the object
+ * Create an additional local connection socket which shares the ephemeral port 
+ * of the first one. 
  *
  * Arguments:
  *
- * 1. Pointer to receive header to destroy
+ * 1. The local connection FD already bound by the caller with SO_REUSEPORT set.
  *
  * Return value
  *
- * Always NULL
+ * A new bound socket, or -1 if there was an error.
  */
-	
-void *destroyRX(rxHeadPtr_t xh)
+ 
+static int rxCreateShardSock(int localConnFD)
 {
+	struct sockaddr_storage addr;
+	socklen_t addrLen = sizeof(addr);
+	int sock;
+	int flag = 1;
+	char eStr[64];
+	
+	/* Get the address the first socket was bound to */
+	if(getsockname(localConnFD, (struct sockaddr *) &addr, &addrLen) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: getsockname failed: %s", __func__, strerror_r(errno, eStr, 64));
+		return -1;
+	}
+	
+	if((sock = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: Could not create socket: %s", __func__, strerror_r(errno, eStr, 64));
+		return -1;
+	}
+	
+	/* Share the port with the other shards, and mark as a broadcast socket */
+	if((setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) ||
+		(setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &flag, sizeof(flag)) < 0)){
+		debug(DEBUG_UNEXPECTED, "%s: setsockopt failed: %s", __func__, strerror_r(errno, eStr, 64));
+		close(sock);
+		return -1;
+	}
+	
+	/* Bind to the same address and port */
+	if(bind(sock, (struct sockaddr *) &addr, addrLen) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: Could not bind shard socket: %s", __func__, strerror_r(errno, eStr, 64));
+		close(sock);
+		return -1;
+	}
+	
+	return sock;
+}
+
+/*
+ * Set the socket options for a local connection socket
+ *
+ * Turns on kernel receive timestamps and drop counts, and sets the receive buffer size.
+ *
+ * Arguments:
+ *
+ * 1. Socket to set options on.
+ * 2. Receive buffer size in bytes, or 0 to leave it at the system default.
+ *
+ * Return value
+ *
+ * None
+ */
 
+static void rxSetSockOpts(int sock, unsigned rcvBufSize)
+{
+	int flag = 1;
+	int size;
+	socklen_t sizeLen = sizeof(size);
+	char eStr[64];
 	
+	/* Kernel arrival timestamps */
+	if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &flag, sizeof(flag)) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: Unable to set SO_TIMESTAMPNS: %s", __func__, strerror_r(errno, eStr, 64));
+	}
+	/* Socket drop counts */
+	if(setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &flag, sizeof(flag)) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: Unable to set SO_RXQ_OVFL: %s", __func__, strerror_r(errno, eStr, 64));
+	}
+	
+	if(rcvBufSize){
+		size = (rcvBufSize > INT_MAX) ? INT_MAX : rcvBufSize;
+		/* Try to exceed rmem_max first. This only works with CAP_NET_ADMIN */
+		if(setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0){
+			if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0){
+				debug(DEBUG_UNEXPECTED, "%s: Unable to set SO_RCVBUF: %s", __func__, strerror_r(errno, eStr, 64));
+			}
+		}
+		if(0 == getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, &sizeLen)){
+			debug(DEBUG_ACTION, "%s: Receive buffer size is now %d bytes", __func__, size);
+		}
+	}
+}
+
+/*
+ * Cleanup a receive shard's FD's and poller
+ *
+ * Arguments:
+ *
+ * 1. Pointer to receive shard to clean up
+ *
+ * Return value
+ *
+ * None
+ */
+ 
+static void destroyShard(rxShardPtr_t rs)
+{
 	/* Destroy the poller */
-	if(xh->rxPoller){
+	if(rs->rxPoller){
 		/* Unregister the local connection */
-		PollUnRegEvent(xh->rxPoller, xh->localConnFD);
+		PollUnRegEvent(rs->rxPoller, rs->localConnFD);
 		/* Unregister the control FD */
-		PollUnRegEvent(xh->rxPoller, xh->rxControlFD);	
-		PollDestroy(xh->rxPoller);
+		PollUnRegEvent(rs->rxPoller, rs->rxControlFD);	
+		PollDestroy(rs->rxPoller);
 	}
 	
+	/* Close the shard socket if we created it */
+	if(rs->ownsConnFD && (rs->localConnFD > 0)){
+		close(rs->localConnFD);
+	}
 		
 	/* Close the control FD */
-	if(xh->rxControlFD > 0){
-		close(xh->rxControlFD);
+	if(rs->rxControlFD > 0){
+		close(rs->rxControlFD);
 	}
 		
 	/* Close the timer FD */
-	if(xh->timerFD > 0){
-		close(xh->timerFD);
+	if(rs->timerFD > 0){
+		close(rs->timerFD);
+	}
+	
+	rs->magic = 0;
+}
+
+/*
+ * Cleanup RX FD's and resources, then destroy the object
+ *
+ * Arguments:
+ *
+ * 1. Pointer to receive header to destroy
+ *
+ * Return value
+ *
+ * Always NULL
+ */
+	
+void *destroyRX(rxHeadPtr_t xh)
+{
+	unsigned i;
+	
+	/* Clean up the shards */
+	for(i = 0; xh->shards && (i < xh->numShards); i++){
+		if(xh->shards[i]){
+			destroyShard(xh->shards[i]);
+		}
 	}
 	
 	/* Invalidate then free the object */
@@ -446,29 +777,153 @@ void *destroyRX(rxHeadPtr_t xh)
 }
 
 /*
- * Send an control message to the RX thread 
+ * Initialize a receive shard and start its thread
  *
  * Arguments:
  *
  * 1. Pointer to receive header
+ * 2. Shard index
+ * 3. FD for the local connection socket to read
+ * 4. TRUE if the shard owns the FD, and must close it when destroyed.
+ * 5. Receive buffer size for the socket, or 0 for the system default.
+ *
+ * Return value
+ *
+ * PASS if the shard was started, otherwise FAIL.
+ */
+ 
+static Bool initShard(rxHeadPtr_t xh, unsigned index, int localConnFD, Bool ownsConnFD, unsigned rcvBufSize)
+{
+	pthread_attr_t attrs;
+	int res;
+	rxShardPtr_t rs;
+	struct itimerspec its;
+	
+	/* Allocate a shard */
+	MALLOC_FAIL(rs = talloc_zero(xh, rxShard_t))
+	xh->shards[index] = rs;
+	rs->xh = xh;
+	rs->index = index;
+	rs->timerFD = rs->rxControlFD = -1;
+	
+	/* Initialize the guarding mutex */
+	ASSERT_FAIL( 0 == pthread_mutex_init(&rs->lock, NULL))
+	
+	/* Allocate the receive string pool */
+	MALLOC_FAIL(rs->rxStringPool = talloc_pool(rs, RXBUFFPOOLSIZE));
+	
+	/* Allocate the queue entry pool */
+	MALLOC_FAIL(rs->rxQEPool = talloc_pool(rs, RXQEPOOLSIZE));
+	
+	/* Note the local connection FD */
+	rs->localConnFD = localConnFD;
+	rs->ownsConnFD = ownsConnFD;
+	
+	/* Set up the socket options */
+	rxSetSockOpts(localConnFD, rcvBufSize);
+	
+	/* Create the timer FD */
+	if((rs->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: Could not create an timer FD", __func__);
+		return FAIL;
+	}
+	
+	/* Set the timerfd time interval */
+	its.it_value.tv_sec = its.it_interval.tv_sec = 1;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = 0;
+	if(timerfd_settime(rs->timerFD, 0, &its, NULL) < 0){
+		debug(DEBUG_UNEXPECTED, "%s: Could not set timer FD interval", __func__);
+		return FAIL;
+	}		
+	
+	/* Get an event FD for control */
+	if((rs->rxControlFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0){
+		debug(DEBUG_UNEXPECTED, "Could not create an event FD");
+		return FAIL;
+	}
+	
+	/* Create a polling resource */
+	if(!(rs->rxPoller = PollInit(rs, 4))){
+		debug(DEBUG_UNEXPECTED, "%s: Could not create polling resource", __func__);
+		return FAIL;
+	}
+
+	/* Add the control FD to the polling list */
+	if(FAIL == PollRegEvent(rs->rxPoller, rs->rxControlFD, POLL_WT_IN, rxControlAction, rs)){
+		debug(DEBUG_UNEXPECTED, "%s: Could not register RX Control eventfd", __func__);
+		return FAIL;
+	}
+	
+	/* Add the local connection FD to the polling list. The poller reads the packets for us */
+	if(FAIL == PollRegRecv(rs->rxPoller, rs->localConnFD, RXBUFFSIZE - 1, RXBUFFCOUNT, rxIncomingAction, rs)){
+		debug(DEBUG_UNEXPECTED, "%s: Could not register local connection FD", __func__);
+		return FAIL;
+	}
+
+	
+	/* Add the timer FD to the polling list */
+	if(FAIL == PollRegEvent(rs->rxPoller, rs->timerFD, POLL_WT_IN, rxTick, rs)){
+		debug(DEBUG_UNEXPECTED, "%s: Could not register local connection FD", __func__);
+		return FAIL;
+	}
+	
+	/* Set the magic number before the thread can look at it */
+	rs->magic = RS_MAGIC;
+
+	
+	/* Initialize attr type */
+	if((res = pthread_attr_init(&attrs))){
+		debug(DEBUG_UNEXPECTED, "%s: Could not initialize pthread attribute: res = %d", __func__, res);
+		return FAIL;
+	}
+	
+	/* Set the detached state attr */
+	if((res = pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED))){
+		debug(DEBUG_UNEXPECTED, "%s: Could not set detach attribute: res = %d", __func__, res);
+		return FAIL;
+	}
+	
+	/* Set the stack size attr */
+	if((res = pthread_attr_setstacksize(&attrs, RXTHREADSTACKSIZE))){
+		debug(DEBUG_UNEXPECTED, "%s: Could not set stack size attribute: res = %d", __func__, res);
+		return FAIL;
+	}
+	
+	/* Create the thread */
+	if((res = pthread_create(&rs->rxThread, &attrs, rxThread, rs))){
+		debug(DEBUG_UNEXPECTED, "%s: Could not create thread: res = %d", __func__, res);
+		rs->magic = 0;
+		return FAIL;
+	}
+	
+	return PASS;
+}
+
+/*
+ * Send an control message to an RX shard thread 
+ *
+ * Arguments:
+ *
+ * 1. Pointer to receive shard
  * 2. Control message code to send
  *
  * Return value
  *
  * PASS if message sent successfully, otherwise FAIL
  */
- 
-Bool XplrxSendControlMsg(void *objPtr, int val)
+
+static Bool shardSendControlMsg(rxShardPtr_t rs, int val)
 {
-	rxHeadPtr_t xh = objPtr;
 	int evFD;
 	long long incr = 1;
-	ASSERT_FAIL(xh)
-	ASSERT_FAIL(XH_MAGIC == xh->magic)
-	XH_LOCK
-	xh->rxControlVal = val; /* Get the value */
-	evFD = xh->rxControlFD; /* Copy the fd */
-	XH_UNLOCK
+	
+	ASSERT_FAIL(rs)
+	ASSERT_FAIL(RS_MAGIC == rs->magic)
+	
+	RS_LOCK
+	rs->rxControlVal = val; /* Get the value */
+	evFD = rs->rxControlFD; /* Copy the fd */
+	RS_UNLOCK
 	
 	/* Send the event */
 	if(write(evFD, &incr, sizeof(incr)) < 0){
@@ -479,13 +934,44 @@ Bool XplrxSendControlMsg(void *objPtr, int val)
 	return PASS;
 }
 
+/*
+ * Send an control message to the RX threads 
+ *
+ * Arguments:
+ *
+ * 1. Pointer to receive header
+ * 2. Control message code to send
+ *
+ * Return value
+ *
+ * PASS if message sent successfully to every thread, otherwise FAIL
+ */
+ 
+Bool XplrxSendControlMsg(void *objPtr, int val)
+{
+	rxHeadPtr_t xh = objPtr;
+	unsigned i;
+	Bool res = PASS;
+	
+	ASSERT_FAIL(xh)
+	ASSERT_FAIL(XH_MAGIC == xh->magic)
+	
+	for(i = 0; i < xh->numShards; i++){
+		if(FAIL == shardSendControlMsg(xh->shards[i], val)){
+			res = FAIL;
+		}
+	}
+
+	return res;
+}
+
 
 /*
  * Destroy the receiver. 
  * 
  * Called from the main thread.
- * Kills the receiver thread, 
- * destroys the receiver poll object, closes the control FD.
+ * Kills the receiver threads, 
+ * destroys the receiver poll objects, closes the control FD's.
  * and frees all memory used.
  *
  * Arguments:
@@ -500,34 +986,42 @@ Bool XplrxSendControlMsg(void *objPtr, int val)
 void XplRXDestroy(void *objPtr)
 {
 	int termCount = 0;
+	unsigned i, numTerminated;
 	rxHeadPtr_t xh = objPtr;
+	rxShardPtr_t rs;
 	char eBuf[8];
 	
 	ASSERT_FAIL(xh)
 	ASSERT_FAIL(XH_MAGIC == xh->magic)
 	
-	debug(DEBUG_ACTION, "%s: Sending request to terminate rx thread...", __func__);
+	debug(DEBUG_ACTION, "%s: Sending request to terminate rx thread(s)...", __func__);
 	/* Send terminate request */
 	if(FAIL == XplrxSendControlMsg(xh, XHCM_TERM_REQUEST)){
 		fatal("%s: Terminate event transmission failed, exiting unclean",__func__);
 	}
-	/* Wait for RX thread to signal it terminated */
-	XH_LOCK
-	while(termCount < 10){ /* Wait for RX thread dying gasp */
-		XH_UNLOCK
-		if(8 == read(xh->rxReadyFD, eBuf, 8)){
-			XH_LOCK
+	/* Wait for all of the RX threads to signal they terminated */
+	while(termCount < 10){ 
+		/* Drain the ready event */
+		if(read(xh->rxReadyFD, eBuf, 8) < 0){
+			debug(DEBUG_EXPECTED, "%s: No ready event yet", __func__);
+		}
+		for(i = 0, numTerminated = 0; i < xh->numShards; i++){
+			rs = xh->shards[i];
+			RS_LOCK
+			if(rs->terminated){
+				numTerminated++;
+			}
+			RS_UNLOCK
+		}
+		if(numTerminated == xh->numShards){
 			break;
 		}
 		usleep(100000);
 		termCount++;
-		XH_LOCK
 	}
 	
-	XH_UNLOCK
-	
 	if(termCount < 10){
-		debug(DEBUG_ACTION,"%s: RX thread terminated", __func__);
+		debug(DEBUG_ACTION,"%s: RX thread(s) terminated", __func__);
 	}
 	else{
 		fatal("%s: Problem terminating RX thread", __func__);
@@ -545,11 +1039,18 @@ void XplRXDestroy(void *objPtr)
  * Creates a receiver poll object.
  * Creates the receiver thread.
  *
+ * If more than one receiver thread is requested, the local connection FD must have 
+ * been bound with SO_REUSEPORT set. Additional sockets are then bound to the same 
+ * ephemeral port, and each one gets its own thread and queue. The kernel steers 
+ * each source address/port to one socket, so per-source message order is kept.
+ *
  * Arguments:
  *
  * 1. FD for local hub connection
  * 2. Ephemeral port for hub connection
  * 3. FD to use to send RX ready events.
+ * 4. Number of receiver threads to start (0 or 1 for a single thread).
+ * 5. Receive buffer size for each socket in bytes, or 0 for the system default.
  *
  *
  * Return value
@@ -557,124 +1058,151 @@ void XplRXDestroy(void *objPtr)
  * Pointer to Receive header
  */
 
-void *XplRXInit(int localConnFD, int localConnPort, int rxReadyFD)
+void *XplRXInit(int localConnFD, int localConnPort, int rxReadyFD, unsigned rxThreads, unsigned rcvBufSize)
 {
-	pthread_attr_t attrs;
-	int res;
 	rxHeadPtr_t xh;
-	struct itimerspec its;
+	unsigned i;
+	int shardFD;
 	
 	/* Allocate a Header */
 	MALLOC_FAIL(xh = talloc_zero(NULL, rxHead_t))
 	
-
-	/* Initialize the guarding mutex */
-	ASSERT_FAIL( 0 == pthread_mutex_init(&xh->lock, NULL))
-	
-			
-	/* Allocate the receive string pool */
-	MALLOC_FAIL(xh->rxStringPool = talloc_pool(xh, RXBUFFPOOLSIZE));
-	
-	/* Allocate the queue entry pool */
-	MALLOC_FAIL(xh->rxQEPool = talloc_pool(xh, RXQEPOOLSIZE));
-
-	/* Allocate the receive buffer */
-	xh->rxBuffSize = RXBUFFSIZE;
-	MALLOC_FAIL(xh->rxBuff = talloc_array(xh, char, xh->rxBuffSize))
+	/* Clamp the number of receive threads */
+	if(rxThreads < 1){
+		rxThreads = 1;
+	}
+	else if(rxThreads > XPLRX_MAX_THREADS){
+		rxThreads = XPLRX_MAX_THREADS;
+	}
 	
+	/* Allocate the shard table */
+	MALLOC_FAIL(xh->shards = talloc_zero_array(xh, rxShardPtr_t, rxThreads))
+	xh->numShards = rxThreads;
 	
-	/* Note the local connection FD and the port */
-	xh->localConnFD = localConnFD;
+	/* Note the port */
 	xh->localConnPort = localConnPort;
 	
 	/* Note the ready file descriptor */
 	xh->rxReadyFD = rxReadyFD;
-
-		
-	/* Create the timer FD */
-	if((xh->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0){
-		debug(DEBUG_UNEXPECTED, "%s: Could not create an timer FD", __func__);
-		return destroyRX(xh);
-	}
 	
-	/* Set the timerfd time interval */
-	its.it_value.tv_sec = its.it_interval.tv_sec = 1;
-	its.it_value.tv_nsec = its.it_interval.tv_nsec = 0;
-	if(timerfd_settime(xh->timerFD, 0, &its, NULL) < 0){
-		debug(DEBUG_UNEXPECTED, "%s: Could not set timer FD interval", __func__);
-		return destroyRX(xh);
-	}		
+	/* Validate the header before any threads are started */
+	xh->magic = XH_MAGIC;
 	
-	/* Get an event FD for control */
-	if((xh->rxControlFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0){
-		debug(DEBUG_UNEXPECTED, "Could not create an event FD");
-		return destroyRX(xh);
+	/* Start the shards */
+	for(i = 0; i < rxThreads; i++){
+		if(i){
+			shardFD = rxCreateShardSock(localConnFD);
+		}
+		else{
+			shardFD = localConnFD;
+		}
+		if((shardFD < 0) || (FAIL == initShard(xh, i, shardFD, (i != 0), rcvBufSize))){
+			/* Clean up the shard which failed */
+			if(xh->shards[i]){
+				destroyShard(xh->shards[i]);
+				xh->shards[i] = NULL;
+			}
+			/* Stop the shards which are already running */
+			xh->numShards = i;
+			if(i){
+				XplRXDestroy(xh);
+				return NULL;
+			}
+			return destroyRX(xh);
+		}
 	}
 	
-	/* Create a polling resource */
-	if(!(xh->rxPoller = PollInit(xh, 4))){
-		debug(DEBUG_UNEXPECTED, "%s: Could not create polling resource", __func__);
-		return destroyRX(xh);
-	}
-
-	/* Add the control FD to the polling list */
-	if(FAIL == PollRegEvent(xh->rxPoller, xh->rxControlFD, POLL_WT_IN, rxControlAction, xh)){
-		debug(DEBUG_UNEXPECTED, "%s: Could not register RX Control eventfd", __func__);
-		return destroyRX(xh);
-	}
+	debug(DEBUG_ACTION, "%s: Started %u receive thread(s) on port %d", __func__, rxThreads, localConnPort);
 	
-	/* Add the local connection FD to the polling list */
-	if(FAIL == PollRegEvent(xh->rxPoller, xh->localConnFD, POLL_WT_IN, rxIncomingAction, xh)){
-		debug(DEBUG_UNEXPECTED, "%s: Could not register local connection FD", __func__);
-		return destroyRX(xh);
-	}
-
+	/* Return the object */
 	
-	/* Add the timer FD to the polling list */
-	if(FAIL == PollRegEvent(xh->rxPoller, xh->timerFD, POLL_WT_IN, rxTick, xh)){
-		debug(DEBUG_UNEXPECTED, "%s: Could not register local connection FD", __func__);
-		return destroyRX(xh);
-	}
+	return xh;
+}
 
-	
-	/* Initialize attr type */
-	if((res = pthread_attr_init(&attrs))){
-		debug(DEBUG_UNEXPECTED, "%s: Could not initialize pthread attribute: res = %d", __func__, res);
-		return destroyRX(xh);
+/*
+ * Pick the traffic class to dequeue from next
+ *
+ * The highest priority class with something waiting is normally picked. Each time a 
+ * waiting class is passed over, its pass over count is bumped. When a class has been 
+ * passed over RXSTARVELIMIT times in a row, it is picked instead so that a steady stream 
+ * of higher priority traffic can't starve it.
+ *
+ * Called from the main thread.
+ *
+ * Arguments:
+ *
+ * 1. Pointer to the receive header.
+ *
+ * Return value
+ *
+ * Traffic class, or RXC_NUMCLASSES if all of the queues are empty.
+ */
+ 
+static rxClass_t rxPickClass(rxHeadPtr_t xh)
+{
+	unsigned waiting[RXC_NUMCLASSES];
+	rxShardPtr_t rs;
+	unsigned i;
+	int c;
+	rxClass_t pick = RXC_NUMCLASSES;
+	
+	/* Count what is waiting in each class */
+	for(c = 0; c < RXC_NUMCLASSES; c++){
+		waiting[c] = 0;
 	}
-	
-	/* Set the detached state attr */
-	if((res = pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED))){
-		debug(DEBUG_UNEXPECTED, "%s: Could not set detach attribute: res = %d", __func__, res);
-		return destroyRX(xh);
+	for(i = 0; i < xh->numShards; i++){
+		rs = xh->shards[i];
+		RS_LOCK
+		for(c = 0; c < RXC_NUMCLASSES; c++){
+			waiting[c] += rs->classEntries[c];
+		}
+		RS_UNLOCK
 	}
 	
-	/* Set the stack size attr */
-	if((res = pthread_attr_setstacksize(&attrs, RXTHREADSTACKSIZE))){
-		debug(DEBUG_UNEXPECTED, "%s: Could not set stack size attribute: res = %d", __func__, res);
-		return destroyRX(xh);
+	/* Look for a starved class first, highest priority first */
+	for(c = 0; c < RXC_NUMCLASSES; c++){
+		if(waiting[c] && (xh->passedOver[c] >= RXSTARVELIMIT)){
+			pick = c;
+			xh->starveCount++;
+			break;
+		}
 	}
 	
-	/* Create the thread */
-	if(pthread_create(&xh->rxThread, &attrs, rxThread, xh) < 0){
-		debug(DEBUG_UNEXPECTED, "%s: Could not create thread", __func__);
-		return destroyRX(xh);
+	/* Otherwise, the highest priority class with something waiting */
+	if(RXC_NUMCLASSES == pick){
+		for(c = 0; c < RXC_NUMCLASSES; c++){
+			if(waiting[c]){
+				pick = c;
+				break;
+			}
+		}
 	}
 	
-		
-	/* Set the magic number */
-	xh->magic = XH_MAGIC;
-
+	if(RXC_NUMCLASSES == pick){
+		return pick;
+	}
 	
-	/* Return the object */
+	/* Update the pass over counts */
+	for(c = 0; c < RXC_NUMCLASSES; c++){
+		if(c == pick || !waiting[c]){
+			xh->passedOver[c] = 0;
+		}
+		else{
+			xh->passedOver[c]++;
+		}
+	}
 	
-	return xh;
-}
+	return pick;
+}	
 
 /*
- * Remove a string from the receive queue and return a copy of it.
+ * Remove a string from the receive queues and return a copy of it.
  *
  * Used by the main thread to get a message from the queue.
+ * Messages are removed in traffic class priority order: triggers, commands, status, then 
+ * heartbeats, with starvation protection for the lower classes (see rxPickClass).
+ * When there are several receive shards, the queues for a class are visited round robin,
+ * one message at a time, so a busy shard can't starve the others.
  *
  * Arguments:
  *
@@ -683,37 +1211,71 @@ void *XplRXInit(int localConnFD, int localConnPort, int rxReadyFD)
  *
  * Return value
  *
- * Message string or NULL if there is no message in the queue.
+ * Message string or NULL if there is no message in any queue.
  */
  
 String XplrxDQRawString(TALLOC_CTX *ctx, void *objPtr)
 {
 	String res,pStr;
 	rxHeadPtr_t xh = objPtr;
-	
-	/* Lock the mutex */
-	XH_LOCK
+	rxShardPtr_t rs;
+	rxClass_t class;
+	unsigned i, index;
+	struct timespec arrival, now;
+	double delayUs;
 	
 	/* Sanity checks */
 	ASSERT_FAIL(xh);
 	ASSERT_FAIL(XH_MAGIC == xh->magic);
 	
-	/* See if there's something in the queue */
-	
-	if(!(pStr = rxDQRawString(xh))){
-		/*Nothing is in the queue */
-		/*Unlock the mutex and return */
-		XH_UNLOCK
+	/* Decide which class to service */
+	if(RXC_NUMCLASSES == (class = rxPickClass(xh))){
+		/*Nothing is in any of the queues */
 		return NULL;
 	}
-	/* Move the string into the supplied context, freeing the original back to the string pool */
-	MALLOC_FAIL(res = UtilMoveString(ctx, pStr, 0))
 	
-	/* Unlock the mutex */
-	XH_UNLOCK
-	/* Return the string */
-	return res;
+	for(i = 0; i < xh->numShards; i++){
+		index = (xh->nextShard[class] + i) % xh->numShards;
+		rs = xh->shards[index];
+		
+		/* Lock the mutex */
+		RS_LOCK
+	
+		/* See if there's something in the queue */
+		if((pStr = rxDQRawString(rs, class, &arrival))){
+			/* Move the string into the supplied context, freeing the original back to the string pool */
+			MALLOC_FAIL(res = UtilMoveString(ctx, pStr, 0))
+			/* Unlock the mutex */
+			RS_UNLOCK
+			/* Next time, start with the shard after this one */
+			xh->nextShard[class] = (index + 1) % xh->numShards;
+			
+			/* Update the statistics */
+			xh->dqCount++;
+			xh->dqClassCount[class]++;
+			if(arrival.tv_sec && (0 == clock_gettime(CLOCK_REALTIME, &now))){
+				delayUs = ((now.tv_sec - arrival.tv_sec) * 1e6) + ((now.tv_nsec - arrival.tv_nsec) / 1e3);
+				if(delayUs >= 0){
+					xh->delayCount++;
+					xh->delaySumUs += delayUs;
+					if(delayUs > xh->delayMaxUs){
+						xh->delayMaxUs = delayUs;
+					}
+				}
+			}
+			/* Return the string */
+			return res;
+		}
+		
+		/* Unlock the mutex */
+		RS_UNLOCK
+	}
+	
+	/* Only the main thread removes entries, so this shouldn't happen */
+	debug(DEBUG_UNEXPECTED, "%s: Class %s queue unexpectedly empty", __func__, rxClassNames[class]);
+	return NULL;
 }
+
 /*
  * Return the watchdog counter count, and reset it back to 0
  * 
@@ -723,7 +1285,7 @@ String XplrxDQRawString(TALLOC_CTX *ctx, void *objPtr)
  * 
  * Return value:
  * 
- * Number of ticks counted since last read.
+ * Number of ticks counted since last read by the slowest RX thread.
  * 
  */
  
@@ -731,24 +1293,160 @@ String XplrxDQRawString(TALLOC_CTX *ctx, void *objPtr)
 int XplrxGetAndResetWdogCounter(void *objPtr)
 {
 	rxHeadPtr_t xh = objPtr;
-	int res;
-	
-	/* Lock the mutex */
-	XH_LOCK
+	rxShardPtr_t rs;
+	unsigned i;
+	int res = INT_MAX;
 	
 	/* Sanity checks */
 	ASSERT_FAIL(xh);
 	ASSERT_FAIL(XH_MAGIC == xh->magic);
 	
-	res = xh->wdogCounter;
-	xh->wdogCounter = 0;
-	
-	/* Unlock the mutex */
-	XH_UNLOCK
+	for(i = 0; i < xh->numShards; i++){
+		rs = xh->shards[i];
+		/* Lock the mutex */
+		RS_LOCK
+		if(rs->wdogCounter < res){
+			res = rs->wdogCounter;
+		}
+		rs->wdogCounter = 0;
+		/* Unlock the mutex */
+		RS_UNLOCK
+	}
 	
 	return res;
 	
 }
 
+/*
+ * Set the source tags whose echoes the RX threads may drop
+ *
+ * Called from the main thread. Echoes of messages with one of these source tags are dropped
+ * before they are queued, unless they have a heartbeat or config schema, or were targeted
+ * at the same tag. The caller must only pass in tags for which no listener would report the 
+ * echo.
+ *
+ * Arguments:
+ * 
+ * 1. Pointer to receive header
+ * 2. Array of source tags in vendor-device.instance form.
+ * 3. Number of tags in the array. 0 turns echo dropping off.
+ * 
+ * Return value:
+ * 
+ * None
+ */
+
+void XplrxSetEchoFilter(void *objPtr, const String *tags, unsigned numTags)
+{
+	rxHeadPtr_t xh = objPtr;
+	rxShardPtr_t rs;
+	unsigned i, j;
+	void *echoCTX, *oldCTX;
+	String *echoSource, *echoTarget;
+	
+	/* Sanity checks */
+	ASSERT_FAIL(xh);
+	ASSERT_FAIL(XH_MAGIC == xh->magic);
+	ASSERT_FAIL(tags || !numTags)
+	
+	for(i = 0; i < xh->numShards; i++){
+		rs = xh->shards[i];
+		echoCTX = NULL;
+		echoSource = echoTarget = NULL;
+		
+		/* Build the match strings outside of the lock */
+		if(numTags){
+			MALLOC_FAIL(echoCTX = talloc_new(rs))
+			MALLOC_FAIL(echoSource = talloc_array(echoCTX, String, numTags))
+			MALLOC_FAIL(echoTarget = talloc_array(echoCTX, String, numTags))
+			for(j = 0; j < numTags; j++){
+				ASSERT_FAIL(tags[j])
+				MALLOC_FAIL(echoSource[j] = talloc_asprintf(echoCTX, "\nsource=%s\n", tags[j]))
+				MALLOC_FAIL(echoTarget[j] = talloc_asprintf(echoCTX, "\ntarget=%s\n", tags[j]))
+			}
+		}
+		
+		/* Swap them in */
+		RS_LOCK
+		oldCTX = rs->echoCTX;
+		rs->echoCTX = echoCTX;
+		rs->echoSource = echoSource;
+		rs->echoTarget = echoTarget;
+		rs->numEchoTags = numTags;
+		RS_UNLOCK
+		
+		/* Free the old ones */
+		if(oldCTX){
+			talloc_free(oldCTX);
+		}
+	}
+}
+
+/*
+ * Return the receiver statistics as a string of space separated name=value pairs
+ *
+ * Queueing delay is measured from kernel arrival to removal from the queue by the main thread.
+ * Kernel drops are the datagrams dropped by the socket(s) because the receive buffer was full.
+ * Starved is the number of times a lower priority traffic class was serviced ahead of a higher one.
+ * Echo drops are echoes of our own messages dropped by the RX thread(s) (see XplrxSetEchoFilter).
+ * 
+ * Arguments:
+ * 
+ * 1. Talloc context to hang the result off of.
+ * 2. Pointer to receive header
+ * 
+ * Return value:
+ * 
+ * Statistics string
+ * 
+ */
 
+String XplrxGetStats(TALLOC_CTX *ctx, void *objPtr)
+{
+	rxHeadPtr_t xh = objPtr;
+	rxShardPtr_t rs;
+	unsigned i;
+	int c;
+	unsigned rxPackets = 0, rxTruncated = 0, queued = 0, echoDrops = 0;
+	unsigned classQueued[RXC_NUMCLASSES];
+	unsigned long long rxBytes = 0, kernelDrops = 0;
+	String res;
 	
+	/* Sanity checks */
+	ASSERT_FAIL(xh);
+	ASSERT_FAIL(XH_MAGIC == xh->magic);
+	
+	for(c = 0; c < RXC_NUMCLASSES; c++){
+		classQueued[c] = 0;
+	}
+	
+	/* Sum up the shards */
+	for(i = 0; i < xh->numShards; i++){
+		rs = xh->shards[i];
+		RS_LOCK
+		rxPackets += rs->rxPackets;
+		rxBytes += rs->rxBytes;
+		rxTruncated += rs->rxTruncated;
+		kernelDrops += rs->kernelDrops;
+		queued += rs->numRxEntries;
+		echoDrops += rs->echoDrops;
+		for(c = 0; c < RXC_NUMCLASSES; c++){
+			classQueued[c] += rs->classEntries[c];
+		}
+		RS_UNLOCK
+	}
+	
+	MALLOC_FAIL(res = talloc_asprintf(ctx, "rx-threads=%u rx-packets=%u rx-bytes=%llu rx-truncated=%u "
+	"rx-kernel-drops=%llu rx-queued=%u rx-dispatched=%u rx-qdelay-avg-us=%.0f rx-qdelay-max-us=%.0f rx-starved=%u rx-echo-drops=%u",
+	xh->numShards, rxPackets, rxBytes, rxTruncated, kernelDrops, queued, xh->dqCount,
+	(xh->delayCount) ? xh->delaySumUs / xh->delayCount : 0.0, xh->delayMaxUs, xh->starveCount, echoDrops))
+	
+	/* Per class counts */
+	for(c = 0; c < RXC_NUMCLASSES; c++){
+		MALLOC_FAIL(res = talloc_asprintf_append(res, " rx-%s-queued=%u rx-%s-dispatched=%u",
+		rxClassNames[c], classQueued[c], rxClassNames[c], xh->dqClassCount[c]))
+	}
+	
+	return res;
+}
+
@@ -2,11 +2,14 @@
 #define XPLRX_H
 
 #define XHCM_TERM_REQUEST 0x55
+#define XPLRX_MAX_THREADS 16
 
 void XplRXDestroy(void *objPtr);
-void *XplRXInit(int localConnFD, int localConnPort, int rxReadyFD);
+void *XplRXInit(int localConnFD, int localConnPort, int rxReadyFD, unsigned rxThreads, unsigned rcvBufSize);
 Bool XplrxSendControlMsg(void *xplrxheader, int val);
 String XplrxDQRawString(TALLOC_CTX *ctx, void *xplrxheader);
 int XplrxGetAndResetWdogCounter(void *objPtr);
+String XplrxGetStats(TALLOC_CTX *ctx, void *objPtr);
+void XplrxSetEchoFilter(void *objPtr, const String *tags, unsigned numTags);
 
 #endif